@@ -0,0 +1,329 @@
+/*
+ * Miter microbenchmarks.
+ *
+ * Builds the editor core into a harness (miter.c is included with its
+ * main() renamed) and times the hot paths against generated inputs.
+ * Each result is printed as one JSON object per line on stdout, so runs
+ * can be collected and compared across releases:
+ *
+ *   {"benchmark":"editor_open","input":"c_source","seconds":0.412,...}
+ *
+ * Run with `make bench`. MITER_BENCH_SCALE (default 1.0) scales every
+ * input, e.g. 0.01 for a quick smoke run.
+ */
+
+/*** includes ***/
+
+#define main miter_main
+#include "../miter.c"
+#undef main
+
+/*** defines ***/
+
+/* Full-size inputs (scaled by MITER_BENCH_SCALE) */
+#define BENCH_C_SOURCE_LINES 1000000
+#define BENCH_JSON_BYTES (100 * 1024 * 1024)
+#define BENCH_MAKEFILE_LINES 200000
+#define BENCH_PROSE_PARAGRAPHS 20000
+/* Virtual screen used for drawing */
+#define BENCH_SCREEN_COLUMNS 120
+#define BENCH_SCREEN_ROWS 50
+/* Frames drawn per editor_draw_rows run */
+#define BENCH_DRAW_FRAMES 200
+/* Rows inserted per editor_insert_row run */
+#define BENCH_INSERT_ROWS 500
+/* Characters typed into the undo group (kept under UNDO_MAX_ENTRIES) */
+#define BENCH_UNDO_GROUP_CHARACTERS 8000
+/* Queries for simple_search, each occurring throughout its input */
+#define BENCH_C_SOURCE_QUERY "buffer_length"
+#define BENCH_JSON_QUERY "\"name\":\"item-1"
+#define BENCH_MAKEFILE_QUERY "$(CFLAGS)"
+#define BENCH_PROSE_QUERY "lazy dog"
+/* Environment variable scaling every input */
+#define BENCH_SCALE_ENVIRONMENT "MITER_BENCH_SCALE"
+
+/*** data ***/
+
+/* Directory holding the generated inputs */
+static char bench_directory[PATH_MAX / 2];
+
+/* Input size multiplier */
+static double bench_scale = 1.0;
+
+/*** timing ***/
+
+/* Monotonic time in seconds. */
+static double bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Print one result line. */
+static void bench_report(const char *benchmark, const char *input, double seconds,
+                         long long operations, long long bytes) {
+  printf("{\"benchmark\":\"%s\",\"input\":\"%s\",\"seconds\":%.6f,\"operations\":%lld,"
+         "\"bytes\":%lld,\"rows\":%d}\n",
+         benchmark, input, seconds, operations, bytes, editor.row_count);
+  fflush(stdout);
+}
+
+/* Stop the run if a benchmark left the buffer with the wrong row count. */
+static void bench_expect_rows(const char *benchmark, const char *input, int rows) {
+  if (editor.row_count == rows) return;
+  fprintf(stderr, "%s on %s: expected %d rows, found %d\n", benchmark, input, rows, editor.row_count);
+  exit(1);
+}
+
+/*** inputs ***/
+
+/* Scale a full-size count, never below one. */
+static long bench_scaled(long count) {
+  long scaled = (long)(count * bench_scale);
+  return scaled > 0 ? scaled : 1;
+}
+
+/* Open a file for an input in the bench directory. */
+static FILE *bench_create(const char *name, char *path, size_t size) {
+  snprintf(path, size, "%s/%s", bench_directory, name);
+  FILE *file_pointer = fopen(path, "w");
+  if (!file_pointer) {
+    perror(path);
+    exit(1);
+  }
+  return file_pointer;
+}
+
+/* C source: functions with comments, strings, numbers and keywords. */
+static void bench_write_c_source(char *path, size_t size) {
+  FILE *file_pointer = bench_create("source.c", path, size);
+  long lines = bench_scaled(BENCH_C_SOURCE_LINES);
+  for (long line = 0; line < lines; line += 8) {
+    fprintf(file_pointer,
+            "/* Copy the %ld-th block into the output buffer. */\n"
+            "static int copy_block_%ld(char *buffer, int buffer_length) {\n"
+            "  const char *label = \"block %ld\";\n"
+            "  for (int index = 0; index < buffer_length; index++) {\n"
+            "    if (buffer[index] == '\\t') buffer[index] = ' ';\n"
+            "  }\n"
+            "  return buffer_length + %ld; // done\n"
+            "}\n",
+            line, line, line, line % 977);
+  }
+  fclose(file_pointer);
+}
+
+/* One-line JSON: an array of small objects with no newlines at all. */
+static void bench_write_json(char *path, size_t size) {
+  FILE *file_pointer = bench_create("single_line.json", path, size);
+  long target = bench_scaled(BENCH_JSON_BYTES);
+  long written = fprintf(file_pointer, "[");
+  for (long item = 0; written < target; item++) {
+    written += fprintf(file_pointer, "%s{\"id\":%ld,\"name\":\"item-%ld\",\"tags\":[\"a\",\"b\"],\"ok\":true}",
+                       item ? "," : "", item, item);
+  }
+  fprintf(file_pointer, "]\n");
+  fclose(file_pointer);
+}
+
+/* Makefile: tab-indented recipes, which expand on render. */
+static void bench_write_makefile(char *path, size_t size) {
+  FILE *file_pointer = bench_create("Makefile", path, size);
+  long lines = bench_scaled(BENCH_MAKEFILE_LINES);
+  for (long line = 0; line < lines; line += 4) {
+    fprintf(file_pointer,
+            "target_%ld: source_%ld.c\n"
+            "\t$(CC)\t$(CFLAGS)\t-c\tsource_%ld.c\t-o\t$@\n"
+            "\t\t@echo\t\"built\t%ld\"\n"
+            "\n",
+            line, line, line, line);
+  }
+  fclose(file_pointer);
+}
+
+/* Prose: long paragraphs on single lines, for soft wrap. */
+static void bench_write_prose(char *path, size_t size) {
+  FILE *file_pointer = bench_create("prose.txt", path, size);
+  static const char *sentence = "The quick brown fox jumps over the lazy dog while the editor wraps "
+                                "this paragraph at word boundaries across the screen. ";
+  long paragraphs = bench_scaled(BENCH_PROSE_PARAGRAPHS);
+  for (long paragraph = 0; paragraph < paragraphs; paragraph++) {
+    for (int repeat = 0; repeat < 12; repeat++) fputs(sentence, file_pointer);
+    fputs("\n\n", file_pointer);
+  }
+  fclose(file_pointer);
+}
+
+/*** benchmarks ***/
+
+/* Load path into an empty buffer, timing editor_open. */
+static void bench_open(const char *input, const char *path) {
+  editor_clear_buffer();
+  /* Group numbers restart, so the previous input's history must go too */
+  buffer_free_undo(editor.undo_stack, editor.undo_stack_count);
+  editor.undo_stack = NULL;
+  editor.undo_stack_count = editor.undo_stack_capacity = 0;
+  struct stat file_stat;
+  stat(path, &file_stat);
+
+  double start = bench_now();
+  editor_open((char *)path);
+  bench_report("editor_open", input, bench_now() - start, 1, file_stat.st_size);
+}
+
+/* Re-highlight every row. */
+static void bench_update_syntax(const char *input) {
+  double start = bench_now();
+  for (int i = 0; i < editor.row_count; i++) editor_update_syntax(&editor.row[i]);
+  bench_report("editor_update_syntax", input, bench_now() - start, editor.row_count, 0);
+}
+
+/* Search the whole buffer. */
+static void bench_search(const char *input, const char *query) {
+  double start = bench_now();
+  simple_search(query);
+  bench_report("simple_search", input, bench_now() - start, editor.search_result_count, 0);
+  if (editor.search_result_count == 0) {
+    fprintf(stderr, "simple_search on %s: \"%s\" not found\n", input, query);
+    exit(1);
+  }
+}
+
+/* Draw frames at offsets spread through the buffer. */
+static void bench_draw_rows(const char *input) {
+  long long bytes = 0;
+  double start = bench_now();
+  for (int frame = 0; frame < BENCH_DRAW_FRAMES; frame++) {
+    editor.row_offset = editor.row_count > editor.screen_rows
+                          ? (int)((long long)frame * 7919 % (editor.row_count - editor.screen_rows))
+                          : 0;
+    editor.cursor_y = editor.row_offset;
+    struct append_buffer ab = ABUF_INIT;
+    editor_draw_rows(&ab);
+    bytes += ab.length;
+    append_buffer_destroy(&ab);
+  }
+  editor.row_offset = 0;
+  editor.cursor_y = 0;
+  bench_report("editor_draw_rows", input, bench_now() - start, BENCH_DRAW_FRAMES, bytes);
+}
+
+/* Insert rows at the head, middle or tail of the buffer. */
+static void bench_insert_rows(const char *input, const char *where) {
+  static char line[] = "  int inserted = compute(value, 42); /* bench */";
+  double start = bench_now();
+  for (int i = 0; i < BENCH_INSERT_ROWS; i++) {
+    int at = where[0] == 'h' ? 0 : where[0] == 'm' ? editor.row_count / 2 : editor.row_count;
+    editor_insert_row(at, line, sizeof(line) - 1);
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "editor_insert_row_%s", where);
+  bench_report(name, input, bench_now() - start, BENCH_INSERT_ROWS, 0);
+}
+
+/* Type one large undo group at the end of the middle row, then undo and
+ * redo it. Typing at the end extends a long row (the JSON input's one
+ * line) instead of shifting all of it on every key. */
+static void bench_undo_redo(const char *input) {
+  editor.cursor_y = editor.row_count / 2;
+  editor.cursor_x = editor.row_count ? editor.row[editor.cursor_y].line_size : 0;
+  int rows_before = editor.row_count;
+
+  /* Newlines would otherwise start groups of their own */
+  undo_start_new_group();
+  editor.undo_group_held = 1;
+  for (int i = 0; i < BENCH_UNDO_GROUP_CHARACTERS; i++) {
+    if (i % 80 == 79) {
+      editor_insert_newline();
+    } else {
+      editor_insert_char('a' + i % 26);
+    }
+  }
+  editor.undo_group_held = 0;
+  int rows_after = editor.row_count;
+
+  double start = bench_now();
+  editor_undo();
+  bench_report("editor_undo", input, bench_now() - start, BENCH_UNDO_GROUP_CHARACTERS, 0);
+  bench_expect_rows("editor_undo", input, rows_before);
+
+  start = bench_now();
+  editor_redo();
+  bench_report("editor_redo", input, bench_now() - start, BENCH_UNDO_GROUP_CHARACTERS, 0);
+  bench_expect_rows("editor_redo", input, rows_after);
+}
+
+/* Save the buffer to a scratch file. */
+static void bench_save(const char *input) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/saved.out", bench_directory);
+  char *original = editor.filename;
+  editor.filename = path;
+
+  double start = bench_now();
+  editor_save();
+  double seconds = bench_now() - start;
+
+  struct stat file_stat;
+  stat(path, &file_stat);
+  bench_report("editor_save", input, seconds, 1, file_stat.st_size);
+  unlink(path);
+  editor.filename = original;
+}
+
+/* Run the benchmarks on one input. */
+static void bench_input(const char *input, const char *path, const char *query, int soft_wrap) {
+  editor.soft_wrap = soft_wrap;
+  bench_open(input, path);
+  /* Only C has rules in the syntax database; the other inputs borrow them
+   * so every input exercises the highlighter (strings, numbers, comments) */
+  if (!editor.syntax) editor.syntax = &HLDB[0];
+  bench_update_syntax(input);
+  bench_search(input, query);
+  bench_draw_rows(input);
+  /* Before the inserts, so the group is typed into the input's own text
+   * (the one line of the JSON input) */
+  bench_undo_redo(input);
+  bench_insert_rows(input, "head");
+  bench_insert_rows(input, "middle");
+  bench_insert_rows(input, "tail");
+  bench_save(input);
+  unlink(path);
+}
+
+/*** init ***/
+
+int main() {
+  const char *scale = getenv(BENCH_SCALE_ENVIRONMENT);
+  if (scale && atof(scale) > 0) bench_scale = atof(scale);
+
+  const char *temporary = getenv("TMPDIR");
+  snprintf(bench_directory, sizeof(bench_directory), "%s/miter-bench-XXXXXX", temporary ? temporary : "/tmp");
+  if (!mkdtemp(bench_directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  /* The real editor state, on a virtual screen with output discarded */
+  headless.enabled = 1;
+  headless.columns = BENCH_SCREEN_COLUMNS;
+  headless.rows = BENCH_SCREEN_ROWS;
+  int sink = open("/dev/null", O_WRONLY);
+  if (sink >= 0) terminal_output.fd = sink;
+  editor_init();
+  editor.center_scroll = 0;
+
+  char path[PATH_MAX];
+  bench_write_c_source(path, sizeof(path));
+  bench_input("c_source", path, BENCH_C_SOURCE_QUERY, 0);
+  bench_write_json(path, sizeof(path));
+  bench_input("single_line_json", path, BENCH_JSON_QUERY, 0);
+  bench_write_makefile(path, sizeof(path));
+  bench_input("tab_makefile", path, BENCH_MAKEFILE_QUERY, 0);
+  bench_write_prose(path, sizeof(path));
+  bench_input("soft_wrapped_prose", path, BENCH_PROSE_QUERY, 1);
+
+  editor_clear_buffer();
+  rmdir(bench_directory);
+  return 0;
+}
@@ -35,14 +35,24 @@
 
 #include <ctype.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -50,6 +60,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <setjmp.h>
 
 /* PCRE2 for regex-based syntax highlighting patterns */
 #ifndef PCRE2_DISABLED
@@ -57,29 +71,142 @@
 #include <pcre2.h>
 #endif
 
+#include "miter.h"
+
 /*** defines ***/
 
 /* Editor version string displayed in welcome message */
 #define MITER_VERSION "0.0.1"
-/* Number of spaces to render for each tab character */
+/* Default number of spaces to render for each tab character (tab_stop=) */
 #define MITER_TAB_STOP 8
 /* Number of Ctrl-Q presses required to quit with unsaved changes */
 #define MITER_QUIT_TIMES 3
+/* Most words on a batch script line */
+#define BATCH_WORDS_MAX 4
+/* Most worker threads in batch mode */
+#define BATCH_THREADS_MAX 64
+/* Initial slots for batch script commands (doubled when full) */
+#define BATCH_COMMANDS_INITIAL_CAPACITY 16
+/* Line numbers in a batch script are decimal */
+#define BATCH_LINE_NUMBER_BASE 10
+/* Batch timings are reported in milliseconds */
+#define BATCH_MILLISECONDS_PER_SECOND 1000.0
+#define BATCH_NANOSECONDS_PER_MILLISECOND 1000000.0
+/* Batch report: one line per file (status, rows, load, edit and save
+ * times, path), then the totals */
+#define BATCH_RESULT_FORMAT "%-9s %8d rows  load %8.2f ms  edit %8.2f ms  save %8.2f ms  %s\n"
+#define BATCH_SKIPPED_FORMAT "skipped    %s: same file as %s\n"
+#define BATCH_FAILED_FORMAT "failed     %s: %s\n"
+#define BATCH_SUMMARY_FORMAT "%d files, %d changed, %d skipped, %d failed in %.2f ms on %d thread%s\n"
+/* Screen size library contexts assume (used for soft wrap) */
+#define MITER_CONTEXT_COLUMNS 80
+#define MITER_CONTEXT_ROWS 24
 
 /* Buffer size for reading cursor position response from terminal */
 #define CURSOR_POSITION_BUFFER_SIZE 32
-/* Buffer size for formatting line number display in gutter */
-#define LINE_NUMBER_BUFFER_SIZE 16
+/* Buffer size for formatting line number display in gutter (room for
+ * any long long: the huge file viewer numbers lines past int) */
+#define LINE_NUMBER_BUFFER_SIZE 24
 /* Buffer size for reading lines from config files */
 #define CONFIG_LINE_BUFFER_SIZE 256
+/* Config file read and written in the working directory */
+#define CONFIG_FILE_NAME "miter.conf"
+/* Legacy config file name, read when miter.conf doesn't exist */
+#define CONFIG_LEGACY_FILE_NAME "terra.conf"
+/* Largest accepted tab_stop= setting */
+#define CONFIG_TAB_STOP_MAX 16
+/* Largest accepted wrap_column= setting */
+#define CONFIG_WRAP_COLUMN_MAX 1000
+/* Memory background buffers may hold before clean ones are evicted, in
+ * MiB (buffer_memory_mb=), and the largest accepted setting */
+#define DEFAULT_BUFFER_MEMORY_MB 64
+#define CONFIG_BUFFER_MEMORY_MB_MAX 65536
+/* Quiet time after an outside write before the file is re-read */
+#define FILE_WATCH_SETTLE_MS 50
+/* Most differing lines a reload matches up one by one; beyond that the
+ * changed region is replaced whole */
+#define FILE_RELOAD_DIFF_MAX 1000
+/* Bytes a reload's read of the file starts with, doubled as needed */
+#define FILE_RELOAD_READ_INITIAL_CAPACITY 65536
+/* FNV-1a hash parameters (64-bit), for hashing lines and paths */
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+/* Most appended bytes follow mode reads per pass of the main loop, so a
+ * flood of output can't hold up keypresses */
+#define FOLLOW_READ_MAX (4 * 1024 * 1024)
+/* Files at least this big open in the read-only viewer (--view opens
+ * any file there) */
+#define VIEWER_MIN_BYTES (512LL * 1024 * 1024)
+/* Lines between entries of the viewer's line index, and the entries it
+ * has room for at first */
+#define VIEWER_CHECKPOINT_LINES 1024
+#define VIEWER_CHECKPOINTS_INITIAL_CAPACITY 1024
+/* Bytes of the file the viewer maps at once */
+#define VIEWER_MAP_BYTES (64 * 1024 * 1024)
+/* Bytes the viewer's line scan and search read at once. They use pread,
+ * which just reads short if the file is truncated meanwhile */
+#define VIEWER_READ_BYTES (4 * 1024 * 1024)
+/* Reads a viewer search makes between checks for a key to stop it, each
+ * check also showing how far it has got */
+#define VIEWER_FIND_CHECK_READS 8
+/* Whole of the file, for the percentage scanned or searched */
+#define VIEWER_PERCENT_WHOLE 100
+/* Rows the viewer builds around the cursor, and how close the cursor
+ * gets to either end of them before they are rebuilt around it */
+#define VIEWER_WINDOW_LINES 2048
+#define VIEWER_WINDOW_MARGIN 512
+/* Longest line the viewer shows whole; longer ones are cut off */
+#define VIEWER_LINE_MAX (16 * 1024)
+/* Marks the end of a cut-off line */
+#define VIEWER_ELISION "\xe2\x80\xa6"
+#define VIEWER_ELISION_LENGTH 3
+/* Rows at least this long are split into chunks of about
+ * ROW_CHUNK_SIZE bytes; a chunk that edits grow past twice that has
+ * the row re-split */
+#define ROW_CHUNK_MIN_LENGTH (16 * 1024)
+#define ROW_CHUNK_SIZE 4096
+/* How far before an edit highlighting restarts, more than any keyword
+ * or comment delimiter looks ahead */
+#define ROW_CHUNK_LOOKBEHIND 256
+/* How far into a line a log timestamp may start, and how many of the
+ * first non-empty lines decide whether a file is a log */
+#define LOG_TIME_SEARCH 64
+#define LOG_DETECT_LINES 64
+/* Bytes read at each viewer checkpoint looking for a timestamp */
+#define LOG_INDEX_PROBE_BYTES 4096
+/* How long the timestamp index waits for the line scan to get further */
+#define LOG_INDEX_WAIT_MS 20
+/* Milliseconds in a day, the unit timestamps are kept in */
+#define LOG_DAY_MS (24LL * 60 * 60 * 1000)
+/* Marks a checkpoint with no timestamp near it */
+#define LOG_TIME_NONE LLONG_MIN
+/* Most split views on screen, and layout tree nodes that many leaves need */
+#define VIEW_MAX 8
+#define VIEW_NODE_MAX (2 * VIEW_MAX - 1)
+/* Smallest text area a split may leave a view */
+#define VIEW_MIN_ROWS 2
+#define VIEW_MIN_COLUMNS 10
+/* Column drawn between side-by-side views */
+#define VIEW_SEPARATOR "\xe2\x94\x82"
+#define VIEW_SEPARATOR_LEN 3
 /* Initial size for prompt input buffer (grows dynamically) */
 #define PROMPT_INITIAL_BUFFER_SIZE 128
 /* Buffer size for formatting RGB color escape sequences */
 #define COLOR_ESCAPE_BUFFER_SIZE 32
+/* 256-colour palette layout: 16 basic colours, a 6x6x6 cube, 24 greys */
+#define COLOR_PALETTE_BASIC_COUNT 16
+#define COLOR_CUBE_LEVELS 6
+#define COLOR_GREY_BASE 232
+#define COLOR_GREY_STEPS 24
+/* Slots in the quantized colour cache (power of two) */
+#define COLOR_QUANTIZE_CACHE_SIZE 256
 /* Buffer size for status message text */
 #define STATUS_MESSAGE_BUFFER_SIZE 128
 /* Buffer size for status bar left and right sections */
 #define STATUS_BAR_BUFFER_SIZE 80
+/* Buffer size for the status bar's short parts: the buffer's position
+ * in the list and the viewer's indexing progress */
+#define STATUS_PART_BUFFER_SIZE 32
 /* Buffer size for welcome message text */
 #define WELCOME_BUFFER_SIZE 80
 /* Buffer size for reading escape sequence characters */
@@ -87,6 +214,8 @@
 
 /* Unix file permission mode for newly created files (rw-r--r--) */
 #define FILE_PERMISSION_DEFAULT 0644
+/* Permission bits of a file's mode: set-id, sticky and rwx for all */
+#define FILE_PERMISSION_BITS 07777
 
 /* Duration in seconds before status messages fade */
 #define STATUS_MESSAGE_TIMEOUT_SECONDS 5
@@ -109,6 +238,52 @@
 
 /* Timeout for terminal read in 1/10 second units */
 #define VTIME_DECISECONDS 1
+/* Performance HUD: latency histogram of PERF_HISTOGRAM_BUCKETS power-of-two
+ * buckets starting below PERF_HISTOGRAM_FIRST_US, halved every
+ * PERF_HISTOGRAM_DECAY samples */
+#define PERF_HISTOGRAM_BUCKETS 12
+#define PERF_HISTOGRAM_FIRST_US 32L
+#define PERF_HISTOGRAM_DECAY 256
+/* Buffer size for the HUD's text */
+#define PERF_HUD_BUFFER_SIZE 128
+
+/* Trace events buffered before being written to the --trace file */
+#define TRACE_BUFFER_EVENTS 4096
+/* Environment variable naming a trace file, like --trace */
+#define TRACE_FILE_ENVIRONMENT "MITER_TRACE_FILE"
+
+/* Virtual screen size for --headless when --size isn't given */
+#define HEADLESS_DEFAULT_COLUMNS 80
+#define HEADLESS_DEFAULT_ROWS 24
+/* Initial slots for --headless latency samples (doubled when full) */
+#define HEADLESS_LATENCY_INITIAL_CAPACITY 1024
+/* Percentiles of key-to-frame latency in the --headless report; the last
+ * is the slowest key */
+#define HEADLESS_PERCENTILE_MEDIAN 50
+#define HEADLESS_PERCENTILE_HIGH 90
+#define HEADLESS_PERCENTILE_TAIL 99
+#define HEADLESS_PERCENTILE_MAX 100
+/* Latency samples are kept in nanoseconds and reported in microseconds */
+#define HEADLESS_NANOSECONDS_PER_MICROSECOND 1000.0
+/* \xHH escapes in a --headless script: two hexadecimal digits */
+#define HEADLESS_ESCAPE_HEX_DIGITS 2
+#define HEADLESS_ESCAPE_HEX_BASE 16
+/* Server mode: socket file name, in $XDG_RUNTIME_DIR or /tmp/miter-UID */
+#define SERVER_SOCKET_NAME "miter.sock"
+/* Request bytes: attach a terminal, stop the server */
+#define SERVER_REQUEST_ATTACH 'A'
+#define SERVER_REQUEST_STOP 'S'
+/* Client-to-server byte sent when the client's window was resized */
+#define SERVER_MESSAGE_RESIZE 'W'
+/* NUL-terminated fields after the request byte: working directory, file,
+ * TERM, COLORTERM, TERM_PROGRAM */
+#define SERVER_REQUEST_FIELDS 5
+/* Largest request accepted */
+#define SERVER_REQUEST_MAX (3 * PATH_MAX)
+/* How long the server waits for a new connection's request */
+#define SERVER_REQUEST_TIMEOUT_SECONDS 1
+/* How long exit waits for queued output to make progress */
+#define TERMINAL_OUTPUT_FLUSH_TIMEOUT_MS 1000
 /* Bitmask for converting key to Ctrl+key equivalent */
 #define CTRL_KEY_MASK 0x1f
 /* Upper bound for 7-bit ASCII character values */
@@ -166,10 +341,22 @@
 
 /* ANSI escape format: position cursor at row, column */
 #define ESCAPE_CURSOR_POSITION_FORMAT "\x1b[%d;%dH"
+/* ANSI escape format: blank count characters from the cursor (ECH) */
+#define ESCAPE_ERASE_CHARACTERS_FORMAT "\x1b[%dX"
 /* ANSI escape format: set foreground color with RGB values */
 #define ESCAPE_FOREGROUND_RGB_FORMAT "\x1b[38;2;%d;%d;%dm"
 /* ANSI escape format: set background color with RGB values */
 #define ESCAPE_BACKGROUND_RGB_FORMAT "\x1b[48;2;%d;%d;%dm"
+/* ANSI escapes: 256-colour palette foreground/background */
+#define ESCAPE_FOREGROUND_256_FORMAT "\x1b[38;5;%dm"
+#define ESCAPE_BACKGROUND_256_FORMAT "\x1b[48;5;%dm"
+/* ANSI escape: 16-colour SGR (30-37/90-97 fg, 40-47/100-107 bg) */
+#define ESCAPE_COLOR_16_FORMAT "\x1b[%dm"
+/* SGR bases for the 16-colour palette */
+#define SGR_FOREGROUND_BASE 30
+#define SGR_FOREGROUND_BRIGHT_BASE 90
+#define SGR_BACKGROUND_BASE 40
+#define SGR_BACKGROUND_BRIGHT_BASE 100
 
 /* ASCII escape character value */
 #define CHAR_ESCAPE '\x1b'
@@ -186,6 +373,94 @@
 #define MOUSE_DISABLE_BUTTON "\x1b[?1002l"
 #define MOUSE_DISABLE_SGR "\x1b[?1006l"
 
+/* Focus reporting: terminal sends CSI I on focus-in and CSI O on focus-out */
+#define ESCAPE_FOCUS_REPORTING_ENABLE "\x1b[?1004h"
+#define ESCAPE_FOCUS_REPORTING_ENABLE_LEN 8
+#define ESCAPE_FOCUS_REPORTING_DISABLE "\x1b[?1004l"
+#define ESCAPE_FOCUS_REPORTING_DISABLE_LEN 8
+
+/* OSC 52 clipboard escape: ESC ] 52 ; c ; <base64 payload> BEL */
+#define ESCAPE_OSC52_PREFIX "\x1b]52;c;"
+#define ESCAPE_OSC52_PREFIX_LEN 7
+#define ESCAPE_OSC52_SUFFIX "\x07"
+#define ESCAPE_OSC52_SUFFIX_LEN 1
+/* Largest selection sent over OSC 52 (many terminals reject bigger payloads) */
+#define CLIPBOARD_OSC52_MAX_BYTES (1024 * 1024)
+
+/* Shell commands used by the clipboard worker to talk to the system clipboard */
+#define CLIPBOARD_XSEL_WRITE_COMMAND "xsel --clipboard --input 2>/dev/null"
+#define CLIPBOARD_XSEL_READ_COMMAND "xsel --clipboard --output 2>/dev/null"
+#define CLIPBOARD_XCLIP_WRITE_COMMAND "xclip -selection clipboard 2>/dev/null"
+#define CLIPBOARD_XCLIP_READ_COMMAND "xclip -selection clipboard -o 2>/dev/null"
+/* Size of each read from the system clipboard pipe (content itself is unbounded) */
+#define CLIPBOARD_READ_BUFFER_SIZE 65536
+/* Smallest and largest chunk allocated for clipboard text; chunk capacity
+ * doubles between the two so big copies need few allocations and small
+ * copies don't waste memory */
+#define CLIPBOARD_CHUNK_MIN_SIZE 256
+#define CLIPBOARD_CHUNK_MAX_SIZE (1024 * 1024)
+/* Output buffer for streaming base64 into an OSC 52 sequence */
+#define CLIPBOARD_OSC52_OUTPUT_BUFFER_SIZE 4096
+/* Number of directory listings the file browser keeps cached */
+#define FILE_LIST_CACHE_SIZE 16
+/* Directory entries read per step while a listing is still loading, so the
+ * browser can redraw and handle keys in between */
+#define FILE_LIST_READ_BATCH 2048
+/* Events that mean a cached directory listing is out of date */
+#define FILE_LIST_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                                IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+/* Bytes of inotify events read at once */
+#define INOTIFY_EVENT_BUFFER_SIZE 4096
+/* Directory under $XDG_CACHE_HOME (or ~/.cache) for miter's cache files,
+ * and its permissions (private to the user) */
+#define CACHE_DIRECTORY_NAME "miter"
+#define CACHE_DIRECTORY_PERMISSIONS 0700
+/* Longest fuzzy finder query */
+#define FUZZY_QUERY_MAX 64
+/* Number of best matches the fuzzy finder keeps and can display */
+#define FUZZY_RESULTS_MAX 256
+/* Stop indexing past this many files (protects against walking all of /) */
+#define FUZZY_INDEX_MAX_FILES 4000000
+/* Upper bound on threads for the tree walk and for scoring */
+#define FUZZY_THREADS_MAX 8
+/* Scoring passes over fewer files than this stay on one thread */
+#define FUZZY_PARALLEL_MIN_FILES 32768
+/* Re-walk the tree when the finder opens and the last walk is this old */
+#define FUZZY_REINDEX_SECONDS 30
+/* Initial slots in the walk's set of directories already read */
+#define FUZZY_VISITED_INITIAL_CAPACITY 1024
+/* A scoring pass checks for a newer query after every this many files */
+#define FUZZY_CANCEL_CHECK_FILES 4096
+/* Binary cache of all parsed themes, in the cache directory */
+#define THEME_CACHE_FILE_NAME "themes.cache"
+/* Header of the theme cache; bump the digit when the layout changes */
+#define THEME_CACHE_MAGIC "MITERTH1"
+#define THEME_CACHE_MAGIC_LEN 8
+/* Header of the saved file index; bump the digit when the layout changes */
+#define FUZZY_INDEX_MAGIC "MITERFZ1"
+#define FUZZY_INDEX_MAGIC_LEN 8
+/* Header of a saved line index for the huge file viewer; bump the digit
+ * when the layout changes */
+#define LINE_INDEX_MAGIC "MITERLI1"
+#define LINE_INDEX_MAGIC_LENGTH 8
+/* File name of a saved line index, from a hash of the file's path, and
+ * room for it */
+#define LINE_INDEX_NAME_FORMAT "lines-%016llx.idx"
+#define LINE_INDEX_NAME_SIZE 64
+/* Fuzzy match scoring: per matched character, bonus for continuing a run,
+ * for starting a word, and for landing in the file name; penalty per
+ * skipped character inside the match, and one point per this many path
+ * characters so shorter paths win ties */
+#define FUZZY_SCORE_MATCH 16
+#define FUZZY_SCORE_CONSECUTIVE 24
+#define FUZZY_SCORE_BOUNDARY 32
+#define FUZZY_SCORE_FILENAME 8
+#define FUZZY_PENALTY_GAP 1
+#define FUZZY_PENALTY_LENGTH_DIVISOR 8
+/* Widest span of a path searched for the optimal alignment; wider matches
+ * use the greedy alignments instead */
+#define FUZZY_OPTIMAL_WINDOW_MAX 128
+
 /* Mouse scroll direction */
 #define MOUSE_SCROLL_LINES 3
 
@@ -226,6 +501,41 @@
 #define KITTY_KEYBOARD_QUERY "\x1b[?u"        /* Query current flags */
 #define KITTY_KEYBOARD_QUERY_LEN 4
 
+/* Terminfo: legacy (16-bit numbers) and extended (32-bit numbers) magic */
+#define TERMINFO_MAGIC_LEGACY 0432
+#define TERMINFO_MAGIC_EXTENDED 01036
+/* Index of the max_colors ("colors") numeric capability */
+#define TERMINFO_MAX_COLORS_INDEX 13
+/* Size of the terminfo header (six 16-bit fields) */
+#define TERMINFO_HEADER_SIZE 12
+/* Largest compiled terminfo entry we read */
+#define TERMINFO_MAX_SIZE 32768
+
+/* Terminal capability probing. All queries go out in one write, followed
+ * by a primary device attributes request (DA1) that every terminal
+ * answers. Replies arrive in order, so once the DA1 reply is seen any query
+ * still unanswered is unsupported. Replies are read by the key parser, so
+ * nothing waits for them. */
+#define TERMINAL_QUERY_SYNC_OUTPUT "\x1b[?2026$p"        /* DECRQM mode 2026 */
+#define TERMINAL_QUERY_TRUECOLOR "\x1bP+q524742\x1b\\"   /* XTGETTCAP "RGB" */
+#define TERMINAL_QUERY_DEVICE_ATTRIBUTES "\x1b[c"        /* DA1 sentinel */
+/* XTGETTCAP reply prefix for a capability the terminal has */
+#define TERMINAL_REPLY_CAPABILITY_FOUND "1+r"
+/* Mode number for synchronized output (DECSET 2026) */
+#define TERMINAL_MODE_SYNC_OUTPUT 2026
+/* Buffer size for one capability reply */
+#define TERMINAL_REPLY_BUFFER_SIZE 128
+/* Cached probe results live in the cache dir as terminal-<TERM>.caps */
+#define TERMINAL_CAPS_FILE_PREFIX "terminal-"
+#define TERMINAL_CAPS_FILE_SUFFIX ".caps"
+
+/* Synchronized output: the terminal holds the frame until the end marker,
+ * so a redraw never shows half-painted */
+#define ESCAPE_SYNC_OUTPUT_BEGIN "\x1b[?2026h"
+#define ESCAPE_SYNC_OUTPUT_BEGIN_LEN 8
+#define ESCAPE_SYNC_OUTPUT_END "\x1b[?2026l"
+#define ESCAPE_SYNC_OUTPUT_END_LEN 8
+
 /* Kitty keyboard modifier bits (reported as 1 + value in CSI sequence) */
 #define KITTY_MOD_SHIFT     1
 #define KITTY_MOD_ALT       2
@@ -282,7 +592,44 @@ enum editor_key {
   ALT_OPEN_BRACKET,
   ALT_CLOSE_BRACKET,
   ALT_M,
-  F10_KEY
+  ALT_H,
+  ALT_I,
+  ALT_B,
+  ALT_K,
+  ALT_COMMA,
+  ALT_PERIOD,
+  ALT_MINUS,
+  ALT_BACKSLASH,
+  ALT_F,
+  ALT_X,
+  ALT_E,
+  ALT_G,
+  F10_KEY,
+  FOCUS_IN,
+  FOCUS_OUT
+};
+
+/* Split view layout nodes: a view, or two children stacked or side by side */
+enum view_node_type { VIEW_NODE_FREE = 0, VIEW_NODE_LEAF, VIEW_NODE_STACKED, VIEW_NODE_SIDE_BY_SIDE };
+
+/* Timestamp formats log mode recognises at the start of lines */
+enum log_format {
+  LOG_FORMAT_NONE = 0,
+  LOG_FORMAT_ISO,     /* 2024-05-01T14:03:22.123, or with a space */
+  LOG_FORMAT_CLF,     /* 01/May/2024:14:03:22 (web server access logs) */
+  LOG_FORMAT_SYSLOG,  /* May  1 14:03:22 */
+  LOG_FORMAT_TIME     /* 14:03:22,123 alone */
+};
+
+/* Fields of a saved line index that say which file it describes, in the
+ * order they are saved; all but the line count must match the file */
+enum line_index_key {
+  LINE_INDEX_KEY_SIZE,
+  LINE_INDEX_KEY_MODIFIED_SECONDS,
+  LINE_INDEX_KEY_MODIFIED_NANOSECONDS,
+  LINE_INDEX_KEY_INODE,
+  LINE_INDEX_KEY_LINE_COUNT,
+  LINE_INDEX_KEY_COUNT
 };
 
 /* Undo operation types for logging edits */
@@ -291,10 +638,13 @@ enum undo_op_type {
   UNDO_CHAR_DELETE = 2,       /* Single character deleted (backspace) */
   UNDO_CHAR_DELETE_FWD = 3,   /* Delete key (forward delete) */
   UNDO_ROW_INSERT = 4,        /* New row inserted (Enter at end of line) */
-  UNDO_ROW_DELETE = 5,        /* Row deleted (backspace at start joins lines) */
+  UNDO_ROW_DELETE = 5,        /* Row joined onto the previous one (backspace at start);
+                               * char_pos is where the previous row ended. Row 0
+                               * has none and is simply removed */
   UNDO_ROW_SPLIT = 6,         /* Row split into two (Enter in middle) */
   UNDO_SELECTION_DELETE = 7,  /* Selection deleted */
-  UNDO_PASTE = 8              /* Text pasted (multi-char/line) */
+  UNDO_PASTE = 8,             /* Text pasted (multi-char/line) */
+  UNDO_TEXT_INSERT = 9        /* Text inserted verbatim (editor_insert_text) */
 };
 
 /* In-memory undo entry */
@@ -310,6 +660,7 @@ typedef struct undo_entry {
   int end_row;
   int end_col;
   char *multi_line;           /* For selection/paste */
+  size_t multi_line_length;   /* Bytes in multi_line, which may hold NULs */
 } undo_entry;
 
 #define UNDO_MAX_ENTRIES 10000
@@ -367,18 +718,7 @@ typedef struct {
   int anchor_column;            /* Selection anchor column */
 } cursor_position;
 
-/* Syntax highlighting categories for coloring text */
-enum editor_highlight {
-  HL_NORMAL = 0,
-  HL_COMMENT,
-  HL_MLCOMMENT,
-  HL_KEYWORD1,
-  HL_KEYWORD2,
-  HL_STRING,
-  HL_NUMBER,
-  HL_MATCH,
-  HL_BRACKET_MATCH
-};
+/* Syntax highlighting categories (enum editor_highlight) are in miter.h */
 
 /* Syntax highlighting feature flags (bitmask) */
 /* Enable highlighting of numeric literals */
@@ -423,6 +763,26 @@ typedef struct syntax_pattern {
 } syntax_pattern;
 #endif
 
+/*
+ * Checkpoint into a long row. Rows of ROW_CHUNK_MIN_LENGTH bytes or more
+ * are split into chunks of about ROW_CHUNK_SIZE bytes, so an edit only
+ * re-highlights and re-wraps the text near it, and column mapping only
+ * walks one chunk. The text itself stays contiguous.
+ */
+typedef struct row_chunk {
+  /* Offsets of the chunk in chars and in render */
+  int chars_start;
+  int render_start;
+  /* First position at or after render_start the highlighter stopped at
+   * (a token can straddle the boundary), or -1 if it never got there */
+  int highlight_start;
+  /* Highlighter state at highlight_start */
+  char in_string;
+  char in_comment;
+  char prev_sep;
+  unsigned char prev_highlight;
+} row_chunk;
+
 /*
  * Represents a single line of text in the editor buffer.
  * Maintains both raw and rendered versions for tab expansion and
@@ -449,6 +809,13 @@ typedef struct editor_row {
   int *wrap_breaks;
   /* Number of wrap break positions in wrap_breaks array */
   int wrap_break_count;
+  /* Width wrap_breaks were calculated for, or 0 if they are stale */
+  int wrap_width;
+  /* Number of tabs in chars; without any, render is a copy of chars */
+  int tab_count;
+  /* Chunk table of a long row, else NULL */
+  row_chunk *chunks;
+  int chunk_count;
 } editor_row;
 
 /*
@@ -479,6 +846,15 @@ typedef struct {
   unsigned char b;
 } rgb_color;
 
+/* Colour depth used for output. COLOR_DEPTH_AUTO picks one from the
+ * terminal (probe, COLORTERM, terminfo). */
+enum color_depth {
+  COLOR_DEPTH_AUTO = 0,
+  COLOR_DEPTH_TRUECOLOR,
+  COLOR_DEPTH_256,
+  COLOR_DEPTH_16
+};
+
 /* Generate theme color enum from X-macro */
 enum theme_color {
 #define X(name, r, g, b, desc) THEME_##name,
@@ -523,9 +899,93 @@ static const char *theme_color_names[] = {
 /* Access loaded themes like an array for compatibility */
 #define THEME_COUNT loaded_theme_count
 
+/* True once every theme on disk is in the registry. At startup only the
+ * configured theme is parsed; the rest are loaded when first needed. */
+static int theme_registry_complete = 0;
+
+/* Set by theme_load_from_file when a theme's @base isn't in the registry */
+static int theme_base_missing = 0;
+
+/* Time theme_init took, reported by --startup-time */
+static double theme_init_milliseconds = 0;
+
+/*
+ * One block of clipboard text. Chunks are filled front to back and never
+ * modified once the owning clipboard_text is shared.
+ */
+typedef struct clipboard_chunk {
+  /* Next chunk in the list, or NULL for the tail */
+  struct clipboard_chunk *next;
+  /* Bytes of data in use */
+  size_t length;
+  /* Bytes of data allocated */
+  size_t capacity;
+  /* The text itself (not NUL-terminated) */
+  char data[];
+} clipboard_chunk;
+
+/*
+ * Reference-counted clipboard content stored as a chunk list. The internal
+ * clipboard, the smart-merge bookkeeping and the clipboard worker all hold
+ * references to the same chunks instead of private copies, and text streams
+ * to and from the system clipboard without any size limit.
+ */
+typedef struct {
+  /* Number of owners; the text is freed when this drops to zero */
+  int reference_count;
+  /* Total bytes across all chunks */
+  size_t total_length;
+  /* First and last chunk of the list */
+  clipboard_chunk *head;
+  clipboard_chunk *tail;
+} clipboard_text;
+
 /* Store last parsed mouse event for handler to read */
 static mouse_event last_mouse_event;
 
+/*
+ * A file open in the background. The active buffer's state lives in the
+ * editor fields (row, filename, undo stack, ...); switching moves those
+ * fields here and another buffer's back. A parked buffer keeps its rows,
+ * render and highlight, so switching back is instant, until the memory
+ * budget evicts it: then only the path, the file's size and mtime and the
+ * view position remain, and the rows are read from disk on the next
+ * switch. Buffers with unsaved changes are never evicted.
+ */
+typedef struct editor_buffer {
+  char *filename;
+  editor_row *row;
+  int row_count;
+  int dirty;
+  int cursor_x, cursor_y;
+  int row_offset, column_offset;
+  struct editor_syntax *syntax;
+  /* Tab stop the render text was built with */
+  int tab_stop;
+  /* Undo history (kept across eviction while the file is unchanged) */
+  undo_entry *undo_stack;
+  int undo_stack_count;
+  int undo_stack_capacity;
+  int undo_group_id;
+  int undo_position;
+  int undo_memory_groups;
+  /* Approximate bytes held by the rows while parked */
+  size_t memory;
+  /* Value of the LRU clock when last active */
+  unsigned long last_used;
+  /* True once the rows have been dropped */
+  int evicted;
+  /* The file as the rows were read or written (editor_config has the
+   * active buffer's) */
+  off_t file_size;
+  struct timespec file_mtime;
+  ino_t file_inode;
+  int follow;
+  int log_format;
+  int crlf;
+  int no_final_newline;
+} editor_buffer;
+
 /*
  * Global editor state containing all runtime configuration and data.
  * Single instance 'editor' holds cursor position, file content, display
@@ -580,6 +1040,8 @@ struct editor_config {
   int gutter_width;
   /* Column position for hard wrap (Alt-Q) */
   int wrap_column;
+  /* Number of columns a tab advances to (tab_stop=) */
+  int tab_stop;
   /* True if soft wrap (visual wrapping) is enabled */
   int soft_wrap;
   /* True if center/typewriter scrolling is enabled (cursor stays near center) */
@@ -590,7 +1052,7 @@ struct editor_config {
   /* Selection state for text selection */
   selection_state selection;
   /* Last synced system clipboard content (for smart merge) */
-  char *last_system_clipboard;
+  clipboard_text *last_system_clipboard;
   /* Undo system state */
   int undo_group_id;        /* Current undo group number */
   int undo_position;        /* Current position in undo stack (for redo) */
@@ -619,9 +1081,46 @@ struct editor_config {
   int allow_primary_overlap;    /* 1 = keep secondary cursor at primary position */
   /* Keyboard protocol state */
   int kitty_keyboard_mode;      /* 1 = Kitty protocol active, 0 = legacy mode */
+  /* Terminal capabilities (cached per TERM, confirmed by probing) */
+  int sync_output;              /* 1 = frames are wrapped in mode 2026 */
+  int truecolor;                /* 1 = terminal accepts 24-bit colour */
+  int perf_hud;                 /* 1 = performance HUD shown in the message bar */
+  int color_depth_setting;      /* color_depth= from config (enum color_depth) */
+  int color_depth;              /* Depth colours are emitted in (never AUTO) */
+  int highlight_disabled;       /* 1 = rows are never highlighted (batch edits) */
+  /* The file as the rows were last read from or written to it, to tell
+   * changes made outside from the editor's own saves */
+  off_t file_size;
+  struct timespec file_mtime;
+  ino_t file_inode;
+  /* 1 = text appended to the file is read in as it is written (tail -f) */
+  int follow;
+  /* enum log_format the lines' timestamps are in, or LOG_FORMAT_NONE */
+  int log_format;
+  /* Line endings of the file as loaded, kept when it is written back */
+  int crlf;                     /* 1 = lines end in \r\n */
+  int no_final_newline;         /* 1 = the last line has no newline */
+  /* File line of row 0; only the huge file viewer holds a window of the
+   * file rather than all of it */
+  long long line_number_base;
+  /* 1 = undo entries join the current group (a reload is one step) */
+  int undo_group_held;
+  /* Open buffers, empty until a second file is opened. The slot of the
+   * active buffer is unused; its state is in the fields above */
+  editor_buffer *buffers;
+  int buffer_count;
+  int buffer_current;
+  unsigned long buffer_clock;   /* LRU clock, advanced on every switch */
+  size_t buffer_memory_budget;  /* Bytes parked buffers may hold (buffer_memory_mb=) */
 };
 
-struct editor_config editor;
+/* The editor state functions work on. The TUI uses editor_default;
+ * library clients bind their own miter_context to the calling thread
+ * (see the library interface), so buffers in different threads don't
+ * share state. Existing code keeps writing editor.field. */
+static struct editor_config editor_default;
+static __thread struct editor_config *editor_current = &editor_default;
+#define editor (*editor_current)
 
 /* Forward declaration */
 void simple_search(const char *query);
@@ -668,7 +1167,22 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int));
 #ifndef PCRE2_DISABLED
 void syntax_free_patterns();
 #endif
+int config_refresh();
+const char *config_get_string(const char *section, const char *key, const char *fallback);
+int config_get_int(const char *section, const char *key, int fallback, int minimum, int maximum);
+int config_get_bool(const char *section, const char *key, int fallback);
+void config_set_string(const char *section, const char *key, const char *value);
+void config_set_int(const char *section, const char *key, int value);
+void config_save();
+void config_apply_settings();
+void config_reload_if_changed();
+void color_depth_update();
+void headless_latency_sample(long long elapsed);
+void perf_key_read();
+void headless_finish();
+void color_quantize_prepare();
 void theme_init();
+void theme_registry_ensure_complete();
 void theme_load(int index);
 void theme_cycle();
 const char* theme_get_name();
@@ -685,8 +1199,11 @@ void editor_update_gutter_width();
 void editor_toggle_line_numbers();
 void editor_toggle_soft_wrap();
 void editor_toggle_center_scroll();
+void editor_toggle_perf_hud();
 void editor_update_scroll_speed();
 void editor_calculate_wrap_breaks(editor_row *row, int available_width);
+void editor_rewrap_all_rows();
+void editor_update_syntax(editor_row *row);
 rgb_color theme_get_color(enum theme_color color_id);
 int rgb_equal(rgb_color color_a, rgb_color color_b);
 void editor_handle_mouse_event();
@@ -699,17 +1216,62 @@ void undo_maybe_start_group(int force_new);
 void undo_log(enum undo_op_type type, int cursor_row, int cursor_col,
               int row_idx, int char_pos, const char *char_data,
               int end_row, int end_col, const char *multi_line);
+void undo_log_adopt(enum undo_op_type type, int cursor_row, int cursor_col,
+                    int row_idx, int char_pos, const char *char_data,
+                    int end_row, int end_col, char *multi_line, size_t multi_line_length);
 void undo_clear_redo();
 void editor_undo();
 void editor_redo();
 void editor_handle_resize();
+int server_wait_for_input();
+void server_detach_and_wait(const char *message);
 void editor_insert_char(int character);
 void editor_insert_newline();
-int clipboard_store(const char *content, int content_type);
-char *clipboard_get_latest(int *content_type);
-void clipboard_sync_to_system(const char *content);
-char *clipboard_read_from_system();
+void editor_insert_text(const char *text, size_t length);
+void editor_insert_text_adopt(char *text, size_t length, enum undo_op_type type);
+int buffer_open(const char *path);
+int buffer_dirty_count();
+void buffer_cycle(int direction);
+void buffer_close();
+void buffer_pick();
+void buffer_switch(int index);
+void view_invalidate();
+void file_watch_poll();
+void editor_toggle_follow();
+int viewer_open(const char *filename, int always);
+void viewer_poll();
+int viewer_progress(long long *lines, int *percent);
+int viewer_allows_key(int key);
+void log_detect_format();
+void log_index_restart();
+void editor_jump_to_time();
+void editor_note_file_state(const struct stat *file_stat);
+int editor_file_state_matches(const struct stat *file_stat);
+void editor_clear_buffer(void);
+static void buffer_free_undo(undo_entry *stack, int count);
+void view_layout();
+void view_split(enum view_node_type type);
+void view_next();
+void view_close();
+int view_mouse_position(int *x, int *y);
+clipboard_text *clipboard_text_create();
+clipboard_text *clipboard_text_retain(clipboard_text *text);
+void clipboard_text_release(clipboard_text *text);
+int clipboard_text_append(clipboard_text *text, const char *data, size_t length);
+clipboard_text *clipboard_text_from_string(const char *string);
+char *clipboard_text_flatten(clipboard_text *text);
+int clipboard_store(clipboard_text *content, int content_type);
+clipboard_text *clipboard_get_latest(int *content_type);
+void clipboard_sync_to_system(clipboard_text *content);
+clipboard_text *clipboard_read_from_system();
 void clipboard_smart_merge();
+int editor_cache_path(const char *name, char *buffer, size_t size);
+int editor_working_directory(char *buffer, size_t size);
+int editor_absolute_path(const char *path, char *buffer, size_t size);
+int editor_prompt_save_changes();
+void editor_open_fuzzy_finder();
+void clipboard_worker_start();
+void clipboard_request_refresh();
 int is_word_char(int c);
 int get_first_nonwhitespace_col(editor_row *row);
 int editor_line_indentation(editor_row *row);
@@ -721,6 +1283,114 @@ void multicursor_remove_duplicates();
 static bool *multicursor_mark_primary(cursor_position *all, size_t total);
 void editor_row_append_string(editor_row *row, char *s, size_t len);
 
+/*** tracing ***/
+
+/*
+ * Scoped hot-path tracing, compiled in only with -DMITER_TRACE (make
+ * trace). TRACE_SCOPE(name) at the top of a function records one
+ * complete event covering the rest of the scope. Events are buffered and
+ * written as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev)
+ * to the file given by --trace FILE or MITER_TRACE_FILE. Only the main
+ * thread is traced.
+ */
+#ifdef MITER_TRACE
+
+/* One recorded event; name must be a string literal (or __func__) */
+typedef struct {
+  const char *name;
+  long long start;
+  long long duration;
+} trace_event;
+
+static struct {
+  FILE *file;
+  pthread_t main_thread;
+  /* Events recorded since the last flush */
+  trace_event events[TRACE_BUFFER_EVENTS];
+  int event_count;
+  /* True once an event has been written (controls the separating comma) */
+  int written;
+} trace;
+
+/* Monotonic time in nanoseconds. */
+static long long trace_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Write buffered events out. Timestamps are microseconds with nanosecond
+ * decimals, as the format expects. */
+static void trace_flush() {
+  if (!trace.file) return;
+  for (int i = 0; i < trace.event_count; i++) {
+    trace_event *event = &trace.events[i];
+    fprintf(trace.file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+            "\"pid\":%d,\"tid\":1}",
+            trace.written ? ",\n" : "", event->name,
+            event->start / 1000, event->start % 1000,
+            event->duration / 1000, event->duration % 1000, (int)getpid());
+    trace.written = 1;
+  }
+  trace.event_count = 0;
+}
+
+/* Finish the trace file at exit. */
+static void trace_close() {
+  if (!trace.file) return;
+  trace_flush();
+  fprintf(trace.file, "\n]\n");
+  fclose(trace.file);
+  trace.file = NULL;
+}
+
+/* Start tracing to path. Returns 0 on success, -1 if it can't be opened. */
+int trace_open(const char *path) {
+  trace.file = fopen(path, "w");
+  if (!trace.file) return -1;
+  trace.main_thread = pthread_self();
+  /* The array form stays loadable even if the closing bracket is lost */
+  fprintf(trace.file, "[\n");
+  atexit(trace_close);
+  return 0;
+}
+
+/* Scope marker handed between TRACE_SCOPE and its cleanup. */
+typedef struct {
+  const char *name;
+  long long start;
+} trace_scope;
+
+static inline trace_scope trace_scope_begin(const char *name) {
+  trace_scope scope = {name, 0};
+  if (trace.file && pthread_equal(pthread_self(), trace.main_thread)) scope.start = trace_now();
+  return scope;
+}
+
+static inline void trace_scope_end(trace_scope *scope) {
+  if (!scope->start || !trace.file) return;
+  if (trace.event_count == TRACE_BUFFER_EVENTS) trace_flush();
+  trace_event *event = &trace.events[trace.event_count++];
+  event->name = scope->name;
+  event->start = scope->start;
+  event->duration = trace_now() - scope->start;
+}
+
+#define TRACE_SCOPE(name) \
+  trace_scope trace_scope_guard __attribute__((cleanup(trace_scope_end))) = trace_scope_begin(name)
+
+#else
+
+/* Tracing compiled out: --trace is refused */
+int trace_open(const char *path) {
+  (void)path;
+  return -1;
+}
+
+#define TRACE_SCOPE(name) do { } while (0)
+
+#endif
+
 /*** word wrapping utilities ***/
 
 /* Check if character is whitespace (space, tab, newline, or carriage return). */
@@ -951,72 +1621,493 @@ line_prefix detect_line_prefix(editor_row *row) {
 
 /*** terminal ***/
 
-/* Print error message and exit. Clears screen first. */
+/* Screen output goes through a second descriptor for the terminal opened
+ * non-blocking, so a slow terminal or SSH link never stalls the editor.
+ * Bytes the terminal hasn't accepted yet wait in this queue; while it is
+ * non-empty, new frames are dropped rather than queued behind it, and the
+ * newest state is drawn once it drains. A frame that has started going out
+ * is always finished, so the display is never left half-drawn. */
+static struct {
+  /* Non-blocking descriptor (STDOUT_FILENO if the tty couldn't be opened) */
+  int fd;
+  /* Queued bytes; data[offset..length) is still to be written */
+  char *data;
+  size_t length;
+  size_t offset;
+  size_t capacity;
+  /* Frames skipped because the previous one hadn't drained */
+  unsigned long frames_dropped;
+  /* Total bytes handed to terminal_write */
+  unsigned long long bytes_written;
+} terminal_output = {STDOUT_FILENO, NULL, 0, 0, 0, 0, 0};
+
+/* Headless mode (--headless): keys come from a script on stdin, output
+ * goes to /dev/null and the screen size is fixed. The normal keypress and
+ * refresh code runs unchanged; these fields let it measure itself. */
+static struct {
+  int enabled;
+  /* Virtual screen size */
+  int rows;
+  int columns;
+  /* Size of the decoded script; the run ends when it is all read */
+  off_t input_size;
+  /* Key-to-frame latencies in nanoseconds */
+  long long *latencies;
+  int latency_count;
+  int latency_capacity;
+  /* Keys read from the script */
+  unsigned long keys;
+  /* Allocation count when replay began (file already loaded) */
+  unsigned long long allocations_at_start;
+} headless;
+
+/* Server mode (--server): one long-lived editor that terminals attach to
+ * with --attach. The client passes its terminal descriptor over the
+ * socket and the server installs it as stdin and stdout, so the ordinary
+ * terminal code drives it; while detached both point at /dev/null and the
+ * buffer, undo history and caches stay in memory. */
+static struct {
+  int enabled;
+  /* Listening socket and its path (removed on exit) */
+  int listen_fd;
+  char path[PATH_MAX];
+  /* Connection of the attached client, or -1 while detached */
+  int client_fd;
+  /* The attached client's working directory, which relative paths
+   * resolve against; the server's own never changes, as clients in
+   * different directories share its buffers */
+  char directory[PATH_MAX];
+} server = {0, -1, "", -1, ""};
+
+/*
+ * Split views (Alt+- and Alt+\). Each view shows a buffer with its own
+ * cursor and scroll position. The active view's are the editor fields,
+ * with editor.screen_rows/screen_columns sized to its text area; the
+ * others are kept here. Views on the same buffer share its rows, render
+ * and highlight, and soft wrap follows the width of the view drawing it.
+ * The layout is a tree whose leaves are views and whose inner nodes
+ * halve their area between two children.
+ *
+ * Inactive views are drawn every frame, but each remembers a hash of
+ * every line it last sent, and lines whose output hasn't changed are
+ * dropped from the frame: an edit repaints only the lines it touched in
+ * the other views.
+ */
+typedef struct {
+  /* Buffer slot shown (stale while active: editor.buffer_current is) */
+  int buffer;
+  int cursor_x, cursor_y;
+  int row_offset, column_offset;
+  /* Text area on screen, 0-based; the view's status line is below it */
+  int top, left, rows, columns;
+  /* Leaf node holding the view */
+  int node;
+  /* Hash of each text line, then the status line, as last sent (0 = unknown) */
+  unsigned long long *line_hashes;
+} editor_view;
+
+typedef struct {
+  enum view_node_type type;
+  /* -1 for the root */
+  int parent;
+  /* Top or left child first */
+  int children[2];
+  /* View index of a leaf */
+  int view;
+  /* Area covered, status lines included */
+  int top, left, height, width;
+} view_node;
+
+static struct {
+  editor_view views[VIEW_MAX];
+  /* 0 until the screen is split, and again once one view is left */
+  int count;
+  int active;
+  view_node nodes[VIEW_NODE_MAX];
+  int root;
+  /* Area the views share: the screen less the message bar */
+  int screen_rows, screen_columns;
+  /* True if every line must be sent on the next frame */
+  int repaint;
+  /* View editor_draw_rows is drawing, and its hashes (NULL when active) */
+  editor_view *drawing;
+  unsigned long long *drawing_hashes;
+} views;
+
+/* Open the non-blocking output descriptor. Without one, output falls back
+ * to ordinary blocking writes on stdout. */
+void terminal_output_open() {
+  const char *name = ttyname(STDOUT_FILENO);
+  if (!name) return;
+  int fd = open(name, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd >= 0) terminal_output.fd = fd;
+}
+
+/* Write as much of the queue as the terminal will take without blocking.
+ * Returns 1 if the queue is now empty, 0 if bytes are still waiting. */
+int terminal_output_drain() {
+  while (terminal_output.offset < terminal_output.length) {
+    ssize_t written = write(terminal_output.fd, terminal_output.data + terminal_output.offset,
+                            terminal_output.length - terminal_output.offset);
+    if (written > 0) {
+      terminal_output.offset += written;
+    } else if (written == -1 && errno == EINTR) {
+      continue;
+    } else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    } else {
+      /* Terminal is gone: nothing more can be delivered */
+      break;
+    }
+  }
+  terminal_output.offset = terminal_output.length = 0;
+  return 1;
+}
+
+/* Queue bytes for the terminal and send what can be sent now. Nothing is
+ * ever dropped here; use for control sequences that must arrive in order
+ * with the frames. */
+void terminal_write(const char *data, size_t length) {
+  /* Compact written bytes away before growing */
+  if (terminal_output.offset > 0) {
+    memmove(terminal_output.data, terminal_output.data + terminal_output.offset,
+            terminal_output.length - terminal_output.offset);
+    terminal_output.length -= terminal_output.offset;
+    terminal_output.offset = 0;
+  }
+  if (terminal_output.length + length > terminal_output.capacity) {
+    size_t capacity = terminal_output.capacity ? terminal_output.capacity : length;
+    while (capacity < terminal_output.length + length) capacity *= 2;
+    char *data = realloc(terminal_output.data, capacity);
+    if (!data) return;
+    terminal_output.data = data;
+    terminal_output.capacity = capacity;
+  }
+  memcpy(terminal_output.data + terminal_output.length, data, length);
+  terminal_output.length += length;
+  terminal_output.bytes_written += length;
+  terminal_output_drain();
+}
+
+/* Called before rendering a frame. Returns 1 if the frame should be drawn,
+ * or 0 (counting it as dropped) while the last one is still going out. */
+int terminal_output_ready() {
+  if (terminal_output_drain()) return 1;
+  terminal_output.frames_dropped++;
+  return 0;
+}
+
+/* Block until everything queued has been written, giving up after
+ * TERMINAL_OUTPUT_FLUSH_TIMEOUT_MS without progress. Used on exit. */
+void terminal_output_flush() {
+  while (!terminal_output_drain()) {
+    fd_set writefds;
+    FD_ZERO(&writefds);
+    FD_SET(terminal_output.fd, &writefds);
+    struct timeval timeout = {0, TERMINAL_OUTPUT_FLUSH_TIMEOUT_MS * 1000};
+    if (select(terminal_output.fd + 1, NULL, &writefds, NULL, &timeout) <= 0) break;
+  }
+}
+
+/* While output is queued, wait for either input or room in the terminal
+ * (up to the usual read timeout), draining output as room appears.
+ * Returns 1 if input is ready to read, 0 if the caller should return
+ * without a key so the screen is redrawn. */
+static int terminal_output_wait_for_input() {
+  if (terminal_output.offset >= terminal_output.length) return 1;
+
+  fd_set readfds, writefds;
+  FD_ZERO(&readfds);
+  FD_ZERO(&writefds);
+  FD_SET(STDIN_FILENO, &readfds);
+  FD_SET(terminal_output.fd, &writefds);
+  int highest = terminal_output.fd > STDIN_FILENO ? terminal_output.fd : STDIN_FILENO;
+  struct timeval timeout = {0, VTIME_DECISECONDS * 100000};
+
+  if (select(highest + 1, &readfds, &writefds, NULL, &timeout) <= 0) return 0;
+  if (FD_ISSET(terminal_output.fd, &writefds)) terminal_output_drain();
+  return FD_ISSET(STDIN_FILENO, &readfds);
+}
+
+/* Print error message and exit. Clears screen first. Library builds
+ * record the error as the status message and return instead. */
 void die(const char *message) {
+#ifdef MITER_LIBRARY
+  /* The library must not end its host: leave the error on the bound
+   * context, where miter_status_message reports it */
+  editor_set_status_message("%s: %s", message, strerror(errno));
+#else
+  terminal_output_flush();
   write(STDOUT_FILENO, ESCAPE_CLEAR_SCREEN, ESCAPE_CLEAR_SCREEN_LEN);
   write(STDOUT_FILENO, ESCAPE_CURSOR_HOME, ESCAPE_CURSOR_HOME_LEN);
 
   perror(message);
   exit(1);
+#endif
 }
 
+/* True while the terminal is in raw mode */
+static int raw_mode_enabled;
+
 /* Restore terminal to canonical mode. Called via atexit(). */
 void disable_raw_mode() {
+  if (!raw_mode_enabled) return;
+  raw_mode_enabled = 0;
+  /* Let the last frame finish before resetting the terminal */
+  terminal_output_flush();
   /* Disable Kitty keyboard protocol if it was enabled */
   if (editor.kitty_keyboard_mode) {
     write(STDOUT_FILENO, KITTY_KEYBOARD_DISABLE, KITTY_KEYBOARD_DISABLE_LEN);
   }
-  /* Disable mouse tracking before restoring terminal */
+  /* Disable focus reporting and mouse tracking before restoring terminal */
+  write(STDOUT_FILENO, ESCAPE_FOCUS_REPORTING_DISABLE, ESCAPE_FOCUS_REPORTING_DISABLE_LEN);
   write(STDOUT_FILENO, MOUSE_DISABLE_SGR, 8);
   write(STDOUT_FILENO, MOUSE_DISABLE_BUTTON, 8);
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor.original_termios) == -1)
+  /* A server's client may already have hung up its terminal */
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor.original_termios) == -1 && !server.enabled)
     die("tcsetattr");
 }
 
-/* Try to detect Kitty keyboard protocol support.
- * Sends query sequence and checks for valid response.
- * Returns 1 if supported, 0 otherwise. */
-static int detect_kitty_keyboard_support() {
-  /* Send query: CSI ? u */
-  write(STDOUT_FILENO, KITTY_KEYBOARD_QUERY, KITTY_KEYBOARD_QUERY_LEN);
+/* Read the max_colors capability of TERM from the compiled terminfo
+ * database. Returns the number of colours, or -1 if it can't be found. */
+int terminfo_max_colors() {
+  const char *term = getenv("TERM");
+  if (!term || !term[0] || strchr(term, '/')) return -1;
+
+  const char *home = getenv("HOME");
+  const char *terminfo = getenv("TERMINFO");
+  char home_directory[PATH_MAX] = "";
+  if (home) snprintf(home_directory, sizeof(home_directory), "%s/.terminfo", home);
+  const char *directories[] = {terminfo, home_directory, "/etc/terminfo", "/lib/terminfo",
+                               "/usr/share/terminfo", "/usr/lib/terminfo"};
+
+  FILE *f = NULL;
+  for (size_t i = 0; !f && i < sizeof(directories) / sizeof(directories[0]); i++) {
+    if (!directories[i] || !directories[i][0]) continue;
+    char path[PATH_MAX];
+    /* Entries are filed under their first letter, or its hex code on macOS */
+    snprintf(path, sizeof(path), "%s/%c/%s", directories[i], term[0], term);
+    f = fopen(path, "rb");
+    if (f) break;
+    snprintf(path, sizeof(path), "%s/%02x/%s", directories[i], (unsigned char)term[0], term);
+    f = fopen(path, "rb");
+  }
+  if (!f) return -1;
 
-  /* Use select() for short timeout to read response */
-  fd_set readfds;
-  struct timeval tv;
-  FD_ZERO(&readfds);
-  FD_SET(STDIN_FILENO, &readfds);
-  tv.tv_sec = 0;
-  tv.tv_usec = 100000;  /* 100ms timeout */
+  unsigned char data[TERMINFO_MAX_SIZE];
+  size_t size = fread(data, 1, sizeof(data), f);
+  fclose(f);
+  if (size < TERMINFO_HEADER_SIZE) return -1;
+
+  int magic = data[0] | data[1] << 8;
+  int names_size = data[2] | data[3] << 8;
+  int bool_count = data[4] | data[5] << 8;
+  int number_count = data[6] | data[7] << 8;
+  int number_size = magic == TERMINFO_MAGIC_EXTENDED ? 4 : 2;
+  if (magic != TERMINFO_MAGIC_LEGACY && magic != TERMINFO_MAGIC_EXTENDED) return -1;
+  if (number_count <= TERMINFO_MAX_COLORS_INDEX) return -1;
+
+  /* Numbers follow the names and booleans, aligned to an even offset */
+  size_t offset = TERMINFO_HEADER_SIZE + names_size + bool_count;
+  offset += offset & 1;
+  offset += TERMINFO_MAX_COLORS_INDEX * number_size;
+  if (offset + number_size > size) return -1;
+
+  long colors = data[offset] | data[offset + 1] << 8;
+  if (number_size == 4) {
+    colors |= (long)data[offset + 2] << 16 | (long)data[offset + 3] << 24;
+    if (colors >= 0x80000000L) return -1;
+  } else if (colors >= 0x8000) {
+    return -1;
+  }
+  return colors;
+}
+
+/* State of the startup capability probe. Results start out as whatever
+ * was cached for this TERM and are replaced by the terminal's replies. */
+static struct {
+  /* True from sending the queries until the DA1 reply arrives */
+  int pending;
+  /* Capabilities the terminal has answered for so far */
+  int kitty_keyboard;
+  int sync_output;
+  int truecolor;
+  /* Values read from the cache file (-1 if there was none) */
+  int cached_kitty_keyboard;
+  int cached_sync_output;
+  int cached_truecolor;
+} terminal_probe = {0, 0, 0, 0, -1, -1, -1};
+
+/* Build the cache file path for the current TERM (and TERM_PROGRAM, since
+ * many terminals share TERM=xterm-256color). Returns 0 on success. */
+static int terminal_caps_path(char *path, size_t size) {
+  const char *term = getenv("TERM");
+  const char *program = getenv("TERM_PROGRAM");
+  char name[NAME_MAX];
+  int length = snprintf(name, sizeof(name), TERMINAL_CAPS_FILE_PREFIX "%s%s%s" TERMINAL_CAPS_FILE_SUFFIX,
+                        term ? term : "unknown", program ? "-" : "", program ? program : "");
+  if (length >= (int)sizeof(name)) return -1;
+
+  /* Keep the name a plain file name whatever the variables contain */
+  for (char *p = name; *p; p++) {
+    if (!isalnum((unsigned char)*p) && *p != '-' && *p != '.') *p = '_';
+  }
+  return editor_cache_path(name, path, size);
+}
+
+/* Read cached capabilities for this terminal, if any. */
+static void terminal_caps_load() {
+  char path[PATH_MAX];
+  if (terminal_caps_path(path, sizeof(path)) != 0) return;
+  FILE *f = fopen(path, "r");
+  if (!f) return;
 
-  if (select(STDIN_FILENO + 1, &readfds, NULL, NULL, &tv) <= 0) {
-    return 0;  /* No response - not supported */
+  char line[CONFIG_LINE_BUFFER_SIZE];
+  int value;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "kitty_keyboard=%d", &value) == 1) terminal_probe.cached_kitty_keyboard = value;
+    else if (sscanf(line, "sync_output=%d", &value) == 1) terminal_probe.cached_sync_output = value;
+    else if (sscanf(line, "truecolor=%d", &value) == 1) terminal_probe.cached_truecolor = value;
   }
+  fclose(f);
+}
 
-  /* Read response: should be CSI ? flags u (e.g., "\x1b[?0u" or "\x1b[?1u") */
-  char buf[32];
-  int idx = 0;
-  char c;
+/* Write the probed capabilities to the cache if they differ from what it
+ * held. Written to a temporary file and renamed so readers never see a
+ * partial file. */
+static void terminal_caps_save() {
+  if (terminal_probe.kitty_keyboard == terminal_probe.cached_kitty_keyboard &&
+      terminal_probe.sync_output == terminal_probe.cached_sync_output &&
+      terminal_probe.truecolor == terminal_probe.cached_truecolor) return;
+
+  char path[PATH_MAX], temporary[PATH_MAX];
+  if (terminal_caps_path(path, sizeof(path)) != 0) return;
+  if (snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) >= (int)sizeof(temporary)) return;
+
+  FILE *f = fopen(temporary, "w");
+  if (!f) return;
+  fprintf(f, "kitty_keyboard=%d\nsync_output=%d\ntruecolor=%d\n",
+          terminal_probe.kitty_keyboard, terminal_probe.sync_output, terminal_probe.truecolor);
+  if (fclose(f) != 0 || rename(temporary, path) != 0) unlink(temporary);
+}
+
+/* True if COLORTERM advertises 24-bit colour. */
+static int terminal_colorterm_truecolor() {
+  const char *colorterm = getenv("COLORTERM");
+  return colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0);
+}
 
-  while (idx < 31) {
-    if (read(STDIN_FILENO, &c, 1) != 1) break;
-    buf[idx++] = c;
-    if (c == 'u') break;  /* End of response */
+/* Switch the Kitty keyboard protocol on or off. */
+static void terminal_set_kitty_keyboard(int enable) {
+  if (enable == editor.kitty_keyboard_mode) return;
+  if (enable) {
+    terminal_write(KITTY_KEYBOARD_ENABLE, KITTY_KEYBOARD_ENABLE_LEN);
+  } else {
+    terminal_write(KITTY_KEYBOARD_DISABLE, KITTY_KEYBOARD_DISABLE_LEN);
   }
-  buf[idx] = '\0';
+  editor.kitty_keyboard_mode = enable;
+}
+
+/* Start the capability probe: apply cached results straight away so the
+ * first frame is drawn with them, then send every query at once. Nothing
+ * here waits for the terminal. */
+static void terminal_probe_start() {
+  /* Forget any earlier terminal's answers (a server probes each client) */
+  terminal_probe.kitty_keyboard = terminal_probe.sync_output = terminal_probe.truecolor = 0;
+  terminal_probe.cached_kitty_keyboard = -1;
+  terminal_probe.cached_sync_output = -1;
+  terminal_probe.cached_truecolor = -1;
+  terminal_caps_load();
+  editor.kitty_keyboard_mode = 0;
+  editor.sync_output = terminal_probe.cached_sync_output > 0;
+  editor.truecolor = terminal_probe.cached_truecolor > 0 || terminal_colorterm_truecolor();
+
+  static const char queries[] = KITTY_KEYBOARD_QUERY TERMINAL_QUERY_SYNC_OUTPUT
+                                TERMINAL_QUERY_TRUECOLOR TERMINAL_QUERY_DEVICE_ATTRIBUTES;
+  write(STDOUT_FILENO, queries, sizeof(queries) - 1);
+  terminal_probe.pending = 1;
+
+  if (terminal_probe.cached_kitty_keyboard > 0) terminal_set_kitty_keyboard(1);
+}
+
+/* The DA1 reply has arrived: anything not answered by now is unsupported.
+ * Undo cached guesses that turned out wrong and refresh the cache. */
+static void terminal_probe_finish() {
+  if (!terminal_probe.pending) return;
+  terminal_probe.pending = 0;
+
+  if (!terminal_probe.kitty_keyboard) terminal_set_kitty_keyboard(0);
+  editor.sync_output = terminal_probe.sync_output;
+  editor.truecolor = terminal_probe.truecolor || terminal_colorterm_truecolor();
+  color_depth_update();
+  terminal_caps_save();
+}
+
+/* Read the rest of a terminal reply after its introducer (ESC [ ? for
+ * CSI replies, ESC P for DCS strings) and record what it says. Returns -1
+ * so callers treat it like a read timeout rather than a key. */
+static int terminal_read_reply(char introducer) {
+  char reply[TERMINAL_REPLY_BUFFER_SIZE];
+  int length = 0;
+  char final = '\0';
+  char c;
 
-  /* Check for valid response format: ESC [ ? flags u */
-  /* Response is "\x1b[?Nu" where N is the current flags (typically 0) */
-  if (idx >= 4 && buf[0] == CHAR_ESCAPE && buf[1] == CHAR_CSI && buf[2] == '?') {
-    return 1;  /* Kitty protocol supported */
+  while (read(STDIN_FILENO, &c, 1) == 1) {
+    /* CSI ends at its final byte; DCS ends with ST (ESC \) */
+    if (introducer == CHAR_CSI && c >= '@' && c <= '~') {
+      final = c;
+      break;
+    }
+    if (introducer != CHAR_CSI && c == '\\' && length > 0 && reply[length - 1] == CHAR_ESCAPE) {
+      length--;
+      final = c;
+      break;
+    }
+    if (length < (int)sizeof(reply) - 1) reply[length++] = c;
+  }
+  reply[length] = '\0';
+  /* Reply cut short by a read timeout: drop it */
+  if (!final) return -1;
+
+  if (introducer != CHAR_CSI) {
+    /* XTGETTCAP: "1+r<name>=<value>" if the capability exists */
+    if (strncmp(reply, TERMINAL_REPLY_CAPABILITY_FOUND, strlen(TERMINAL_REPLY_CAPABILITY_FOUND)) == 0) {
+      terminal_probe.truecolor = 1;
+      editor.truecolor = 1;
+      color_depth_update();
+    }
+    return -1;
   }
 
-  return 0;
+  int mode, state;
+  switch (final) {
+    case 'u':
+      /* Kitty keyboard flags: CSI ? flags u */
+      terminal_probe.kitty_keyboard = 1;
+      terminal_set_kitty_keyboard(1);
+      break;
+    case 'y':
+      /* DECRPM: CSI ? mode ; state $ y, state 1-3 means recognized */
+      if (sscanf(reply, "%d;%d", &mode, &state) == 2 && mode == TERMINAL_MODE_SYNC_OUTPUT) {
+        terminal_probe.sync_output = state >= 1 && state <= 3;
+        editor.sync_output = terminal_probe.sync_output;
+      }
+      break;
+    case 'c':
+      /* DA1: the sentinel that ends the probe */
+      terminal_probe_finish();
+      break;
+  }
+  return -1;
 }
 
 /* Put terminal into raw mode for character-by-character input. */
 void enable_raw_mode() {
   if (tcgetattr(STDIN_FILENO, &editor.original_termios) == -1) die("tcgetattr");
-  atexit(disable_raw_mode);
+  /* A server enters raw mode once per attached client */
+  static int exit_handler_registered;
+  if (!exit_handler_registered) atexit(disable_raw_mode);
+  exit_handler_registered = 1;
 
   struct termios raw = editor.original_termios;
   raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -1027,14 +2118,12 @@ void enable_raw_mode() {
   raw.c_cc[VTIME] = VTIME_DECISECONDS;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  raw_mode_enabled = 1;
+  terminal_output_open();
 
-  /* Try to enable Kitty keyboard protocol */
-  if (detect_kitty_keyboard_support()) {
-    write(STDOUT_FILENO, KITTY_KEYBOARD_ENABLE, KITTY_KEYBOARD_ENABLE_LEN);
-    editor.kitty_keyboard_mode = 1;
-  } else {
-    editor.kitty_keyboard_mode = 0;
-  }
+  /* Ask for Kitty keyboard, synchronized output and truecolor support;
+   * the replies are picked up by editor_read_key as they arrive */
+  terminal_probe_start();
 
   /* Enable mouse tracking (SGR extended mode for large terminals) */
   /* Mode 1006: SGR format for coordinates (supports large terminals) */
@@ -1042,6 +2131,10 @@ void enable_raw_mode() {
   /* NOTE: Do NOT enable Mode 1000 - it conflicts with and disables Mode 1002 */
   write(STDOUT_FILENO, MOUSE_ENABLE_SGR, 8);
   write(STDOUT_FILENO, MOUSE_ENABLE_BUTTON, 8);
+
+  /* Ask for focus-in/focus-out reports so the clipboard cache can be
+   * refreshed when the user comes back from another application */
+  write(STDOUT_FILENO, ESCAPE_FOCUS_REPORTING_ENABLE, ESCAPE_FOCUS_REPORTING_ENABLE_LEN);
 }
 
 /*
@@ -1261,6 +2354,14 @@ int parse_kitty_key_event(const char *already_read, int already_len) {
         case 'v': return ALT_V;
         case 'z': return ALT_Z;
         case 'm': return ALT_M;
+        case 'h': return ALT_H;
+        case 'i': return ALT_I;
+        case 'b': return ALT_B;
+        case 'k': return ALT_K;
+        case 'f': return ALT_F;
+        case 'x': return ALT_X;
+        case 'e': return ALT_E;
+        case 'g': return ALT_G;
       }
     }
     return keycode;
@@ -1286,6 +2387,14 @@ int parse_kitty_key_event(const char *already_read, int already_len) {
         case 'v': return ALT_V;
         case 'z': return ALT_Z;
         case 'm': return ALT_M;
+        case 'h': return ALT_H;
+        case 'i': return ALT_I;
+        case 'b': return ALT_B;
+        case 'k': return ALT_K;
+        case 'f': return ALT_F;
+        case 'x': return ALT_X;
+        case 'e': return ALT_E;
+        case 'g': return ALT_G;
       }
     }
     return keycode;
@@ -1294,6 +2403,10 @@ int parse_kitty_key_event(const char *already_read, int already_len) {
   /* Bracket keys with Alt */
   if (keycode == '[' && alt) return ALT_OPEN_BRACKET;
   if (keycode == ']' && alt) return ALT_CLOSE_BRACKET;
+  if (keycode == ',' && alt) return ALT_COMMA;
+  if (keycode == '.' && alt) return ALT_PERIOD;
+  if (keycode == '-' && alt) return ALT_MINUS;
+  if (keycode == '\\' && alt) return ALT_BACKSLASH;
 
   /* Special characters with Ctrl */
   if (ctrl) {
@@ -1325,6 +2438,11 @@ static int editor_read_key_kitty() {
   if (bytes_read == 0) return -1;
   if (bytes_read == -1) {
     if (errno == EAGAIN) return -1;
+    /* The client's terminal went away: wait for the next one */
+    if (server.enabled) {
+      server_detach_and_wait(NULL);
+      return -1;
+    }
     die("read");
   }
 
@@ -1336,12 +2454,19 @@ static int editor_read_key_kitty() {
     /* Read next char - should be '[' for CSI */
     if (read(STDIN_FILENO, &c, 1) != 1) return CHAR_ESCAPE;
 
+    /* DCS string: only a reply to the startup probe */
+    if (c == 'P' && terminal_probe.pending) return terminal_read_reply(c);
+
     if (c == CHAR_CSI) {
+      if (read(STDIN_FILENO, &c, 1) != 1) return CHAR_ESCAPE;
+      /* CSI ? ... is a reply to a capability query, never a key */
+      if (c == '?') return terminal_read_reply(CHAR_CSI);
+      seq[idx++] = c;
+
       /* Read until terminator */
-      while (idx < 62) {
+      while (idx < 62 && !(c == 'u' || c == '~' || c == 'M' || c == 'm' || (c >= 'A' && c <= 'Z'))) {
         if (read(STDIN_FILENO, &c, 1) != 1) return CHAR_ESCAPE;
         seq[idx++] = c;
-        if (c == 'u' || c == '~' || c == 'M' || c == 'm' || (c >= 'A' && c <= 'Z')) break;
       }
       seq[idx] = '\0';
 
@@ -1466,6 +2591,10 @@ static int editor_read_key_kitty() {
             return END_KEY;
           case 'Z':  /* Shift+Tab */
             return SHIFT_TAB;
+          case 'I':  /* Focus gained */
+            return FOCUS_IN;
+          case 'O':  /* Focus lost */
+            return FOCUS_OUT;
         }
       }
 
@@ -1498,6 +2627,11 @@ static int editor_read_key_legacy() {
   if (bytes_read == 0) return -1;
   if (bytes_read == -1) {
     if (errno == EAGAIN) return -1;
+    /* The client's terminal went away: wait for the next one */
+    if (server.enabled) {
+      server_detach_and_wait(NULL);
+      return -1;
+    }
     die("read");
   }
 
@@ -1506,6 +2640,9 @@ static int editor_read_key_legacy() {
 
     if (read(STDIN_FILENO, &escape_sequence[0], 1) != 1) return CHAR_ESCAPE;
 
+    /* DCS string: only a reply to the startup probe */
+    if (escape_sequence[0] == 'P' && terminal_probe.pending) return terminal_read_reply('P');
+
     /* Handle Alt+key combinations (ESC followed by a character) */
     if (escape_sequence[0] == 't' || escape_sequence[0] == 'T') return ALT_T;
     if (escape_sequence[0] == 'l' || escape_sequence[0] == 'L') return ALT_L;
@@ -1519,6 +2656,18 @@ static int editor_read_key_legacy() {
     if (escape_sequence[0] == 'v' || escape_sequence[0] == 'V') return ALT_V;
     if (escape_sequence[0] == 'z' || escape_sequence[0] == 'Z') return ALT_Z;
     if (escape_sequence[0] == 'm' || escape_sequence[0] == 'M') return ALT_M;
+    if (escape_sequence[0] == 'h' || escape_sequence[0] == 'H') return ALT_H;
+    if (escape_sequence[0] == 'i' || escape_sequence[0] == 'I') return ALT_I;
+    if (escape_sequence[0] == 'b' || escape_sequence[0] == 'B') return ALT_B;
+    if (escape_sequence[0] == 'k' || escape_sequence[0] == 'K') return ALT_K;
+    if (escape_sequence[0] == ',') return ALT_COMMA;
+    if (escape_sequence[0] == 'f' || escape_sequence[0] == 'F') return ALT_F;
+    if (escape_sequence[0] == 'x' || escape_sequence[0] == 'X') return ALT_X;
+    if (escape_sequence[0] == 'e' || escape_sequence[0] == 'E') return ALT_E;
+    if (escape_sequence[0] == 'g' || escape_sequence[0] == 'G') return ALT_G;
+    if (escape_sequence[0] == '.') return ALT_PERIOD;
+    if (escape_sequence[0] == '-') return ALT_MINUS;
+    if (escape_sequence[0] == '\\') return ALT_BACKSLASH;
     if (escape_sequence[0] == ']') return ALT_CLOSE_BRACKET;
 
     if (read(STDIN_FILENO, &escape_sequence[1], 1) != 1) {
@@ -1527,6 +2676,9 @@ static int editor_read_key_legacy() {
     }
 
     if (escape_sequence[0] == CHAR_CSI) {
+      /* CSI ? ... is a reply to a capability query, never a key */
+      if (escape_sequence[1] == '?') return terminal_read_reply(CHAR_CSI);
+
       /* SGR mouse format: ESC [ < ... */
       if (escape_sequence[1] == '<') {
         return parse_sgr_mouse_event();
@@ -1592,6 +2744,8 @@ static int editor_read_key_legacy() {
           case 'H': return HOME_KEY;
           case 'F': return END_KEY;
           case 'Z': return SHIFT_TAB;
+          case 'I': return FOCUS_IN;
+          case 'O': return FOCUS_OUT;
         }
       }
     } else if (escape_sequence[0] == CHAR_SS3) {
@@ -1610,14 +2764,41 @@ static int editor_read_key_legacy() {
 /*
  * Read a single keypress and return its key code.
  * Dispatches to Kitty or legacy handler based on terminal mode.
- * Returns -1 if no input available (timeout).
+ * Returns -1 if no input available (timeout). Focus reports are acted on
+ * here and also read as a timeout, so no caller ever sees them.
  */
 int editor_read_key() {
+  if (headless.enabled) {
+    /* End of the script: report and exit */
+    if (lseek(STDIN_FILENO, 0, SEEK_CUR) >= headless.input_size) headless_finish();
+  } else if (server.enabled) {
+    /* Also watch the client connection and the listening socket */
+    if (!server_wait_for_input()) return -1;
+  } else if (!terminal_output_wait_for_input()) {
+    /* Don't sit in read() while a frame is waiting for the terminal */
+    return -1;
+  }
+
+  int key;
   if (editor.kitty_keyboard_mode) {
-    return editor_read_key_kitty();
+    key = editor_read_key_kitty();
   } else {
-    return editor_read_key_legacy();
+    key = editor_read_key_legacy();
+  }
+
+  /* Focus changes: the user may have copied something elsewhere */
+  if (key == FOCUS_IN) {
+    clipboard_request_refresh();
+    config_reload_if_changed();
+    return -1;
+  }
+  if (key == FOCUS_OUT) return -1;
+
+  if (key >= 0) {
+    if (headless.enabled) headless.keys++;
+    perf_key_read();
   }
+  return key;
 }
 
 /* Query terminal for current cursor position using escape sequence.
@@ -1646,6 +2827,18 @@ int cursor_get_position(int *rows, int *cols) {
 int window_get_size(int *rows, int *cols) {
   struct winsize window_size;
 
+  if (headless.enabled) {
+    *rows = headless.rows;
+    *cols = headless.columns;
+    return 0;
+  }
+  /* A detached server keeps a nominal size until a client attaches */
+  if (server.enabled && server.client_fd < 0) {
+    *rows = HEADLESS_DEFAULT_ROWS;
+    *cols = HEADLESS_DEFAULT_COLUMNS;
+    return 0;
+  }
+
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) == -1 || window_size.ws_col == 0) {
     if (write(STDOUT_FILENO, ESCAPE_MOVE_CURSOR_TO_END, ESCAPE_MOVE_CURSOR_TO_END_LEN) != ESCAPE_MOVE_CURSOR_TO_END_LEN) return -1;
     return cursor_get_position(rows, cols);
@@ -1673,6 +2866,13 @@ void editor_handle_resize() {
   /* Ensure screen_rows is at least 1 */
   if (editor.screen_rows < 1) editor.screen_rows = 1;
 
+  /* Split views share the screen; the active one's area becomes the editor's */
+  if (views.count > 1) {
+    views.screen_rows = editor.screen_rows + SCREEN_RESERVED_ROWS - 1;
+    views.screen_columns = editor.screen_columns;
+    view_layout();
+  }
+
   /* Recalculate gutter width */
   editor_update_gutter_width();
 
@@ -1689,13 +2889,267 @@ void editor_handle_resize() {
   editor.row_offset = 0;
   editor.column_offset = 0;
 
-  /* Recalculate wrap breaks if soft wrap is enabled */
-  if (editor.soft_wrap) {
-    int available_width = editor.screen_columns - editor.gutter_width;
-    for (int i = 0; i < editor.row_count; i++) {
-      editor_calculate_wrap_breaks(&editor.row[i], available_width);
+  editor_rewrap_all_rows();
+}
+
+/*** performance counters ***/
+
+/* Count every heap allocation for the HUD and headless reports, in builds
+ * made with -DMITER_COUNT_ALLOCATIONS (make trace) on glibc. Replacing
+ * malloc is opt-in because it hides allocations from sanitizers and
+ * valgrind. The counter is shared with the worker threads. */
+static unsigned long long allocation_count;
+
+#if defined(MITER_COUNT_ALLOCATIONS) && defined(__GLIBC__) && !defined(MITER_LIBRARY)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) {
+  __atomic_fetch_add(&allocation_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  __atomic_fetch_add(&allocation_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+  __atomic_fetch_add(&allocation_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(pointer, size);
+}
+#define ALLOCATION_COUNTING 1
+#else
+#define ALLOCATION_COUNTING 0
+#endif
+
+/* Always-on counters behind the performance HUD (Alt+H). Each frame
+ * costs two clock reads and a few additions; the resident size is only
+ * re-read about once a second, and only while the HUD is shown. */
+static struct {
+  /* When the oldest key not yet on screen was read */
+  struct timespec key_started;
+  int key_pending;
+  /* Key-to-frame latency histogram: bucket i counts samples below
+   * PERF_HISTOGRAM_FIRST_US << i microseconds (the last takes the rest).
+   * Halved every PERF_HISTOGRAM_DECAY samples so it follows recent keys. */
+  unsigned long latency_histogram[PERF_HISTOGRAM_BUCKETS];
+  unsigned long latency_samples;
+  /* Frame in progress */
+  struct timespec frame_started;
+  unsigned long frame_rows_start;
+  unsigned long long frame_allocations_start;
+  /* Last completed frame */
+  long long last_frame_ns;
+  size_t last_frame_bytes;
+  unsigned long last_frame_rows;
+  unsigned long long last_frame_allocations;
+  /* Running totals */
+  unsigned long frames;
+  unsigned long rows_highlighted;
+  /* Resident set size in bytes and when it was read */
+  long resident_bytes;
+  time_t resident_checked;
+} perf;
+
+/* Nanoseconds between two timestamps. */
+static long long perf_elapsed(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+/* A key was read; its latency runs until the next frame is written. Keys
+ * read before that frame (pasted runs, prompts) share one sample. */
+void perf_key_read() {
+  if (perf.key_pending) return;
+  clock_gettime(CLOCK_MONOTONIC, &perf.key_started);
+  perf.key_pending = 1;
+}
+
+/* Start timing a frame. */
+void perf_frame_begin() {
+  clock_gettime(CLOCK_MONOTONIC, &perf.frame_started);
+  perf.frame_rows_start = perf.rows_highlighted;
+  perf.frame_allocations_start = __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+}
+
+/* A frame of bytes has been handed to the terminal: record its cost and
+ * close the pending key's latency sample. Returns that latency in
+ * nanoseconds, or -1 if no key was waiting for this frame. */
+long long perf_frame_end(size_t bytes) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  perf.frames++;
+  perf.last_frame_ns = perf_elapsed(&perf.frame_started, &now);
+  perf.last_frame_bytes = bytes;
+  perf.last_frame_rows = perf.rows_highlighted - perf.frame_rows_start;
+  perf.last_frame_allocations = __atomic_load_n(&allocation_count, __ATOMIC_RELAXED) -
+                                perf.frame_allocations_start;
+
+  if (!perf.key_pending) return -1;
+  perf.key_pending = 0;
+  long long latency = perf_elapsed(&perf.key_started, &now);
+
+  int bucket = 0;
+  while (bucket < PERF_HISTOGRAM_BUCKETS - 1 &&
+         latency >= (long long)(PERF_HISTOGRAM_FIRST_US << bucket) * 1000) bucket++;
+  perf.latency_histogram[bucket]++;
+  if (++perf.latency_samples % PERF_HISTOGRAM_DECAY == 0) {
+    for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) perf.latency_histogram[i] /= 2;
+  }
+  return latency;
+}
+
+/*** memory accounting ***/
+
+/* Subsystems whose heap use is tracked. */
+enum memory_tag {
+  MEMORY_ROW_CHARS,
+  MEMORY_ROW_RENDER,
+  MEMORY_ROW_HIGHLIGHT,
+  MEMORY_ROW_WRAP_BREAKS,
+  MEMORY_UNDO,
+  MEMORY_SEARCH,
+  MEMORY_CLIPBOARD,
+  MEMORY_THEMES,
+  MEMORY_LINE_INDEX,
+  MEMORY_ROW_CHUNKS,
+  MEMORY_TAG_COUNT
+};
+
+static const char *memory_tag_names[MEMORY_TAG_COUNT] = {
+  "chars", "render", "highlight", "wrap_breaks", "undo", "search", "clipboard", "themes", "line_index", "chunks"
+};
+
+/* Per-tag counters. Sizes are the allocator's usable size of each block,
+ * so a block freed through a wrapper is subtracted exactly as it was
+ * added. Updated atomically: the clipboard is also used by its worker. */
+static struct {
+  long long live_bytes;
+  long long live_count;
+  long long peak_bytes;
+  unsigned long long allocations;
+} memory_stats[MEMORY_TAG_COUNT];
+
+/* Peak of all tags together */
+static long long memory_peak_total;
+
+/* Usable size of a heap block (0 for NULL). */
+static size_t memory_block_size(void *block) {
+  if (!block) return 0;
+#ifdef __APPLE__
+  return malloc_size(block);
+#else
+  return malloc_usable_size(block);
+#endif
+}
+
+/* Raise *peak to value if it is higher. */
+static void memory_raise_peak(long long *peak, long long value) {
+  long long current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(peak, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/* Account for a block entering (sign 1) or leaving (sign -1) a tag. */
+static void memory_account(enum memory_tag tag, void *block, int sign) {
+  if (!block) return;
+  long long size = (long long)memory_block_size(block) * sign;
+  long long live = __atomic_add_fetch(&memory_stats[tag].live_bytes, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&memory_stats[tag].live_count, sign, __ATOMIC_RELAXED);
+  if (sign < 0) return;
+
+  __atomic_add_fetch(&memory_stats[tag].allocations, 1, __ATOMIC_RELAXED);
+  memory_raise_peak(&memory_stats[tag].peak_bytes, live);
+
+  long long total = 0;
+  for (int i = 0; i < MEMORY_TAG_COUNT; i++) total += __atomic_load_n(&memory_stats[i].live_bytes, __ATOMIC_RELAXED);
+  memory_raise_peak(&memory_peak_total, total);
+}
+
+/* malloc() counted against tag. */
+void *memory_malloc(enum memory_tag tag, size_t size) {
+  void *block = malloc(size);
+  memory_account(tag, block, 1);
+  return block;
+}
+
+/* calloc() counted against tag. */
+void *memory_calloc(enum memory_tag tag, size_t count, size_t size) {
+  void *block = calloc(count, size);
+  memory_account(tag, block, 1);
+  return block;
+}
+
+/* realloc() counted against tag. On failure the old block stays counted,
+ * as it stays allocated. */
+void *memory_realloc(enum memory_tag tag, void *block, size_t size) {
+  size_t old_size = memory_block_size(block);
+  void *resized = realloc(block, size);
+  if (!resized && size) return NULL;
+
+  if (block) {
+    __atomic_add_fetch(&memory_stats[tag].live_bytes, -(long long)old_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memory_stats[tag].live_count, -1, __ATOMIC_RELAXED);
+  }
+  memory_account(tag, resized, 1);
+  return resized;
+}
+
+/* strdup() counted against tag. */
+char *memory_strdup(enum memory_tag tag, const char *string) {
+  char *copy = strdup(string);
+  memory_account(tag, copy, 1);
+  return copy;
+}
+
+/* free() of a block allocated under tag. */
+void memory_free(enum memory_tag tag, void *block) {
+  memory_account(tag, block, -1);
+  free(block);
+}
+
+/* Show live bytes and block counts per tag in the message bar, largest
+ * first (Alt+I). */
+void editor_show_memory_stats() {
+  int order[MEMORY_TAG_COUNT];
+  for (int i = 0; i < MEMORY_TAG_COUNT; i++) order[i] = i;
+  for (int i = 1; i < MEMORY_TAG_COUNT; i++) {
+    for (int j = i; j > 0 && memory_stats[order[j]].live_bytes > memory_stats[order[j - 1]].live_bytes; j--) {
+      int swap = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = swap;
     }
   }
+
+  char message[STATUS_MESSAGE_BUFFER_SIZE];
+  int length = 0;
+  for (int i = 0; i < MEMORY_TAG_COUNT && length < (int)sizeof(message); i++) {
+    int tag = order[i];
+    length += snprintf(message + length, sizeof(message) - length, "%s%s %.1fK/%lld",
+                       i ? " " : "", memory_tag_names[tag],
+                       memory_stats[tag].live_bytes / 1024.0, memory_stats[tag].live_count);
+  }
+  editor_set_status_message("%s", message);
+}
+
+/* Print per-tag totals and peaks to stderr (--stats, run at exit after
+ * the terminal has been restored). */
+void memory_stats_report() {
+  fprintf(stderr, "%-12s %14s %10s %14s %12s\n", "tag", "live bytes", "live", "peak bytes", "allocations");
+  long long live_total = 0;
+  unsigned long long allocations_total = 0;
+  for (int i = 0; i < MEMORY_TAG_COUNT; i++) {
+    fprintf(stderr, "%-12s %14lld %10lld %14lld %12llu\n", memory_tag_names[i], memory_stats[i].live_bytes,
+            memory_stats[i].live_count, memory_stats[i].peak_bytes, memory_stats[i].allocations);
+    live_total += memory_stats[i].live_bytes;
+    allocations_total += memory_stats[i].allocations;
+  }
+  fprintf(stderr, "%-12s %14lld %10s %14lld %12llu\n", "total", live_total, "", memory_peak_total, allocations_total);
+  if (ALLOCATION_COUNTING) {
+    fprintf(stderr, "all heap allocations: %llu\n", __atomic_load_n(&allocation_count, __ATOMIC_RELAXED));
+  }
 }
 
 /*** syntax highlighting ***/
@@ -1705,13 +3159,16 @@ int is_separator(int character) {
   return isspace(character) || character == '\0' || strchr(",.()+-/*=~%<>[];", character) != NULL;
 }
 
-/* Update syntax highlighting for a row based on current syntax rules. */
-void editor_update_syntax(editor_row *row) {
-  row->highlight = realloc(row->highlight, row->render_size);
-  memset(row->highlight, HL_NORMAL, row->render_size);
-
-  if (editor.syntax == NULL) return;
-
+/* Highlight a row's render text from position i on, starting in the
+ * given highlighter state, and record the state in each chunk of a long
+ * row as the scan reaches it. After an edit (converge_from >= 0) the
+ * text from i on still has its old classes: it is cleared a chunk ahead
+ * of the scan, and the scan stops at the first chunk from converge_from
+ * on that it reaches in the same state as before, since nothing after
+ * that can have changed. Returns 1 if it stopped there; otherwise the
+ * row's open_comment is updated, re-highlighting the next row if it
+ * changed, and 0 is returned. */
+static int editor_highlight_from(editor_row *row, int i, row_chunk state, int next_chunk, int converge_from) {
   char **keywords = editor.syntax->keywords;
 
   char *single_comment_start = editor.syntax->singleline_comment_start;
@@ -1722,47 +3179,34 @@ void editor_update_syntax(editor_row *row) {
   int multiline_comment_start_length = multiline_comment_start ? strlen(multiline_comment_start) : 0;
   int multiline_comment_end_length = multiline_comment_end ? strlen(multiline_comment_end) : 0;
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->line_index > 0 && editor.row[row->line_index - 1].open_comment);
-
-#ifndef PCRE2_DISABLED
-  /* Check PCRE2 patterns first (for preprocessor directives, etc.)
-   * These patterns are checked once at line start before character-by-character processing */
-  if (editor.syntax_pattern_count > 0 && !in_comment) {
-    for (int p = 0; p < editor.syntax_pattern_count; p++) {
-      syntax_pattern *pat = &editor.syntax_patterns[p];
-      if (!pat->regex || !pat->match_data) continue;
-
-      int rc = pcre2_match(
-          pat->regex,
-          (PCRE2_SPTR)row->render,
-          row->render_size,
-          0,  /* start offset */
-          0,  /* options */
-          pat->match_data,
-          NULL
-      );
-
-      if (rc >= 0) {
-        /* Pattern matched - get match bounds */
-        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(pat->match_data);
-        PCRE2_SIZE match_start = ovector[0];
-        PCRE2_SIZE match_end = ovector[1];
+  int prev_sep = state.prev_sep;
+  int in_string = state.in_string;
+  int in_comment = state.in_comment;
+  int start = i;
+  /* End of the text already cleared for this scan */
+  int cleared = converge_from >= 0 ? i : row->render_size;
 
-        /* Apply highlighting to matched region */
-        if (match_end > match_start && match_end <= (PCRE2_SIZE)row->render_size) {
-          memset(&row->highlight[match_start], pat->highlight_type, match_end - match_start);
-        }
-      }
+  while (i < row->render_size) {
+    while (next_chunk < row->chunk_count && i >= row->chunks[next_chunk].render_start) {
+      row_chunk *chunk = &row->chunks[next_chunk++];
+      unsigned char previous = i == start ? state.prev_highlight : row->highlight[i - 1];
+      if (converge_from >= 0 && i >= converge_from && chunk->highlight_start == i &&
+          chunk->in_string == in_string && chunk->in_comment == in_comment &&
+          chunk->prev_sep == prev_sep && chunk->prev_highlight == previous)
+        return 1;
+      chunk->highlight_start = i;
+      chunk->in_string = in_string;
+      chunk->in_comment = in_comment;
+      chunk->prev_sep = prev_sep;
+      chunk->prev_highlight = previous;
+    }
+    if (i >= cleared) {
+      cleared = next_chunk < row->chunk_count ? row->chunks[next_chunk].render_start : row->render_size;
+      memset(&row->highlight[i], HL_NORMAL, cleared - i);
     }
-  }
-#endif
 
-  int i = 0;
-  while (i < row->render_size) {
     char current_char = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+    unsigned char prev_hl = i == start ? state.prev_highlight : (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
 
     if (single_comment_start_length && !in_string && !in_comment) {
       if (!strncmp(&row->render[i], single_comment_start, single_comment_start_length)) {
@@ -1848,10 +3292,68 @@ void editor_update_syntax(editor_row *row) {
     i++;
   }
 
+  /* A single-line comment ran to the end before the scan got to these */
+  for (; next_chunk < row->chunk_count; next_chunk++) row->chunks[next_chunk].highlight_start = -1;
+
   int changed = (row->open_comment != in_comment);
   row->open_comment = in_comment;
   if (changed && row->line_index + 1 < editor.row_count)
     editor_update_syntax(&editor.row[row->line_index + 1]);
+  return 0;
+}
+
+/* Update syntax highlighting for a row based on current syntax rules. */
+void editor_update_syntax(editor_row *row) {
+  TRACE_SCOPE(__func__);
+  if (editor.highlight_disabled) return;
+  __atomic_fetch_add(&perf.rows_highlighted, 1, __ATOMIC_RELAXED);
+  row->highlight = memory_realloc(MEMORY_ROW_HIGHLIGHT, row->highlight, row->render_size);
+  /* An empty row may have no highlight buffer at all */
+  if (row->render_size > 0) memset(row->highlight, HL_NORMAL, row->render_size);
+  for (int c = 0; c < row->chunk_count; c++) row->chunks[c].highlight_start = -1;
+
+  if (editor.syntax == NULL) return;
+
+  int in_comment = (row->line_index > 0 && editor.row[row->line_index - 1].open_comment);
+
+#ifndef PCRE2_DISABLED
+  /* Check PCRE2 patterns first (for preprocessor directives, etc.)
+   * These patterns are checked once at line start before character-by-character processing */
+  if (editor.syntax_pattern_count > 0 && !in_comment) {
+    for (int p = 0; p < editor.syntax_pattern_count; p++) {
+      syntax_pattern *pat = &editor.syntax_patterns[p];
+      if (!pat->regex || !pat->match_data) continue;
+
+      int rc = pcre2_match(
+          pat->regex,
+          (PCRE2_SPTR)row->render,
+          row->render_size,
+          0,  /* start offset */
+          0,  /* options */
+          pat->match_data,
+          NULL
+      );
+
+      if (rc >= 0) {
+        /* Pattern matched - get match bounds */
+        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(pat->match_data);
+        PCRE2_SIZE match_start = ovector[0];
+        PCRE2_SIZE match_end = ovector[1];
+
+        /* Apply highlighting to matched region */
+        if (match_end > match_start && match_end <= (PCRE2_SIZE)row->render_size) {
+          memset(&row->highlight[match_start], pat->highlight_type, match_end - match_start);
+        }
+      }
+    }
+  }
+#endif
+
+  row_chunk state = {0};
+  state.prev_sep = 1;
+  state.in_comment = in_comment;
+  state.prev_highlight = HL_NORMAL;
+  editor_highlight_from(row, 0, state, 0, -1);
 }
 
 /* Map syntax highlight type to theme color. */
@@ -1920,14 +3422,36 @@ void editor_select_syntax_highlight() {
 
 /*** row operations ***/
 
+/* Index of the chunk of a long row holding chars offset cx, or render
+ * offset rx when by_render is set. */
+static int editor_row_chunk_at(editor_row *row, int offset, int by_render) {
+  int low = 0, high = row->chunk_count - 1;
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    row_chunk *chunk = &row->chunks[middle];
+    if ((by_render ? chunk->render_start : chunk->chars_start) <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
 /* Convert cursor x position to render x position.
  * Accounts for tab characters which expand to multiple spaces. */
 int editor_row_cursor_to_render(editor_row *row, int cx) {
+  if (row->tab_count == 0) return cx;
   int rx = 0;
-  int char_index;
-  for (char_index = 0; char_index < cx; char_index++) {
+  int char_index = 0;
+  if (row->chunks) {
+    row_chunk *chunk = &row->chunks[editor_row_chunk_at(row, cx, 0)];
+    char_index = chunk->chars_start;
+    rx = chunk->render_start;
+  }
+  for (; char_index < cx; char_index++) {
     if (row->chars[char_index] == '\t')
-      rx += (MITER_TAB_STOP - 1) - (rx % MITER_TAB_STOP);
+      rx += (editor.tab_stop - 1) - (rx % editor.tab_stop);
     rx++;
   }
   return rx;
@@ -1936,11 +3460,17 @@ int editor_row_cursor_to_render(editor_row *row, int cx) {
 /* Convert render x position back to cursor x position.
  * Inverse of editor_row_cursor_to_render for navigating with tabs. */
 int editor_row_render_to_cursor(editor_row *row, int rx) {
+  if (row->tab_count == 0) return rx < row->line_size ? (rx < 0 ? 0 : rx) : row->line_size;
   int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->line_size; cx++) {
+  int cx = 0;
+  if (row->chunks) {
+    row_chunk *chunk = &row->chunks[editor_row_chunk_at(row, rx, 1)];
+    cx = chunk->chars_start;
+    cur_rx = chunk->render_start;
+  }
+  for (; cx < row->line_size; cx++) {
     if (row->chars[cx] == '\t')
-      cur_rx += (MITER_TAB_STOP - 1) - (cur_rx % MITER_TAB_STOP);
+      cur_rx += (editor.tab_stop - 1) - (cur_rx % editor.tab_stop);
     cur_rx++;
 
     if (cur_rx > rx) return cx;
@@ -1949,21 +3479,38 @@ int editor_row_render_to_cursor(editor_row *row, int rx) {
 }
 
 /* Generate the render string from raw chars, expanding tabs to spaces.
- * Also triggers syntax highlighting update for the row. */
+ * Also splits a long row into chunks and triggers syntax highlighting
+ * update for the row. */
 void editor_update_row(editor_row *row) {
   int tabs = 0;
   int char_index;
   for (char_index = 0; char_index < row->line_size; char_index++)
     if (row->chars[char_index] == '\t') tabs++;
+  row->tab_count = tabs;
+  row->wrap_width = 0;
 
-  free(row->render);
-  row->render = malloc(row->line_size + tabs*(MITER_TAB_STOP - 1) + 1);
+  memory_free(MEMORY_ROW_CHUNKS, row->chunks);
+  row->chunks = NULL;
+  row->chunk_count = 0;
+  if (row->line_size >= ROW_CHUNK_MIN_LENGTH) {
+    row->chunks = memory_malloc(MEMORY_ROW_CHUNKS,
+                                sizeof(row_chunk) * ((row->line_size + ROW_CHUNK_SIZE - 1) / ROW_CHUNK_SIZE));
+  }
+
+  memory_free(MEMORY_ROW_RENDER, row->render);
+  row->render = memory_malloc(MEMORY_ROW_RENDER, row->line_size + tabs*(editor.tab_stop - 1) + 1);
 
   int render_index = 0;
   for (char_index = 0; char_index < row->line_size; char_index++) {
+    if (row->chunks && char_index % ROW_CHUNK_SIZE == 0) {
+      row_chunk *chunk = &row->chunks[row->chunk_count++];
+      chunk->chars_start = char_index;
+      chunk->render_start = render_index;
+      chunk->highlight_start = -1;
+    }
     if (row->chars[char_index] == '\t') {
       row->render[render_index++] = ' ';
-      while (render_index % MITER_TAB_STOP != 0) row->render[render_index++] = ' ';
+      while (render_index % editor.tab_stop != 0) row->render[render_index++] = ' ';
     } else {
       row->render[render_index++] = row->chars[char_index];
     }
@@ -1974,22 +3521,189 @@ void editor_update_row(editor_row *row) {
   editor_update_syntax(row);
 }
 
+/* Bring a row's cached wrap breaks up to date after an edit replaced
+ * 'removed' render bytes at 'at' with 'inserted' new ones. Breaks
+ * decided before the edit are kept, and the scan restarts after the
+ * last of them and stops once it makes a break an old one (shifted)
+ * made in the same place past the edit. */
+static void editor_rewrap_edit(editor_row *row, int at, int removed, int inserted) {
+  int width = row->wrap_width;
+  if (width <= 0) return;
+  int *old = row->wrap_breaks;
+  int old_count = row->wrap_break_count;
+  if (row->render_size <= width) {
+    memory_free(MEMORY_ROW_WRAP_BREAKS, old);
+    row->wrap_breaks = NULL;
+    row->wrap_break_count = 0;
+    return;
+  }
+
+  /* Break j is decided at the previous break plus the width, having
+   * looked only at the text before that */
+  int kept = 0;
+  while (kept < old_count) {
+    int decided = (kept ? old[kept - 1] : 0) + width;
+    if (decided > at || decided >= row->render_size) break;
+    kept++;
+  }
+
+  /* Breaks between the kept ones and those that converged */
+  int *fresh = NULL;
+  int fresh_count = 0, fresh_capacity = 0;
+  int line_start = kept ? old[kept - 1] : 0;
+  int last_break_pos = line_start;
+  int i = kept ? (kept > 1 ? old[kept - 2] : 0) + width + 1 : 0;
+  int delta = inserted - removed;
+  /* Old breaks from here on still hold, shifted by delta */
+  int tail = old_count;
+  int next_old = kept;
+
+  for (; i < row->render_size; i++) {
+    if (i > 0 && (row->render[i-1] == ' ' || row->render[i-1] == '\t')) {
+      last_break_pos = i;
+    }
+    if (i - line_start >= width) {
+      int break_pos = last_break_pos > line_start ? last_break_pos : i;
+      if (fresh_count == fresh_capacity) {
+        fresh_capacity = fresh_capacity ? 2 * fresh_capacity : 16;
+        fresh = memory_realloc(MEMORY_ROW_WRAP_BREAKS, fresh, sizeof(int) * fresh_capacity);
+      }
+      fresh[fresh_count++] = break_pos;
+      line_start = break_pos;
+      last_break_pos = break_pos;
+
+      if (i < at + inserted) continue;
+      while (next_old < old_count && old[next_old] + delta < break_pos) next_old++;
+      if (next_old < old_count && old[next_old] + delta == break_pos &&
+          (next_old ? old[next_old - 1] : 0) + width + delta == i) {
+        /* The rest of the row wraps as it did */
+        tail = next_old + 1;
+        break;
+      }
+    }
+  }
+
+  /* Splice the fresh breaks in between the kept and the shifted ones */
+  int tail_count = old_count - tail;
+  int break_count = kept + fresh_count + tail_count;
+  if (break_count > old_count) old = memory_realloc(MEMORY_ROW_WRAP_BREAKS, old, sizeof(int) * break_count);
+  memmove(&old[kept + fresh_count], &old[tail], sizeof(int) * tail_count);
+  for (int j = kept + fresh_count; j < break_count; j++) old[j] += delta;
+  if (fresh_count) memcpy(&old[kept], fresh, sizeof(int) * fresh_count);
+  memory_free(MEMORY_ROW_WRAP_BREAKS, fresh);
+
+  if (break_count == 0) {
+    memory_free(MEMORY_ROW_WRAP_BREAKS, old);
+    old = NULL;
+  }
+  row->wrap_breaks = old;
+  row->wrap_break_count = break_count;
+}
+
+/* Update a row after an edit replaced 'removed' bytes of chars at 'at'
+ * with 'inserted' new ones. A long row without tabs is patched in
+ * place: render and highlight are spliced, highlighting is redone from
+ * a chunk shortly before the edit until it agrees with the old classes
+ * again, and only the wrap breaks near the edit are recomputed. Any
+ * other row gets a full editor_update_row. */
+void editor_update_row_edit(editor_row *row, int at, int removed, int inserted) {
+  int delta = inserted - removed;
+  int old_size = row->render_size;
+  int fast = row->chunks && row->tab_count == 0 && row->line_size >= ROW_CHUNK_MIN_LENGTH &&
+             removed + inserted <= ROW_CHUNK_SIZE && !memchr(&row->chars[at], '\t', inserted);
+#ifndef PCRE2_DISABLED
+  /* Patterns match against the whole row */
+  if (editor.syntax_pattern_count > 0) fast = 0;
+#endif
+  if (fast) {
+    /* Re-split once the chunk holding the edit grows too big */
+    int edited = editor_row_chunk_at(row, at, 0);
+    int end = edited + 1 < row->chunk_count ? row->chunks[edited + 1].chars_start : old_size;
+    if (end - row->chunks[edited].chars_start + delta > 2 * ROW_CHUNK_SIZE) fast = 0;
+  }
+  if (!fast) {
+    editor_update_row(row);
+    return;
+  }
+
+  /* Without tabs render is the same bytes as chars */
+  if (delta > 0) row->render = memory_realloc(MEMORY_ROW_RENDER, row->render, row->line_size + 1);
+  memmove(&row->render[at + inserted], &row->render[at + removed], old_size - at - removed + 1);
+  if (delta < 0) row->render = memory_realloc(MEMORY_ROW_RENDER, row->render, row->line_size + 1);
+  memcpy(&row->render[at], &row->chars[at], inserted);
+  row->render_size = row->line_size;
+
+  /* Shift the chunks after the edit and drop those it swallowed. The
+   * highlighter state of a chunk before the edit is only kept if it was
+   * reached before the edit too */
+  int kept = 0;
+  for (int c = 0; c < row->chunk_count; c++) {
+    row_chunk chunk = row->chunks[c];
+    if (chunk.chars_start > at) {
+      if (chunk.chars_start < at + removed) continue;
+      chunk.chars_start += delta;
+      chunk.render_start += delta;
+      if (chunk.highlight_start >= 0) chunk.highlight_start += delta;
+      if (chunk.chars_start <= row->chunks[kept - 1].chars_start) continue;
+    } else if (chunk.highlight_start >= at) {
+      chunk.highlight_start = -1;
+    }
+    row->chunks[kept++] = chunk;
+  }
+  row->chunk_count = kept;
+
+  if (!editor.highlight_disabled) {
+    if (delta > 0) row->highlight = memory_realloc(MEMORY_ROW_HIGHLIGHT, row->highlight, row->render_size);
+    memmove(&row->highlight[at + inserted], &row->highlight[at + removed], old_size - at - removed);
+    if (delta < 0) row->highlight = memory_realloc(MEMORY_ROW_HIGHLIGHT, row->highlight, row->render_size);
+    memset(&row->highlight[at], HL_NORMAL, inserted);
+
+    if (editor.syntax) {
+      __atomic_fetch_add(&perf.rows_highlighted, 1, __ATOMIC_RELAXED);
+      /* Resume from the last chunk whose state nothing near the edit
+       * decided, or from the start of the row */
+      int resume = editor_row_chunk_at(row, at, 0);
+      while (resume >= 0 && (row->chunks[resume].highlight_start < 0 ||
+                             row->chunks[resume].highlight_start + ROW_CHUNK_LOOKBEHIND > at))
+        resume--;
+      row_chunk state = {0};
+      int i = 0;
+      if (resume >= 0) {
+        state = row->chunks[resume];
+        i = state.highlight_start;
+      } else {
+        state.prev_sep = 1;
+        state.in_comment = (row->line_index > 0 && editor.row[row->line_index - 1].open_comment);
+        state.prev_highlight = HL_NORMAL;
+      }
+      editor_highlight_from(row, i, state, resume + 1, at + inserted);
+    }
+  }
+
+  editor_rewrap_edit(row, at, removed, inserted);
+}
+
 /* Calculate word-boundary wrap break points for soft wrap
  * Returns array of render positions where line should wrap
- * Breaks at word boundaries (spaces, tabs) rather than mid-word */
+ * Breaks at word boundaries (spaces, tabs) rather than mid-word.
+ * The breaks are kept until the row or the width changes. */
 void editor_calculate_wrap_breaks(editor_row *row, int available_width) {
+  if (available_width > 0 && row->wrap_width == available_width) return;
+
   /* Free existing breaks */
-  free(row->wrap_breaks);
+  memory_free(MEMORY_ROW_WRAP_BREAKS, row->wrap_breaks);
   row->wrap_breaks = NULL;
   row->wrap_break_count = 0;
+  row->wrap_width = available_width > 0 ? available_width : 0;
 
   /* No wrapping needed */
   if (available_width <= 0 || row->render_size <= available_width) {
     return;
   }
 
-  /* Allocate space for break points (worst case: one break per character) */
-  int *breaks = malloc(sizeof(int) * (row->render_size / available_width + 2));
+  /* Allocate space for break points (each pair of segments spans more
+   * than the width, however the word boundaries fall) */
+  int *breaks = memory_malloc(MEMORY_ROW_WRAP_BREAKS, sizeof(int) * (2 * (row->render_size / available_width) + 2));
   int break_count = 0;
 
   /* Start of current line segment */
@@ -2021,7 +3735,17 @@ void editor_calculate_wrap_breaks(editor_row *row, int available_width) {
     row->wrap_breaks = breaks;
     row->wrap_break_count = break_count;
   } else {
-    free(breaks);
+    memory_free(MEMORY_ROW_WRAP_BREAKS, breaks);
+  }
+}
+
+/* Recalculate the wrap breaks of every row for the current text width, if
+ * soft wrap is enabled. Rows already wrapped at that width are skipped. */
+void editor_rewrap_all_rows() {
+  if (!editor.soft_wrap) return;
+  int available_width = editor.screen_columns - editor.gutter_width;
+  for (int i = 0; i < editor.row_count; i++) {
+    editor_calculate_wrap_breaks(&editor.row[i], available_width);
   }
 }
 
@@ -2036,7 +3760,7 @@ void editor_insert_row(int at, char *string, size_t length) {
   editor.row[at].line_index = at;
 
   editor.row[at].line_size = length;
-  editor.row[at].chars = malloc(length + 1);
+  editor.row[at].chars = memory_malloc(MEMORY_ROW_CHARS, length + 1);
   memcpy(editor.row[at].chars, string, length);
   editor.row[at].chars[length] = '\0';
 
@@ -2048,6 +3772,10 @@ void editor_insert_row(int at, char *string, size_t length) {
   editor.row[at].dirty = 1;
   editor.row[at].wrap_breaks = NULL;
   editor.row[at].wrap_break_count = 0;
+  editor.row[at].wrap_width = 0;
+  editor.row[at].tab_count = 0;
+  editor.row[at].chunks = NULL;
+  editor.row[at].chunk_count = 0;
   editor_update_row(&editor.row[at]);
 
   editor.row_count++;
@@ -2055,12 +3783,70 @@ void editor_insert_row(int at, char *string, size_t length) {
   editor_update_gutter_width();
 }
 
+/* Append text read from the end of the file as rows, in one batch: the
+ * row array grows once and the gutter is measured once, however many
+ * lines arrive. If join is set the first line continues the last row,
+ * which the file had not finished. The rows match the file, so neither
+ * they nor the buffer are marked dirty. Returns the number of rows
+ * added. */
+int editor_append_rows(const char *text, size_t length, int join) {
+  size_t newlines = 0;
+  for (const char *p = text; (p = memchr(p, '\n', text + length - p)) != NULL; p++) newlines++;
+  editor_row *rows = realloc(editor.row, sizeof(editor_row) * (editor.row_count + newlines + 1));
+  if (!rows) return 0;
+  editor.row = rows;
+
+  int added = 0;
+  const char *line = text, *end = text + length;
+  while (line < end) {
+    const char *newline = memchr(line, '\n', end - line);
+    size_t line_length = (newline ? newline : end) - line;
+    if (line_length > 0 && line[line_length - 1] == '\r') line_length--;
+
+    if (join && editor.row_count > 0) {
+      editor_row *row = &editor.row[editor.row_count - 1];
+      row->chars = memory_realloc(MEMORY_ROW_CHARS, row->chars, row->line_size + line_length + 1);
+      memcpy(&row->chars[row->line_size], line, line_length);
+      row->line_size += line_length;
+      row->chars[row->line_size] = '\0';
+      editor_update_row(row);
+    } else {
+      editor_row *row = &editor.row[editor.row_count];
+      row->line_index = editor.row_count;
+      row->line_size = line_length;
+      row->chars = memory_malloc(MEMORY_ROW_CHARS, line_length + 1);
+      memcpy(row->chars, line, line_length);
+      row->chars[line_length] = '\0';
+      row->render_size = 0;
+      row->render = NULL;
+      row->highlight = NULL;
+      row->open_comment = 0;
+      row->dirty = 0;
+      row->wrap_breaks = NULL;
+      row->wrap_break_count = 0;
+      row->wrap_width = 0;
+      row->tab_count = 0;
+      row->chunks = NULL;
+      row->chunk_count = 0;
+      editor_update_row(row);
+      editor.row_count++;
+      added++;
+    }
+    join = 0;
+    line = newline ? newline + 1 : end;
+  }
+
+  editor_update_gutter_width();
+  return added;
+}
+
 /* Free all memory associated with a row. */
 void editor_free_row(editor_row *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->highlight);
-  free(row->wrap_breaks);
+  memory_free(MEMORY_ROW_RENDER, row->render);
+  memory_free(MEMORY_ROW_CHARS, row->chars);
+  memory_free(MEMORY_ROW_HIGHLIGHT, row->highlight);
+  memory_free(MEMORY_ROW_WRAP_BREAKS, row->wrap_breaks);
+  memory_free(MEMORY_ROW_CHUNKS, row->chunks);
 }
 
 /* Delete the row at index 'at' and shift remaining rows up.
@@ -2231,6 +4017,32 @@ char *selection_get_text(int *length) {
   return result;
 }
 
+/* Extract selected text as clipboard chunks, copying each row's bytes once
+ * straight into the chunk list with no intermediate flat string.
+ * Returns a new clipboard text (caller must release) or NULL. */
+clipboard_text *selection_get_clipboard_text() {
+  if (!editor.selection.active) return NULL;
+
+  selection_pos start, end;
+  selection_normalize(&start, &end);
+
+  clipboard_text *text = clipboard_text_create();
+  if (!text) return NULL;
+
+  for (int r = start.row; r <= end.row && r < editor.row_count; r++) {
+    int line_start = (r == start.row) ? start.col : 0;
+    int line_end = (r == end.row) ? end.col : editor.row[r].line_size;
+
+    if (clipboard_text_append(text, editor.row[r].chars + line_start,
+                              line_end - line_start) != 0 ||
+        (r < end.row && clipboard_text_append(text, "\n", 1) != 0)) {
+      clipboard_text_release(text);
+      return NULL;
+    }
+  }
+  return text;
+}
+
 /* Delete currently selected text. */
 void selection_delete() {
   if (!editor.selection.active) return;
@@ -2269,7 +4081,7 @@ void selection_delete() {
     editor_row *last = &editor.row[end.row];
     int new_size = start.col + (last->line_size - end.col);
 
-    first->chars = realloc(first->chars, new_size + 1);
+    first->chars = memory_realloc(MEMORY_ROW_CHARS, first->chars, new_size + 1);
     memcpy(first->chars + start.col, last->chars + end.col,
            last->line_size - end.col);
     first->line_size = new_size;
@@ -3203,7 +5015,7 @@ void multicursor_delete_char() {
       prev_line_len[i] = editor.row[line - 1].line_size;
 
       /* Log row merge for undo */
-      undo_log(UNDO_ROW_DELETE, line, col, line, 0, NULL, 0, 0, NULL);
+      undo_log(UNDO_ROW_DELETE, line, col, line, prev_line_len[i], NULL, 0, 0, NULL);
 
       /* Perform line merge */
       editor_row_append_string(&editor.row[line - 1],
@@ -3396,15 +5208,13 @@ void multicursor_insert_newline() {
     int line = all_cursors[i].line;
     int col = all_cursors[i].column;
 
-    /* Log undo - use ROW_INSERT for col==0, ROW_SPLIT otherwise */
-    if (col == 0) {
-      undo_log(UNDO_ROW_INSERT, line, col, line, 0, NULL, 0, 0, NULL);
-    } else {
-      undo_log(UNDO_ROW_SPLIT, line, col, line, col, NULL, 0, 0, NULL);
-    }
+    /* Log undo - use ROW_INSERT for col==0, ROW_SPLIT otherwise. A row
+     * insert records the row's text, so it is logged once the row exists */
+    if (col != 0) undo_log(UNDO_ROW_SPLIT, line, col, line, col, NULL, 0, 0, NULL);
 
     /* Perform the newline insert (this handles indentation internally) */
     editor_insert_newline_at(line, col);
+    if (col == 0) undo_log(UNDO_ROW_INSERT, line, col, line, 0, NULL, 0, 0, NULL);
   }
 
   /* Calculate new cursor positions using Kilo's algorithm */
@@ -3466,15 +5276,13 @@ void multicursor_insert_newline() {
 void editor_copy() {
   if (!editor.selection.active) return;
 
-  int length;
-  char *text = selection_get_text(&length);
+  clipboard_text *text = selection_get_clipboard_text();
   if (!text) return;
 
   clipboard_store(text, editor.selection.mode);
-  clipboard_sync_to_system(text);
 
-  editor_set_status_message("Copied %d chars", length);
-  free(text);
+  editor_set_status_message("Copied %zu chars", text->total_length);
+  clipboard_text_release(text);
 }
 
 /* Cut selection (copy + delete). */
@@ -3492,7 +5300,7 @@ void editor_paste() {
   clipboard_smart_merge();
 
   int content_type;
-  char *text = clipboard_get_latest(&content_type);
+  clipboard_text *text = clipboard_get_latest(&content_type);
   if (!text) {
     editor_set_status_message("Clipboard empty");
     return;
@@ -3503,29 +5311,16 @@ void editor_paste() {
     selection_delete();
   }
 
-  /* Record start position for undo */
-  int start_row = editor.cursor_y;
-  int start_col = editor.cursor_x;
-
-  /* Temporarily disable undo logging for individual chars */
-  editor.undo_logging = 1;
-
-  /* Insert text character by character */
-  for (char *p = text; *p; p++) {
-    if (*p == '\n') {
-      editor_insert_newline();
-    } else {
-      editor_insert_char(*p);
-    }
+  /* Insert the whole paste in one pass; the flattened copy becomes the
+   * undo entry's text rather than being duplicated for it. The clipboard's
+   * own length is used throughout, so NUL bytes are pasted too. */
+  char *flat = clipboard_text_flatten(text);
+  if (flat) {
+    memory_account(MEMORY_UNDO, flat, 1);
+    editor_insert_text_adopt(flat, text->total_length, UNDO_PASTE);
   }
 
-  /* Log the entire paste as a single undo operation */
-  editor.undo_logging = 0;
-  undo_log(UNDO_PASTE, start_row, start_col,
-           start_row, start_col, NULL,
-           editor.cursor_y, editor.cursor_x, text);
-
-  free(text);
+  clipboard_text_release(text);
   editor_set_status_message("Pasted");
 }
 
@@ -3739,7 +5534,7 @@ static int indent_line_apply(int line) {
   editor_row *row = &editor.row[line];
   const int indent_size = 4;
 
-  row->chars = realloc(row->chars, row->line_size + indent_size + 1);
+  row->chars = memory_realloc(MEMORY_ROW_CHARS, row->chars, row->line_size + indent_size + 1);
   memmove(&row->chars[indent_size], row->chars, row->line_size + 1);
   for (int i = 0; i < indent_size; i++) {
     row->chars[i] = ' ';
@@ -3816,11 +5611,11 @@ int editor_auto_unindent_closing_brace(int line) {
 
 void editor_row_insert_char(editor_row *row, int at, int character) {
   if (at < 0 || at > row->line_size) at = row->line_size;
-  row->chars = realloc(row->chars, row->line_size + 2);
+  row->chars = memory_realloc(MEMORY_ROW_CHARS, row->chars, row->line_size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->line_size - at + 1);
   row->line_size++;
   row->chars[at] = character;
-  editor_update_row(row);
+  editor_update_row_edit(row, at, 0, 1);
   /* Mark row as dirty for SQLite sync */
   row->dirty = 1;
   editor.dirty++;
@@ -3829,11 +5624,12 @@ void editor_row_insert_char(editor_row *row, int at, int character) {
 /* Append 'string' of 'length' to end of the row.
  * Used when joining lines together. */
 void editor_row_append_string(editor_row *row, char *string, size_t length) {
-  row->chars = realloc(row->chars, row->line_size + length + 1);
+  int at = row->line_size;
+  row->chars = memory_realloc(MEMORY_ROW_CHARS, row->chars, row->line_size + length + 1);
   memcpy(&row->chars[row->line_size], string, length);
   row->line_size += length;
   row->chars[row->line_size] = '\0';
-  editor_update_row(row);
+  editor_update_row_edit(row, at, 0, length);
   /* Mark row as dirty for SQLite sync */
   row->dirty = 1;
   editor.dirty++;
@@ -3845,7 +5641,7 @@ void editor_row_delete_char(editor_row *row, int at) {
   if (at < 0 || at >= row->line_size) return;
   memmove(&row->chars[at], &row->chars[at + 1], row->line_size - at);
   row->line_size--;
-  editor_update_row(row);
+  editor_update_row_edit(row, at, 1, 0);
   /* Mark row as dirty for SQLite sync */
   row->dirty = 1;
   editor.dirty++;
@@ -3938,10 +5734,11 @@ void editor_insert_newline() {
   }
 
   if (editor.cursor_x == 0) {
-    /* Log as row insert (empty row at beginning) */
+    /* Log as row insert (empty row at beginning), once the row exists:
+     * the entry records the inserted row's text for redo */
+    editor_insert_row(editor.cursor_y, "", 0);
     undo_log(UNDO_ROW_INSERT, editor.cursor_y, editor.cursor_x,
              editor.cursor_y, 0, NULL, 0, 0, NULL);
-    editor_insert_row(editor.cursor_y, "", 0);
   } else {
     /* Log as row split (Enter in middle of line) */
     undo_log(UNDO_ROW_SPLIT, editor.cursor_y, editor.cursor_x,
@@ -3977,6 +5774,61 @@ void editor_insert_newline() {
   /* Track edit for idle sync */
 }
 
+/* Insert text at the cursor exactly as given: no auto-indent, and
+ * newlines split the line. Logged as one undo step. Leaves the
+ * cursor after the inserted text. */
+void editor_insert_text(const char *text, size_t length) {
+  char *logged = memory_malloc(MEMORY_UNDO, length + 1);
+  if (!logged) return;
+  memcpy(logged, text, length);
+  logged[length] = '\0';
+  editor_insert_text_adopt(logged, length, UNDO_TEXT_INSERT);
+}
+
+/* Insert text the same way, then hand the buffer itself to the undo entry
+ * of the given type. text must be a MEMORY_UNDO block of length bytes
+ * plus a terminating NUL; NULs before the end are inserted like any byte. */
+void editor_insert_text_adopt(char *text, size_t length, enum undo_op_type type) {
+  if (editor.selection.active) selection_delete();
+  if (editor.cursor_y == editor.row_count) editor_insert_row(editor.row_count, "", 0);
+
+  int start_row = editor.cursor_y;
+  int start_col = editor.cursor_x;
+  size_t segment_start = 0;
+  for (size_t i = 0; i <= length; i++) {
+    if (i < length && text[i] != '\n') continue;
+
+    /* Splice text[segment_start, i) into the cursor's row */
+    editor_row *row = &editor.row[editor.cursor_y];
+    size_t segment_length = i - segment_start;
+    if (segment_length > 0) {
+      row->chars = memory_realloc(MEMORY_ROW_CHARS, row->chars, row->line_size + segment_length + 1);
+      memmove(&row->chars[editor.cursor_x + segment_length], &row->chars[editor.cursor_x],
+              row->line_size - editor.cursor_x + 1);
+      memcpy(&row->chars[editor.cursor_x], text + segment_start, segment_length);
+      row->line_size += segment_length;
+      editor.cursor_x += segment_length;
+    }
+
+    if (i < length) {
+      /* Newline: the rest of the row moves down */
+      editor_insert_row(editor.cursor_y + 1, &row->chars[editor.cursor_x], row->line_size - editor.cursor_x);
+      row = &editor.row[editor.cursor_y];
+      row->line_size = editor.cursor_x;
+      row->chars[row->line_size] = '\0';
+      editor.cursor_y++;
+      editor.cursor_x = 0;
+    }
+    editor_update_row(row);
+    row->dirty = 1;
+    segment_start = i + 1;
+  }
+  editor.dirty++;
+
+  undo_log_adopt(type, start_row, start_col, start_row, start_col, NULL,
+                 editor.cursor_y, editor.cursor_x, text, length);
+}
+
 /* Indent current line by inserting spaces at the beginning.
  * Uses 4-space indentation. */
 void editor_indent_line() {
@@ -4141,7 +5993,7 @@ void editor_delete_char() {
   } else {
     /* Log row delete (joining lines via backspace at start) */
     undo_log(UNDO_ROW_DELETE, editor.cursor_y, editor.cursor_x,
-             editor.cursor_y, 0, NULL, 0, 0, NULL);
+             editor.cursor_y, editor.row[editor.cursor_y - 1].line_size, NULL, 0, 0, NULL);
 
     editor.cursor_x = editor.row[editor.cursor_y - 1].line_size;
     editor_row_append_string(&editor.row[editor.cursor_y - 1], row->chars, row->line_size);
@@ -4984,20 +6836,39 @@ void editor_toggle_block_comment() {
 
 /*** file i/o ***/
 
-/* Convert all editor rows to a single string with newlines.
- * Sets buffer_length to total byte count. Caller must free result. */
+/* Remember the state of the file the rows now match. */
+void editor_note_file_state(const struct stat *file_stat) {
+  editor.file_size = file_stat->st_size;
+  editor.file_mtime = file_stat->st_mtim;
+  editor.file_inode = file_stat->st_ino;
+}
+
+/* True if file_stat is the file the rows were read from or written to. */
+int editor_file_state_matches(const struct stat *file_stat) {
+  return file_stat->st_size == editor.file_size && file_stat->st_ino == editor.file_inode &&
+         file_stat->st_mtim.tv_sec == editor.file_mtime.tv_sec &&
+         file_stat->st_mtim.tv_nsec == editor.file_mtime.tv_nsec;
+}
+
+/* Convert all editor rows to a single string, ending lines the way the
+ * file did when it was loaded (\r\n or \n, and no newline after the last
+ * line if it had none). Sets buffer_length to total byte count. Caller
+ * must free result. */
 char *editor_rows_to_string(int *buffer_length) {
+  int newline_length = editor.crlf ? 2 : 1;
   int total_length = 0;
   int row_index;
   for (row_index = 0; row_index < editor.row_count; row_index++)
-    total_length += editor.row[row_index].line_size + 1;
+    total_length += editor.row[row_index].line_size + newline_length;
+  if (editor.no_final_newline && editor.row_count > 0) total_length -= newline_length;
   *buffer_length = total_length;
 
-  char *buffer = malloc(total_length);
+  char *buffer = malloc(total_length + newline_length);
   char *write_ptr = buffer;
   for (row_index = 0; row_index < editor.row_count; row_index++) {
     memcpy(write_ptr, editor.row[row_index].chars, editor.row[row_index].line_size);
     write_ptr += editor.row[row_index].line_size;
+    if (editor.crlf) *write_ptr++ = '\r';
     *write_ptr = '\n';
     write_ptr++;
   }
@@ -5005,20 +6876,58 @@ char *editor_rows_to_string(int *buffer_length) {
   return buffer;
 }
 
-/* Open a file and load its contents into the editor buffer. */
-void editor_open(char *filename) {
+/* Get the directory relative paths resolve against: the attached
+ * client's in server mode, otherwise the process's. Returns 0, or -1 if
+ * it can't be determined. */
+int editor_working_directory(char *buffer, size_t size) {
+  if (server.enabled && server.directory[0]) {
+    return snprintf(buffer, size, "%s", server.directory) < (int)size ? 0 : -1;
+  }
+  return getcwd(buffer, size) ? 0 : -1;
+}
+
+/* Make path absolute against editor_working_directory, into buffer (a
+ * path already absolute, or with no known directory, is copied as is).
+ * Returns 0, or -1 if it doesn't fit. */
+int editor_absolute_path(const char *path, char *buffer, size_t size) {
+  char directory[PATH_MAX];
+  int length;
+  if (path[0] != '/' && editor_working_directory(directory, sizeof(directory)) == 0) {
+    length = snprintf(buffer, size, "%s/%s", directory, path);
+  } else {
+    length = snprintf(buffer, size, "%s", path);
+  }
+  return length < (int)size ? 0 : -1;
+}
+
+/* Load a file into the editor buffer and take its name. Returns 0, or
+ * -1 with errno set if the file can't be opened. */
+int editor_load_file(const char *filename) {
+  FILE *file_pointer = fopen(filename, "r");
+  if (!file_pointer) return -1;
+
+  /* Taken before reading, so a write racing the read shows as a change */
+  struct stat file_stat;
+  if (fstat(fileno(file_pointer), &file_stat) == 0) editor_note_file_state(&file_stat);
+
   free(editor.filename);
   editor.filename = strdup(filename);
 
   editor_select_syntax_highlight();
 
-  FILE *file_pointer = fopen(filename, "r");
-  if (!file_pointer) die("fopen");
-
   char *line = NULL;
   size_t line_capacity = 0;
   ssize_t line_length;
+  int first_line = 1;
+  editor.crlf = 0;
+  editor.no_final_newline = 0;
   while ((line_length = getline(&line, &line_capacity, file_pointer)) != -1) {
+    /* The first line decides the line ending saves write back */
+    int newline = line[line_length - 1] == '\n';
+    if (first_line && newline && line_length > 1 && line[line_length - 2] == '\r') editor.crlf = 1;
+    first_line = 0;
+    editor.no_final_newline = !newline;
+
     while (line_length > 0 && (line[line_length - 1] == '\n' ||
                            line[line_length - 1] == '\r'))
       line_length--;
@@ -5027,2617 +6936,7112 @@ void editor_open(char *filename) {
   free(line);
   fclose(file_pointer);
   editor.dirty = 0;
+  log_detect_format();
+  return 0;
+}
+
+/* Open a file and load its contents into the editor buffer. */
+void editor_open(char *filename) {
+  TRACE_SCOPE(__func__);
+  if (editor_load_file(filename) == -1) die("fopen");
+}
+
+/* Replace the contents of an open file with the buffer. Returns the
+ * number of bytes written, or -1 with errno set. */
+static int editor_write_descriptor(int file_descriptor) {
+  int length;
+  char *buffer = editor_rows_to_string(&length);
+  if (!buffer) return -1;
+
+  int result = -1;
+  if (ftruncate(file_descriptor, length) != -1 &&
+      write(file_descriptor, buffer, length) == length) {
+    result = length;
+  }
+  free(buffer);
+  return result;
+}
+
+/* Write the buffer to path. Returns the number of bytes written, or -1
+ * with errno set. */
+int editor_write_file(const char *path) {
+  int result = -1;
+  int file_descriptor = open(path, O_RDWR | O_CREAT, FILE_PERMISSION_DEFAULT);
+  if (file_descriptor != -1) {
+    result = editor_write_descriptor(file_descriptor);
+    int saved_errno = errno;
+    close(file_descriptor);
+    errno = saved_errno;
+  }
+  return result;
+}
 
-  /* Sync buffer to FTS5 search index */
-  /* removed */
+/* Write the buffer to path atomically: into a new temporary file beside
+ * the real one (symlinks are followed, so the link keeps pointing at it),
+ * synced to disk and then renamed over it, keeping the original's
+ * owner (when allowed) and permissions. Readers see the old or the new file, never a partial one.
+ * A path that doesn't exist yet is simply written. Returns the number of
+ * bytes written, or -1 with errno set. */
+int editor_write_file_atomic(const char *path) {
+  char resolved[PATH_MAX];
+  struct stat file_stat;
+  if (!realpath(path, resolved) || stat(resolved, &file_stat) == -1) {
+    if (errno == ENOENT) return editor_write_file(path);
+    return -1;
+  }
+
+  /* mkstemp creates it exclusively, so nothing else's file is reused */
+  char temporary[PATH_MAX];
+  const char *slash = strrchr(resolved, '/');
+  int directory_length = slash ? (int)(slash - resolved) + 1 : 0;
+  if (snprintf(temporary, sizeof(temporary), "%.*s.miter-XXXXXX", directory_length, resolved) >=
+      (int)sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int file_descriptor = mkstemp(temporary);
+  if (file_descriptor == -1) return -1;
+
+  /* Owner before mode, since chown clears the set-id bits. Only root may
+   * give a file away, so anyone else keeps the file as their own. */
+  int length = editor_write_descriptor(file_descriptor);
+  if (length != -1 && fchown(file_descriptor, file_stat.st_uid, file_stat.st_gid) == -1 &&
+      errno != EPERM) {
+    length = -1;
+  }
+  if (length != -1 && (fchmod(file_descriptor, file_stat.st_mode & FILE_PERMISSION_BITS) == -1 ||
+                       fsync(file_descriptor) == -1)) {
+    length = -1;
+  }
+  int saved_errno = errno;
+  if (close(file_descriptor) == -1 && length != -1) {
+    length = -1;
+    saved_errno = errno;
+  }
+  if (length != -1 && rename(temporary, resolved) == -1) {
+    length = -1;
+    saved_errno = errno;
+  }
+  if (length == -1) {
+    unlink(temporary);
+    errno = saved_errno;
+  }
+  return length;
 }
 
 /* Save the current buffer to disk. Prompts for filename if needed. */
 void editor_save() {
+  TRACE_SCOPE(__func__);
   if (editor.filename == NULL) {
     editor.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
     if (editor.filename == NULL) {
       editor_set_status_message("Save aborted");
       return;
     }
+    /* A server's filenames are all absolute: its clients' directories differ */
+    char absolute[PATH_MAX];
+    if (server.enabled && editor_absolute_path(editor.filename, absolute, sizeof(absolute)) == 0) {
+      free(editor.filename);
+      editor.filename = strdup(absolute);
+    }
     editor_select_syntax_highlight();
   }
 
-  int length;
-  char *buffer = editor_rows_to_string(&length);
+  int length = editor_write_file(editor.filename);
+  if (length == -1) {
+    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+  struct stat file_stat;
+  if (stat(editor.filename, &file_stat) == 0) editor_note_file_state(&file_stat);
+  editor.dirty = 0;
+  editor_set_status_message("%d bytes written to disk", length);
+}
 
-  int file_descriptor = open(editor.filename, O_RDWR | O_CREAT, FILE_PERMISSION_DEFAULT);
-  if (file_descriptor != -1) {
-    if (ftruncate(file_descriptor, length) != -1) {
-      if (write(file_descriptor, buffer, length) == length) {
-        close(file_descriptor);
-        free(buffer);
-        editor.dirty = 0;
-        /* removed */
-        editor_set_status_message("%d bytes written to disk", length);
-        return;
-      }
-    }
-    close(file_descriptor);
+/* Build the path of a file in miter's cache directory, creating the
+ * directory if needed. Returns 0 on success, -1 if there is no usable
+ * cache location. */
+int editor_cache_path(const char *name, char *buffer, size_t size) {
+  char directory[PATH_MAX];
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  int length;
+  if (cache_home && cache_home[0] == '/') {
+    mkdir(cache_home, CACHE_DIRECTORY_PERMISSIONS);
+    length = snprintf(directory, sizeof(directory), "%s/%s", cache_home, CACHE_DIRECTORY_NAME);
+  } else if (home) {
+    length = snprintf(directory, sizeof(directory), "%s/.cache", home);
+    if (length < (int)sizeof(directory)) mkdir(directory, CACHE_DIRECTORY_PERMISSIONS);
+    length = snprintf(directory, sizeof(directory), "%s/.cache/%s", home, CACHE_DIRECTORY_NAME);
+  } else {
+    return -1;
   }
+  if (length >= (int)sizeof(directory)) return -1;
+  if (mkdir(directory, CACHE_DIRECTORY_PERMISSIONS) != 0 && errno != EEXIST) return -1;
 
-  free(buffer);
-  editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+  if (snprintf(buffer, size, "%s/%s", directory, name) >= (int)size) return -1;
+  return 0;
 }
 
-/*** find ***/
+/*** huge file viewer ***/
+
+/* Files too big to hold as rows (multi-GB logs, 100 GB+ traces) open
+ * read-only in a viewer. Only a window of up to VIEWER_WINDOW_LINES rows
+ * around the cursor exists at a time, built from an mmap()ed window of
+ * the file and rebuilt as the cursor nears either end of it;
+ * editor.line_number_base is the file line of its first row. A
+ * background scan records the offset of every VIEWER_CHECKPOINT_LINES-th
+ * line, so reaching any line walks at most that many lines from the
+ * nearest checkpoint. Memory stays flat whatever the file's size: one
+ * mapped window, one window of rows, and 8 bytes of index per
+ * checkpoint.
+ *
+ * A file truncated while it is shown (as copytruncate log rotation does)
+ * would fault (SIGBUS) on mapped pages past its new end. The scan and
+ * search read with pread instead, the size is checked before each
+ * mapped read, and the rare truncation between the check and the read is
+ * caught by a SIGBUS handler that fails the read soft. A shrunk file is
+ * then indexed again from the start. */
+static struct {
+  pthread_mutex_t lock;
+  int active;
+  int file_descriptor;
+  off_t size;
+  /* Absolute path, and the identity of the file the index describes */
+  char *path;
+  struct timespec modification_time;
+  ino_t inode;
+  /* Window of the file mapped for building rows and searching */
+  char *map;
+  off_t map_start;
+  size_t map_length;
+  /* Offset just past the last line in the rows */
+  off_t window_end;
+  /* Offset of line n * VIEWER_CHECKPOINT_LINES at index n. These and
+   * the scan's progress below are shared with the scan; lock held */
+  off_t *checkpoints;
+  long long checkpoint_count;
+  long long checkpoint_capacity;
+  /* Lines and bytes the scan has got through */
+  long long line_count;
+  off_t scanned;
+  int scan_done;
+  /* Bumped when the index is rebuilt; a scan started for an older one
+   * stops without publishing anything */
+  int generation;
+  /* Set by a scan that read short: the file shrank under it */
+  int scan_short;
+  /* Set (main thread only) once the file is seen to be shorter than the
+   * index describes; viewer_poll then rebuilds it */
+  int shrunk;
+} viewer = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .file_descriptor = -1
+};
 
-/* Callback for incremental search. Handles navigation keys and
- * executes FTS5 search when query changes. Highlights current match. */
-void editor_find_callback(char *query, int key) {
-  static int current_result_index = -1;
-  static int direction = 1;
-  static char *last_query = NULL;
+/* Record the offset of the next checkpoint line. Lock held. Returns 0,
+ * or -1 if out of memory (the index then just stays coarser at the end). */
+static int viewer_add_checkpoint(off_t offset) {
+  if (viewer.checkpoint_count == viewer.checkpoint_capacity) {
+    long long capacity = viewer.checkpoint_capacity ? viewer.checkpoint_capacity * 2 : VIEWER_CHECKPOINTS_INITIAL_CAPACITY;
+    off_t *checkpoints = memory_realloc(MEMORY_LINE_INDEX, viewer.checkpoints, capacity * sizeof(off_t));
+    if (!checkpoints) return -1;
+    viewer.checkpoints = checkpoints;
+    viewer.checkpoint_capacity = capacity;
+  }
+  viewer.checkpoints[viewer.checkpoint_count++] = offset;
+  return 0;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+/* Build the cache path for the saved line index of a file. The file
+ * name is a hash of its absolute path. Returns 0 on success. */
+static int viewer_index_cache_path(char *buffer, size_t size) {
+  /* FNV-1a */
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  for (const char *character = viewer.path; *character; character++) {
+    hash ^= (unsigned char)*character;
+    hash *= FNV_PRIME;
+  }
 
-  /* Ignore timeout - no input available (must be first to preserve highlight) */
-  if (key == -1) {
+  char name[LINE_INDEX_NAME_SIZE];
+  snprintf(name, sizeof(name), LINE_INDEX_NAME_FORMAT, hash);
+  return editor_cache_path(name, buffer, size);
+}
+
+/* Save the finished line index so the next open of the same file skips
+ * the scan. Only written if the file is still the one scanned, through
+ * a temporary file renamed into place. Lock held. */
+static void viewer_index_save() {
+  struct stat file_stat;
+  if (!viewer.path || fstat(viewer.file_descriptor, &file_stat) == -1 || file_stat.st_size != viewer.size || file_stat.st_ino != viewer.inode ||
+      file_stat.st_mtim.tv_sec != viewer.modification_time.tv_sec ||
+      file_stat.st_mtim.tv_nsec != viewer.modification_time.tv_nsec) {
     return;
   }
+  char path[PATH_MAX], temporary[PATH_MAX];
+  if (viewer_index_cache_path(path, sizeof(path)) != 0) return;
+  if (snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) >= (int)sizeof(temporary)) return;
+
+  FILE *file = fopen(temporary, "wb");
+  if (!file) return;
+
+  uint32_t path_length = strlen(viewer.path);
+  uint32_t checkpoint_lines = VIEWER_CHECKPOINT_LINES;
+  int64_t keys[LINE_INDEX_KEY_COUNT] = {
+    [LINE_INDEX_KEY_SIZE] = viewer.size,
+    [LINE_INDEX_KEY_MODIFIED_SECONDS] = viewer.modification_time.tv_sec,
+    [LINE_INDEX_KEY_MODIFIED_NANOSECONDS] = viewer.modification_time.tv_nsec,
+    [LINE_INDEX_KEY_INODE] = (int64_t)viewer.inode,
+    [LINE_INDEX_KEY_LINE_COUNT] = viewer.line_count
+  };
+  uint64_t checkpoint_count = viewer.checkpoint_count;
+  int written = fwrite(LINE_INDEX_MAGIC, 1, LINE_INDEX_MAGIC_LENGTH, file) == LINE_INDEX_MAGIC_LENGTH &&
+           fwrite(&path_length, sizeof(path_length), 1, file) == 1 &&
+           fwrite(viewer.path, 1, path_length, file) == path_length &&
+           fwrite(&checkpoint_lines, sizeof(checkpoint_lines), 1, file) == 1 &&
+           fwrite(keys, sizeof(keys), 1, file) == 1 &&
+           fwrite(&checkpoint_count, sizeof(checkpoint_count), 1, file) == 1 &&
+           fwrite(viewer.checkpoints, sizeof(off_t), checkpoint_count, file) == checkpoint_count;
+
+  if (fclose(file) != 0) written = 0;
+  if (!written || rename(temporary, path) != 0) unlink(temporary);
+}
 
-  /* Restore previous highlight */
-  if (saved_hl) {
-    memcpy(editor.row[saved_hl_line].highlight, saved_hl, editor.row[saved_hl_line].render_size);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+/* Load the saved line index of the open file, if one was saved for this
+ * path, size, modification time and inode. Every checkpoint is checked,
+ * so a damaged cache file is rejected rather than trusted. Returns 0 if
+ * the index is complete and no scan is needed. */
+static int viewer_index_load() {
+  char path[PATH_MAX];
+  if (viewer_index_cache_path(path, sizeof(path)) != 0) return -1;
+  FILE *file = fopen(path, "rb");
+  if (!file) return -1;
+
+  char magic[LINE_INDEX_MAGIC_LENGTH];
+  char saved_path[PATH_MAX];
+  uint32_t path_length, checkpoint_lines;
+  int64_t keys[LINE_INDEX_KEY_COUNT];
+  uint64_t checkpoint_count;
+  int valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+           memcmp(magic, LINE_INDEX_MAGIC, LINE_INDEX_MAGIC_LENGTH) == 0 &&
+           fread(&path_length, sizeof(path_length), 1, file) == 1 &&
+           path_length < sizeof(saved_path) &&
+           fread(saved_path, 1, path_length, file) == path_length &&
+           fread(&checkpoint_lines, sizeof(checkpoint_lines), 1, file) == 1 &&
+           checkpoint_lines == VIEWER_CHECKPOINT_LINES &&
+           fread(keys, sizeof(keys), 1, file) == 1 &&
+           keys[LINE_INDEX_KEY_SIZE] == viewer.size &&
+           keys[LINE_INDEX_KEY_MODIFIED_SECONDS] == viewer.modification_time.tv_sec &&
+           keys[LINE_INDEX_KEY_MODIFIED_NANOSECONDS] == viewer.modification_time.tv_nsec &&
+           keys[LINE_INDEX_KEY_INODE] == (int64_t)viewer.inode && keys[LINE_INDEX_KEY_LINE_COUNT] >= 0 &&
+           fread(&checkpoint_count, sizeof(checkpoint_count), 1, file) == 1 &&
+           checkpoint_count >= 1 && checkpoint_count <= (uint64_t)keys[LINE_INDEX_KEY_LINE_COUNT] / VIEWER_CHECKPOINT_LINES + 1;
+  if (valid) {
+    saved_path[path_length] = '\0';
+    valid = strcmp(saved_path, viewer.path) == 0;
+  }
+  off_t *checkpoints = valid ? memory_malloc(MEMORY_LINE_INDEX, checkpoint_count * sizeof(off_t)) : NULL;
+  valid = checkpoints && fread(checkpoints, sizeof(off_t), checkpoint_count, file) == checkpoint_count &&
+       checkpoints[0] == 0;
+  fclose(file);
+  for (uint64_t i = 1; valid && i < checkpoint_count; i++) {
+    valid = checkpoints[i] > checkpoints[i - 1] && checkpoints[i] <= viewer.size;
+  }
+  if (!valid) {
+    memory_free(MEMORY_LINE_INDEX, checkpoints);
+    return -1;
+  }
+
+  pthread_mutex_lock(&viewer.lock);
+  memory_free(MEMORY_LINE_INDEX, viewer.checkpoints);
+  viewer.checkpoints = checkpoints;
+  viewer.checkpoint_count = viewer.checkpoint_capacity = checkpoint_count;
+  viewer.line_count = keys[LINE_INDEX_KEY_LINE_COUNT];
+  viewer.scanned = viewer.size;
+  viewer.scan_done = 1;
+  pthread_mutex_unlock(&viewer.lock);
+  return 0;
+}
 
-  /* Handle exit keys */
-  if (key == '\r' || key == CHAR_ESCAPE) {
-    current_result_index = -1;
-    direction = 1;
-    if (last_query) {
-      free(last_query);
-      last_query = NULL;
+/* Background scan: count lines through the whole file, reading
+ * VIEWER_READ_BYTES at a time, and publish checkpoints as it goes.
+ * argument is the generation of the index it builds. */
+static void *viewer_scan_run(void *argument) {
+  int generation = (int)(intptr_t)argument;
+  pthread_mutex_lock(&viewer.lock);
+  off_t size = viewer.size;
+  pthread_mutex_unlock(&viewer.lock);
+
+  long long lines = 0;
+  off_t offset = 0;
+  char last = '\n';
+  int current = 1;
+  char *buffer = malloc(VIEWER_READ_BYTES);
+  /* Checkpoints found in one read: at most one per
+   * VIEWER_CHECKPOINT_LINES bytes */
+  off_t *found = malloc((VIEWER_READ_BYTES / VIEWER_CHECKPOINT_LINES + 1) * sizeof(off_t));
+  while (current && buffer && found && offset < size) {
+    size_t wanted = size - offset < VIEWER_READ_BYTES ? (size_t)(size - offset) : VIEWER_READ_BYTES;
+    ssize_t length = pread(viewer.file_descriptor, buffer, wanted, offset);
+    if (length <= 0) break;
+
+    /* Counted without the lock, which only publishes the results */
+    int found_count = 0;
+    for (const char *newline = buffer; (newline = memchr(newline, '\n', buffer + length - newline)) != NULL;
+         newline++) {
+      if (++lines % VIEWER_CHECKPOINT_LINES == 0) found[found_count++] = offset + (newline - buffer) + 1;
     }
-    return;
+    last = buffer[length - 1];
+    offset += length;
+
+    pthread_mutex_lock(&viewer.lock);
+    current = viewer.generation == generation;
+    if (current) {
+      for (int i = 0; i < found_count; i++) viewer_add_checkpoint(found[i]);
+      viewer.line_count = lines;
+      viewer.scanned = offset;
+    }
+    pthread_mutex_unlock(&viewer.lock);
   }
+  int complete = buffer && found && offset == size;
+  free(found);
+  free(buffer);
 
-  /* Handle navigation keys */
-  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    /* New query - reset index and search */
-    current_result_index = -1;
-    direction = 1;
+  pthread_mutex_lock(&viewer.lock);
+  if (viewer.generation == generation) {
+    /* A last line without a newline still counts */
+    if (complete && last != '\n') viewer.line_count = lines + 1;
+    /* Reading short means the file shrank; viewer_poll indexes it again */
+    if (offset < size && buffer && found) viewer.scan_short = 1;
+    viewer.scan_done = 1;
+    if (complete) viewer_index_save();
   }
+  pthread_mutex_unlock(&viewer.lock);
+  return NULL;
+}
 
-  /* Check if query changed */
-  if (!last_query || strcmp(last_query, query) != 0) {
-    /* New query - execute search */
-    if (last_query) free(last_query);
-    last_query = strdup(query);
-    simple_search(query);
-    current_result_index = -1;
-  }
+/* Lines found so far and the percentage of the file scanned. Returns
+ * true once the count is final. */
+int viewer_progress(long long *lines, int *percent) {
+  pthread_mutex_lock(&viewer.lock);
+  *lines = viewer.line_count;
+  *percent = viewer.size ? (int)(viewer.scanned * VIEWER_PERCENT_WHOLE / viewer.size) : VIEWER_PERCENT_WHOLE;
+  int done = viewer.scan_done;
+  pthread_mutex_unlock(&viewer.lock);
+  return done;
+}
 
-  /* No results */
-  if (editor.search_result_count == 0) {
+/* Check the file against viewer.size before a mapped read. If it shrank,
+ * clamp the size (and the window of rows) to it and drop a mapping that
+ * reaches past its end; viewer_poll then indexes it again. So it does a
+ * file that was emptied and written again, as a copy-and-truncate log
+ * rotation leaves it. */
+static void viewer_check_size() {
+  struct stat file_stat;
+  if (fstat(viewer.file_descriptor, &file_stat) == -1) return;
+  if (viewer.size == 0 && file_stat.st_size > 0) {
+    viewer.shrunk = 1;
     return;
   }
+  if (file_stat.st_size >= viewer.size) return;
+  pthread_mutex_lock(&viewer.lock);
+  viewer.size = file_stat.st_size;
+  pthread_mutex_unlock(&viewer.lock);
+  if (viewer.window_end > viewer.size) viewer.window_end = viewer.size;
+  if (viewer.map && viewer.map_start + (off_t)viewer.map_length > viewer.size) {
+    munmap(viewer.map, viewer.map_length);
+    viewer.map = NULL;
+  }
+  viewer.shrunk = 1;
+}
 
-  /* Navigate through results */
-  if (current_result_index == -1) {
-    /* First search or new query */
-    if (direction == 1) {
-      current_result_index = 0;
-    } else {
-      current_result_index = editor.search_result_count - 1;
-    }
-  } else {
-    /* Navigate to next/prev result */
-    current_result_index += direction;
+/* SIGBUS guard for the main thread's mapped reads: a guarded call sets
+ * the return point with sigsetjmp and arms it, and a fault while armed
+ * jumps back there instead of killing the editor. */
+static sigjmp_buf viewer_fault_return;
+static volatile sig_atomic_t viewer_fault_armed;
+static pthread_t viewer_fault_thread;
+
+/* SIGBUS handler: fail the guarded read, or die as the signal would
+ * have for any other fault. */
+static void viewer_fault_handler(int signal_number) {
+  if (viewer_fault_armed && pthread_equal(pthread_self(), viewer_fault_thread)) {
+    viewer_fault_armed = 0;
+    siglongjmp(viewer_fault_return, 1);
+  }
+  signal(signal_number, SIG_DFL);
+}
 
-    /* Wraparound */
-    if (current_result_index < 0) {
-      current_result_index = editor.search_result_count - 1;
-    } else if (current_result_index >= editor.search_result_count) {
-      current_result_index = 0;
-    }
-  }
+/* Install the SIGBUS guard; the reads it covers belong to this thread. */
+static void viewer_fault_install() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = viewer_fault_handler;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, NULL);
+  viewer_fault_thread = pthread_self();
+}
 
-  /* Apply result */
-  search_result *result = &editor.search_results[current_result_index];
-  editor_row *row = &editor.row[result->line_number];
+/* After a guarded read faulted: the mapping reaches past the file's end,
+ * so drop it and take the file's size again. */
+static void viewer_fault_recover() {
+  viewer_fault_armed = 0;
+  if (viewer.map) munmap(viewer.map, viewer.map_length);
+  viewer.map = NULL;
+  viewer_check_size();
+}
 
-  editor.cursor_y = result->line_number;
-  editor.cursor_x = editor_row_render_to_cursor(row, result->match_offset);
-  /* Force scroll adjustment on next refresh */
-  editor.row_offset = editor.row_count;
+/* Pointer to length bytes of the file at offset, mapping a new window if
+ * the current one doesn't hold them. length must be at most
+ * VIEWER_MAP_BYTES / 2. NULL if the file no longer reaches that far or
+ * mmap fails. Only called under the SIGBUS guard. */
+static const char *viewer_map(off_t offset, size_t length) {
+  viewer_check_size();
+  if (offset + (off_t)length > viewer.size) return NULL;
+  if (viewer.map && offset >= viewer.map_start &&
+      offset + (off_t)length <= viewer.map_start + (off_t)viewer.map_length) {
+    return viewer.map + (offset - viewer.map_start);
+  }
+  if (viewer.map) munmap(viewer.map, viewer.map_length);
+  viewer.map = NULL;
+  off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+  size_t map_length = viewer.size - start < VIEWER_MAP_BYTES ? (size_t)(viewer.size - start) : VIEWER_MAP_BYTES;
+  if (map_length == 0) return NULL;
+  char *map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, viewer.file_descriptor, start);
+  if (map == MAP_FAILED) return NULL;
+  viewer.map = map;
+  viewer.map_start = start;
+  viewer.map_length = map_length;
+  return viewer.map + (offset - start);
+}
 
-  /* Ensure match is visible horizontally */
-  editor.render_x = result->match_offset;
-  if (editor.render_x < editor.column_offset) {
-    editor.column_offset = editor.render_x;
-  }
-  if (editor.render_x >= editor.column_offset + editor.screen_columns - editor.gutter_width) {
-    editor.column_offset = editor.render_x - editor.screen_columns + editor.gutter_width + 1;
-  }
+/* Offset of the newline ending the line at offset (the file size for a
+ * last line without one), or -1 if the file can't be mapped. */
+static off_t viewer_line_end(off_t offset) {
+  while (offset < viewer.size) {
+    size_t length = viewer.size - offset < VIEWER_MAP_BYTES / 2 ? (size_t)(viewer.size - offset) : VIEWER_MAP_BYTES / 2;
+    const char *text = viewer_map(offset, length);
+    if (!text) return -1;
+    const char *newline = memchr(text, '\n', length);
+    if (newline) return offset + (newline - text);
+    offset += length;
+  }
+  return viewer.size;
+}
 
-  /* Highlight the match */
-  saved_hl_line = result->line_number;
-  saved_hl = malloc(row->render_size);
-  memcpy(saved_hl, row->highlight, row->render_size);
-  memset(&row->highlight[result->match_offset], HL_MATCH, result->match_length);
+/* Offset where a line starts, walking from the checkpoint at or before
+ * it, or -1 if the file has no such line. Only called under the SIGBUS
+ * guard. */
+static off_t viewer_line_offset(long long line) {
+  pthread_mutex_lock(&viewer.lock);
+  long long checkpoint = line / VIEWER_CHECKPOINT_LINES;
+  if (checkpoint >= viewer.checkpoint_count) checkpoint = viewer.checkpoint_count - 1;
+  off_t offset = viewer.checkpoints[checkpoint];
+  pthread_mutex_unlock(&viewer.lock);
+
+  for (long long walked = checkpoint * VIEWER_CHECKPOINT_LINES; walked < line; walked++) {
+    off_t end = viewer_line_end(offset);
+    if (end < 0 || end >= viewer.size) return -1;
+    offset = end + 1;
+  }
+  /* Past a final newline there is no line */
+  if (offset >= viewer.size && line > 0) return -1;
+  return offset;
 }
 
-/* Start interactive search mode. Prompts user for search term
- * and uses FTS5 for incremental search. ESC restores cursor. */
-void editor_find() {
-  int saved_cx = editor.cursor_x;
-  int saved_cy = editor.cursor_y;
-  int saved_coloff = editor.column_offset;
-  int saved_rowoff = editor.row_offset;
+/* Offset where a line starts, as viewer_line_offset, under the SIGBUS
+ * guard: -1 if the file was truncated under the read. */
+static off_t viewer_guarded_line_offset(long long line) {
+  if (sigsetjmp(viewer_fault_return, 1) != 0) {
+    viewer_fault_recover();
+    return -1;
+  }
+  viewer_fault_armed = 1;
+  off_t offset = viewer_line_offset(line);
+  viewer_fault_armed = 0;
+  return offset;
+}
 
-  char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editor_find_callback);
+/* Rebuild the rows as the window of lines starting at file line first.
+ * Only called under the SIGBUS guard. */
+static void viewer_fill_window(long long first) {
+  off_t offset = viewer_line_offset(first);
+  if (offset < 0) return;
+  for (int i = 0; i < editor.row_count; i++) editor_free_row(&editor.row[i]);
+  editor.row_count = 0;
+  editor.line_number_base = first;
+  selection_clear();
+  editor.search_result_count = 0;
+  editor_reset_bracket_match();
 
-  if (query) {
-    free(query);
-  } else {
-    editor.cursor_x = saved_cx;
-    editor.cursor_y = saved_cy;
-    editor.column_offset = saved_coloff;
-    editor.row_offset = saved_rowoff;
+  while (editor.row_count < VIEWER_WINDOW_LINES && offset < viewer.size) {
+    off_t end = viewer_line_end(offset);
+    if (end < 0) break;
+    size_t length = end - offset;
+    const char *text;
+    if (length > VIEWER_LINE_MAX) {
+      /* Too long to keep: show the start of it */
+      if (!(text = viewer_map(offset, VIEWER_LINE_MAX))) break;
+      editor_append_rows(text, VIEWER_LINE_MAX, 0);
+      editor_append_rows(VIEWER_ELISION, VIEWER_ELISION_LENGTH, 1);
+    } else {
+      /* With its newline, so an empty line still makes a row */
+      if (end < viewer.size) length++;
+      if (!(text = viewer_map(offset, length))) break;
+      editor_append_rows(text, length, 0);
+    }
+    offset = end + 1;
   }
+  viewer.window_end = offset < viewer.size ? offset : viewer.size;
 }
 
-/*** append buffer ***/
+/* Rebuild the rows as the window of lines starting at file line first.
+ * Under the SIGBUS guard: a truncation under the read ends the window
+ * where it struck. */
+static void viewer_load_window(long long first) {
+  if (sigsetjmp(viewer_fault_return, 1) != 0) {
+    viewer_fault_recover();
+    return;
+  }
+  viewer_fault_armed = 1;
+  viewer_fill_window(first);
+  viewer_fault_armed = 0;
+}
 
-/*
- * Dynamic string buffer for building screen output.
- * Grows automatically as data is appended, then written
- * to terminal in a single write() call to prevent flicker.
- */
-struct append_buffer {
-  /* Heap-allocated character array */
-  char *buffer;
-  /* Current length of data in buffer */
-  int length;
-};
+/* Put the cursor on a file line and column, rebuilding the rows around
+ * it, with the line centred on screen. */
+static void viewer_show(long long line, int column) {
+  long long first = line - VIEWER_WINDOW_LINES / 2;
+  if (first < 0) first = 0;
+  viewer_load_window(first);
+  editor.cursor_y = line - editor.line_number_base;
+  if (editor.cursor_y > editor.row_count) editor.cursor_y = editor.row_count;
+  int line_size = editor.cursor_y < editor.row_count ? editor.row[editor.cursor_y].line_size : 0;
+  editor.cursor_x = column < line_size ? column : line_size;
+  editor.row_offset = editor.cursor_y - editor.screen_rows / 2;
+  if (editor.row_offset < 0) editor.row_offset = 0;
+}
 
-/* Initializer for empty append_buffer */
-#define ABUF_INIT {NULL, 0}
+/* Open filename in the viewer if it is at least VIEWER_MIN_BYTES, or
+ * whatever its size if always is set. Returns 0 if it was opened, -1 if
+ * the caller should load it as usual. */
+int viewer_open(const char *filename, int always) {
+  int file_descriptor = open(filename, O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1) return -1;
+  struct stat file_stat;
+  if (fstat(file_descriptor, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) ||
+      (!always && file_stat.st_size < VIEWER_MIN_BYTES)) {
+    close(file_descriptor);
+    return -1;
+  }
+
+  viewer.file_descriptor = file_descriptor;
+  viewer.size = file_stat.st_size;
+  viewer.modification_time = file_stat.st_mtim;
+  viewer.inode = file_stat.st_ino;
+  viewer.path = realpath(filename, NULL);
+  if (!viewer.path) viewer.path = strdup(filename);
+  pthread_mutex_lock(&viewer.lock);
+  int indexed = viewer_add_checkpoint(0);
+  pthread_mutex_unlock(&viewer.lock);
+  /* A saved index of this very file makes the scan unnecessary */
+  if (indexed == 0 && (!viewer.path || viewer_index_load() != 0)) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, viewer_scan_run, (void *)(intptr_t)viewer.generation) != 0) {
+      indexed = -1;
+    } else {
+      pthread_detach(thread);
+    }
+  }
+  if (indexed == -1) {
+    close(file_descriptor);
+    viewer.file_descriptor = -1;
+    return -1;
+  }
 
-void set_foreground_rgb(struct append_buffer *ab, rgb_color color);
-void set_background_rgb(struct append_buffer *ab, rgb_color color);
-void reset_colors(struct append_buffer *ab);
+  viewer.active = 1;
+  viewer_fault_install();
+  free(editor.filename);
+  editor.filename = strdup(filename);
+  editor_select_syntax_highlight();
+  editor_note_file_state(&file_stat);
+  viewer_show(0, 0);
+  log_detect_format();
+  editor_set_status_message("%s is shown read-only; Ctrl-G jumps to a line%s, Ctrl-F searches", filename,
+                            editor.log_format ? ", Alt-G to a time" : "");
+  return 0;
+}
 
-/* Append 'string' of 'length' to the buffer.
- * Automatically grows the buffer as needed. */
-void append_buffer_write(struct append_buffer *ab, const char *string, int length) {
-  char *new_buffer = realloc(ab->buffer, ab->length + length);
+/* Index a file that shrank again from the start, with a new scan (and
+ * timestamp index), and show its first line: the old index describes
+ * text that is gone. */
+static void viewer_rescan() {
+  struct stat file_stat;
+  pthread_mutex_lock(&viewer.lock);
+  viewer.generation++;
+  if (fstat(viewer.file_descriptor, &file_stat) == 0) {
+    viewer.size = file_stat.st_size;
+    /* Seen, so the file watch doesn't report it too */
+    editor_note_file_state(&file_stat);
+  }
+  /* The first checkpoint's slot is kept, so this can't fail */
+  viewer.checkpoint_count = 0;
+  viewer_add_checkpoint(0);
+  viewer.line_count = 0;
+  viewer.scanned = 0;
+  viewer.scan_done = 0;
+  viewer.scan_short = 0;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, viewer_scan_run, (void *)(intptr_t)viewer.generation) == 0) {
+    pthread_detach(thread);
+  } else {
+    viewer.scan_done = 1;
+  }
+  pthread_mutex_unlock(&viewer.lock);
+  viewer.shrunk = 0;
 
-  if (new_buffer == NULL) return;
-  memcpy(&new_buffer[ab->length], string, length);
-  ab->buffer = new_buffer;
-  ab->length += length;
+  log_index_restart();
+  viewer_show(0, 0);
+  log_detect_format();
+  editor_set_status_message("%s shrank on disk; indexing it again from the start", editor.filename);
 }
 
-/* Free the buffer's allocated memory. */
-void append_buffer_destroy(struct append_buffer *ab) {
-  free(ab->buffer);
+/* Keep the rows around the cursor: once it comes within
+ * VIEWER_WINDOW_MARGIN rows of an end that isn't the file's, rebuild
+ * them centred on it without moving anything on screen. A file that
+ * shrank is indexed again. Called from the main loop. */
+void viewer_poll() {
+  if (!viewer.active) return;
+  pthread_mutex_lock(&viewer.lock);
+  int scan_short = viewer.scan_short;
+  pthread_mutex_unlock(&viewer.lock);
+  viewer_check_size();
+  if (viewer.shrunk || scan_short) viewer_rescan();
+
+  /* The scan may have found more digits' worth of lines */
+  editor_update_gutter_width();
+  int near_top = editor.cursor_y < VIEWER_WINDOW_MARGIN && editor.line_number_base > 0;
+  int near_bottom = editor.row_count - editor.cursor_y < VIEWER_WINDOW_MARGIN && viewer.window_end < viewer.size;
+  if (!near_top && !near_bottom) return;
+
+  long long cursor_line = editor.line_number_base + editor.cursor_y;
+  long long top_line = editor.line_number_base + editor.row_offset;
+  long long first = cursor_line - VIEWER_WINDOW_LINES / 2;
+  if (first < 0) first = 0;
+  int cursor_x = editor.cursor_x;
+  viewer_load_window(first);
+  editor.cursor_y = cursor_line - editor.line_number_base;
+  editor.cursor_x = cursor_x;
+  editor.row_offset = top_line > editor.line_number_base ? top_line - editor.line_number_base : 0;
 }
 
-/*** output ***/
-
-/* Adjust viewport offsets to keep cursor visible on screen.
- * Handles both normal scrolling and soft-wrap visual rows.
- * When center_scroll is enabled, implements typewriter scrolling
- * to keep cursor near the vertical center of the screen. */
-void editor_scroll() {
-  editor.render_x = 0;
-  if (editor.cursor_y < editor.row_count) {
-    editor.render_x = editor_row_cursor_to_render(&editor.row[editor.cursor_y], editor.cursor_x);
+/* Jump to a 1-based file line through the index (Ctrl+G). */
+static void viewer_jump_to_line(const char *text) {
+  long long line = atoll(text);
+  long long lines;
+  int percent;
+  int done = viewer_progress(&lines, &percent);
+  if (line < 1 || (done && line > lines)) {
+    editor_set_status_message("Invalid line number: %lld (valid: 1-%lld)", line, lines);
+    return;
   }
+  if (!done && line > lines) {
+    editor_set_status_message("Line %lld isn't indexed yet (%lld lines so far, %d%%)", line, lines, percent);
+    return;
+  }
+  viewer_show(line - 1, 0);
+  editor_set_status_message("Jumped to line %lld", line);
+}
 
-  if (editor.soft_wrap) {
-    /* With soft wrap, we need to account for wrapped lines
-     * Calculate visual row position of cursor */
-    int cursor_visual_row = editor_visual_rows_up_to(editor.cursor_y - 1) + editor_cursor_wrap_row();
-
-    /* Disable center scroll during selection or multi-cursor operations */
-    int use_center_scroll = editor.center_scroll &&
-                            !editor.selection.active &&
-                            editor.cursor_count == 0;
-
-    if (use_center_scroll) {
-      /* Typewriter scrolling: keep cursor near screen center */
-      int target_rowoff = cursor_visual_row - SCREEN_CENTER;
-
-      /* Clamp to valid range */
-      if (target_rowoff < 0) target_rowoff = 0;
+/* True if a key is waiting (used to stop a long search). */
+static int viewer_key_waiting() {
+  fd_set readfds;
+  struct timeval no_wait = {0, 0};
+  FD_ZERO(&readfds);
+  FD_SET(STDIN_FILENO, &readfds);
+  return select(STDIN_FILENO + 1, &readfds, NULL, NULL, &no_wait) > 0;
+}
 
-      /* Calculate max scroll offset (allow one line past end) */
-      int total_visual_rows = editor_visual_rows_up_to(editor.row_count - 1);
-      int max_rowoff = total_visual_rows - editor.screen_rows + 1;
-      if (max_rowoff < 0) max_rowoff = 0;
-      if (target_rowoff > max_rowoff) target_rowoff = max_rowoff;
+/* Search forward from the cursor for plain text, reading the file
+ * VIEWER_READ_BYTES at a time and counting newlines on the way to learn
+ * the match's line (Ctrl+F). A keypress stops it. */
+static void viewer_find() {
+  char *query = editor_prompt("Search: %s (ESC to cancel; any key stops a long search)", NULL);
+  if (!query) return;
+  size_t query_length = strlen(query);
+  if (query_length > VIEWER_READ_BYTES / 2) {
+    editor_set_status_message("Search text too long");
+    free(query);
+    return;
+  }
 
-      editor.row_offset = target_rowoff;
-    } else {
-      /* Edge-triggered scrolling: only scroll when cursor leaves visible area */
-      if (cursor_visual_row < editor.row_offset) {
-        editor.row_offset = cursor_visual_row;
+  long long line = editor.line_number_base + editor.cursor_y;
+  off_t line_start = viewer_guarded_line_offset(line);
+  if (line_start < 0) {
+    /* On the line past the last one */
+    editor_set_status_message("\"%s\" not found before the end of the file", query);
+    free(query);
+    return;
+  }
+  char *buffer = malloc(VIEWER_READ_BYTES);
+  if (!buffer) {
+    editor_set_status_message("Out of memory searching %s", editor.filename);
+    free(query);
+    return;
+  }
+  /* Matches count from just after the cursor */
+  off_t from = line_start + editor.cursor_x + 1;
+  off_t position = line_start;
+  const size_t chunk = VIEWER_READ_BYTES - query_length;
+  int reads = 0, stopped = 0;
+  while (position < viewer.size) {
+    size_t length = viewer.size - position < (off_t)chunk ? (size_t)(viewer.size - position) : chunk;
+    /* Take in enough of the next chunk for a match starting in this one */
+    size_t available = viewer.size - position < (off_t)(length + query_length - 1)
+                         ? (size_t)(viewer.size - position) : length + query_length - 1;
+    if (pread(viewer.file_descriptor, buffer, available, position) != (ssize_t)available) {
+      /* Read short: the file shrank, and viewer_poll indexes it again */
+      viewer_check_size();
+      editor_set_status_message("%s shrank on disk while searching it", editor.filename);
+      stopped = 1;
+      break;
+    }
+    const char *text = buffer;
+    size_t skip = from > position ? (size_t)(from - position) : 0;
+    const char *match = skip < available ? memmem(text + skip, available - skip, query, query_length) : NULL;
+    if (match && (size_t)(match - text) < length) {
+      for (const char *newline = text; (newline = memchr(newline, '\n', match - newline)) != NULL; newline++) {
+        line++;
+        line_start = position + (newline - text) + 1;
       }
-      if (cursor_visual_row >= editor.row_offset + editor.screen_rows) {
-        editor.row_offset = cursor_visual_row - editor.screen_rows + 1;
+      viewer_show(line, position + (match - text) - line_start);
+      editor_set_status_message("Found \"%s\" on line %lld", query, line + 1);
+      stopped = 1;
+      break;
+    }
+    for (const char *newline = text; (newline = memchr(newline, '\n', text + length - newline)) != NULL;
+         newline++) {
+      line++;
+      line_start = position + (newline - text) + 1;
+    }
+    position += length;
+
+    if (++reads % VIEWER_FIND_CHECK_READS == 0) {
+      if (viewer_key_waiting()) {
+        editor_read_key();
+        editor_set_status_message("Search stopped at line %lld (%d%% through the file)", line + 1,
+                                  (int)(position * VIEWER_PERCENT_WHOLE / viewer.size));
+        stopped = 1;
+        break;
       }
+      editor_set_status_message("Searching for \"%s\": line %lld, %d%%", query, line + 1,
+                                (int)(position * VIEWER_PERCENT_WHOLE / viewer.size));
+      editor_refresh_screen();
     }
+  }
+  if (!stopped) editor_set_status_message("\"%s\" not found before the end of the file", query);
+  free(buffer);
+  free(query);
+}
 
-    /* No horizontal scrolling with soft wrap */
-    editor.column_offset = 0;
-  } else {
-    /* Normal scrolling without soft wrap */
-    /* Disable center scroll during selection or multi-cursor operations */
-    int use_center_scroll = editor.center_scroll &&
-                            !editor.selection.active &&
-                            editor.cursor_count == 0;
+/* Keys the viewer acts on; everything else would edit. */
+int viewer_allows_key(int key) {
+  switch (key) {
+    case CTRL_KEY('q'): case CTRL_KEY('f'): case CTRL_KEY('g'): case CTRL_KEY('c'): case CTRL_KEY('l'):
+    case CTRL_KEY(']'): case CHAR_ESCAPE:
+    case ARROW_UP: case ARROW_DOWN: case ARROW_LEFT: case ARROW_RIGHT:
+    case SHIFT_ARROW_UP: case SHIFT_ARROW_DOWN: case SHIFT_ARROW_LEFT: case SHIFT_ARROW_RIGHT:
+    case CTRL_ARROW_LEFT: case CTRL_ARROW_RIGHT:
+    case HOME_KEY: case END_KEY: case SHIFT_HOME: case SHIFT_END: case PAGE_UP: case PAGE_DOWN:
+    case ALT_T: case ALT_L: case ALT_W: case ALT_Z: case ALT_H: case ALT_I: case ALT_G:
+    case MOUSE_EVENT:
+      return 1;
+  }
+  return 0;
+}
 
-    if (use_center_scroll) {
-      /* Typewriter scrolling: keep cursor near screen center */
-      int target_rowoff = editor.cursor_y - SCREEN_CENTER;
+/*** log timestamps ***/
+
+/* Logs are sorted by time, so a time can be found by bisection rather
+ * than searched for. A buffer whose first lines carry timestamps in one
+ * of the enum log_format formats is in log mode: Alt+G jumps to the
+ * first line at or after a time, and the status bar shows the span of
+ * times on screen. Timestamps compare as milliseconds; formats without
+ * a year count from an arbitrary origin, which is all ordering within
+ * one file needs. Rows held in memory are bisected directly, reading
+ * only the rows probed. The huge file viewer holds just a window of
+ * rows, so a background thread builds a sparse index instead: the
+ * timestamp at each line index checkpoint. A jump bisects that, then
+ * the rows of one window. */
+static struct {
+  pthread_mutex_t lock;
+  int format;
+  /* Timestamp of the first line with one within LOG_INDEX_PROBE_BYTES
+   * of each viewer checkpoint (LOG_TIME_NONE if there is none), in step
+   * with viewer.checkpoints. Shared with the thread; lock held */
+  long long *times;
+  long long count;
+  long long capacity;
+  int done;
+  /* Bumped when the viewer indexes its file again; a thread started for
+   * an older one stops without adding to times */
+  int generation;
+} log_index = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
 
-      /* Clamp to valid range */
-      if (target_rowoff < 0) target_rowoff = 0;
+/* Value of count decimal digits at text, or -1 if they aren't all digits. */
+static int log_digits(const char *text, int count) {
+  int value = 0;
+  for (int i = 0; i < count; i++) {
+    if (!isdigit((unsigned char)text[i])) return -1;
+    value = value * 10 + text[i] - '0';
+  }
+  return value;
+}
 
-      /* Calculate max scroll offset (allow one line past end) */
-      int max_rowoff = editor.row_count - editor.screen_rows + 1;
-      if (max_rowoff < 0) max_rowoff = 0;
-      if (target_rowoff > max_rowoff) target_rowoff = max_rowoff;
+/* Month (1-12) of an English three-letter abbreviation at text, or 0. */
+static int log_month(const char *text) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  for (int i = 0; i < 12; i++) {
+    if (!strncmp(text, &months[3 * i], 3)) return i + 1;
+  }
+  return 0;
+}
 
-      editor.row_offset = target_rowoff;
-    } else {
-      /* Edge-triggered scrolling: only scroll when cursor leaves visible area */
-      if (editor.cursor_y < editor.row_offset) {
-        editor.row_offset = editor.cursor_y;
-      }
-      if (editor.cursor_y >= editor.row_offset + editor.screen_rows) {
-        editor.row_offset = editor.cursor_y - editor.screen_rows + 1;
-      }
+/* Days from 1970-01-01 to a Gregorian calendar date. */
+static long long log_days_from_civil(int year, int month, int day) {
+  year -= month <= 2;
+  long long era = (year >= 0 ? year : year - 399) / 400;
+  int year_of_era = year - era * 400;
+  int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  return era * 146097 + year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year - 719468;
+}
+
+/* Milliseconds into the day of "HH:MM:SS" at text, with an optional
+ * ".123" or ",123" fraction (seconds may be left out when
+ * seconds_optional). Stores the length used in *end. Returns -1 if
+ * there is no time there. */
+static int log_parse_clock(const char *text, int length, int seconds_optional, int *end) {
+  if (length < 5 || text[2] != ':') return -1;
+  int hours = log_digits(text, 2);
+  int minutes = log_digits(text + 3, 2);
+  int seconds = 0;
+  int used = 5;
+  if (length >= 8 && text[5] == ':') {
+    seconds = log_digits(text + 6, 2);
+    used = 8;
+  } else if (!seconds_optional) {
+    return -1;
+  }
+  if (hours < 0 || hours > 23 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 60) return -1;
+
+  int milliseconds = ((hours * 60 + minutes) * 60 + seconds) * 1000;
+  if (used == 8 && used + 1 < length && (text[used] == '.' || text[used] == ',') &&
+      isdigit((unsigned char)text[used + 1])) {
+    used++;
+    for (int scale = 100; used < length && isdigit((unsigned char)text[used]); used++, scale /= 10) {
+      milliseconds += (text[used] - '0') * scale;
     }
+  }
+  /* Run on into more digits it is some other number */
+  if (used < length && isdigit((unsigned char)text[used])) return -1;
+  *end = used;
+  return milliseconds;
+}
 
-    /* Horizontal scrolling (same for both modes) */
-    if (editor.render_x < editor.column_offset) {
-      editor.column_offset = editor.render_x;
+/* Parse a timestamp of the given format starting exactly at text into
+ * *time, storing the length used in *end. Returns 0, or -1 if there is
+ * none there. */
+static int log_parse_at(const char *text, int length, int format, int seconds_optional,
+                        long long *time, int *end) {
+  long long day;
+  int start, clock, used;
+  switch (format) {
+    case LOG_FORMAT_ISO: {
+      if (length < 11 || text[4] != '-' || text[7] != '-' || (text[10] != 'T' && text[10] != ' ')) return -1;
+      int year = log_digits(text, 4), month = log_digits(text + 5, 2), date = log_digits(text + 8, 2);
+      if (year < 0 || month < 1 || month > 12 || date < 1 || date > 31) return -1;
+      day = log_days_from_civil(year, month, date);
+      start = 11;
+      break;
     }
-    if (editor.render_x >= editor.column_offset + editor.screen_columns) {
-      editor.column_offset = editor.render_x - editor.screen_columns + 1;
+    case LOG_FORMAT_CLF: {
+      if (length < 12 || text[2] != '/' || text[6] != '/' || text[11] != ':') return -1;
+      int date = log_digits(text, 2), month = log_month(text + 3), year = log_digits(text + 7, 4);
+      if (date < 1 || date > 31 || month == 0 || year < 0) return -1;
+      day = log_days_from_civil(year, month, date);
+      start = 12;
+      break;
+    }
+    case LOG_FORMAT_SYSLOG: {
+      /* The day of the month is padded with a space */
+      if (length < 7 || text[3] != ' ' || text[6] != ' ') return -1;
+      int month = log_month(text);
+      int date = text[4] == ' ' ? log_digits(text + 5, 1) : log_digits(text + 4, 2);
+      if (month == 0 || date < 1 || date > 31) return -1;
+      day = month * 32 + date;
+      start = 7;
+      break;
     }
+    case LOG_FORMAT_TIME:
+      day = 0;
+      start = 0;
+      break;
+    default:
+      return -1;
   }
+  if ((clock = log_parse_clock(text + start, length - start, seconds_optional, &used)) < 0) return -1;
+  *time = day * LOG_DAY_MS + clock;
+  *end = start + used;
+  return 0;
+}
 
-  /* Ensure scroll offsets are never negative (safety check) */
-  if (editor.row_offset < 0) editor.row_offset = 0;
-  if (editor.column_offset < 0) editor.column_offset = 0;
+/* Find a timestamp of the given format in the first LOG_TIME_SEARCH
+ * bytes of a line. Returns its offset (its length in *length_found if
+ * not NULL) with the time in *time, or -1 if there is none. */
+static int log_find_time(const char *text, int length, int format, long long *time, int *length_found) {
+  int limit = length < LOG_TIME_SEARCH ? length : LOG_TIME_SEARCH;
+  for (int i = 0; i < limit; i++) {
+    /* Only at the start of a word */
+    if (i > 0 && isalnum((unsigned char)text[i - 1])) continue;
+    int end;
+    if (log_parse_at(text + i, length - i, format, 0, time, &end) == 0) {
+      if (length_found) *length_found = end;
+      return i;
+    }
+  }
+  return -1;
 }
 
-/* Render all visible rows to the append buffer.
- * Draws line numbers, text content with syntax highlighting, and welcome message. */
-void editor_draw_rows(struct append_buffer *ab) {
-  int screen_row;
-  for (screen_row = 0; screen_row < editor.screen_rows; screen_row++) {
-    int fileditor_row, wrap_row;
-    int valid = editor_visual_to_logical(screen_row + editor.row_offset, &fileditor_row, &wrap_row);
-
-    /* Draw line number gutter if enabled */
-    if (editor.show_line_numbers) {
-      set_background_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
-
-      if (!valid || fileditor_row >= editor.row_count) {
-        /* Empty line - just draw spaces */
-        set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
-        for (int i = 0; i < editor.gutter_width; i++) {
-          append_buffer_write(ab, " ", 1);
-        }
-      } else if (editor.soft_wrap && wrap_row > 0) {
-        /* Continuation of wrapped line - no line number */
-        for (int i = 0; i < editor.gutter_width; i++) {
-          append_buffer_write(ab, " ", 1);
-        }
-      } else {
-        /* Draw line number (only on first wrap row) */
-        char linenum[16];
-        int linenum_len = snprintf(linenum, sizeof(linenum), "%d", fileditor_row + 1);
-        /* -1 for trailing space */
-        int padding = editor.gutter_width - linenum_len - 1;
+/* Timestamp of a row. Returns 0, or -1 if it has none. */
+static int log_row_time(int row, long long *time) {
+  editor_row *line = &editor.row[row];
+  return log_find_time(line->chars, line->line_size, editor.log_format, time, NULL) < 0 ? -1 : 0;
+}
 
-        /* Color-code line number based on state */
-        if (fileditor_row == editor.cursor_y) {
-          /* Current line - highest priority */
-          set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_CURRENT));
-        } else if (editor.row[fileditor_row].dirty) {
-          /* Dirty (unsynced) line - amber/orange */
-          set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_DIRTY));
-        } else {
-          /* Normal synced line */
-          set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
-        }
+/* First row in [low, high) with a timestamp at or after target, or high
+ * if there is none. Rows without one (continuation lines, stack traces)
+ * are skipped: each probe reads on from the middle to the next row that
+ * has one. */
+static int log_bisect_rows(int low, int high, long long target) {
+  int found = high;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    int row = middle;
+    long long time = 0;
+    while (row < high && log_row_time(row, &time) != 0) row++;
+    if (row == high) {
+      high = middle;
+    } else if (time >= target) {
+      found = row;
+      high = middle;
+    } else {
+      low = row + 1;
+    }
+  }
+  return found;
+}
 
-        /* Padding before line number */
-        for (int i = 0; i < padding; i++) {
-          append_buffer_write(ab, " ", 1);
-        }
+/* Background index for the viewer: read the timestamp at each
+ * checkpoint as the line scan publishes it. argument is the generation
+ * of log_index it builds. */
+static void *log_index_run(void *argument) {
+  int generation = (int)(intptr_t)argument;
+  pthread_mutex_lock(&log_index.lock);
+  int format = log_index.format;
+  pthread_mutex_unlock(&log_index.lock);
+  char probe[LOG_INDEX_PROBE_BYTES];
+  long long next = 0;
+  for (;;) {
+    pthread_mutex_lock(&viewer.lock);
+    int available = next < viewer.checkpoint_count;
+    int scan_done = viewer.scan_done;
+    off_t offset = available ? viewer.checkpoints[next] : 0;
+    pthread_mutex_unlock(&viewer.lock);
+    if (!available) {
+      if (scan_done) break;
+      struct timespec wait = {0, LOG_INDEX_WAIT_MS * 1000000L};
+      nanosleep(&wait, NULL);
+      continue;
+    }
 
-        append_buffer_write(ab, linenum, linenum_len);
-        append_buffer_write(ab, " ", 1);
+    long long time = LOG_TIME_NONE;
+    ssize_t length = pread(viewer.file_descriptor, probe, sizeof(probe), offset);
+    for (const char *line = probe; length > 0 && line < probe + length;) {
+      const char *newline = memchr(line, '\n', probe + length - line);
+      long long found;
+      if (log_find_time(line, (newline ? newline : probe + length) - line, format, &found, NULL) >= 0) {
+        time = found;
+        break;
       }
-
-      /* Reset to editor background - current line highlight set below after gutter */
-      set_background_rgb(ab, theme_get_color(THEME_UI_BACKGROUND));
-      set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
+      if (!newline) break;
+      line = newline + 1;
     }
 
-    /* Determine if this is the current line for background highlighting */
-    int is_current_line = (fileditor_row == editor.cursor_y);
-    /* Also highlight lines with secondary cursors */
-    if (!is_current_line) {
-      for (size_t i = 0; i < editor.cursor_count; i++) {
-        if (editor.cursors[i].line == fileditor_row) {
-          is_current_line = 1;
-          break;
-        }
+    pthread_mutex_lock(&log_index.lock);
+    if (log_index.generation != generation) {
+      pthread_mutex_unlock(&log_index.lock);
+      break;
+    }
+    if (log_index.count == log_index.capacity) {
+      long long capacity = log_index.capacity ? log_index.capacity * 2 : 1024;
+      long long *times = memory_realloc(MEMORY_LINE_INDEX, log_index.times, capacity * sizeof(long long));
+      if (!times) {
+        pthread_mutex_unlock(&log_index.lock);
+        break;
       }
+      log_index.times = times;
+      log_index.capacity = capacity;
     }
-    rgb_color line_bg = is_current_line ? theme_get_color(THEME_UI_CURRENT_LINE)
-                                        : theme_get_color(THEME_UI_BACKGROUND);
-
-    /* Set background for this line (current line highlight or normal) */
-    set_background_rgb(ab, line_bg);
+    log_index.times[log_index.count++] = time;
+    pthread_mutex_unlock(&log_index.lock);
+    next++;
+  }
 
-    /* Draw file content */
-    if (fileditor_row >= editor.row_count) {
-      if (editor.row_count == 0 && screen_row == editor.screen_rows / WELCOME_MESSAGE_ROW_DIVISOR) {
-        char welcome[WELCOME_BUFFER_SIZE];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-          "Terra editor -- version %s", MITER_VERSION);
-        int available_width = editor.screen_columns - editor.gutter_width;
-        if (welcomelen > available_width) welcomelen = available_width;
-        int padding = (available_width - welcomelen) / 2;
-        if (padding) {
-          set_foreground_rgb(ab, theme_get_color(THEME_UI_TILDE));
-          append_buffer_write(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) append_buffer_write(ab, " ", 1);
-        set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
-        append_buffer_write(ab, welcome, welcomelen);
-      } else {
-        set_foreground_rgb(ab, theme_get_color(THEME_UI_TILDE));
-        append_buffer_write(ab, "~", 1);
-      }
-    } else {
-      int available_width = editor.screen_columns - editor.gutter_width;
+  pthread_mutex_lock(&log_index.lock);
+  if (log_index.generation == generation) log_index.done = 1;
+  pthread_mutex_unlock(&log_index.lock);
+  return NULL;
+}
 
-      /* Calculate which portion of the line to show for this wrap segment */
-      int line_offset, line_end;
-      if (editor.soft_wrap) {
-        editor_row *row = &editor.row[fileditor_row];
-        editor_calculate_wrap_breaks(row, available_width);
-        line_offset = editor_wrap_segment_start(row, wrap_row);
-        line_end = editor_wrap_segment_end(row, wrap_row);
-      } else {
-        line_offset = editor.column_offset;
-        line_end = editor.row[fileditor_row].render_size;
-      }
+/* Drop the viewer's timestamp index when its file is indexed again;
+ * log_detect_format then starts a new one. */
+void log_index_restart() {
+  pthread_mutex_lock(&log_index.lock);
+  log_index.generation++;
+  log_index.format = 0;
+  log_index.count = 0;
+  log_index.done = 0;
+  pthread_mutex_unlock(&log_index.lock);
+}
 
-      int line_length = line_end - line_offset;
-      if (line_length < 0) line_length = 0;
-      if (!editor.soft_wrap && line_length > available_width) line_length = available_width;
+/* Set editor.log_format to the format most of the buffer's first
+ * non-empty lines have a timestamp in (LOG_FORMAT_NONE if there is
+ * none). In the viewer, also start indexing the file's timestamps. */
+void log_detect_format() {
+  editor.log_format = LOG_FORMAT_NONE;
+  for (int format = LOG_FORMAT_ISO; format <= LOG_FORMAT_TIME && !editor.log_format; format++) {
+    int lines = 0, stamped = 0;
+    for (int i = 0; i < editor.row_count && lines < LOG_DETECT_LINES; i++) {
+      if (editor.row[i].line_size == 0) continue;
+      lines++;
+      long long time;
+      if (log_find_time(editor.row[i].chars, editor.row[i].line_size, format, &time, NULL) >= 0) stamped++;
+    }
+    if (lines > 0 && stamped * 2 >= lines) editor.log_format = format;
+  }
 
-      char *chars = &editor.row[fileditor_row].render[line_offset];
-      unsigned char *highlight = &editor.row[fileditor_row].highlight[line_offset];
-      rgb_color current_color = {0, 0, 0};
-      int has_color = 0;
-      int in_selection = 0;
-      int char_index;
-      for (char_index = 0; char_index < line_length; char_index++) {
-        /* Check if this character is selected */
-        int render_col = line_offset + char_index;
-        int cursor_col = editor_row_render_to_cursor(&editor.row[fileditor_row], render_col);
-          int is_selected = selection_contains(fileditor_row, cursor_col);
+  if (!viewer.active || !editor.log_format) return;
+  pthread_mutex_lock(&log_index.lock);
+  if (!log_index.format) {
+    log_index.format = editor.log_format;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_index_run, (void *)(intptr_t)log_index.generation) == 0) {
+      pthread_detach(thread);
+    } else {
+      log_index.done = 1;
+    }
+  }
+  pthread_mutex_unlock(&log_index.lock);
+}
 
-          /* Handle selection state changes */
-          if (is_selected && !in_selection) {
-            set_background_rgb(ab, theme_get_color(THEME_UI_SELECTION_BG));
-          set_foreground_rgb(ab, theme_get_color(THEME_UI_SELECTION_FG));
-          in_selection = 1;
-          has_color = 0;
-        } else if (!is_selected && in_selection) {
-          /* Restore normal editor colors (current line highlight or normal bg) */
-          set_background_rgb(ab, line_bg);
-          set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
-          in_selection = 0;
-          has_color = 0;
-        }
+/* Timestamp of the cursor's row, or the nearest one above it with one,
+ * or the first in the buffer: the day a bare time of day refers to.
+ * 0 if no row has one. */
+static long long log_reference_time() {
+  long long time;
+  for (int row = editor.cursor_y < editor.row_count ? editor.cursor_y : editor.row_count - 1; row >= 0; row--) {
+    if (log_row_time(row, &time) == 0) return time;
+  }
+  for (int row = 0; row < editor.row_count; row++) {
+    if (log_row_time(row, &time) == 0) return time;
+  }
+  return 0;
+}
 
-        if (iscntrl(chars[char_index])) {
-          char sym = (chars[char_index] <= 26) ? '@' + chars[char_index] : '?';
-          if (!in_selection) {
-            append_buffer_write(ab, ESCAPE_REVERSE_VIDEO, ESCAPE_REVERSE_VIDEO_LEN);
-          }
-          append_buffer_write(ab, &sym, 1);
-          if (!in_selection) {
-            append_buffer_write(ab, ESCAPE_NORMAL_VIDEO, ESCAPE_NORMAL_VIDEO_LEN);
-            set_background_rgb(ab, line_bg);
-            if (has_color) {
-              set_foreground_rgb(ab, current_color);
-            } else {
-              set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
-            }
-            if (has_color) {
-              set_foreground_rgb(ab, current_color);
-            }
-          }
-        } else if (in_selection) {
-          /* Selected text uses selection colors */
-          append_buffer_write(ab, &chars[char_index], 1);
-        } else {
-          /* Check if this is the matching bracket position */
-          int is_bracket_match = (editor.bracket_match_row == fileditor_row &&
-                                  editor.bracket_match_col == cursor_col);
-          int is_bracket_endpoint = 0;
-          if (editor.bracket_open_row != -1 && editor.bracket_close_row != -1) {
-            if (fileditor_row == editor.bracket_open_row &&
-                cursor_col >= editor.bracket_open_col &&
-                cursor_col < editor.bracket_open_col + editor.bracket_open_len) {
-              is_bracket_endpoint = 1;
-            }
-            if (fileditor_row == editor.bracket_close_row &&
-                cursor_col >= editor.bracket_close_col &&
-                cursor_col < editor.bracket_close_col + editor.bracket_close_len) {
-              is_bracket_endpoint = 1;
-            }
-          }
+/* Parse a time typed at the prompt: a whole timestamp in the log's
+ * format (seconds may be left out), or a time of day, HH:MM[:SS[.fff]],
+ * on the day of reference. Returns 0, or -1 if it isn't a time. */
+static int log_parse_query(const char *text, long long reference, long long *time) {
+  while (isspace((unsigned char)*text)) text++;
+  int length = strlen(text);
+  while (length > 0 && isspace((unsigned char)text[length - 1])) length--;
+
+  int end;
+  if (log_parse_at(text, length, editor.log_format, 1, time, &end) == 0 && end == length) return 0;
+  int clock = log_parse_clock(text, length, 1, &end);
+  if (clock < 0 || end != length) return -1;
+  long long into_day = (reference % LOG_DAY_MS + LOG_DAY_MS) % LOG_DAY_MS;
+  *time = reference - into_day + clock;
+  return 0;
+}
 
-          /* Secondary cursors now rendered via kitty protocol in editor_refresh_screen() */
+/* Put the cursor on a row, centring it on screen. */
+static void log_show_row(int row) {
+  selection_clear();
+  editor.cursor_y = row;
+  editor.cursor_x = 0;
+  int row_offset = row - editor.screen_rows / 2;
+  int max_row_offset = editor.row_count - editor.screen_rows;
+  if (row_offset > max_row_offset) row_offset = max_row_offset;
+  editor.row_offset = row_offset > 0 ? row_offset : 0;
+}
 
-          if (is_bracket_match || is_bracket_endpoint) {
-            /* Underline bracket/comment delimiters for both partners */
-            set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_MATCH));
-            append_buffer_write(ab, ESCAPE_UNDERLINE_START, ESCAPE_UNDERLINE_START_LEN);
-            append_buffer_write(ab, &chars[char_index], 1);
-            append_buffer_write(ab, ESCAPE_UNDERLINE_END, ESCAPE_UNDERLINE_END_LEN);
-            set_background_rgb(ab, line_bg);
-            set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
-            has_color = 0;
-          } else if (highlight[char_index] == HL_NORMAL) {
-            if (has_color) {
-              set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
-              has_color = 0;
-            }
-            append_buffer_write(ab, &chars[char_index], 1);
-          } else {
-            rgb_color color = editor_syntax_to_color(highlight[char_index]);
-            if (!has_color || !rgb_equal(color, current_color)) {
-              current_color = color;
-              has_color = 1;
-              set_foreground_rgb(ab, color);
-            }
-            append_buffer_write(ab, &chars[char_index], 1);
-          }
-        }
-      }
-      /* Reset if we were in selection at end of line */
-      if (in_selection) {
-        set_background_rgb(ab, line_bg);
-        set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
-      } else {
-        set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
-      }
+/* Viewer side of editor_jump_to_time: bisect the timestamps indexed so
+ * far for the first checkpoint at or after target. The line lies
+ * between the last stamped checkpoint before it and it, so the windows
+ * of rows from there are bisected until it turns up (normally in the
+ * first one). */
+static void viewer_jump_to_time(long long target, const char *query) {
+  pthread_mutex_lock(&log_index.lock);
+  long long count = log_index.count;
+  int done = log_index.done;
+  long long low = 0, high = count, found = count;
+  while (low < high) {
+    long long middle = low + (high - low) / 2;
+    long long checkpoint = middle;
+    while (checkpoint < high && log_index.times[checkpoint] == LOG_TIME_NONE) checkpoint++;
+    if (checkpoint == high) {
+      high = middle;
+    } else if (log_index.times[checkpoint] >= target) {
+      found = checkpoint;
+      high = middle;
+    } else {
+      low = checkpoint + 1;
     }
+  }
+  long long before = found - 1;
+  while (before > 0 && log_index.times[before] == LOG_TIME_NONE) before--;
+  pthread_mutex_unlock(&log_index.lock);
 
-    /* Clear to end of line with current background (line_bg already set above) */
-    append_buffer_write(ab, ESCAPE_CLEAR_LINE, ESCAPE_CLEAR_LINE_LEN);
-    /* Reset to normal background for the next line */
-    set_background_rgb(ab, theme_get_color(THEME_UI_BACKGROUND));
-    append_buffer_write(ab, CRLF, CRLF_LEN);
+  if (found == count && !done) {
+    long long lines;
+    int percent;
+    viewer_progress(&lines, &percent);
+    editor_set_status_message("%s is past the timestamps indexed so far (%d%%)", query, percent);
+    return;
   }
-}
 
-/* Count dirty rows for sync status */
-int editor_count_dirty_lines() {
-  int count = 0;
-  for (int i = 0; i < editor.row_count; i++) {
-    if (editor.row[i].dirty) count++;
+  long long first = before > 0 ? before * VIEWER_CHECKPOINT_LINES : 0;
+  for (;;) {
+    viewer_load_window(first);
+    if (editor.row_count == 0 || editor.line_number_base != first) break;
+    int row = log_bisect_rows(0, editor.row_count, target);
+    if (row < editor.row_count) {
+      viewer_show(editor.line_number_base + row, 0);
+      editor_set_status_message("Jumped to %s on line %lld", query, editor.line_number_base + editor.cursor_y + 1);
+      return;
+    }
+    if (viewer.window_end >= viewer.size) break;
+    first += editor.row_count;
   }
-  return count;
+  viewer_show(editor.line_number_base + (editor.row_count > 0 ? editor.row_count - 1 : 0), 0);
+  editor_set_status_message("The log ends before %s", query);
 }
 
-/* Draw the status bar showing filename, line count, and cursor position.
- * Uses reverse video for visibility. */
-void editor_draw_status_bar(struct append_buffer *ab) {
-  append_buffer_write(ab, ESCAPE_CLEAR_LINE, ESCAPE_CLEAR_LINE_LEN);
-  set_background_rgb(ab, theme_get_color(THEME_UI_STATUS_BG));
-  set_foreground_rgb(ab, theme_get_color(THEME_UI_STATUS_FG));
+/* Jump to the first line at or after a time (Alt+G), bisecting the log's
+ * timestamps. A time of day means that time on the cursor's day. */
+void editor_jump_to_time() {
+  if (!editor.log_format) {
+    editor_set_status_message("No timestamps recognised at the start of the lines");
+    return;
+  }
+  char *query = editor_prompt("Jump to time: %s (HH:MM[:SS] or a full timestamp, ESC to cancel)", NULL);
+  if (query == NULL) {
+    editor_set_status_message("Jump cancelled");
+    return;
+  }
 
-  char status[STATUS_BAR_BUFFER_SIZE], rstatus[STATUS_BAR_BUFFER_SIZE];
-  int status_length = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    editor.filename ? editor.filename : "[No Name]", editor.row_count,
-    editor.dirty ? "(modified)" : "");
-
-  /* Check if there are dirty lines for sync status */
-  int dirty_count = editor_count_dirty_lines();
-  const char *sync_status = (dirty_count > 0) ? ESCAPE_STRIKETHROUGH_START "Synced" ESCAPE_STRIKETHROUGH_END : "Synced";
+  long long target;
+  if (log_parse_query(query, log_reference_time(), &target) != 0) {
+    editor_set_status_message("Not a time: %s", query);
+  } else if (viewer.active) {
+    viewer_jump_to_time(target, query);
+  } else {
+    int row = log_bisect_rows(0, editor.row_count, target);
+    if (row < editor.row_count) {
+      log_show_row(row);
+      editor_set_status_message("Jumped to %s on line %d", query, row + 1);
+    } else {
+      log_show_row(editor.row_count > 0 ? editor.row_count - 1 : 0);
+      editor_set_status_message("The log ends before %s", query);
+    }
+  }
+  free(query);
+}
 
-  /* Keyboard protocol indicator */
-  const char *kb_mode = editor.kitty_keyboard_mode ? "Kitty" : "Legacy";
+/* Write the span of times on screen ("14:03:22-14:05:10") into buffer:
+ * the timestamps of the first and last rows on screen that have one,
+ * as times of day, or whole if they fall on different days. Empty if
+ * not in log mode or no row on screen has one. */
+static void log_screen_span(char *buffer, size_t size) {
+  buffer[0] = '\0';
+  if (!editor.log_format) return;
+  int top = editor.row_offset;
+  int bottom = editor.row_offset + editor.screen_rows;
+  if (bottom > editor.row_count) bottom = editor.row_count;
+
+  long long first_time = 0, last_time = 0;
+  int first_length = 0, last_length = 0;
+  int first = top, last = bottom - 1;
+  int first_offset = -1, last_offset = -1;
+  for (; first < bottom && first_offset < 0; first++) {
+    editor_row *row = &editor.row[first];
+    first_offset = log_find_time(row->chars, row->line_size, editor.log_format, &first_time, &first_length);
+  }
+  if (first_offset < 0) return;
+  first--;
+  for (; last >= first && last_offset < 0; last--) {
+    editor_row *row = &editor.row[last];
+    last_offset = log_find_time(row->chars, row->line_size, editor.log_format, &last_time, &last_length);
+  }
+  last++;
+
+  if (first_time / LOG_DAY_MS != last_time / LOG_DAY_MS) {
+    snprintf(buffer, size, "%.*s - %.*s", first_length, &editor.row[first].chars[first_offset],
+             last_length, &editor.row[last].chars[last_offset]);
+    return;
+  }
+  int first_clock = (first_time % LOG_DAY_MS + LOG_DAY_MS) % LOG_DAY_MS / 1000;
+  int last_clock = (last_time % LOG_DAY_MS + LOG_DAY_MS) % LOG_DAY_MS / 1000;
+  snprintf(buffer, size, "%02d:%02d:%02d-%02d:%02d:%02d", first_clock / 3600, first_clock / 60 % 60,
+           first_clock % 60, last_clock / 3600, last_clock / 60 % 60, last_clock % 60);
+}
 
-  /* Calculate ANSI escape code length (invisible characters)
-   * \x1b[9m (4) + \x1b[29m (5) = 9 */
-  int ansi_escape_length = (dirty_count > 0) ? 9 : 0;
+/*** external changes ***/
+
+/* The active buffer's file is watched with inotify for changes made
+ * outside the editor. The directory is watched rather than the file, so
+ * a file replaced by rename (atomic saves, log rotation, git checkout)
+ * is still seen. A clean buffer is brought in line with the new
+ * contents by replacing only the lines that differ; a buffer with
+ * unsaved changes is left alone, with a warning. */
+static struct {
+  int initialized;
+  /* inotify instance (-1 if unavailable) and the directory's watch */
+  int fd;
+  int watch;
+  /* File watched, and its last component within path */
+  char *path;
+  const char *name;
+  /* Events for the file not yet acted on, and when the last arrived */
+  int pending;
+  struct timespec pending_time;
+  /* The writer closed the file, so it is complete */
+  int closed;
+} file_watch;
+
+/* One line in a reload diff. */
+typedef struct {
+  unsigned long long hash;
+  const char *text;
+  int length;
+} reload_line;
 
-  int right_status_length = snprintf(rstatus, sizeof(rstatus), "%s | %s | %s | %s | %d/%d",
-    editor.syntax ? editor.syntax->filetype : "no ft", theme_get_name(), kb_mode, sync_status, editor.cursor_y + 1, editor.row_count);
+/* A run of old lines replaced by a run of new ones: [old_start, old_end)
+ * becomes [new_start, new_end). */
+typedef struct {
+  int old_start, old_end;
+  int new_start, new_end;
+} reload_hunk;
+
+/* Hash a line for diffing (FNV-1a). */
+static unsigned long long reload_hash(const char *text, int length) {
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  for (int i = 0; i < length; i++) {
+    hash ^= (unsigned char)text[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
 
-  /* Adjust right_status_length to account for ANSI escape codes */
-  int right_status_visible_length = right_status_length - ansi_escape_length;
+static int reload_lines_equal(const reload_line *a, const reload_line *b) {
+  return a->hash == b->hash && a->length == b->length && memcmp(a->text, b->text, a->length) == 0;
+}
 
-  if (status_length > editor.screen_columns) status_length = editor.screen_columns;
-  append_buffer_write(ab, status, status_length);
-  while (status_length < editor.screen_columns) {
-    if (editor.screen_columns - status_length == right_status_visible_length) {
-      append_buffer_write(ab, rstatus, right_status_length);
-      break;
-    } else {
-      append_buffer_write(ab, " ", 1);
-      status_length++;
+/* Match old lines to new ones along a shortest edit script (Myers'
+ * greedy algorithm). Sets new_match[j] to the old line new line j is
+ * kept from, or -1 if it is inserted. Returns 0, or -1 if the two differ
+ * in more than FILE_RELOAD_DIFF_MAX lines or memory runs out. */
+static int reload_diff(const reload_line *old_lines, int old_count, const reload_line *new_lines,
+                       int new_count, int *new_match) {
+  int max_edits = old_count + new_count < FILE_RELOAD_DIFF_MAX ? old_count + new_count : FILE_RELOAD_DIFF_MAX;
+  int offset = max_edits + 1;
+  /* Furthest old index reached on each diagonal k = x - y, and its value
+   * after every round d, kept as trace[d * d + k + d] for k in [-d, d] */
+  int *furthest = calloc(2 * max_edits + 3, sizeof(int));
+  int *trace = malloc((size_t)(max_edits + 1) * (max_edits + 1) * sizeof(int));
+  if (!furthest || !trace) {
+    free(furthest);
+    free(trace);
+    return -1;
+  }
+
+  int edits = -1;
+  for (int d = 0; d <= max_edits && edits == -1; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && furthest[offset + k - 1] < furthest[offset + k + 1]))
+                ? furthest[offset + k + 1] : furthest[offset + k - 1] + 1;
+      int y = x - k;
+      while (x < old_count && y < new_count && reload_lines_equal(&old_lines[x], &new_lines[y])) {
+        x++;
+        y++;
+      }
+      furthest[offset + k] = x;
+      if (x >= old_count && y >= new_count) {
+        edits = d;
+        break;
+      }
     }
-  }
-
-  reset_colors(ab);
-  append_buffer_write(ab, CRLF, CRLF_LEN);
+    memcpy(&trace[d * d], &furthest[offset - d], (2 * d + 1) * sizeof(int));
+  }
+  free(furthest);
+  if (edits == -1) {
+    free(trace);
+    return -1;
+  }
+
+  /* Walk back from the end, recording the diagonal runs as matches */
+  for (int j = 0; j < new_count; j++) new_match[j] = -1;
+  int x = old_count, y = new_count;
+  for (int d = edits; d > 0; d--) {
+    const int *previous = &trace[(d - 1) * (d - 1) + d - 1];
+    int k = x - y;
+    int previous_k = (k == -d || (k != d && previous[k - 1] < previous[k + 1])) ? k + 1 : k - 1;
+    int previous_x = previous[previous_k];
+    /* Where the run starts: after the insertion (down) or deletion (right) */
+    int run_start = previous_k == k + 1 ? previous_x : previous_x + 1;
+    while (x > run_start) new_match[--y] = --x;
+    x = previous_x;
+    y = previous_x - previous_k;
+  }
+  while (x > 0 && y > 0) new_match[--y] = --x;
+  free(trace);
+  return 0;
 }
 
-/* Draw the message bar showing status messages with timeout.
- * Messages disappear after STATUS_MESSAGE_TIMEOUT_SECONDS. */
-void editor_draw_message_bar(struct append_buffer *ab) {
-  append_buffer_write(ab, ESCAPE_CLEAR_LINE, ESCAPE_CLEAR_LINE_LEN);
-  set_background_rgb(ab, theme_get_color(THEME_UI_MESSAGE_BG));
-  set_foreground_rgb(ab, theme_get_color(THEME_UI_MESSAGE_FG));
-
-  int message_length = strlen(editor.status_message);
-  if (message_length > editor.screen_columns) message_length = editor.screen_columns;
+/* Where a line ends up once a hunk is applied. Lines inside a replaced
+ * run keep their offset into it, as far as the new run reaches. */
+static int reload_adjust_line(int line, const reload_hunk *hunk) {
+  int new_length = hunk->new_end - hunk->new_start;
+  if (line >= hunk->old_end) return line + new_length - (hunk->old_end - hunk->old_start);
+  if (line < hunk->old_start) return line;
+  int into = line - hunk->old_start;
+  if (into >= new_length) into = new_length > 0 ? new_length - 1 : 0;
+  return hunk->old_start + into;
+}
 
-  int current_column = 0;
-  if (message_length && time(NULL) - editor.status_message_time < STATUS_MESSAGE_TIMEOUT_SECONDS) {
-    append_buffer_write(ab, editor.status_message, message_length);
-    current_column = message_length;
+/* Replace the rows of a hunk with its new lines, through the ordinary
+ * undo-logged edits. */
+static void reload_apply_hunk(const reload_hunk *hunk, const reload_line *new_lines) {
+  /* The new lines as text: each followed by a newline, except at the end
+   * of the buffer, where each is preceded by one instead */
+  int at_end = hunk->old_end == editor.row_count;
+  size_t length = 0;
+  for (int j = hunk->new_start; j < hunk->new_end; j++) length += new_lines[j].length + 1;
+  char *text = malloc(length + 1);
+  if (!text) return;
+  char *end = text;
+  for (int j = hunk->new_start; j < hunk->new_end; j++) {
+    if (at_end && (j > hunk->new_start || hunk->old_start > 0)) *end++ = '\n';
+    memcpy(end, new_lines[j].text, new_lines[j].length);
+    end += new_lines[j].length;
+    if (!at_end) *end++ = '\n';
+  }
+
+  /* Where the old rows start and end as text positions */
+  int start_row = hunk->old_start, start_column = 0;
+  int end_row = hunk->old_end, end_column = 0;
+  if (at_end) {
+    if (start_row > 0) {
+      start_row--;
+      start_column = editor.row[start_row].line_size;
+    }
+    end_row = editor.row_count - 1;
+    end_column = end_row >= 0 ? editor.row[end_row].line_size : 0;
   }
 
-  /* Fill rest of line with spaces to ensure background spans full width */
-  while (current_column < editor.screen_columns) {
-    append_buffer_write(ab, " ", 1);
-    current_column++;
+  if (hunk->old_end > hunk->old_start && (start_row < end_row || start_column < end_column)) {
+    editor.selection.active = 1;
+    editor.selection.mode = SELECTION_CHAR;
+    editor.selection.anchor.row = start_row;
+    editor.selection.anchor.col = start_column;
+    editor.selection.cursor.row = end_row;
+    editor.selection.cursor.col = end_column;
+    selection_delete();
+  }
+  /* Emptied completely: no rows, as a freshly read empty file has. The
+   * row is logged, so undo brings it back before the text */
+  if (editor.row_count == 1 && editor.row[0].line_size == 0 && hunk->new_end == hunk->new_start && at_end &&
+      hunk->old_start == 0) {
+    undo_log(UNDO_ROW_DELETE, 0, 0, 0, 0, NULL, 0, 0, NULL);
+    editor_delete_row(0);
+  }
+  /* Filling a buffer with no rows: its first row is logged on its own
+   * (and is all a lone "\n" needs), so undo leaves no rows again */
+  if (hunk->new_end > hunk->new_start && editor.row_count == 0) {
+    editor_insert_row(0, "", 0);
+    undo_log(UNDO_ROW_INSERT, 0, 0, 0, 0, NULL, 0, 0, NULL);
   }
+  if (end > text) {
+    editor.cursor_y = start_row;
+    editor.cursor_x = start_column;
+    editor_insert_text(text, end - text);
+  }
+  free(text);
+}
 
-  reset_colors(ab);
+/* Split file contents into lines the way editor_load_file does. Returns
+ * the count, or -1 if out of memory. */
+static int reload_split_lines(const char *contents, size_t size, reload_line **lines) {
+  int count = 0, capacity = 0;
+  *lines = NULL;
+  size_t start = 0;
+  while (start < size) {
+    const char *newline = memchr(contents + start, '\n', size - start);
+    size_t stop = newline ? (size_t)(newline - contents) : size;
+    int length = stop - start;
+    while (length > 0 && (contents[start + length - 1] == '\n' || contents[start + length - 1] == '\r')) length--;
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      reload_line *grown = realloc(*lines, capacity * sizeof(reload_line));
+      if (!grown) {
+        free(*lines);
+        *lines = NULL;
+        return -1;
+      }
+      *lines = grown;
+    }
+    (*lines)[count].text = contents + start;
+    (*lines)[count].length = length;
+    (*lines)[count].hash = reload_hash(contents + start, length);
+    count++;
+    start = stop + 1;
+  }
+  return count;
 }
 
-/* Redraw the entire screen. Builds output in append buffer
- * then writes to terminal in one call to prevent flicker. */
-void editor_refresh_screen() {
-  editor_scroll();
+/* Read a whole file into memory. Returns the contents (not terminated)
+ * and sets size, or NULL with errno set. */
+static char *reload_read_file(const char *path, size_t *size) {
+  int file_descriptor = open(path, O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1) return NULL;
+  size_t capacity = FILE_RELOAD_READ_INITIAL_CAPACITY, length = 0;
+  char *contents = malloc(capacity);
+  while (contents) {
+    if (length == capacity) {
+      char *grown = realloc(contents, capacity * 2);
+      if (!grown) break;
+      contents = grown;
+      capacity *= 2;
+    }
+    ssize_t got = read(file_descriptor, contents + length, capacity - length);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) {
+      if (got == 0) {
+        close(file_descriptor);
+        *size = length;
+        return contents;
+      }
+      break;
+    }
+    length += got;
+  }
+  int saved_errno = contents ? errno : ENOMEM;
+  free(contents);
+  close(file_descriptor);
+  errno = saved_errno;
+  return NULL;
+}
 
-  /* Update bracket matching state */
-  editor_find_matching_bracket();
+/* Bring a clean buffer in line with its changed file. Only the runs of
+ * lines that differ are replaced, as one undo step, and the cursors, the
+ * scroll position and other views of the buffer keep their place in the
+ * text around them. Returns 0, or -1 with errno set. */
+static int editor_reload_file(const struct stat *file_stat) {
+  size_t size;
+  char *contents = reload_read_file(editor.filename, &size);
+  if (!contents) {
+    int saved_errno = errno;
+    editor_set_status_message("%s changed on disk but can't be read: %s", editor.filename, strerror(errno));
+    errno = saved_errno;
+    return -1;
+  }
+  reload_line *new_lines;
+  int new_count = reload_split_lines(contents, size, &new_lines);
+  reload_line *old_lines = new_count >= 0 ? malloc((editor.row_count + 1) * sizeof(reload_line)) : NULL;
+  int *new_match = old_lines ? malloc((new_count + 1) * sizeof(int)) : NULL;
+  reload_hunk *hunks = new_match ? malloc((new_count + editor.row_count + 1) * sizeof(reload_hunk)) : NULL;
+  if (!hunks) {
+    editor_set_status_message("Out of memory reloading %s", editor.filename);
+    free(old_lines);
+    free(new_match);
+    free(new_lines);
+    free(contents);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (int i = 0; i < editor.row_count; i++) {
+    old_lines[i].text = editor.row[i].chars;
+    old_lines[i].length = editor.row[i].line_size;
+    old_lines[i].hash = reload_hash(editor.row[i].chars, editor.row[i].line_size);
+  }
+
+  /* Diff only what lies between the common head and tail */
+  int old_count = editor.row_count;
+  int head = 0;
+  while (head < old_count && head < new_count && reload_lines_equal(&old_lines[head], &new_lines[head])) head++;
+  int tail = 0;
+  while (tail < old_count - head && tail < new_count - head &&
+         reload_lines_equal(&old_lines[old_count - 1 - tail], &new_lines[new_count - 1 - tail])) {
+    tail++;
+  }
+  int old_middle = old_count - head - tail, new_middle = new_count - head - tail;
+  int hunk_count = 0;
+  if (old_middle > 0 || new_middle > 0) {
+    if (reload_diff(old_lines + head, old_middle, new_lines + head, new_middle, new_match) == -1) {
+      /* Too different to be worth matching up: replace the middle whole */
+      hunks[hunk_count++] = (reload_hunk){head, head + old_middle, head, head + new_middle};
+    } else {
+      int i = 0, j = 0;
+      while (i < old_middle || j < new_middle) {
+        if (j < new_middle && new_match[j] == i) {
+          i++;
+          j++;
+          continue;
+        }
+        int next_j = j;
+        while (next_j < new_middle && new_match[next_j] == -1) next_j++;
+        int next_i = next_j < new_middle ? new_match[next_j] : old_middle;
+        hunks[hunk_count++] = (reload_hunk){head + i, head + next_i, head + j, head + next_j};
+        i = next_i;
+        j = next_j;
+      }
+    }
+  }
 
-  struct append_buffer ab = ABUF_INIT;
+  /* Positions to carry over, moved by every hunk from the bottom up */
+  int cursor_y = editor.cursor_y, cursor_x = editor.cursor_x, row_offset = editor.row_offset;
+  int added = 0, removed = 0;
+  selection_clear();
+  if (hunk_count > 0) {
+    undo_start_new_group();
+    editor.undo_group_held = 1;
+  }
+  for (int h = hunk_count - 1; h >= 0; h--) {
+    reload_hunk *hunk = &hunks[h];
+    cursor_y = reload_adjust_line(cursor_y, hunk);
+    row_offset = reload_adjust_line(row_offset, hunk);
+    for (size_t c = 0; c < editor.cursor_count; c++) {
+      editor.cursors[c].line = reload_adjust_line(editor.cursors[c].line, hunk);
+    }
+    for (int v = 0; v < views.count; v++) {
+      if (v == views.active || views.views[v].buffer != editor.buffer_current) continue;
+      views.views[v].cursor_y = reload_adjust_line(views.views[v].cursor_y, hunk);
+      views.views[v].row_offset = reload_adjust_line(views.views[v].row_offset, hunk);
+    }
+    reload_apply_hunk(hunk, new_lines);
+    added += hunk->new_end - hunk->new_start;
+    removed += hunk->old_end - hunk->old_start;
+  }
+  editor.undo_group_held = 0;
+  /* The next edit starts its own group */
+  editor.last_edit_time = (struct timespec){0, 0};
+
+  editor.cursor_y = cursor_y <= editor.row_count ? cursor_y : editor.row_count;
+  int line_size = editor.cursor_y < editor.row_count ? editor.row[editor.cursor_y].line_size : 0;
+  editor.cursor_x = cursor_x <= line_size ? cursor_x : line_size;
+  editor.row_offset = row_offset <= editor.cursor_y ? row_offset : editor.cursor_y;
+  for (size_t c = 0; c < editor.cursor_count; c++) {
+    if (editor.cursors[c].line >= editor.row_count) editor.cursors[c].line = editor.row_count ? editor.row_count - 1 : 0;
+    int size = editor.cursors[c].line < editor.row_count ? editor.row[editor.cursors[c].line].line_size : 0;
+    if (editor.cursors[c].column > size) editor.cursors[c].column = size;
+  }
+  /* Match positions refer to the old text */
+  editor.search_result_count = 0;
+  editor_reset_bracket_match();
+  editor_update_gutter_width();
+  editor.dirty = 0;
+  editor_note_file_state(file_stat);
 
-  /* Set editor background and foreground colors */
-  set_background_rgb(&ab, theme_get_color(THEME_UI_BACKGROUND));
-  set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
+  if (hunk_count > 0) {
+    editor_set_status_message("Reloaded %s from disk: %d change%s, +%d -%d lines", editor.filename, hunk_count,
+                              hunk_count == 1 ? "" : "s", added, removed);
+  }
+  free(hunks);
+  free(new_match);
+  free(old_lines);
+  free(new_lines);
+  free(contents);
+  return 0;
+}
 
-  append_buffer_write(&ab, ESCAPE_HIDE_CURSOR, ESCAPE_HIDE_CURSOR_LEN);
-  append_buffer_write(&ab, ESCAPE_CURSOR_HOME, ESCAPE_CURSOR_HOME_LEN);
+/* Put the cursor of the active view on the last row. */
+static void follow_move_to_end() {
+  editor.cursor_y = editor.row_count > 0 ? editor.row_count - 1 : 0;
+  editor.cursor_x = 0;
+}
 
-  editor_draw_rows(&ab);
-  editor_draw_status_bar(&ab);
-  editor_draw_message_bar(&ab);
+/* Read in what was appended to the followed file since the rows were
+ * read: only the bytes from the last known size on, at most
+ * FOLLOW_READ_MAX of them per pass. Views whose cursor is on the last
+ * row stay there, scrolling with the output. */
+static void follow_read_appended(const struct stat *file_stat) {
+  int file_descriptor = open(editor.filename, O_RDONLY | O_CLOEXEC);
+  if (file_descriptor == -1) {
+    editor_set_status_message("Can't follow %s: %s", editor.filename, strerror(errno));
+    return;
+  }
+  off_t offset = editor.file_size;
+  size_t wanted = file_stat->st_size - offset;
+  if (wanted > FOLLOW_READ_MAX) wanted = FOLLOW_READ_MAX;
+  char *text = malloc(wanted);
+  /* The last row is a line still being written if no newline ended it */
+  char last = '\n';
+  int join = offset > 0 && pread(file_descriptor, &last, 1, offset - 1) == 1 && last != '\n';
+  size_t length = 0;
+  while (text && length < wanted) {
+    ssize_t got = pread(file_descriptor, text + length, wanted - length, offset + length);
+    if (got <= 0) break;
+    length += got;
+  }
+  close(file_descriptor);
+  if (!text) {
+    editor_set_status_message("Out of memory following %s", editor.filename);
+    return;
+  }
 
-  /* Position cursor */
-  int cursor_row = (editor.cursor_y - editor.row_offset) + 1;
-  char cursor_buffer[CURSOR_POSITION_BUFFER_SIZE];
-  snprintf(cursor_buffer, sizeof(cursor_buffer), ESCAPE_CURSOR_POSITION_FORMAT, cursor_row,
-                                            (editor.render_x - editor.column_offset) + editor.gutter_width + 1);
-  append_buffer_write(&ab, cursor_buffer, strlen(cursor_buffer));
+  int old_count = editor.row_count;
+  int at_end = editor.cursor_y >= old_count - 1;
+  int added = editor_append_rows(text, length, join);
+  free(text);
+  editor.file_size = offset + length;
+  editor.file_mtime = file_stat->st_mtim;
+  /* More is waiting: read the next batch on the next pass */
+  if (editor.file_size < file_stat->st_size) {
+    file_watch.pending = 1;
+    file_watch.closed = 1;
+  }
+  if (added == 0) return;
+  /* A log followed from empty gets its first timestamps now */
+  if (!editor.log_format) log_detect_format();
+
+  if (at_end) follow_move_to_end();
+  for (int v = 0; v < views.count; v++) {
+    editor_view *view = &views.views[v];
+    if (v == views.active || view->buffer != editor.buffer_current || view->cursor_y < old_count - 1) continue;
+    view->cursor_y = editor.row_count - 1;
+    view->cursor_x = 0;
+    if (view->row_offset < view->cursor_y - view->rows + 1) view->row_offset = view->cursor_y - view->rows + 1;
+  }
+}
 
-  /* Render secondary cursors via kitty protocol */
-  append_buffer_write(&ab, ESCAPE_KITTY_CURSOR_CLEAR, ESCAPE_KITTY_CURSOR_CLEAR_LEN);
-  for (size_t i = 0; i < editor.cursor_count; i++) {
-    int file_row = editor.cursors[i].line;
-    int file_col = editor.cursors[i].column;
+/* Read a followed file that was truncated or replaced from the start.
+ * The rows were a log that no longer exists, so they and their undo
+ * history are dropped rather than diffed away. */
+static void follow_reopen(const char *what) {
+  char *filename = strdup(editor.filename);
+  if (!filename) return;
+  editor_clear_buffer();
+  buffer_free_undo(editor.undo_stack, editor.undo_stack_count);
+  editor.undo_stack = NULL;
+  editor.undo_stack_count = editor.undo_stack_capacity = 0;
+  editor.cursor_count = 0;
+  editor.search_result_count = 0;
+  editor_reset_bracket_match();
 
-    /* Convert to screen coordinates */
-    int screen_row = file_row - editor.row_offset + 1;
+  if (editor_load_file(filename) == -1) {
+    editor_set_status_message("%s was %s and can't be read: %s", filename, what, strerror(errno));
+    editor.filename = filename;
+    editor_select_syntax_highlight();
+  } else {
+    editor_set_status_message("%s was %s; following it from the start", filename, what);
+    free(filename);
+  }
+  editor.follow = 1;
+  follow_move_to_end();
+  for (int v = 0; v < views.count; v++) {
+    if (v == views.active || views.views[v].buffer != editor.buffer_current) continue;
+    views.views[v].cursor_y = editor.cursor_y;
+    views.views[v].cursor_x = 0;
+    views.views[v].row_offset = editor.cursor_y;
+  }
+}
 
-    /* Calculate render_x for this cursor (handle tabs) */
-    int render_col = 0;
-    if (file_row >= 0 && file_row < editor.row_count) {
-      render_col = editor_row_cursor_to_render(&editor.row[file_row], file_col);
+/* Compare the active buffer's file with the state it was read or saved
+ * in, and act on a change. */
+static void file_watch_check() {
+  struct stat file_stat;
+  if (stat(editor.filename, &file_stat) == -1) {
+    if (errno == ENOENT && editor.file_inode) {
+      editor_set_status_message("%s was deleted on disk", editor.filename);
+      editor.file_size = 0;
+      editor.file_mtime = (struct timespec){0, 0};
+      editor.file_inode = 0;
     }
-    int screen_col = render_col - editor.column_offset + editor.gutter_width + 1;
-
-    /* Skip if off-screen */
-    if (screen_row < 1 || screen_row > editor.screen_rows) continue;
-    if (screen_col < 1 || screen_col > editor.screen_columns) continue;
-
-    char kitty_buf[32];
-    int len = snprintf(kitty_buf, sizeof(kitty_buf), ESCAPE_KITTY_CURSOR_FORMAT, screen_row, screen_col);
-    append_buffer_write(&ab, kitty_buf, len);
+    return;
   }
+  if (editor_file_state_matches(&file_stat)) return;
 
-  append_buffer_write(&ab, ESCAPE_SHOW_CURSOR, ESCAPE_SHOW_CURSOR_LEN);
-
-  write(STDOUT_FILENO, ab.buffer, ab.length);
-  append_buffer_destroy(&ab);
+  if (viewer.active) {
+    /* Shrunk: viewer_poll indexes it again. Otherwise the index and rows
+     * no longer match it; say so once */
+    viewer_check_size();
+    if (!viewer.shrunk)
+      editor_set_status_message("%s changed on disk; reopen it to see the changes", editor.filename);
+    editor_note_file_state(&file_stat);
+    return;
+  }
+  if (editor.follow && !editor.dirty) {
+    if (file_stat.st_ino != editor.file_inode) {
+      follow_reopen("replaced");
+      return;
+    }
+    if (file_stat.st_size < editor.file_size) {
+      follow_reopen("truncated");
+      return;
+    }
+    if (file_stat.st_size > editor.file_size) {
+      follow_read_appended(&file_stat);
+      return;
+    }
+    /* Rewritten in place at the same size: reload it as usual */
+  }
+  if (editor.dirty) {
+    editor_set_status_message("%s changed on disk; you have unsaved changes", editor.filename);
+    /* A followed file keeps its last-read state, so the text appended
+     * meanwhile is still read once the buffer is clean again. Otherwise
+     * warn once; saving will overwrite the other version */
+    if (!editor.follow) editor_note_file_state(&file_stat);
+    return;
+  }
+  editor_reload_file(&file_stat);
 }
 
-/* Set a message to display in the message bar.
- * Supports printf-style formatting. Auto-clears after timeout. */
-void editor_set_status_message(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(editor.status_message, sizeof(editor.status_message), fmt, ap);
-  va_end(ap);
-  editor.status_message_time = time(NULL);
+/* Watch the directory of filename (or nothing if NULL). */
+static void file_watch_set(const char *filename) {
+  if (file_watch.watch >= 0) inotify_rm_watch(file_watch.fd, file_watch.watch);
+  file_watch.watch = -1;
+  free(file_watch.path);
+  file_watch.path = NULL;
+  file_watch.pending = 0;
+  if (!filename) return;
+
+  file_watch.path = strdup(filename);
+  if (!file_watch.path) return;
+  char *slash = strrchr(file_watch.path, '/');
+  file_watch.name = slash ? slash + 1 : file_watch.path;
+  char directory[PATH_MAX];
+  if (!slash) {
+    snprintf(directory, sizeof(directory), ".");
+  } else {
+    snprintf(directory, sizeof(directory), "%.*s", slash == file_watch.path ? 1 : (int)(slash - file_watch.path),
+             file_watch.path);
+  }
+  file_watch.watch = inotify_add_watch(file_watch.fd, directory,
+                                       IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_TO |
+                                       IN_MOVED_FROM);
 }
 
-/*** input ***/
-
-/* Display a prompt and read user input.
- * Calls callback on each keystroke for incremental features like search.
- * Returns user input or NULL if cancelled with ESC. */
-char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
-  size_t buffer_size = PROMPT_INITIAL_BUFFER_SIZE;
-  char *buffer = malloc(buffer_size);
-
-  size_t buffer_length = 0;
-  buffer[0] = '\0';
-
-  while (1) {
-    editor_set_status_message(prompt, buffer);
-    editor_refresh_screen();
-
-    int key = editor_read_key();
-    if (key == DEL_KEY || key == CTRL_KEY('h') || key == BACKSPACE) {
-      if (buffer_length != 0) buffer[--buffer_length] = '\0';
-    } else if (key == CHAR_ESCAPE) {
-      editor_set_status_message("");
-      if (callback) callback(buffer, key);
-      free(buffer);
-      return NULL;
-    } else if (key == '\r') {
-      if (buffer_length != 0) {
-        editor_set_status_message("");
-        if (callback) callback(buffer, key);
-        return buffer;
-      }
-    } else if (key >= 0 && !iscntrl(key) && key < ASCII_MAX) {
-      if (buffer_length == buffer_size - 1) {
-        buffer_size *= 2;
-        buffer = realloc(buffer, buffer_size);
+/* Notice outside changes to the active buffer's file. Called from the
+ * main loop; never blocks. A change is acted on once the writer closes
+ * the file or FILE_WATCH_SETTLE_MS pass without another write, or at
+ * once in follow mode, where a writer may never pause. */
+void file_watch_poll() {
+  if (!file_watch.initialized) {
+    file_watch.initialized = 1;
+    file_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    file_watch.watch = -1;
+  }
+  if (file_watch.fd < 0) return;
+
+  /* Follow the active buffer; its file may have changed while parked */
+  if (editor.filename ? !file_watch.path || strcmp(editor.filename, file_watch.path) != 0 : file_watch.path != NULL) {
+    file_watch_set(editor.filename);
+    if (editor.filename) file_watch_check();
+  }
+
+  char buffer[INOTIFY_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while ((length = read(file_watch.fd, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      if (event->wd == file_watch.watch && event->len && strcmp(event->name, file_watch.name) == 0) {
+        file_watch.pending = 1;
+        clock_gettime(CLOCK_MONOTONIC, &file_watch.pending_time);
+        if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) file_watch.closed = 1;
       }
-      buffer[buffer_length++] = key;
-      buffer[buffer_length] = '\0';
+      /* The kernel dropped the watch (directory removed or unmounted) */
+      if (event->wd == file_watch.watch && (event->mask & IN_IGNORED)) file_watch.watch = -1;
+      p += sizeof(struct inotify_event) + event->len;
     }
-
-    if (callback) callback(buffer, key);
   }
+  if (!file_watch.pending || !editor.filename) return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed_ms = (now.tv_sec - file_watch.pending_time.tv_sec) * 1000 +
+                    (now.tv_nsec - file_watch.pending_time.tv_nsec) / 1000000;
+  if (!file_watch.closed && !editor.follow && elapsed_ms < FILE_WATCH_SETTLE_MS) return;
+  file_watch.pending = 0;
+  file_watch.closed = 0;
+  file_watch_check();
 }
 
-/* Jump to a specific line number (Ctrl+G). */
-void editor_jump_to_line(void) {
-  char *line_str = editor_prompt("Jump to line: %s (ESC to cancel)", NULL);
-  if (line_str == NULL) {
-    editor_set_status_message("Jump cancelled");
+/* Toggle follow mode (Alt+E): text appended to the file is read in as
+ * it is written, and the view keeps to the end while the cursor is on
+ * the last row. */
+void editor_toggle_follow() {
+  if (!editor.filename) {
+    editor_set_status_message("Nothing to follow; the buffer has no file");
     return;
   }
-
-  int line = atoi(line_str);
-  free(line_str);
-
-  /* Validate (1-indexed for user, 0-indexed internal) */
-  if (line < 1 || line > editor.row_count) {
-    editor_set_status_message("Invalid line number: %d (valid: 1-%d)", line, editor.row_count);
+  editor.follow = !editor.follow;
+  if (!editor.follow) {
+    editor_set_status_message("Stopped following %s", editor.filename);
     return;
   }
-
-  /* Clear selection */
   selection_clear();
-
-  /* Jump to line (convert to 0-indexed) */
-  editor.cursor_y = line - 1;
-  editor.cursor_x = 0;
-
-  /* Center view on target line */
-  int target_rowoff = editor.cursor_y - (editor.screen_rows / 2);
-  if (target_rowoff < 0) target_rowoff = 0;
-  int max_rowoff = editor.row_count - editor.screen_rows;
-  if (max_rowoff < 0) max_rowoff = 0;
-  if (target_rowoff > max_rowoff) target_rowoff = max_rowoff;
-  editor.row_offset = target_rowoff;
-
-  editor_set_status_message("Jumped to line %d", line);
+  follow_move_to_end();
+  editor_set_status_message("Following %s (Alt+E to stop)", editor.filename);
+  /* Catch up with anything written since the last check */
+  file_watch_check();
 }
 
-/* Skip past next closing bracket/brace/paren (Alt+]).
- * Searches forward from cursor for unmatched closing pair. */
-void editor_skip_closing_pair(void) {
-  if (editor.cursor_y >= editor.row_count) return;
+/*** find ***/
 
-  int nesting = 0;
+/* Callback for incremental search. Handles navigation keys and
+ * executes FTS5 search when query changes. Highlights current match. */
+void editor_find_callback(char *query, int key) {
+  static int current_result_index = -1;
+  static int direction = 1;
+  static char *last_query = NULL;
 
-  /* Search forward from cursor for closing bracket at nesting level 0 */
-  for (int y = editor.cursor_y; y < editor.row_count; y++) {
-    editor_row *row = &editor.row[y];
-    int start_col = (y == editor.cursor_y) ? editor.cursor_x : 0;
+  static int saved_hl_line;
+  static char *saved_hl = NULL;
 
-    for (int x = start_col; x < row->line_size; x++) {
-      char c = row->chars[x];
+  /* Ignore timeout - no input available (must be first to preserve highlight) */
+  if (key == -1) {
+    return;
+  }
 
-      /* Track nesting */
-      if (c == '(' || c == '[' || c == '{') {
-        nesting++;
-      } else if (c == ')' || c == ']' || c == '}') {
-        if (nesting == 0) {
-          /* Found matching closer - move cursor past it */
-          editor.cursor_y = y;
-          editor.cursor_x = x + 1;
-          return;
-        }
-        nesting--;
-      }
+  /* Restore previous highlight */
+  if (saved_hl) {
+    memcpy(editor.row[saved_hl_line].highlight, saved_hl, editor.row[saved_hl_line].render_size);
+    memory_free(MEMORY_SEARCH, saved_hl);
+    saved_hl = NULL;
+  }
+
+  /* Handle exit keys */
+  if (key == '\r' || key == CHAR_ESCAPE) {
+    current_result_index = -1;
+    direction = 1;
+    if (last_query) {
+      free(last_query);
+      last_query = NULL;
     }
+    return;
   }
-  /* Not found - cursor stays in place */
-}
 
-/* Jump back to position after nearest opening bracket/brace/paren (Alt+[).
- * Searches backward from cursor for unmatched opening pair. */
-void editor_skip_opening_pair(void) {
-  if (editor.row_count == 0) return;
+  /* Handle navigation keys */
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    /* New query - reset index and search */
+    current_result_index = -1;
+    direction = 1;
+  }
 
-  int nesting = 0;
+  /* Check if query changed */
+  if (!last_query || strcmp(last_query, query) != 0) {
+    /* New query - execute search */
+    if (last_query) free(last_query);
+    last_query = strdup(query);
+    simple_search(query);
+    current_result_index = -1;
+  }
 
-  /* Search backward from cursor for opening bracket at nesting level 0 */
-  for (int y = editor.cursor_y; y >= 0; y--) {
-    editor_row *row = &editor.row[y];
-    int start_col = (y == editor.cursor_y) ? editor.cursor_x - 1 : row->line_size - 1;
+  /* No results */
+  if (editor.search_result_count == 0) {
+    return;
+  }
 
-    for (int x = start_col; x >= 0; x--) {
-      char c = row->chars[x];
+  /* Navigate through results */
+  if (current_result_index == -1) {
+    /* First search or new query */
+    if (direction == 1) {
+      current_result_index = 0;
+    } else {
+      current_result_index = editor.search_result_count - 1;
+    }
+  } else {
+    /* Navigate to next/prev result */
+    current_result_index += direction;
 
-      /* Track nesting (reversed logic since we're going backward) */
-      if (c == ')' || c == ']' || c == '}') {
-        nesting++;
-      } else if (c == '(' || c == '[' || c == '{') {
-        if (nesting == 0) {
-          /* Found matching opener - move cursor right after it */
-          editor.cursor_y = y;
-          editor.cursor_x = x + 1;
-          return;
-        }
-        nesting--;
-      }
+    /* Wraparound */
+    if (current_result_index < 0) {
+      current_result_index = editor.search_result_count - 1;
+    } else if (current_result_index >= editor.search_result_count) {
+      current_result_index = 0;
     }
   }
-  /* Not found - cursor stays in place */
-}
-
-/*** file browser ***/
 
-/* Structure for file list items in the browser */
-typedef struct {
-  char *name;           /* Display name (with / for directories) */
-  char *actual_name;    /* Actual filename without decorations */
-  int is_directory;
-} file_list_item;
+  /* Apply result */
+  search_result *result = &editor.search_results[current_result_index];
+  editor_row *row = &editor.row[result->line_number];
 
-/* Compare function for sorting file list (directories first, then alphabetical) */
-int file_list_compare(const void *a, const void *b) {
-  const file_list_item *item_a = (const file_list_item *)a;
-  const file_list_item *item_b = (const file_list_item *)b;
+  editor.cursor_y = result->line_number;
+  editor.cursor_x = editor_row_render_to_cursor(row, result->match_offset);
+  /* Force scroll adjustment on next refresh */
+  editor.row_offset = editor.row_count;
 
-  /* Directories sort before files */
-  if (item_a->is_directory && !item_b->is_directory) return -1;
-  if (!item_a->is_directory && item_b->is_directory) return 1;
+  /* Ensure match is visible horizontally */
+  editor.render_x = result->match_offset;
+  if (editor.render_x < editor.column_offset) {
+    editor.column_offset = editor.render_x;
+  }
+  if (editor.render_x >= editor.column_offset + editor.screen_columns - editor.gutter_width) {
+    editor.column_offset = editor.render_x - editor.screen_columns + editor.gutter_width + 1;
+  }
 
-  /* Within same type, sort alphabetically (case-insensitive) */
-  return strcasecmp(item_a->name, item_b->name);
+  /* Highlight the match */
+  saved_hl_line = result->line_number;
+  saved_hl = memory_malloc(MEMORY_SEARCH, row->render_size);
+  memcpy(saved_hl, row->highlight, row->render_size);
+  memset(&row->highlight[result->match_offset], HL_MATCH, result->match_length);
 }
 
-/* Free file list items */
-void file_list_free(file_list_item *items, int count) {
-  for (int i = 0; i < count; i++) {
-    free(items[i].name);
-    free(items[i].actual_name);
+/* Start interactive search mode. Prompts user for search term
+ * and uses FTS5 for incremental search. ESC restores cursor. */
+void editor_find() {
+  if (viewer.active) {
+    viewer_find();
+    return;
   }
-  free(items);
-}
-
-/* Get directory listing */
-file_list_item *file_list_get(const char *path, int *count) {
-  DIR *dp = opendir(path);
-  if (!dp) return NULL;
+  int saved_cx = editor.cursor_x;
+  int saved_cy = editor.cursor_y;
+  int saved_coloff = editor.column_offset;
+  int saved_rowoff = editor.row_offset;
 
-  int capacity = 64;
-  file_list_item *items = malloc(capacity * sizeof(file_list_item));
-  *count = 0;
+  char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)",
+                             editor_find_callback);
 
-  /* Add parent directory entry if not at root */
-  if (strcmp(path, "/") != 0) {
-    items[(*count)].name = strdup("../");
-    items[(*count)].actual_name = strdup("..");
-    items[(*count)].is_directory = 1;
-    (*count)++;
+  if (query) {
+    free(query);
+  } else {
+    editor.cursor_x = saved_cx;
+    editor.cursor_y = saved_cy;
+    editor.column_offset = saved_coloff;
+    editor.row_offset = saved_rowoff;
   }
+}
 
-  struct dirent *entry;
-  while ((entry = readdir(dp))) {
-    /* Skip . and .. */
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-      continue;
+/*** append buffer ***/
 
-    /* Skip hidden files */
-    if (entry->d_name[0] == '.')
-      continue;
+/*
+ * Dynamic string buffer for building screen output.
+ * Grows automatically as data is appended, then written
+ * to terminal in a single write() call to prevent flicker.
+ */
+struct append_buffer {
+  /* Heap-allocated character array */
+  char *buffer;
+  /* Current length of data in buffer */
+  int length;
+};
 
-    /* Resize if needed */
-    if (*count >= capacity) {
-      capacity *= 2;
-      items = realloc(items, capacity * sizeof(file_list_item));
-    }
+/* Initializer for empty append_buffer */
+#define ABUF_INIT {NULL, 0}
 
-    /* Check if directory */
-    char full_path[PATH_MAX];
-    snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-    struct stat st;
-    int is_dir = (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode));
+void set_foreground_rgb(struct append_buffer *ab, rgb_color color);
+void set_background_rgb(struct append_buffer *ab, rgb_color color);
+void reset_colors(struct append_buffer *ab);
+void view_draw_screen(struct append_buffer *ab);
 
-    items[*count].actual_name = strdup(entry->d_name);
-    if (is_dir) {
-      char display[PATH_MAX];
-      snprintf(display, sizeof(display) - 1, "%s/", entry->d_name);
-      items[*count].name = strdup(display);
-    } else {
-      items[*count].name = strdup(entry->d_name);
-    }
-    items[*count].is_directory = is_dir;
-    (*count)++;
-  }
-  closedir(dp);
+/* Append 'string' of 'length' to the buffer.
+ * Automatically grows the buffer as needed. */
+void append_buffer_write(struct append_buffer *ab, const char *string, int length) {
+  char *new_buffer = realloc(ab->buffer, ab->length + length);
 
-  /* Sort: directories first (except ../), then alphabetical */
-  if (*count > 1) {
-    /* Sort everything except the first entry if it's ../ */
-    int start = (items[0].actual_name && strcmp(items[0].actual_name, "..") == 0) ? 1 : 0;
-    if (*count - start > 1) {
-      qsort(&items[start], *count - start, sizeof(file_list_item), file_list_compare);
-    }
-  }
+  if (new_buffer == NULL) return;
+  memcpy(&new_buffer[ab->length], string, length);
+  ab->buffer = new_buffer;
+  ab->length += length;
+}
 
-  return items;
+/* Free the buffer's allocated memory. */
+void append_buffer_destroy(struct append_buffer *ab) {
+  free(ab->buffer);
 }
 
-/* Draw file browser as a centered half-screen panel */
-void file_browser_draw(file_list_item *items, int count, int selected, const char *path, int scroll_offset) {
-  struct append_buffer ab = ABUF_INIT;
+/*** output ***/
 
-  /* Calculate panel dimensions - half screen height, 70% width */
-  int panel_height = editor.screen_rows / 2;
-  if (panel_height < 10) panel_height = 10;
-  if (panel_height > editor.screen_rows - 2) panel_height = editor.screen_rows - 2;
+/* Adjust viewport offsets to keep cursor visible on screen.
+ * Handles both normal scrolling and soft-wrap visual rows.
+ * When center_scroll is enabled, implements typewriter scrolling
+ * to keep cursor near the vertical center of the screen. */
+void editor_scroll() {
+  editor.render_x = 0;
+  if (editor.cursor_y < editor.row_count) {
+    editor.render_x = editor_row_cursor_to_render(&editor.row[editor.cursor_y], editor.cursor_x);
+  }
 
-  int panel_width = (editor.screen_columns * 70) / 100;
-  if (panel_width < 40) panel_width = 40;
-  if (panel_width > editor.screen_columns - 4) panel_width = editor.screen_columns - 4;
+  if (editor.soft_wrap) {
+    /* With soft wrap, we need to account for wrapped lines
+     * Calculate visual row position of cursor */
+    int cursor_visual_row = editor_visual_rows_up_to(editor.cursor_y - 1) + editor_cursor_wrap_row();
 
-  /* Center the panel */
-  int panel_top = (editor.screen_rows - panel_height) / 2;
-  int panel_left = (editor.screen_columns - panel_width) / 2;
+    /* Disable center scroll during selection or multi-cursor operations */
+    int use_center_scroll = editor.center_scroll &&
+                            !editor.selection.active &&
+                            editor.cursor_count == 0;
 
-  append_buffer_write(&ab, ESCAPE_HIDE_CURSOR, ESCAPE_HIDE_CURSOR_LEN);
+    if (use_center_scroll) {
+      /* Typewriter scrolling: keep cursor near screen center */
+      int target_rowoff = cursor_visual_row - SCREEN_CENTER;
 
-  /* Draw each row of the panel */
-  for (int row = 0; row < panel_height; row++) {
-    /* Position cursor at start of this panel row */
-    char pos_buf[32];
-    snprintf(pos_buf, sizeof(pos_buf), "\x1b[%d;%dH", panel_top + row + 1, panel_left + 1);
-    append_buffer_write(&ab, pos_buf, strlen(pos_buf));
+      /* Clamp to valid range */
+      if (target_rowoff < 0) target_rowoff = 0;
 
-    if (row == 0) {
-      /* Header row */
-      set_background_rgb(&ab, theme_get_color(THEME_UI_STATUS_BG));
-      set_foreground_rgb(&ab, theme_get_color(THEME_UI_STATUS_FG));
-
-      char header[256];
-      int header_len = snprintf(header, sizeof(header), " Open: %s", path);
-      if (header_len > panel_width) header_len = panel_width;
-      append_buffer_write(&ab, header, header_len);
+      /* Calculate max scroll offset (allow one line past end) */
+      int total_visual_rows = editor_visual_rows_up_to(editor.row_count - 1);
+      int max_rowoff = total_visual_rows - editor.screen_rows + 1;
+      if (max_rowoff < 0) max_rowoff = 0;
+      if (target_rowoff > max_rowoff) target_rowoff = max_rowoff;
 
-      /* Pad rest of header */
-      for (int p = header_len; p < panel_width; p++) {
-        append_buffer_write(&ab, " ", 1);
+      editor.row_offset = target_rowoff;
+    } else {
+      /* Edge-triggered scrolling: only scroll when cursor leaves visible area */
+      if (cursor_visual_row < editor.row_offset) {
+        editor.row_offset = cursor_visual_row;
       }
-    } else if (row == panel_height - 1) {
-      /* Help bar at bottom */
-      set_background_rgb(&ab, theme_get_color(THEME_UI_MESSAGE_BG));
-      set_foreground_rgb(&ab, theme_get_color(THEME_UI_MESSAGE_FG));
-
-      char help[] = " Up/Down/Scroll:Nav Enter/DblClick:Open ESC:Cancel";
-      int help_len = strlen(help);
-      if (help_len > panel_width) help_len = panel_width;
-      append_buffer_write(&ab, help, help_len);
-
-      /* Pad rest of help bar */
-      for (int p = help_len; p < panel_width; p++) {
-        append_buffer_write(&ab, " ", 1);
+      if (cursor_visual_row >= editor.row_offset + editor.screen_rows) {
+        editor.row_offset = cursor_visual_row - editor.screen_rows + 1;
       }
-    } else {
-      /* File list row */
-      int item_idx = scroll_offset + (row - 1);
+    }
 
-      if (item_idx < count) {
-        file_list_item *item = &items[item_idx];
+    /* No horizontal scrolling with soft wrap */
+    editor.column_offset = 0;
+  } else {
+    /* Normal scrolling without soft wrap */
+    /* Disable center scroll during selection or multi-cursor operations */
+    int use_center_scroll = editor.center_scroll &&
+                            !editor.selection.active &&
+                            editor.cursor_count == 0;
 
-        /* Highlight selected item */
-        if (item_idx == selected) {
-          set_background_rgb(&ab, theme_get_color(THEME_UI_SELECTION_BG));
-          set_foreground_rgb(&ab, theme_get_color(THEME_UI_SELECTION_FG));
-        } else {
-          set_background_rgb(&ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
-          /* Directories get different color */
-          if (item->is_directory) {
-            set_foreground_rgb(&ab, theme_get_color(THEME_SYNTAX_KEYWORD2));
-          } else {
-            set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
-          }
-        }
+    if (use_center_scroll) {
+      /* Typewriter scrolling: keep cursor near screen center */
+      int target_rowoff = editor.cursor_y - SCREEN_CENTER;
 
-        /* Print item name with padding */
-        append_buffer_write(&ab, " ", 1);
-        int name_len = strlen(item->name);
-        int max_name = panel_width - 2;
-        if (name_len > max_name) name_len = max_name;
-        append_buffer_write(&ab, item->name, name_len);
+      /* Clamp to valid range */
+      if (target_rowoff < 0) target_rowoff = 0;
 
-        /* Pad rest of line */
-        for (int p = name_len + 1; p < panel_width; p++) {
-          append_buffer_write(&ab, " ", 1);
-        }
-      } else {
-        /* Empty row in panel */
-        set_background_rgb(&ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
-        set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
-        for (int p = 0; p < panel_width; p++) {
-          append_buffer_write(&ab, " ", 1);
-        }
+      /* Calculate max scroll offset (allow one line past end) */
+      int max_rowoff = editor.row_count - editor.screen_rows + 1;
+      if (max_rowoff < 0) max_rowoff = 0;
+      if (target_rowoff > max_rowoff) target_rowoff = max_rowoff;
+
+      editor.row_offset = target_rowoff;
+    } else {
+      /* Edge-triggered scrolling: only scroll when cursor leaves visible area */
+      if (editor.cursor_y < editor.row_offset) {
+        editor.row_offset = editor.cursor_y;
+      }
+      if (editor.cursor_y >= editor.row_offset + editor.screen_rows) {
+        editor.row_offset = editor.cursor_y - editor.screen_rows + 1;
       }
     }
-  }
 
-  /* Reset colors, keep cursor hidden during dialog */
-  set_background_rgb(&ab, theme_get_color(THEME_UI_BACKGROUND));
-  set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
+    /* Horizontal scrolling (same for both modes) */
+    if (editor.render_x < editor.column_offset) {
+      editor.column_offset = editor.render_x;
+    }
+    if (editor.render_x >= editor.column_offset + editor.screen_columns) {
+      editor.column_offset = editor.render_x - editor.screen_columns + 1;
+    }
+  }
 
-  write(STDOUT_FILENO, ab.buffer, ab.length);
-  append_buffer_destroy(&ab);
+  /* Ensure scroll offsets are never negative (safety check) */
+  if (editor.row_offset < 0) editor.row_offset = 0;
+  if (editor.column_offset < 0) editor.column_offset = 0;
 }
 
-/* Interactive file browser - returns selected filepath or NULL */
-char *editor_file_browser(void) {
-  char current_path[PATH_MAX];
-  if (getcwd(current_path, sizeof(current_path)) == NULL) {
-    strcpy(current_path, "/");
+/* Drop the screen line appended since start if it is exactly what was
+ * sent last time (by hash), otherwise remember it. */
+static void view_drop_unchanged_line(struct append_buffer *ab, int start, unsigned long long *last_hash) {
+  /* FNV-1a */
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  for (int i = start; i < ab->length; i++) {
+    hash ^= (unsigned char)ab->buffer[i];
+    hash *= FNV_PRIME;
+  }
+  if (hash == *last_hash) {
+    ab->length = start;
+  } else {
+    *last_hash = hash;
   }
+}
 
-  int selected = 0;
-  int scroll_offset = 0;
-
-  /* Mouse double-click tracking */
-  struct timespec fb_last_click_time = {0, 0};
-  int fb_last_click_item = -1;
-
-  while (1) {
-    int count;
-    file_list_item *items = file_list_get(current_path, &count);
-    if (!items || count == 0) {
-      editor_set_status_message("Cannot read directory: %s", current_path);
-      if (items) file_list_free(items, count);
-      return NULL;
+/* End a screen line drawn columns wide: clear the rest of the line, or
+ * with split views the rest of the view's width, leaving the views to
+ * its right alone. */
+static void editor_finish_line(struct append_buffer *ab, int columns) {
+  if (views.drawing && views.drawing->left + views.drawing->columns < views.screen_columns) {
+    if (columns < views.drawing->columns) {
+      char erase[CURSOR_POSITION_BUFFER_SIZE];
+      int length = snprintf(erase, sizeof(erase), ESCAPE_ERASE_CHARACTERS_FORMAT,
+                            views.drawing->columns - columns);
+      append_buffer_write(ab, erase, length);
     }
+  } else {
+    append_buffer_write(ab, ESCAPE_CLEAR_LINE, ESCAPE_CLEAR_LINE_LEN);
+  }
+}
 
-    /* Clamp selection */
-    if (selected >= count) selected = count - 1;
-    if (selected < 0) selected = 0;
-
-    /* Calculate visible rows (must match file_browser_draw panel calculation) */
-    int panel_height = editor.screen_rows / 2;
-    if (panel_height < 10) panel_height = 10;
-    if (panel_height > editor.screen_rows - 2) panel_height = editor.screen_rows - 2;
-    int visible_rows = panel_height - 2;  /* minus header and help bar */
-
-    /* Adjust scroll to keep selection visible */
-    if (selected < scroll_offset) {
-      scroll_offset = selected;
-    } else if (selected >= scroll_offset + visible_rows) {
-      scroll_offset = selected - visible_rows + 1;
+/* Render all visible rows to the append buffer.
+ * Draws line numbers, text content with syntax highlighting, and welcome message.
+ * With split views each line is positioned inside the view being drawn. */
+void editor_draw_rows(struct append_buffer *ab) {
+  TRACE_SCOPE(__func__);
+  int screen_row;
+  for (screen_row = 0; screen_row < editor.screen_rows; screen_row++) {
+    int fileditor_row, wrap_row;
+    int valid = editor_visual_to_logical(screen_row + editor.row_offset, &fileditor_row, &wrap_row);
+    int line_start = ab->length;
+    /* Columns drawn so far on this line */
+    int line_columns = 0;
+
+    if (views.drawing) {
+      char position[CURSOR_POSITION_BUFFER_SIZE];
+      int length = snprintf(position, sizeof(position), ESCAPE_CURSOR_POSITION_FORMAT,
+                            views.drawing->top + screen_row + 1, views.drawing->left + 1);
+      append_buffer_write(ab, position, length);
+      /* Lines may be skipped, so don't inherit colours from the one above */
+      set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
     }
 
-    /* Draw file browser */
-    file_browser_draw(items, count, selected, current_path, scroll_offset);
+    /* Draw line number gutter if enabled */
+    if (editor.show_line_numbers) {
+      set_background_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
 
-    int key = editor_read_key();
-    int do_open = 0;  /* Flag to trigger open action (Enter or double-click) */
+      if (!valid || fileditor_row >= editor.row_count) {
+        /* Empty line - just draw spaces */
+        set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
+        for (int i = 0; i < editor.gutter_width; i++) {
+          append_buffer_write(ab, " ", 1);
+        }
+      } else if (editor.soft_wrap && wrap_row > 0) {
+        /* Continuation of wrapped line - no line number */
+        for (int i = 0; i < editor.gutter_width; i++) {
+          append_buffer_write(ab, " ", 1);
+        }
+      } else {
+        /* Draw line number (only on first wrap row) */
+        char line_number[LINE_NUMBER_BUFFER_SIZE];
+        int line_number_length = snprintf(line_number, sizeof(line_number), "%lld",
+                                          fileditor_row + 1 + editor.line_number_base);
+        /* -1 for trailing space */
+        int padding = editor.gutter_width - line_number_length - 1;
 
-    if (key == CHAR_ESCAPE) {
-      file_list_free(items, count);
-      return NULL;
-    } else if (key == ARROW_UP && selected > 0) {
-      selected--;
-    } else if (key == ARROW_DOWN && selected < count - 1) {
-      selected++;
-    } else if (key == PAGE_UP) {
-      selected -= visible_rows;
-      if (selected < 0) selected = 0;
-    } else if (key == PAGE_DOWN) {
-      selected += visible_rows;
-      if (selected >= count) selected = count - 1;
-    } else if (key == HOME_KEY) {
-      selected = 0;
-    } else if (key == END_KEY) {
-      selected = count - 1;
-    } else if (key == '\r') {
-      do_open = 1;
-    } else if (key == MOUSE_EVENT) {
-      /* Calculate panel geometry (must match file_browser_draw) */
-      int panel_width = (editor.screen_columns * 70) / 100;
-      if (panel_width < 40) panel_width = 40;
-      if (panel_width > editor.screen_columns - 4) panel_width = editor.screen_columns - 4;
-      int panel_left = (editor.screen_columns - panel_width) / 2;
-      int panel_top = (editor.screen_rows - panel_height) / 2;
+        /* Color-code line number based on state */
+        if (fileditor_row == editor.cursor_y) {
+          /* Current line - highest priority */
+          set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_CURRENT));
+        } else if (editor.row[fileditor_row].dirty) {
+          /* Dirty (unsynced) line - amber/orange */
+          set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_DIRTY));
+        } else {
+          /* Normal synced line */
+          set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
+        }
 
-      /* Convert 1-indexed terminal coords to 0-indexed */
-      int mx = last_mouse_event.column - 1;
-      int my = last_mouse_event.row - 1;
+        /* Padding before line number */
+        for (int i = 0; i < padding; i++) {
+          append_buffer_write(ab, " ", 1);
+        }
 
-      /* Handle scroll wheel */
-      if (last_mouse_event.button_base == MOUSE_SCROLL_UP) {
-        if (selected > 0) selected--;
-      } else if (last_mouse_event.button_base == MOUSE_SCROLL_DOWN) {
-        if (selected < count - 1) selected++;
+        append_buffer_write(ab, line_number, line_number_length);
+        append_buffer_write(ab, " ", 1);
       }
-      /* Handle left click */
-      else if (last_mouse_event.button_base == MOUSE_BUTTON_LEFT &&
-               !last_mouse_event.is_release && !last_mouse_event.is_motion) {
-        /* Check if click is within panel bounds */
-        if (mx >= panel_left && mx < panel_left + panel_width &&
-            my >= panel_top && my < panel_top + panel_height) {
 
-          int panel_row = my - panel_top;
+      /* Reset to editor background - current line highlight set below after gutter */
+      set_background_rgb(ab, theme_get_color(THEME_UI_BACKGROUND));
+      set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
+      line_columns = editor.gutter_width;
+    }
 
-          /* Skip header (row 0) and help bar (last row) */
-          if (panel_row > 0 && panel_row < panel_height - 1) {
-            int clicked_item = scroll_offset + (panel_row - 1);
+    /* Determine if this is the current line for background highlighting */
+    int is_current_line = (fileditor_row == editor.cursor_y);
+    /* Also highlight lines with secondary cursors */
+    if (!is_current_line) {
+      for (size_t i = 0; i < editor.cursor_count; i++) {
+        if (editor.cursors[i].line == fileditor_row) {
+          is_current_line = 1;
+          break;
+        }
+      }
+    }
+    rgb_color line_bg = is_current_line ? theme_get_color(THEME_UI_CURRENT_LINE)
+                                        : theme_get_color(THEME_UI_BACKGROUND);
 
-            if (clicked_item < count) {
-              /* Detect double-click */
-              struct timespec now;
-              clock_gettime(CLOCK_MONOTONIC, &now);
-              long ms_diff = (now.tv_sec - fb_last_click_time.tv_sec) * 1000 +
-                             (now.tv_nsec - fb_last_click_time.tv_nsec) / 1000000;
-
-              if (ms_diff < 400 && clicked_item == fb_last_click_item) {
-                /* Double-click: open item */
-                selected = clicked_item;
-                do_open = 1;
-              } else {
-                /* Single click: select item */
-                selected = clicked_item;
-              }
+    /* Set background for this line (current line highlight or normal) */
+    set_background_rgb(ab, line_bg);
 
-              fb_last_click_time = now;
-              fb_last_click_item = clicked_item;
-            }
-          }
+    /* Draw file content */
+    if (fileditor_row >= editor.row_count) {
+      if (editor.row_count == 0 && screen_row == editor.screen_rows / WELCOME_MESSAGE_ROW_DIVISOR) {
+        char welcome[WELCOME_BUFFER_SIZE];
+        int welcomelen = snprintf(welcome, sizeof(welcome),
+          "Terra editor -- version %s", MITER_VERSION);
+        int available_width = editor.screen_columns - editor.gutter_width;
+        if (welcomelen > available_width) welcomelen = available_width;
+        int padding = (available_width - welcomelen) / 2;
+        if (padding) {
+          set_foreground_rgb(ab, theme_get_color(THEME_UI_TILDE));
+          append_buffer_write(ab, "~", 1);
+          padding--;
         }
+        line_columns += (available_width - welcomelen) / 2 + welcomelen;
+        while (padding--) append_buffer_write(ab, " ", 1);
+        set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
+        append_buffer_write(ab, welcome, welcomelen);
+      } else {
+        set_foreground_rgb(ab, theme_get_color(THEME_UI_TILDE));
+        append_buffer_write(ab, "~", 1);
+        line_columns++;
       }
-    }
+    } else {
+      int available_width = editor.screen_columns - editor.gutter_width;
 
-    /* Handle open action (Enter key or double-click) */
-    if (do_open) {
-      file_list_item *item = &items[selected];
-      if (item->is_directory) {
-        /* Navigate into directory */
-        if (strcmp(item->actual_name, "..") == 0) {
-          /* Go to parent */
-          char *last_slash = strrchr(current_path, '/');
-          if (last_slash && last_slash != current_path) {
-            *last_slash = '\0';
-          } else {
-            strcpy(current_path, "/");
+      /* Calculate which portion of the line to show for this wrap segment */
+      int line_offset, line_end;
+      if (editor.soft_wrap) {
+        editor_row *row = &editor.row[fileditor_row];
+        editor_calculate_wrap_breaks(row, available_width);
+        line_offset = editor_wrap_segment_start(row, wrap_row);
+        line_end = editor_wrap_segment_end(row, wrap_row);
+      } else {
+        line_offset = editor.column_offset;
+        line_end = editor.row[fileditor_row].render_size;
+      }
+
+      int line_length = line_end - line_offset;
+      if (line_length < 0) line_length = 0;
+      if (!editor.soft_wrap && line_length > available_width) line_length = available_width;
+      line_columns += line_length;
+
+      char *chars = &editor.row[fileditor_row].render[line_offset];
+      unsigned char *highlight = &editor.row[fileditor_row].highlight[line_offset];
+      rgb_color current_color = {0, 0, 0};
+      int has_color = 0;
+      int in_selection = 0;
+      int char_index;
+      for (char_index = 0; char_index < line_length; char_index++) {
+        /* Check if this character is selected */
+        int render_col = line_offset + char_index;
+        int cursor_col = editor_row_render_to_cursor(&editor.row[fileditor_row], render_col);
+          int is_selected = selection_contains(fileditor_row, cursor_col);
+
+          /* Handle selection state changes */
+          if (is_selected && !in_selection) {
+            set_background_rgb(ab, theme_get_color(THEME_UI_SELECTION_BG));
+          set_foreground_rgb(ab, theme_get_color(THEME_UI_SELECTION_FG));
+          in_selection = 1;
+          has_color = 0;
+        } else if (!is_selected && in_selection) {
+          /* Restore normal editor colors (current line highlight or normal bg) */
+          set_background_rgb(ab, line_bg);
+          set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
+          in_selection = 0;
+          has_color = 0;
+        }
+
+        if (iscntrl(chars[char_index])) {
+          char sym = (chars[char_index] <= 26) ? '@' + chars[char_index] : '?';
+          if (!in_selection) {
+            append_buffer_write(ab, ESCAPE_REVERSE_VIDEO, ESCAPE_REVERSE_VIDEO_LEN);
+          }
+          append_buffer_write(ab, &sym, 1);
+          if (!in_selection) {
+            append_buffer_write(ab, ESCAPE_NORMAL_VIDEO, ESCAPE_NORMAL_VIDEO_LEN);
+            set_background_rgb(ab, line_bg);
+            if (has_color) {
+              set_foreground_rgb(ab, current_color);
+            } else {
+              set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
+            }
+            if (has_color) {
+              set_foreground_rgb(ab, current_color);
+            }
           }
+        } else if (in_selection) {
+          /* Selected text uses selection colors */
+          append_buffer_write(ab, &chars[char_index], 1);
         } else {
-          size_t cur_len = strlen(current_path);
-          size_t name_len = strlen(item->actual_name);
-          if (cur_len + 1 + name_len < PATH_MAX) {
-            strcat(current_path, "/");
-            strcat(current_path, item->actual_name);
+          /* Check if this is the matching bracket position */
+          int is_bracket_match = (editor.bracket_match_row == fileditor_row &&
+                                  editor.bracket_match_col == cursor_col);
+          int is_bracket_endpoint = 0;
+          if (editor.bracket_open_row != -1 && editor.bracket_close_row != -1) {
+            if (fileditor_row == editor.bracket_open_row &&
+                cursor_col >= editor.bracket_open_col &&
+                cursor_col < editor.bracket_open_col + editor.bracket_open_len) {
+              is_bracket_endpoint = 1;
+            }
+            if (fileditor_row == editor.bracket_close_row &&
+                cursor_col >= editor.bracket_close_col &&
+                cursor_col < editor.bracket_close_col + editor.bracket_close_len) {
+              is_bracket_endpoint = 1;
+            }
+          }
+
+          /* Secondary cursors now rendered via kitty protocol in editor_refresh_screen() */
+
+          if (is_bracket_match || is_bracket_endpoint) {
+            /* Underline bracket/comment delimiters for both partners */
+            set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_MATCH));
+            append_buffer_write(ab, ESCAPE_UNDERLINE_START, ESCAPE_UNDERLINE_START_LEN);
+            append_buffer_write(ab, &chars[char_index], 1);
+            append_buffer_write(ab, ESCAPE_UNDERLINE_END, ESCAPE_UNDERLINE_END_LEN);
+            set_background_rgb(ab, line_bg);
+            set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
+            has_color = 0;
+          } else if (highlight[char_index] == HL_NORMAL) {
+            if (has_color) {
+              set_foreground_rgb(ab, theme_get_color(THEME_SYNTAX_NORMAL));
+              has_color = 0;
+            }
+            append_buffer_write(ab, &chars[char_index], 1);
+          } else {
+            rgb_color color = editor_syntax_to_color(highlight[char_index]);
+            if (!has_color || !rgb_equal(color, current_color)) {
+              current_color = color;
+              has_color = 1;
+              set_foreground_rgb(ab, color);
+            }
+            append_buffer_write(ab, &chars[char_index], 1);
           }
         }
-        selected = 0;
-        scroll_offset = 0;
-        fb_last_click_item = -1;  /* Reset double-click state on directory change */
+      }
+      /* Reset if we were in selection at end of line */
+      if (in_selection) {
+        set_background_rgb(ab, line_bg);
+        set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
       } else {
-        /* Selected a file - return full path */
-        size_t cur_len = strlen(current_path);
-        size_t name_len = strlen(item->actual_name);
-        size_t total_len = cur_len + 1 + name_len + 1;
-        char *result = malloc(total_len);
-        snprintf(result, total_len, "%s/%s", current_path, item->actual_name);
-        file_list_free(items, count);
-        return result;
+        set_foreground_rgb(ab, theme_get_color(THEME_UI_FOREGROUND));
       }
     }
-    file_list_free(items, count);
+
+    /* Clear to end of line with current background (line_bg already set above) */
+    editor_finish_line(ab, line_columns);
+    /* Reset to normal background for the next line */
+    set_background_rgb(ab, theme_get_color(THEME_UI_BACKGROUND));
+    if (!views.drawing) append_buffer_write(ab, CRLF, CRLF_LEN);
+    if (views.drawing_hashes) view_drop_unchanged_line(ab, line_start, &views.drawing_hashes[screen_row]);
   }
 }
 
-/* Clear current editor buffer */
-void editor_clear_buffer(void) {
-  /* Free all rows */
+/* Count dirty rows for sync status */
+int editor_count_dirty_lines() {
+  int count = 0;
   for (int i = 0; i < editor.row_count; i++) {
-    editor_free_row(&editor.row[i]);
+    if (editor.row[i].dirty) count++;
   }
-  free(editor.row);
-  editor.row = NULL;
-  editor.row_count = 0;
+  return count;
+}
 
-  /* Reset cursor */
-  editor.cursor_x = 0;
-  editor.cursor_y = 0;
-  editor.render_x = 0;
-  editor.row_offset = 0;
-  editor.column_offset = 0;
+/* Draw the status bar showing filename, line count, and cursor position.
+ * Uses reverse video for visibility. */
+void editor_draw_status_bar(struct append_buffer *ab) {
+  /* A split view's status line fills its own width only */
+  if (!views.drawing) append_buffer_write(ab, ESCAPE_CLEAR_LINE, ESCAPE_CLEAR_LINE_LEN);
+  set_background_rgb(ab, theme_get_color(THEME_UI_STATUS_BG));
+  set_foreground_rgb(ab, theme_get_color(THEME_UI_STATUS_FG));
 
-  /* Clear filename */
-  free(editor.filename);
-  editor.filename = NULL;
+  char status[STATUS_BAR_BUFFER_SIZE], rstatus[STATUS_BAR_BUFFER_SIZE];
+  char buffer_position[STATUS_PART_BUFFER_SIZE] = "";
+  if (editor.buffer_count > 1) {
+    snprintf(buffer_position, sizeof(buffer_position), "[%d/%d] ", editor.buffer_current + 1, editor.buffer_count);
+  }
+  /* The viewer's rows are a window; count the file's lines */
+  long long line_count = editor.row_count;
+  char indexing[STATUS_PART_BUFFER_SIZE] = "";
+  if (viewer.active) {
+    int percent;
+    if (!viewer_progress(&line_count, &percent)) snprintf(indexing, sizeof(indexing), "(indexing %d%%) ", percent);
+  }
+  /* Times on screen, in a log */
+  char span[2 * LOG_TIME_SEARCH + 8];
+  log_screen_span(span, sizeof(span));
+  int status_length = snprintf(status, sizeof(status), "%s%.20s - %lld lines %s%s%s%s%s%s", buffer_position,
+    editor.filename ? editor.filename : "[No Name]", line_count, span, span[0] ? " " : "",
+    editor.dirty ? "(modified)" : "", editor.follow ? "(following)" : "", indexing,
+    viewer.active ? "(read-only)" : "");
 
-  /* Clear selection */
-  selection_clear();
+  /* Check if there are dirty lines for sync status */
+  int dirty_count = editor_count_dirty_lines();
+  const char *sync_status = (dirty_count > 0) ? ESCAPE_STRIKETHROUGH_START "Synced" ESCAPE_STRIKETHROUGH_END : "Synced";
 
-  /* Reset undo state (history cleared implicitly with sqlite_sync_buffer) */
-  editor.undo_group_id = 0;
-  editor.undo_position = 0;
-  editor.undo_memory_groups = 0;
+  /* Keyboard protocol indicator */
+  const char *kb_mode = editor.kitty_keyboard_mode ? "Kitty" : "Legacy";
 
-  /* Clear dirty flag */
-  editor.dirty = 0;
+  /* Calculate ANSI escape code length (invisible characters)
+   * \x1b[9m (4) + \x1b[29m (5) = 9 */
+  int ansi_escape_length = (dirty_count > 0) ? 9 : 0;
 
-  /* Reset gutter */
-  editor_update_gutter_width();
-}
+  int right_status_length = snprintf(rstatus, sizeof(rstatus), "%s | %s | %s | %s | %lld/%lld",
+    editor.syntax ? editor.syntax->filetype : "no ft", theme_get_name(), kb_mode, sync_status,
+    editor.line_number_base + editor.cursor_y + 1, line_count);
 
-/* Open file browser and load selected file (Ctrl+O) */
-void editor_open_file_browser(void) {
-  /* Check for unsaved changes */
-  if (editor.dirty) {
-    char *response = editor_prompt("Save changes? (y/n/ESC to cancel): %s", NULL);
-    if (response == NULL) {
-      editor_set_status_message("Open cancelled");
-      return;
-    }
-    if (response[0] == 'y' || response[0] == 'Y') {
-      editor_save();
+  /* Adjust right_status_length to account for ANSI escape codes */
+  int right_status_visible_length = right_status_length - ansi_escape_length;
+
+  if (status_length > editor.screen_columns) status_length = editor.screen_columns;
+  append_buffer_write(ab, status, status_length);
+  while (status_length < editor.screen_columns) {
+    if (editor.screen_columns - status_length == right_status_visible_length) {
+      append_buffer_write(ab, rstatus, right_status_length);
+      break;
+    } else {
+      append_buffer_write(ab, " ", 1);
+      status_length++;
     }
-    free(response);
   }
 
-  char *filepath = editor_file_browser();
-  if (filepath) {
-    /* Clear current buffer and open new file */
-    editor_clear_buffer();
-    editor_open(filepath);
-    free(filepath);
-  } else {
-    editor_set_status_message("Open cancelled");
+  reset_colors(ab);
+  if (!views.drawing) append_buffer_write(ab, CRLF, CRLF_LEN);
+}
+
+/* Upper bound in microseconds of the histogram bucket holding the given
+ * percentile of recent latencies (0 if there are none). */
+static long perf_latency_percentile(int percent) {
+  unsigned long total = 0;
+  for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) total += perf.latency_histogram[i];
+  if (total == 0) return 0;
+
+  unsigned long target = (total * percent + 99) / 100, seen = 0;
+  for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+    seen += perf.latency_histogram[i];
+    if (seen >= target) return PERF_HISTOGRAM_FIRST_US << i;
   }
+  return PERF_HISTOGRAM_FIRST_US << (PERF_HISTOGRAM_BUCKETS - 1);
 }
 
-/* Get column position of first non-whitespace character in a row.
- * Returns 0 if row is NULL, empty, or contains only whitespace. */
-int get_first_nonwhitespace_col(editor_row *row) {
-  if (row == NULL || row->line_size == 0) return 0;
-  int col = 0;
-  while (col < row->line_size && (row->chars[col] == ' ' || row->chars[col] == '\t')) {
-    col++;
+/* Current resident set size in bytes, refreshed at most once a second. */
+static long perf_resident_bytes() {
+  time_t now = time(NULL);
+  if (now == perf.resident_checked) return perf.resident_bytes;
+  perf.resident_checked = now;
+
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return perf.resident_bytes;
+  long pages_total, pages_resident;
+  if (fscanf(f, "%ld %ld", &pages_total, &pages_resident) == 2) {
+    perf.resident_bytes = pages_resident * sysconf(_SC_PAGESIZE);
   }
-  /* If line is all whitespace, return 0 instead of end-of-line */
-  if (col >= row->line_size) return 0;
-  return col;
+  fclose(f);
+  return perf.resident_bytes;
 }
 
-/* Move cursor in response to arrow keys.
- * Handles line wrapping and soft-wrap visual navigation. */
-void editor_move_cursor(int key) {
-  editor_row *row = (editor.cursor_y >= editor.row_count) ? NULL : &editor.row[editor.cursor_y];
-
-  switch (key) {
-    case ARROW_LEFT:
-      if (editor.cursor_x != 0) {
-        editor.cursor_x--;
-      } else if (editor.cursor_y > 0) {
-        editor.cursor_y--;
-        editor.cursor_x = editor.row[editor.cursor_y].line_size;
-      }
-      break;
-    case ARROW_RIGHT:
-      if (row && editor.cursor_x < row->line_size) {
-        editor.cursor_x++;
-      } else if (row && editor.cursor_x == row->line_size) {
-        editor.cursor_y++;
-        editor.cursor_x = 0;
-      }
-      break;
-    case ARROW_UP:
-      if (editor.soft_wrap && editor.cursor_y < editor.row_count) {
-        /* With soft wrap, move between wrap segments within same line */
-        int available_width = editor.screen_columns - editor.gutter_width;
-        if (available_width <= 0) break;
-
-        editor_row *cur_row = &editor.row[editor.cursor_y];
-        editor_calculate_wrap_breaks(cur_row, available_width);
-
-        int current_rx = editor_row_cursor_to_render(cur_row, editor.cursor_x);
-        int wrap_segment = editor_rx_to_wrap_segment(cur_row, current_rx);
-
-        if (wrap_segment > 0) {
-          /* Move up one wrap segment within same line */
-          int segment_start = editor_wrap_segment_start(cur_row, wrap_segment);
-          int offset_in_segment = current_rx - segment_start;
-
-          int prev_segment_start = editor_wrap_segment_start(cur_row, wrap_segment - 1);
-          int prev_segment_end = editor_wrap_segment_end(cur_row, wrap_segment - 1);
-
-          int target_rx = prev_segment_start + offset_in_segment;
-          if (target_rx > prev_segment_end) target_rx = prev_segment_end;
-
-          editor.cursor_x = editor_row_render_to_cursor(cur_row, target_rx);
-        } else {
-          /* Already at first wrap segment, move to previous line */
-          if (editor.cursor_y != 0) {
-            editor.cursor_y--;
-            editor_row *prev_row = &editor.row[editor.cursor_y];
-            editor_calculate_wrap_breaks(prev_row, available_width);
+/* Format a byte count compactly (B, K, M, G). */
+static void perf_format_bytes(char *buffer, size_t size, double bytes) {
+  const char *units = "BKMG";
+  int unit = 0;
+  while (bytes >= 1024 && unit < 3) {
+    bytes /= 1024;
+    unit++;
+  }
+  snprintf(buffer, size, unit ? "%.1f%c" : "%.0f%c", bytes, units[unit]);
+}
 
-            /* Move to last wrap segment of previous line */
-            int total_segments = editor_row_visual_rows(prev_row);
-            int last_segment = total_segments - 1;
+/* Append the HUD to the message bar in at most width columns: last frame
+ * time, a latency sparkline (one block per histogram bucket) with p50/p99,
+ * bytes, re-highlighted rows and allocations (when counted) of the last
+ * frame, and RSS.
+ * Returns the number of columns used (0 if it doesn't fit). */
+int perf_hud_draw(struct append_buffer *ab, int width) {
+  static const char *blocks[] = {" ", "▁", "▂", "▃", "▄",
+                                 "▅", "▆", "▇", "█"};
+  char frame_bytes[16], resident[16];
+  perf_format_bytes(frame_bytes, sizeof(frame_bytes), perf.last_frame_bytes);
+  perf_format_bytes(resident, sizeof(resident), perf_resident_bytes());
+
+  char allocations[PERF_HUD_BUFFER_SIZE] = "";
+  if (ALLOCATION_COUNTING) snprintf(allocations, sizeof(allocations), " a%llu", perf.last_frame_allocations);
+
+  char before[64], after[PERF_HUD_BUFFER_SIZE];
+  int before_length = snprintf(before, sizeof(before), " %.2fms ", perf.last_frame_ns / 1000000.0);
+  int after_length = snprintf(after, sizeof(after), " p50 %ldus p99 %ldus %s hl%lu%s rss %s ",
+                              perf_latency_percentile(50), perf_latency_percentile(99),
+                              frame_bytes, perf.last_frame_rows, allocations, resident);
+  int columns = before_length + PERF_HISTOGRAM_BUCKETS + after_length;
+  if (columns > width) return 0;
+
+  append_buffer_write(ab, before, before_length);
+  unsigned long highest = 0;
+  for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+    if (perf.latency_histogram[i] > highest) highest = perf.latency_histogram[i];
+  }
+  for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+    int level = highest ? (int)((perf.latency_histogram[i] * 8 + highest - 1) / highest) : 0;
+    append_buffer_write(ab, blocks[level], strlen(blocks[level]));
+  }
+  append_buffer_write(ab, after, after_length);
+  return columns;
+}
 
-            int segment_start = editor_wrap_segment_start(cur_row, 0);
-            int offset_in_segment = current_rx - segment_start;
+/* Draw the message bar showing status messages with timeout.
+ * Messages disappear after STATUS_MESSAGE_TIMEOUT_SECONDS. */
+void editor_draw_message_bar(struct append_buffer *ab) {
+  append_buffer_write(ab, ESCAPE_CLEAR_LINE, ESCAPE_CLEAR_LINE_LEN);
+  set_background_rgb(ab, theme_get_color(THEME_UI_MESSAGE_BG));
+  set_foreground_rgb(ab, theme_get_color(THEME_UI_MESSAGE_FG));
 
-            int last_segment_start = editor_wrap_segment_start(prev_row, last_segment);
-            int last_segment_end = editor_wrap_segment_end(prev_row, last_segment);
+  int message_length = strlen(editor.status_message);
+  if (message_length > editor.screen_columns) message_length = editor.screen_columns;
 
-            int target_rx = last_segment_start + offset_in_segment;
-            if (target_rx > last_segment_end) target_rx = last_segment_end;
+  int current_column = 0;
+  if (message_length && time(NULL) - editor.status_message_time < STATUS_MESSAGE_TIMEOUT_SECONDS) {
+    append_buffer_write(ab, editor.status_message, message_length);
+    current_column = message_length;
+  }
 
-            editor.cursor_x = editor_row_render_to_cursor(prev_row, target_rx);
-          }
-        }
-      } else {
-        /* Normal up movement without soft wrap */
-        if (editor.cursor_y != 0) {
-          editor.cursor_y--;
-        }
+  /* Performance HUD, right-aligned after any message */
+  if (editor.perf_hud) {
+    struct append_buffer hud = ABUF_INIT;
+    int hud_columns = perf_hud_draw(&hud, editor.screen_columns - current_column);
+    if (hud_columns > 0) {
+      while (current_column < editor.screen_columns - hud_columns) {
+        append_buffer_write(ab, " ", 1);
+        current_column++;
       }
-      break;
-    case ARROW_DOWN:
-      if (editor.soft_wrap && editor.cursor_y < editor.row_count) {
-        /* With soft wrap, move between wrap segments within same line */
-        int available_width = editor.screen_columns - editor.gutter_width;
-        if (available_width <= 0) break;
-
-        editor_row *cur_row = &editor.row[editor.cursor_y];
-        editor_calculate_wrap_breaks(cur_row, available_width);
+      set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
+      append_buffer_write(ab, hud.buffer, hud.length);
+      current_column += hud_columns;
+    }
+    append_buffer_destroy(&hud);
+  }
 
-        int current_rx = editor_row_cursor_to_render(cur_row, editor.cursor_x);
-        int wrap_segment = editor_rx_to_wrap_segment(cur_row, current_rx);
-        int total_segments = editor_row_visual_rows(cur_row);
+  /* Fill rest of line with spaces to ensure background spans full width */
+  while (current_column < editor.screen_columns) {
+    append_buffer_write(ab, " ", 1);
+    current_column++;
+  }
 
-        if (wrap_segment < total_segments - 1) {
-          /* Move down one wrap segment within same line */
-          int segment_start = editor_wrap_segment_start(cur_row, wrap_segment);
-          int offset_in_segment = current_rx - segment_start;
+  reset_colors(ab);
+}
 
-          int next_segment_start = editor_wrap_segment_start(cur_row, wrap_segment + 1);
-          int next_segment_end = editor_wrap_segment_end(cur_row, wrap_segment + 1);
+/* Redraw the entire screen. Builds output in append buffer
+ * then writes to terminal in one call to prevent flicker. */
+void editor_refresh_screen() {
+  TRACE_SCOPE(__func__);
+  editor_scroll();
 
-          int target_rx = next_segment_start + offset_in_segment;
-          if (target_rx > next_segment_end) target_rx = next_segment_end;
+  /* Update bracket matching state */
+  editor_find_matching_bracket();
 
-          editor.cursor_x = editor_row_render_to_cursor(cur_row, target_rx);
-        } else {
-          /* Already at last wrap segment, move to next line */
-          if (editor.cursor_y < editor.row_count) {
-            editor.cursor_y++;
-            if (editor.cursor_y < editor.row_count) {
-              /* Move to first wrap segment of next line */
-              editor_row *next_row = &editor.row[editor.cursor_y];
-              editor_calculate_wrap_breaks(next_row, available_width);
+  /* Terminal still busy with the previous frame: skip this one */
+  if (!terminal_output_ready()) return;
+  perf_frame_begin();
 
-              int segment_start = editor_wrap_segment_start(cur_row, wrap_segment);
-              int offset_in_segment = current_rx - segment_start;
+  struct append_buffer ab = ABUF_INIT;
+  if (editor.sync_output) append_buffer_write(&ab, ESCAPE_SYNC_OUTPUT_BEGIN, ESCAPE_SYNC_OUTPUT_BEGIN_LEN);
 
-              int first_segment_end = editor_wrap_segment_end(next_row, 0);
+  /* Set editor background and foreground colors */
+  set_background_rgb(&ab, theme_get_color(THEME_UI_BACKGROUND));
+  set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
 
-              int target_rx = offset_in_segment;
-              if (target_rx > first_segment_end) target_rx = first_segment_end;
+  append_buffer_write(&ab, ESCAPE_HIDE_CURSOR, ESCAPE_HIDE_CURSOR_LEN);
+  append_buffer_write(&ab, ESCAPE_CURSOR_HOME, ESCAPE_CURSOR_HOME_LEN);
 
-              editor.cursor_x = editor_row_render_to_cursor(next_row, target_rx);
-            } else {
-              editor.cursor_x = 0;
-            }
-          }
-        }
-      } else {
-        /* Normal down movement without soft wrap */
-        if (editor.cursor_y < editor.row_count) {
-          editor.cursor_y++;
-        }
-      }
-      break;
+  /* Where the active view's text area starts on screen */
+  int origin_row = 0, origin_column = 0;
+  if (views.count > 1) {
+    view_draw_screen(&ab);
+    origin_row = views.views[views.active].top;
+    origin_column = views.views[views.active].left;
+  } else {
+    editor_draw_rows(&ab);
+    editor_draw_status_bar(&ab);
+    editor_draw_message_bar(&ab);
   }
 
-  row = (editor.cursor_y >= editor.row_count) ? NULL : &editor.row[editor.cursor_y];
-  int rowlen = row ? row->line_size : 0;
-  if (editor.cursor_x > rowlen) {
-    editor.cursor_x = rowlen;
-  }
-}
+  /* Position cursor */
+  int cursor_row = (editor.cursor_y - editor.row_offset) + 1;
+  char cursor_buffer[CURSOR_POSITION_BUFFER_SIZE];
+  snprintf(cursor_buffer, sizeof(cursor_buffer), ESCAPE_CURSOR_POSITION_FORMAT, origin_row + cursor_row,
+           origin_column + (editor.render_x - editor.column_offset) + editor.gutter_width + 1);
+  append_buffer_write(&ab, cursor_buffer, strlen(cursor_buffer));
 
-/* Check if character is a word character (alphanumeric or underscore) */
-int is_word_char(int c) {
-  return isalnum(c) || c == '_';
-}
+  /* Render secondary cursors via kitty protocol */
+  append_buffer_write(&ab, ESCAPE_KITTY_CURSOR_CLEAR, ESCAPE_KITTY_CURSOR_CLEAR_LEN);
+  for (size_t i = 0; i < editor.cursor_count; i++) {
+    int file_row = editor.cursors[i].line;
+    int file_col = editor.cursors[i].column;
 
-/* Move cursor to the beginning of the previous word */
-void editor_move_word_left() {
-  if (editor.cursor_y >= editor.row_count) return;
+    /* Convert to screen coordinates */
+    int screen_row = file_row - editor.row_offset + 1;
 
-  /* If at beginning of line, move to end of previous line */
-  if (editor.cursor_x == 0) {
-    if (editor.cursor_y > 0) {
-      editor.cursor_y--;
-      editor.cursor_x = editor.row[editor.cursor_y].line_size;
+    /* Calculate render_x for this cursor (handle tabs) */
+    int render_col = 0;
+    if (file_row >= 0 && file_row < editor.row_count) {
+      render_col = editor_row_cursor_to_render(&editor.row[file_row], file_col);
     }
-    return;
-  }
+    int screen_col = render_col - editor.column_offset + editor.gutter_width + 1;
 
-  editor_row *row = &editor.row[editor.cursor_y];
-  int x = editor.cursor_x;
+    /* Skip if off-screen */
+    if (screen_row < 1 || screen_row > editor.screen_rows) continue;
+    if (screen_col < 1 || screen_col > editor.screen_columns) continue;
 
-  /* Skip whitespace/separators going backward */
-  while (x > 0 && !is_word_char(row->chars[x - 1])) {
-    x--;
+    char kitty_buf[32];
+    int len = snprintf(kitty_buf, sizeof(kitty_buf), ESCAPE_KITTY_CURSOR_FORMAT,
+                       origin_row + screen_row, origin_column + screen_col);
+    append_buffer_write(&ab, kitty_buf, len);
   }
 
-  /* Skip word characters going backward */
-  while (x > 0 && is_word_char(row->chars[x - 1])) {
-    x--;
-  }
+  append_buffer_write(&ab, ESCAPE_SHOW_CURSOR, ESCAPE_SHOW_CURSOR_LEN);
 
-  editor.cursor_x = x;
+  if (editor.sync_output) append_buffer_write(&ab, ESCAPE_SYNC_OUTPUT_END, ESCAPE_SYNC_OUTPUT_END_LEN);
+  terminal_write(ab.buffer, ab.length);
+  long long latency = perf_frame_end(ab.length);
+  if (headless.enabled && latency >= 0) headless_latency_sample(latency);
+  append_buffer_destroy(&ab);
 }
 
-/* Move cursor to the end of the next word */
-void editor_move_word_right() {
-  if (editor.cursor_y >= editor.row_count) return;
+/* Set a message to display in the message bar.
+ * Supports printf-style formatting. Auto-clears after timeout. */
+void editor_set_status_message(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(editor.status_message, sizeof(editor.status_message), fmt, ap);
+  va_end(ap);
+  editor.status_message_time = time(NULL);
+}
 
-  editor_row *row = &editor.row[editor.cursor_y];
+/*** input ***/
 
-  /* If at end of line, move to beginning of next line */
-  if (editor.cursor_x >= row->line_size) {
-    if (editor.cursor_y < editor.row_count - 1) {
-      editor.cursor_y++;
-      editor.cursor_x = 0;
-    }
-    return;
-  }
+/* Display a prompt and read user input.
+ * Calls callback on each keystroke for incremental features like search.
+ * Returns user input or NULL if cancelled with ESC. */
+char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
+  size_t buffer_size = PROMPT_INITIAL_BUFFER_SIZE;
+  char *buffer = malloc(buffer_size);
 
-  int x = editor.cursor_x;
+  size_t buffer_length = 0;
+  buffer[0] = '\0';
 
-  /* Skip word characters going forward */
-  while (x < row->line_size && is_word_char(row->chars[x])) {
-    x++;
-  }
+  while (1) {
+    editor_set_status_message(prompt, buffer);
+    editor_refresh_screen();
 
-  /* Skip whitespace/separators going forward */
-  while (x < row->line_size && !is_word_char(row->chars[x])) {
-    x++;
-  }
+    int key = editor_read_key();
+    if (key == DEL_KEY || key == CTRL_KEY('h') || key == BACKSPACE) {
+      if (buffer_length != 0) buffer[--buffer_length] = '\0';
+    } else if (key == CHAR_ESCAPE) {
+      editor_set_status_message("");
+      if (callback) callback(buffer, key);
+      free(buffer);
+      return NULL;
+    } else if (key == '\r') {
+      if (buffer_length != 0) {
+        editor_set_status_message("");
+        if (callback) callback(buffer, key);
+        return buffer;
+      }
+    } else if (key >= 0 && !iscntrl(key) && key < ASCII_MAX) {
+      if (buffer_length == buffer_size - 1) {
+        buffer_size *= 2;
+        buffer = realloc(buffer, buffer_size);
+      }
+      buffer[buffer_length++] = key;
+      buffer[buffer_length] = '\0';
+    }
 
-  editor.cursor_x = x;
+    if (callback) callback(buffer, key);
+  }
 }
 
-/* Delete word backward (Ctrl+Backspace or Ctrl+W behavior) */
-void editor_delete_word_backward() {
-  if (editor.cursor_count > 0) {
-    multicursor_delete_word_backward_all();
+/* Jump to a specific line number (Ctrl+G). */
+void editor_jump_to_line(void) {
+  char *line_str = editor_prompt("Jump to line: %s (ESC to cancel)", NULL);
+  if (line_str == NULL) {
+    editor_set_status_message("Jump cancelled");
+    return;
+  }
+  if (viewer.active) {
+    viewer_jump_to_line(line_str);
+    free(line_str);
     return;
   }
 
-  if (editor.cursor_y >= editor.row_count) return;
+  int line = atoi(line_str);
+  free(line_str);
 
-  /* If at beginning of line, join with previous line */
-  if (editor.cursor_x == 0) {
-    if (editor.cursor_y > 0) {
-      editor_delete_char();
-    }
+  /* Validate (1-indexed for user, 0-indexed internal) */
+  if (line < 1 || line > editor.row_count) {
+    editor_set_status_message("Invalid line number: %d (valid: 1-%d)", line, editor.row_count);
     return;
   }
 
-  editor_row *row = &editor.row[editor.cursor_y];
-  int start_x = editor.cursor_x;
-  int x = editor.cursor_x;
+  /* Clear selection */
+  selection_clear();
 
-  /* Skip whitespace/separators going backward */
-  while (x > 0 && !is_word_char(row->chars[x - 1])) {
-    x--;
-  }
+  /* Jump to line (convert to 0-indexed) */
+  editor.cursor_y = line - 1;
+  editor.cursor_x = 0;
 
-  /* Skip word characters going backward */
-  while (x > 0 && is_word_char(row->chars[x - 1])) {
-    x--;
-  }
+  /* Center view on target line */
+  int target_rowoff = editor.cursor_y - (editor.screen_rows / 2);
+  if (target_rowoff < 0) target_rowoff = 0;
+  int max_rowoff = editor.row_count - editor.screen_rows;
+  if (max_rowoff < 0) max_rowoff = 0;
+  if (target_rowoff > max_rowoff) target_rowoff = max_rowoff;
+  editor.row_offset = target_rowoff;
 
-  /* Delete characters from x to start_x */
-  int chars_to_delete = start_x - x;
-  editor.cursor_x = x;
-  for (int i = 0; i < chars_to_delete; i++) {
-    editor_row_delete_char(row, editor.cursor_x);
-  }
-  editor.dirty++;
+  editor_set_status_message("Jumped to line %d", line);
 }
 
-/* Delete word forward (Ctrl+Delete behavior) */
-void editor_delete_word_forward() {
-  if (editor.cursor_count > 0) {
-    multicursor_delete_word_forward_all();
-    return;
-  }
-
+/* Skip past next closing bracket/brace/paren (Alt+]).
+ * Searches forward from cursor for unmatched closing pair. */
+void editor_skip_closing_pair(void) {
   if (editor.cursor_y >= editor.row_count) return;
 
-  editor_row *row = &editor.row[editor.cursor_y];
+  int nesting = 0;
 
-  /* If at end of line, join with next line */
-  if (editor.cursor_x >= row->line_size) {
-    if (editor.cursor_y < editor.row_count - 1) {
-      editor_move_cursor(ARROW_RIGHT);
-      editor_delete_char();
+  /* Search forward from cursor for closing bracket at nesting level 0 */
+  for (int y = editor.cursor_y; y < editor.row_count; y++) {
+    editor_row *row = &editor.row[y];
+    int start_col = (y == editor.cursor_y) ? editor.cursor_x : 0;
+
+    for (int x = start_col; x < row->line_size; x++) {
+      char c = row->chars[x];
+
+      /* Track nesting */
+      if (c == '(' || c == '[' || c == '{') {
+        nesting++;
+      } else if (c == ')' || c == ']' || c == '}') {
+        if (nesting == 0) {
+          /* Found matching closer - move cursor past it */
+          editor.cursor_y = y;
+          editor.cursor_x = x + 1;
+          return;
+        }
+        nesting--;
+      }
     }
-    return;
   }
+  /* Not found - cursor stays in place */
+}
 
-  int x = editor.cursor_x;
+/* Jump back to position after nearest opening bracket/brace/paren (Alt+[).
+ * Searches backward from cursor for unmatched opening pair. */
+void editor_skip_opening_pair(void) {
+  if (editor.row_count == 0) return;
 
-  /* Skip word characters going forward */
-  while (x < row->line_size && is_word_char(row->chars[x])) {
-    x++;
-  }
+  int nesting = 0;
 
-  /* Skip whitespace/separators going forward */
-  while (x < row->line_size && !is_word_char(row->chars[x])) {
-    x++;
-  }
+  /* Search backward from cursor for opening bracket at nesting level 0 */
+  for (int y = editor.cursor_y; y >= 0; y--) {
+    editor_row *row = &editor.row[y];
+    int start_col = (y == editor.cursor_y) ? editor.cursor_x - 1 : row->line_size - 1;
 
-  /* Delete characters from cursor_x to x */
-  int chars_to_delete = x - editor.cursor_x;
-  for (int i = 0; i < chars_to_delete; i++) {
-    editor_row_delete_char(row, editor.cursor_x);
-  }
-  editor.dirty++;
-}
+    for (int x = start_col; x >= 0; x--) {
+      char c = row->chars[x];
 
-/* Get the matching bracket character for a given bracket */
-char get_matching_bracket(char c) {
-  switch (c) {
-    case '(': return ')';
-    case ')': return '(';
-    case '[': return ']';
-    case ']': return '[';
-    case '{': return '}';
-    case '}': return '{';
-    default: return '\0';
+      /* Track nesting (reversed logic since we're going backward) */
+      if (c == ')' || c == ']' || c == '}') {
+        nesting++;
+      } else if (c == '(' || c == '[' || c == '{') {
+        if (nesting == 0) {
+          /* Found matching opener - move cursor right after it */
+          editor.cursor_y = y;
+          editor.cursor_x = x + 1;
+          return;
+        }
+        nesting--;
+      }
+    }
   }
+  /* Not found - cursor stays in place */
 }
 
-/* Check if character is an opening bracket */
-int is_opening_bracket(char c) {
-  return c == '(' || c == '[' || c == '{';
+/*** file browser ***/
+
+/* Structure for file list items in the browser */
+typedef struct {
+  char *name;           /* Display name (with / for directories) */
+  char *actual_name;    /* Actual filename without decorations */
+  int is_directory;
+} file_list_item;
+
+/* Compare function for sorting file list (directories first, then alphabetical) */
+int file_list_compare(const void *a, const void *b) {
+  const file_list_item *item_a = (const file_list_item *)a;
+  const file_list_item *item_b = (const file_list_item *)b;
+
+  /* Directories sort before files */
+  if (item_a->is_directory && !item_b->is_directory) return -1;
+  if (!item_a->is_directory && item_b->is_directory) return 1;
+
+  /* Within same type, sort alphabetically (case-insensitive) */
+  return strcasecmp(item_a->name, item_b->name);
 }
 
-/* Reset bracket match state */
-void editor_reset_bracket_match() {
-  editor.bracket_match_row = -1;
-  editor.bracket_match_col = -1;
-  editor.bracket_open_row = -1;
-  editor.bracket_open_col = -1;
-  editor.bracket_open_len = 0;
-  editor.bracket_close_row = -1;
-  editor.bracket_close_col = -1;
-  editor.bracket_close_len = 0;
+/* Free file list items */
+void file_list_free(file_list_item *items, int count) {
+  for (int i = 0; i < count; i++) {
+    free(items[i].name);
+    free(items[i].actual_name);
+  }
+  free(items);
 }
 
-static int editor_search_comment_forward(const char *needle, int needle_len, int start_row, int start_col, int *out_row, int *out_col) {
-  if (needle_len <= 0) return 0;
-  for (int r = start_row; r < editor.row_count; r++) {
-    editor_row *row = &editor.row[r];
-    int sc = (r == start_row) ? start_col : 0;
-    for (int c = sc; c + needle_len <= row->line_size; c++) {
-      if (!strncmp(&row->chars[c], needle, needle_len)) {
-        *out_row = r;
-        *out_col = c;
-        return 1;
+/* One cached directory listing. A listing is filled a batch at a time
+ * while reader is open, and sorted once the whole directory has been read. */
+typedef struct {
+  /* Directory path this listing belongs to, or NULL for an unused slot */
+  char *path;
+  /* Entries read so far */
+  file_list_item *items;
+  int count;
+  int capacity;
+  /* Open directory while the listing is still loading, NULL when complete */
+  DIR *reader;
+  /* inotify watch on the directory, or -1 when not watched */
+  int watch;
+  /* Directory modification time, used to validate unwatched listings */
+  struct timespec modified;
+  /* Set when inotify reports a change; the listing is re-read on the next
+   * use after any read in progress has finished */
+  int stale;
+  /* Lookup stamp for least-recently-used eviction */
+  unsigned long last_used;
+} file_list_cache_entry;
+
+static file_list_cache_entry file_list_cache[FILE_LIST_CACHE_SIZE];
+
+/* inotify instance shared by all cached listings (-1 if unavailable) */
+static int file_list_inotify_fd = -1;
+static int file_list_inotify_initialized = 0;
+
+/* Counter handing out last_used stamps */
+static unsigned long file_list_cache_clock = 0;
+
+/* Drain pending inotify events and mark the affected listings stale.
+ * Never blocks. */
+static void file_list_cache_poll_changes() {
+  if (file_list_inotify_fd < 0) return;
+
+  char buffer[INOTIFY_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while ((length = read(file_list_inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      for (int i = 0; i < FILE_LIST_CACHE_SIZE; i++) {
+        if (file_list_cache[i].path && file_list_cache[i].watch == event->wd) {
+          file_list_cache[i].stale = 1;
+          /* The kernel dropped the watch (directory removed or unmounted) */
+          if (event->mask & IN_IGNORED) file_list_cache[i].watch = -1;
+        }
       }
+      p += sizeof(struct inotify_event) + event->len;
     }
   }
-  return 0;
 }
 
-static int editor_search_comment_backward(const char *needle, int needle_len, int start_row, int start_col, int *out_row, int *out_col) {
-  if (needle_len <= 0) return 0;
-  for (int r = start_row; r >= 0; r--) {
-    editor_row *row = &editor.row[r];
-    int sc = (r == start_row) ? start_col : row->line_size - 1;
-    for (int c = sc; c - needle_len + 1 >= 0; c--) {
-      if (!strncmp(&row->chars[c - needle_len + 1], needle, needle_len)) {
-        *out_row = r;
-        *out_col = c - needle_len + 1;
-        return 1;
-      }
-    }
+/* Throw away the entries of a listing and stop any read in progress. */
+static void file_list_cache_clear(file_list_cache_entry *entry) {
+  if (entry->reader) closedir(entry->reader);
+  entry->reader = NULL;
+  file_list_free(entry->items, entry->count);
+  entry->items = NULL;
+  entry->count = 0;
+  entry->capacity = 0;
+  entry->stale = 0;
+}
+
+/* Release a cache slot completely, including its inotify watch. */
+static void file_list_cache_evict(file_list_cache_entry *entry) {
+  file_list_cache_clear(entry);
+  if (entry->watch >= 0 && file_list_inotify_fd >= 0) {
+    inotify_rm_watch(file_list_inotify_fd, entry->watch);
   }
+  entry->watch = -1;
+  free(entry->path);
+  entry->path = NULL;
+}
+
+/* Append one entry to a listing. Returns 0 on success, -1 if out of memory. */
+static int file_list_cache_add(file_list_cache_entry *entry, const char *name, int is_directory) {
+  if (entry->count >= entry->capacity) {
+    int capacity = entry->capacity ? entry->capacity * 2 : 64;
+    file_list_item *items = realloc(entry->items, capacity * sizeof(file_list_item));
+    if (!items) return -1;
+    entry->items = items;
+    entry->capacity = capacity;
+  }
+
+  size_t name_length = strlen(name);
+  file_list_item *item = &entry->items[entry->count];
+  item->actual_name = strdup(name);
+  item->name = malloc(name_length + 2);
+  if (!item->actual_name || !item->name) {
+    free(item->actual_name);
+    free(item->name);
+    return -1;
+  }
+  memcpy(item->name, name, name_length);
+  if (is_directory) item->name[name_length++] = '/';
+  item->name[name_length] = '\0';
+  item->is_directory = is_directory;
+  entry->count++;
   return 0;
 }
 
-/* Internal: find match starting at specific position (bracket or comment delimiter). */
-static int editor_match_from(int start_row, int start_col) {
-  editor_reset_bracket_match();
+/* Start (re)reading a directory into a listing. Returns 0 on success. */
+static int file_list_cache_open(file_list_cache_entry *entry) {
+  file_list_cache_clear(entry);
 
-  if (start_row < 0 || start_row >= editor.row_count) return 0;
-  editor_row *row = &editor.row[start_row];
-  if (start_col < 0 || start_col >= row->line_size) return 0;
+  entry->reader = opendir(entry->path);
+  if (!entry->reader) return -1;
 
-  char current = row->chars[start_col];
-  char match = get_matching_bracket(current);
+  struct stat st;
+  if (fstat(dirfd(entry->reader), &st) == 0) entry->modified = st.st_mtim;
 
-  int direction = is_opening_bracket(current) ? 1 : -1;
-  int depth = 1;
-  int search_row = start_row;
-  int search_col = start_col + direction;
-  int in_string = 0;
-  char string_delim = '\0';
-  int in_multiline_comment = 0;
+  /* Add parent directory entry if not at root */
+  if (strcmp(entry->path, "/") != 0) file_list_cache_add(entry, "..", 1);
+  return 0;
+}
 
-  char *ml_start = editor.syntax ? editor.syntax->multiline_comment_start : NULL;
-  char *ml_end = editor.syntax ? editor.syntax->multiline_comment_end : NULL;
-  int ml_start_len = ml_start ? (int)strlen(ml_start) : 0;
-  int ml_end_len = ml_end ? (int)strlen(ml_end) : 0;
+/* Read up to FILE_LIST_READ_BATCH more entries into a loading listing.
+ * The entry type comes from d_type; only entries the filesystem can't
+ * classify (and symlinks, which may point at directories) cost an fstatat
+ * relative to the open directory. Sorts the listing once the directory is
+ * exhausted. Returns 1 if the listing changed. */
+int file_list_cache_read_more(file_list_cache_entry *entry) {
+  if (!entry->reader) return 0;
+
+  int directory_fd = dirfd(entry->reader);
+  struct dirent *dirent;
+  for (int n = 0; n < FILE_LIST_READ_BATCH; n++) {
+    dirent = readdir(entry->reader);
+    if (!dirent) break;
+
+    /* Skip hidden files (including . and ..) */
+    if (dirent->d_name[0] == '.') continue;
+
+    int is_directory;
+    if (dirent->d_type == DT_DIR) {
+      is_directory = 1;
+    } else if (dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK) {
+      struct stat st;
+      is_directory = (fstatat(directory_fd, dirent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+    } else {
+      is_directory = 0;
+    }
 
-  /* Handle multiline comment delimiters as matchable pairs */
-  if (ml_start_len && ml_end_len &&
-      start_col + ml_start_len <= row->line_size &&
-      !strncmp(&row->chars[start_col], ml_start, ml_start_len)) {
-    int mr, mc;
-    if (editor_search_comment_forward(ml_end, ml_end_len, start_row, start_col + ml_start_len, &mr, &mc)) {
-      editor.bracket_match_row = mr;
-      editor.bracket_match_col = mc;
-      editor.bracket_open_row = start_row;
-      editor.bracket_open_col = start_col;
-      editor.bracket_open_len = ml_start_len;
-      editor.bracket_close_row = mr;
-      editor.bracket_close_col = mc;
-      editor.bracket_close_len = ml_end_len;
-      return 1;
+    if (file_list_cache_add(entry, dirent->d_name, is_directory) != 0) break;
+  }
+
+  if (dirent) return 1;
+
+  closedir(entry->reader);
+  entry->reader = NULL;
+
+  /* Sort: directories first (except ../), then alphabetical */
+  int start = (entry->count > 0 && strcmp(entry->items[0].actual_name, "..") == 0) ? 1 : 0;
+  if (entry->count - start > 1) {
+    qsort(&entry->items[start], entry->count - start, sizeof(file_list_item), file_list_compare);
+  }
+  return 1;
+}
+
+/* Whether a listing is still being read. */
+int file_list_cache_loading(file_list_cache_entry *entry) {
+  return entry->reader != NULL;
+}
+
+/* Get the cached listing for a directory, starting a fresh read if it isn't
+ * cached or has changed since it was last read completely. Changes are picked up from inotify; listings
+ * that could not be watched fall back to comparing the directory mtime.
+ * Returns NULL if the directory can't be opened. */
+file_list_cache_entry *file_list_cache_get(const char *path) {
+  if (!file_list_inotify_initialized) {
+    file_list_inotify_initialized = 1;
+    file_list_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; i < FILE_LIST_CACHE_SIZE; i++) file_list_cache[i].watch = -1;
+  }
+  file_list_cache_poll_changes();
+
+  file_list_cache_entry *entry = NULL;
+  file_list_cache_entry *oldest = &file_list_cache[0];
+  for (int i = 0; i < FILE_LIST_CACHE_SIZE; i++) {
+    file_list_cache_entry *candidate = &file_list_cache[i];
+    if (candidate->path && strcmp(candidate->path, path) == 0) {
+      entry = candidate;
+      break;
+    }
+    if (!candidate->path || (oldest->path && candidate->last_used < oldest->last_used)) {
+      oldest = candidate;
     }
-    return 0;
   }
-  if (ml_start_len && ml_end_len &&
-      start_col + ml_end_len <= row->line_size &&
-      !strncmp(&row->chars[start_col], ml_end, ml_end_len)) {
-    int mr, mc;
-    if (editor_search_comment_backward(ml_start, ml_start_len, start_row, start_col - 1, &mr, &mc)) {
-      editor.bracket_match_row = mr;
-      editor.bracket_match_col = mc;
-      editor.bracket_open_row = mr;
-      editor.bracket_open_col = mc;
-      editor.bracket_open_len = ml_start_len;
-      editor.bracket_close_row = start_row;
-      editor.bracket_close_col = start_col;
-      editor.bracket_close_len = ml_end_len;
-      return 1;
+
+  if (entry) {
+    if (entry->watch < 0 && !entry->reader && !entry->stale) {
+      struct stat st;
+      entry->stale = (stat(path, &st) != 0 ||
+                      st.st_mtim.tv_sec != entry->modified.tv_sec ||
+                      st.st_mtim.tv_nsec != entry->modified.tv_nsec);
+    }
+    /* A change seen mid-read doesn't restart the read, or a busy directory
+     * would never finish loading; the flag stays set for the next use */
+    if (entry->stale && !entry->reader && file_list_cache_open(entry) != 0) {
+      file_list_cache_evict(entry);
+      return NULL;
+    }
+  } else {
+    entry = oldest;
+    file_list_cache_evict(entry);
+    entry->path = strdup(path);
+    if (!entry->path) return NULL;
+
+    if (file_list_inotify_fd >= 0) {
+      entry->watch = inotify_add_watch(file_list_inotify_fd, path, FILE_LIST_WATCH_EVENTS);
+    }
+    if (file_list_cache_open(entry) != 0) {
+      file_list_cache_evict(entry);
+      return NULL;
     }
-    return 0;
   }
 
-  if (match == '\0') return 0;
+  entry->last_used = ++file_list_cache_clock;
+  return entry;
+}
 
-  while (depth > 0) {
-    if (direction > 0) {
-      while (search_row < editor.row_count) {
-        editor_row *r = &editor.row[search_row];
-        while (search_col < r->line_size) {
-          char c = r->chars[search_col];
+/* Draw file browser as a centered half-screen panel */
+void file_browser_draw(file_list_item *items, int count, int selected, const char *path, int scroll_offset,
+                       int loading) {
+  if (!terminal_output_ready()) return;
 
-          if (!in_multiline_comment) {
-            if (in_string) {
-              if (c == string_delim) {
-                int backslashes = 0;
-                int k = search_col - 1;
-                while (k >= 0 && r->chars[k] == '\\') {
-                  backslashes++;
-                  k--;
-                }
-                if (backslashes % 2 == 0) {
-                  in_string = 0;
-                  string_delim = '\0';
-                }
-              }
-              search_col++;
-              continue;
-            } else if (c == '"' || c == '\'') {
-              in_string = 1;
-              string_delim = c;
-              search_col++;
-              continue;
-            }
-          }
+  struct append_buffer ab = ABUF_INIT;
+  if (editor.sync_output) append_buffer_write(&ab, ESCAPE_SYNC_OUTPUT_BEGIN, ESCAPE_SYNC_OUTPUT_BEGIN_LEN);
 
-          if (ml_start_len && ml_end_len && !in_string) {
-            if (!in_multiline_comment &&
-                search_col + ml_start_len <= r->line_size &&
-                strncmp(&r->chars[search_col], ml_start, ml_start_len) == 0) {
-              in_multiline_comment = 1;
-              search_col += ml_start_len;
-              continue;
-            } else if (in_multiline_comment &&
-                       search_col + ml_end_len <= r->line_size &&
-                       strncmp(&r->chars[search_col], ml_end, ml_end_len) == 0) {
-              in_multiline_comment = 0;
-              search_col += ml_end_len;
-              continue;
-            }
-            if (in_multiline_comment) {
-              search_col++;
-              continue;
-            }
-          }
+  /* Calculate panel dimensions - half screen height, 70% width */
+  int panel_height = editor.screen_rows / 2;
+  if (panel_height < 10) panel_height = 10;
+  if (panel_height > editor.screen_rows - 2) panel_height = editor.screen_rows - 2;
 
-          if (c == current) {
-            depth++;
-          } else if (c == match) {
-            depth--;
-            if (depth == 0) {
-              editor.bracket_match_row = search_row;
-              editor.bracket_match_col = search_col;
-              if (direction > 0) {
-                editor.bracket_open_row = start_row;
-                editor.bracket_open_col = start_col;
-                editor.bracket_open_len = 1;
-                editor.bracket_close_row = search_row;
-                editor.bracket_close_col = search_col;
-                editor.bracket_close_len = 1;
-              } else {
-                editor.bracket_open_row = search_row;
-                editor.bracket_open_col = search_col;
-                editor.bracket_open_len = 1;
-                editor.bracket_close_row = start_row;
-                editor.bracket_close_col = start_col;
-                editor.bracket_close_len = 1;
-              }
-              return 1;
-            }
-          }
-          search_col++;
-        }
-        search_row++;
-        search_col = 0;
+  int panel_width = (editor.screen_columns * 70) / 100;
+  if (panel_width < 40) panel_width = 40;
+  if (panel_width > editor.screen_columns - 4) panel_width = editor.screen_columns - 4;
+
+  /* Center the panel */
+  int panel_top = (editor.screen_rows - panel_height) / 2;
+  int panel_left = (editor.screen_columns - panel_width) / 2;
+
+  append_buffer_write(&ab, ESCAPE_HIDE_CURSOR, ESCAPE_HIDE_CURSOR_LEN);
+
+  /* Draw each row of the panel */
+  for (int row = 0; row < panel_height; row++) {
+    /* Position cursor at start of this panel row */
+    char pos_buf[32];
+    snprintf(pos_buf, sizeof(pos_buf), "\x1b[%d;%dH", panel_top + row + 1, panel_left + 1);
+    append_buffer_write(&ab, pos_buf, strlen(pos_buf));
+
+    if (row == 0) {
+      /* Header row */
+      set_background_rgb(&ab, theme_get_color(THEME_UI_STATUS_BG));
+      set_foreground_rgb(&ab, theme_get_color(THEME_UI_STATUS_FG));
+
+      char header[256];
+      int header_len;
+      if (loading) {
+        header_len = snprintf(header, sizeof(header), " Open: %s (reading... %d)", path, count);
+      } else {
+        header_len = snprintf(header, sizeof(header), " Open: %s", path);
+      }
+      if (header_len < 0) header_len = 0;
+      if (header_len > (int)sizeof(header) - 1) header_len = sizeof(header) - 1;
+      if (header_len > panel_width) header_len = panel_width;
+      append_buffer_write(&ab, header, header_len);
+
+      /* Pad rest of header */
+      for (int p = header_len; p < panel_width; p++) {
+        append_buffer_write(&ab, " ", 1);
+      }
+    } else if (row == panel_height - 1) {
+      /* Help bar at bottom */
+      set_background_rgb(&ab, theme_get_color(THEME_UI_MESSAGE_BG));
+      set_foreground_rgb(&ab, theme_get_color(THEME_UI_MESSAGE_FG));
+
+      char help[] = " Up/Down/Scroll:Nav Enter/DblClick:Open ESC:Cancel";
+      int help_len = strlen(help);
+      if (help_len > panel_width) help_len = panel_width;
+      append_buffer_write(&ab, help, help_len);
+
+      /* Pad rest of help bar */
+      for (int p = help_len; p < panel_width; p++) {
+        append_buffer_write(&ab, " ", 1);
       }
-      break;
     } else {
-      while (search_row >= 0) {
-        editor_row *r = &editor.row[search_row];
-        if (search_col < 0) search_col = r->line_size - 1;
-        while (search_col >= 0) {
-          char c = r->chars[search_col];
+      /* File list row */
+      int item_idx = scroll_offset + (row - 1);
 
-          if (!in_multiline_comment) {
-            if (in_string) {
-              if (c == string_delim) {
-                int backslashes = 0;
-                int k = search_col - 1;
-                while (k >= 0 && r->chars[k] == '\\') {
-                  backslashes++;
-                  k--;
-                }
-                if (backslashes % 2 == 0) {
-                  in_string = 0;
-                  string_delim = '\0';
-                }
-              }
-              search_col--;
-              continue;
-            } else if (c == '"' || c == '\'') {
-              in_string = 1;
-              string_delim = c;
-              search_col--;
-              continue;
-            }
-          }
+      if (item_idx < count) {
+        file_list_item *item = &items[item_idx];
 
-          if (ml_start_len && ml_end_len && !in_string) {
-            if (!in_multiline_comment &&
-                search_col - ml_end_len + 1 >= 0 &&
-                strncmp(&r->chars[search_col - ml_end_len + 1], ml_end, ml_end_len) == 0) {
-              in_multiline_comment = 1;
-              search_col -= ml_end_len;
-              continue;
-            } else if (in_multiline_comment &&
-                       search_col - ml_start_len + 1 >= 0 &&
-                       strncmp(&r->chars[search_col - ml_start_len + 1], ml_start, ml_start_len) == 0) {
-              in_multiline_comment = 0;
-              search_col -= ml_start_len;
-              continue;
-            }
-            if (in_multiline_comment) {
-              search_col--;
-              continue;
-            }
+        /* Highlight selected item */
+        if (item_idx == selected) {
+          set_background_rgb(&ab, theme_get_color(THEME_UI_SELECTION_BG));
+          set_foreground_rgb(&ab, theme_get_color(THEME_UI_SELECTION_FG));
+        } else {
+          set_background_rgb(&ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
+          /* Directories get different color */
+          if (item->is_directory) {
+            set_foreground_rgb(&ab, theme_get_color(THEME_SYNTAX_KEYWORD2));
+          } else {
+            set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
           }
+        }
 
-          if (c == current) {
-            depth++;
-          } else if (c == match) {
-            depth--;
-            if (depth == 0) {
-              editor.bracket_match_row = search_row;
-              editor.bracket_match_col = search_col;
-              if (direction > 0) {
-                editor.bracket_open_row = start_row;
-                editor.bracket_open_col = start_col;
-                editor.bracket_open_len = 1;
-                editor.bracket_close_row = search_row;
-                editor.bracket_close_col = search_col;
-                editor.bracket_close_len = 1;
+        /* Print item name with padding */
+        append_buffer_write(&ab, " ", 1);
+        int name_len = strlen(item->name);
+        int max_name = panel_width - 2;
+        if (name_len > max_name) name_len = max_name;
+        append_buffer_write(&ab, item->name, name_len);
+
+        /* Pad rest of line */
+        for (int p = name_len + 1; p < panel_width; p++) {
+          append_buffer_write(&ab, " ", 1);
+        }
+      } else {
+        /* Empty row in panel */
+        set_background_rgb(&ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
+        set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
+        for (int p = 0; p < panel_width; p++) {
+          append_buffer_write(&ab, " ", 1);
+        }
+      }
+    }
+  }
+
+  /* Reset colors, keep cursor hidden during dialog */
+  set_background_rgb(&ab, theme_get_color(THEME_UI_BACKGROUND));
+  set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
+
+  if (editor.sync_output) append_buffer_write(&ab, ESCAPE_SYNC_OUTPUT_END, ESCAPE_SYNC_OUTPUT_END_LEN);
+  terminal_write(ab.buffer, ab.length);
+  append_buffer_destroy(&ab);
+  /* Drawn over any split views */
+  view_invalidate();
+}
+
+/* Interactive file browser - returns selected filepath or NULL */
+char *editor_file_browser(void) {
+  char current_path[PATH_MAX];
+  if (editor_working_directory(current_path, sizeof(current_path)) == -1) {
+    strcpy(current_path, "/");
+  }
+
+  int selected = 0;
+  int scroll_offset = 0;
+
+  /* Mouse double-click tracking */
+  struct timespec fb_last_click_time = {0, 0};
+  int fb_last_click_item = -1;
+
+  while (1) {
+    file_list_cache_entry *listing = file_list_cache_get(current_path);
+    while (listing && listing->count == 0 && file_list_cache_loading(listing)) {
+      file_list_cache_read_more(listing);
+    }
+    if (!listing || listing->count == 0) {
+      editor_set_status_message("Cannot read directory: %s", current_path);
+      return NULL;
+    }
+    file_list_item *items = listing->items;
+    int count = listing->count;
+    int loading = file_list_cache_loading(listing);
+
+    /* Clamp selection */
+    if (selected >= count) selected = count - 1;
+    if (selected < 0) selected = 0;
+
+    /* Calculate visible rows (must match file_browser_draw panel calculation) */
+    int panel_height = editor.screen_rows / 2;
+    if (panel_height < 10) panel_height = 10;
+    if (panel_height > editor.screen_rows - 2) panel_height = editor.screen_rows - 2;
+    int visible_rows = panel_height - 2;  /* minus header and help bar */
+
+    /* Adjust scroll to keep selection visible */
+    if (selected < scroll_offset) {
+      scroll_offset = selected;
+    } else if (selected >= scroll_offset + visible_rows) {
+      scroll_offset = selected - visible_rows + 1;
+    }
+
+    /* Draw file browser */
+    file_browser_draw(items, count, selected, current_path, scroll_offset, loading);
+
+    /* While a big directory is still loading, read another batch whenever
+     * no key is waiting, so the list fills in on screen and stays usable */
+    if (loading) {
+      fd_set readfds;
+      struct timeval no_wait = {0, 0};
+      FD_ZERO(&readfds);
+      FD_SET(STDIN_FILENO, &readfds);
+      if (select(STDIN_FILENO + 1, &readfds, NULL, NULL, &no_wait) <= 0) {
+        /* Keep the same entry selected across the final sort */
+        char *selected_name = items[selected].actual_name;
+        file_list_cache_read_more(listing);
+        if (!file_list_cache_loading(listing)) {
+          for (int i = 0; i < listing->count; i++) {
+            if (listing->items[i].actual_name == selected_name) {
+              selected = i;
+              break;
+            }
+          }
+        }
+        continue;
+      }
+    }
+
+    int key = editor_read_key();
+    int do_open = 0;  /* Flag to trigger open action (Enter or double-click) */
+
+    if (key == CHAR_ESCAPE) {
+      return NULL;
+    } else if (key == ARROW_UP && selected > 0) {
+      selected--;
+    } else if (key == ARROW_DOWN && selected < count - 1) {
+      selected++;
+    } else if (key == PAGE_UP) {
+      selected -= visible_rows;
+      if (selected < 0) selected = 0;
+    } else if (key == PAGE_DOWN) {
+      selected += visible_rows;
+      if (selected >= count) selected = count - 1;
+    } else if (key == HOME_KEY) {
+      selected = 0;
+    } else if (key == END_KEY) {
+      selected = count - 1;
+    } else if (key == '\r') {
+      do_open = 1;
+    } else if (key == MOUSE_EVENT) {
+      /* Calculate panel geometry (must match file_browser_draw) */
+      int panel_width = (editor.screen_columns * 70) / 100;
+      if (panel_width < 40) panel_width = 40;
+      if (panel_width > editor.screen_columns - 4) panel_width = editor.screen_columns - 4;
+      int panel_left = (editor.screen_columns - panel_width) / 2;
+      int panel_top = (editor.screen_rows - panel_height) / 2;
+
+      /* Convert 1-indexed terminal coords to 0-indexed */
+      int mx = last_mouse_event.column - 1;
+      int my = last_mouse_event.row - 1;
+
+      /* Handle scroll wheel */
+      if (last_mouse_event.button_base == MOUSE_SCROLL_UP) {
+        if (selected > 0) selected--;
+      } else if (last_mouse_event.button_base == MOUSE_SCROLL_DOWN) {
+        if (selected < count - 1) selected++;
+      }
+      /* Handle left click */
+      else if (last_mouse_event.button_base == MOUSE_BUTTON_LEFT &&
+               !last_mouse_event.is_release && !last_mouse_event.is_motion) {
+        /* Check if click is within panel bounds */
+        if (mx >= panel_left && mx < panel_left + panel_width &&
+            my >= panel_top && my < panel_top + panel_height) {
+
+          int panel_row = my - panel_top;
+
+          /* Skip header (row 0) and help bar (last row) */
+          if (panel_row > 0 && panel_row < panel_height - 1) {
+            int clicked_item = scroll_offset + (panel_row - 1);
+
+            if (clicked_item < count) {
+              /* Detect double-click */
+              struct timespec now;
+              clock_gettime(CLOCK_MONOTONIC, &now);
+              long ms_diff = (now.tv_sec - fb_last_click_time.tv_sec) * 1000 +
+                             (now.tv_nsec - fb_last_click_time.tv_nsec) / 1000000;
+
+              if (ms_diff < 400 && clicked_item == fb_last_click_item) {
+                /* Double-click: open item */
+                selected = clicked_item;
+                do_open = 1;
               } else {
-                editor.bracket_open_row = search_row;
-                editor.bracket_open_col = search_col;
-                editor.bracket_open_len = 1;
-                editor.bracket_close_row = start_row;
-                editor.bracket_close_col = start_col;
-                editor.bracket_close_len = 1;
+                /* Single click: select item */
+                selected = clicked_item;
               }
-              return 1;
+
+              fb_last_click_time = now;
+              fb_last_click_item = clicked_item;
             }
           }
-          search_col--;
         }
-        search_row--;
-        if (search_row >= 0) {
-          search_col = editor.row[search_row].line_size - 1;
+      }
+    }
+
+    /* Handle open action (Enter key or double-click) */
+    if (do_open) {
+      file_list_item *item = &items[selected];
+      if (item->is_directory) {
+        /* Navigate into directory */
+        if (strcmp(item->actual_name, "..") == 0) {
+          /* Go to parent */
+          char *last_slash = strrchr(current_path, '/');
+          if (last_slash && last_slash != current_path) {
+            *last_slash = '\0';
+          } else {
+            strcpy(current_path, "/");
+          }
+        } else {
+          size_t cur_len = strlen(current_path);
+          size_t name_len = strlen(item->actual_name);
+          if (cur_len + 1 + name_len < PATH_MAX) {
+            strcat(current_path, "/");
+            strcat(current_path, item->actual_name);
+          }
         }
+        selected = 0;
+        scroll_offset = 0;
+        fb_last_click_item = -1;  /* Reset double-click state on directory change */
+      } else {
+        /* Selected a file - return full path */
+        size_t cur_len = strlen(current_path);
+        size_t name_len = strlen(item->actual_name);
+        size_t total_len = cur_len + 1 + name_len + 1;
+        char *result = malloc(total_len);
+        snprintf(result, total_len, "%s/%s", current_path, item->actual_name);
+        return result;
       }
-      break;
     }
   }
+}
+
+/* Clear current editor buffer */
+void editor_clear_buffer(void) {
+  /* Free all rows */
+  for (int i = 0; i < editor.row_count; i++) {
+    editor_free_row(&editor.row[i]);
+  }
+  free(editor.row);
+  editor.row = NULL;
+  editor.row_count = 0;
+
+  /* Reset cursor */
+  editor.cursor_x = 0;
+  editor.cursor_y = 0;
+  editor.render_x = 0;
+  editor.row_offset = 0;
+  editor.column_offset = 0;
+
+  /* Clear filename */
+  free(editor.filename);
+  editor.filename = NULL;
+  editor.file_size = 0;
+  editor.file_mtime = (struct timespec){0, 0};
+  editor.file_inode = 0;
+  editor.follow = 0;
+  editor.log_format = LOG_FORMAT_NONE;
+  editor.crlf = 0;
+  editor.no_final_newline = 0;
+
+  /* Clear selection */
+  selection_clear();
+
+  /* Reset undo state (history cleared implicitly with sqlite_sync_buffer) */
+  editor.undo_group_id = 0;
+  editor.undo_position = 0;
+  editor.undo_memory_groups = 0;
+
+  /* Clear dirty flag */
+  editor.dirty = 0;
+
+  /* Reset gutter */
+  editor_update_gutter_width();
+}
+
+/* Offer to save unsaved changes before the buffer is replaced.
+ * Returns 0 if the user cancelled, 1 to go ahead. */
+int editor_prompt_save_changes() {
+  if (!editor.dirty) return 1;
+
+  char *response = editor_prompt("Save changes? (y/n/ESC to cancel): %s", NULL);
+  if (response == NULL) return 0;
+  if (response[0] == 'y' || response[0] == 'Y') {
+    editor_save();
+  }
+  free(response);
+  return 1;
+}
+
+/* Open file browser and load selected file into a buffer (Ctrl+O) */
+void editor_open_file_browser(void) {
+  char *filepath = editor_file_browser();
+  if (filepath) {
+    buffer_open(filepath);
+    free(filepath);
+  } else {
+    editor_set_status_message("Open cancelled");
+  }
+}
+
+/* Get column position of first non-whitespace character in a row.
+ * Returns 0 if row is NULL, empty, or contains only whitespace. */
+int get_first_nonwhitespace_col(editor_row *row) {
+  if (row == NULL || row->line_size == 0) return 0;
+  int col = 0;
+  while (col < row->line_size && (row->chars[col] == ' ' || row->chars[col] == '\t')) {
+    col++;
+  }
+  /* If line is all whitespace, return 0 instead of end-of-line */
+  if (col >= row->line_size) return 0;
+  return col;
+}
+
+/* Move cursor in response to arrow keys.
+ * Handles line wrapping and soft-wrap visual navigation. */
+void editor_move_cursor(int key) {
+  editor_row *row = (editor.cursor_y >= editor.row_count) ? NULL : &editor.row[editor.cursor_y];
+
+  switch (key) {
+    case ARROW_LEFT:
+      if (editor.cursor_x != 0) {
+        editor.cursor_x--;
+      } else if (editor.cursor_y > 0) {
+        editor.cursor_y--;
+        editor.cursor_x = editor.row[editor.cursor_y].line_size;
+      }
+      break;
+    case ARROW_RIGHT:
+      if (row && editor.cursor_x < row->line_size) {
+        editor.cursor_x++;
+      } else if (row && editor.cursor_x == row->line_size) {
+        editor.cursor_y++;
+        editor.cursor_x = 0;
+      }
+      break;
+    case ARROW_UP:
+      if (editor.soft_wrap && editor.cursor_y < editor.row_count) {
+        /* With soft wrap, move between wrap segments within same line */
+        int available_width = editor.screen_columns - editor.gutter_width;
+        if (available_width <= 0) break;
+
+        editor_row *cur_row = &editor.row[editor.cursor_y];
+        editor_calculate_wrap_breaks(cur_row, available_width);
+
+        int current_rx = editor_row_cursor_to_render(cur_row, editor.cursor_x);
+        int wrap_segment = editor_rx_to_wrap_segment(cur_row, current_rx);
+
+        if (wrap_segment > 0) {
+          /* Move up one wrap segment within same line */
+          int segment_start = editor_wrap_segment_start(cur_row, wrap_segment);
+          int offset_in_segment = current_rx - segment_start;
+
+          int prev_segment_start = editor_wrap_segment_start(cur_row, wrap_segment - 1);
+          int prev_segment_end = editor_wrap_segment_end(cur_row, wrap_segment - 1);
+
+          int target_rx = prev_segment_start + offset_in_segment;
+          if (target_rx > prev_segment_end) target_rx = prev_segment_end;
+
+          editor.cursor_x = editor_row_render_to_cursor(cur_row, target_rx);
+        } else {
+          /* Already at first wrap segment, move to previous line */
+          if (editor.cursor_y != 0) {
+            editor.cursor_y--;
+            editor_row *prev_row = &editor.row[editor.cursor_y];
+            editor_calculate_wrap_breaks(prev_row, available_width);
+
+            /* Move to last wrap segment of previous line */
+            int total_segments = editor_row_visual_rows(prev_row);
+            int last_segment = total_segments - 1;
+
+            int segment_start = editor_wrap_segment_start(cur_row, 0);
+            int offset_in_segment = current_rx - segment_start;
+
+            int last_segment_start = editor_wrap_segment_start(prev_row, last_segment);
+            int last_segment_end = editor_wrap_segment_end(prev_row, last_segment);
+
+            int target_rx = last_segment_start + offset_in_segment;
+            if (target_rx > last_segment_end) target_rx = last_segment_end;
+
+            editor.cursor_x = editor_row_render_to_cursor(prev_row, target_rx);
+          }
+        }
+      } else {
+        /* Normal up movement without soft wrap */
+        if (editor.cursor_y != 0) {
+          editor.cursor_y--;
+        }
+      }
+      break;
+    case ARROW_DOWN:
+      if (editor.soft_wrap && editor.cursor_y < editor.row_count) {
+        /* With soft wrap, move between wrap segments within same line */
+        int available_width = editor.screen_columns - editor.gutter_width;
+        if (available_width <= 0) break;
+
+        editor_row *cur_row = &editor.row[editor.cursor_y];
+        editor_calculate_wrap_breaks(cur_row, available_width);
+
+        int current_rx = editor_row_cursor_to_render(cur_row, editor.cursor_x);
+        int wrap_segment = editor_rx_to_wrap_segment(cur_row, current_rx);
+        int total_segments = editor_row_visual_rows(cur_row);
+
+        if (wrap_segment < total_segments - 1) {
+          /* Move down one wrap segment within same line */
+          int segment_start = editor_wrap_segment_start(cur_row, wrap_segment);
+          int offset_in_segment = current_rx - segment_start;
+
+          int next_segment_start = editor_wrap_segment_start(cur_row, wrap_segment + 1);
+          int next_segment_end = editor_wrap_segment_end(cur_row, wrap_segment + 1);
+
+          int target_rx = next_segment_start + offset_in_segment;
+          if (target_rx > next_segment_end) target_rx = next_segment_end;
+
+          editor.cursor_x = editor_row_render_to_cursor(cur_row, target_rx);
+        } else {
+          /* Already at last wrap segment, move to next line */
+          if (editor.cursor_y < editor.row_count) {
+            editor.cursor_y++;
+            if (editor.cursor_y < editor.row_count) {
+              /* Move to first wrap segment of next line */
+              editor_row *next_row = &editor.row[editor.cursor_y];
+              editor_calculate_wrap_breaks(next_row, available_width);
+
+              int segment_start = editor_wrap_segment_start(cur_row, wrap_segment);
+              int offset_in_segment = current_rx - segment_start;
+
+              int first_segment_end = editor_wrap_segment_end(next_row, 0);
+
+              int target_rx = offset_in_segment;
+              if (target_rx > first_segment_end) target_rx = first_segment_end;
+
+              editor.cursor_x = editor_row_render_to_cursor(next_row, target_rx);
+            } else {
+              editor.cursor_x = 0;
+            }
+          }
+        }
+      } else {
+        /* Normal down movement without soft wrap */
+        if (editor.cursor_y < editor.row_count) {
+          editor.cursor_y++;
+        }
+      }
+      break;
+  }
+
+  row = (editor.cursor_y >= editor.row_count) ? NULL : &editor.row[editor.cursor_y];
+  int rowlen = row ? row->line_size : 0;
+  if (editor.cursor_x > rowlen) {
+    editor.cursor_x = rowlen;
+  }
+}
+
+/* Check if character is a word character (alphanumeric or underscore) */
+int is_word_char(int c) {
+  return isalnum(c) || c == '_';
+}
+
+/* Move cursor to the beginning of the previous word */
+void editor_move_word_left() {
+  if (editor.cursor_y >= editor.row_count) return;
+
+  /* If at beginning of line, move to end of previous line */
+  if (editor.cursor_x == 0) {
+    if (editor.cursor_y > 0) {
+      editor.cursor_y--;
+      editor.cursor_x = editor.row[editor.cursor_y].line_size;
+    }
+    return;
+  }
+
+  editor_row *row = &editor.row[editor.cursor_y];
+  int x = editor.cursor_x;
+
+  /* Skip whitespace/separators going backward */
+  while (x > 0 && !is_word_char(row->chars[x - 1])) {
+    x--;
+  }
+
+  /* Skip word characters going backward */
+  while (x > 0 && is_word_char(row->chars[x - 1])) {
+    x--;
+  }
+
+  editor.cursor_x = x;
+}
+
+/* Move cursor to the end of the next word */
+void editor_move_word_right() {
+  if (editor.cursor_y >= editor.row_count) return;
+
+  editor_row *row = &editor.row[editor.cursor_y];
+
+  /* If at end of line, move to beginning of next line */
+  if (editor.cursor_x >= row->line_size) {
+    if (editor.cursor_y < editor.row_count - 1) {
+      editor.cursor_y++;
+      editor.cursor_x = 0;
+    }
+    return;
+  }
+
+  int x = editor.cursor_x;
+
+  /* Skip word characters going forward */
+  while (x < row->line_size && is_word_char(row->chars[x])) {
+    x++;
+  }
+
+  /* Skip whitespace/separators going forward */
+  while (x < row->line_size && !is_word_char(row->chars[x])) {
+    x++;
+  }
+
+  editor.cursor_x = x;
+}
+
+/* Delete word backward (Ctrl+Backspace or Ctrl+W behavior) */
+void editor_delete_word_backward() {
+  if (editor.cursor_count > 0) {
+    multicursor_delete_word_backward_all();
+    return;
+  }
+
+  if (editor.cursor_y >= editor.row_count) return;
+
+  /* If at beginning of line, join with previous line */
+  if (editor.cursor_x == 0) {
+    if (editor.cursor_y > 0) {
+      editor_delete_char();
+    }
+    return;
+  }
+
+  editor_row *row = &editor.row[editor.cursor_y];
+  int start_x = editor.cursor_x;
+  int x = editor.cursor_x;
+
+  /* Skip whitespace/separators going backward */
+  while (x > 0 && !is_word_char(row->chars[x - 1])) {
+    x--;
+  }
+
+  /* Skip word characters going backward */
+  while (x > 0 && is_word_char(row->chars[x - 1])) {
+    x--;
+  }
+
+  /* Delete characters from x to start_x */
+  int chars_to_delete = start_x - x;
+  editor.cursor_x = x;
+  for (int i = 0; i < chars_to_delete; i++) {
+    editor_row_delete_char(row, editor.cursor_x);
+  }
+  editor.dirty++;
+}
+
+/* Delete word forward (Ctrl+Delete behavior) */
+void editor_delete_word_forward() {
+  if (editor.cursor_count > 0) {
+    multicursor_delete_word_forward_all();
+    return;
+  }
+
+  if (editor.cursor_y >= editor.row_count) return;
+
+  editor_row *row = &editor.row[editor.cursor_y];
+
+  /* If at end of line, join with next line */
+  if (editor.cursor_x >= row->line_size) {
+    if (editor.cursor_y < editor.row_count - 1) {
+      editor_move_cursor(ARROW_RIGHT);
+      editor_delete_char();
+    }
+    return;
+  }
+
+  int x = editor.cursor_x;
+
+  /* Skip word characters going forward */
+  while (x < row->line_size && is_word_char(row->chars[x])) {
+    x++;
+  }
+
+  /* Skip whitespace/separators going forward */
+  while (x < row->line_size && !is_word_char(row->chars[x])) {
+    x++;
+  }
+
+  /* Delete characters from cursor_x to x */
+  int chars_to_delete = x - editor.cursor_x;
+  for (int i = 0; i < chars_to_delete; i++) {
+    editor_row_delete_char(row, editor.cursor_x);
+  }
+  editor.dirty++;
+}
+
+/* Get the matching bracket character for a given bracket */
+char get_matching_bracket(char c) {
+  switch (c) {
+    case '(': return ')';
+    case ')': return '(';
+    case '[': return ']';
+    case ']': return '[';
+    case '{': return '}';
+    case '}': return '{';
+    default: return '\0';
+  }
+}
+
+/* Check if character is an opening bracket */
+int is_opening_bracket(char c) {
+  return c == '(' || c == '[' || c == '{';
+}
+
+/* Reset bracket match state */
+void editor_reset_bracket_match() {
+  editor.bracket_match_row = -1;
+  editor.bracket_match_col = -1;
+  editor.bracket_open_row = -1;
+  editor.bracket_open_col = -1;
+  editor.bracket_open_len = 0;
+  editor.bracket_close_row = -1;
+  editor.bracket_close_col = -1;
+  editor.bracket_close_len = 0;
+}
+
+static int editor_search_comment_forward(const char *needle, int needle_len, int start_row, int start_col, int *out_row, int *out_col) {
+  if (needle_len <= 0) return 0;
+  for (int r = start_row; r < editor.row_count; r++) {
+    editor_row *row = &editor.row[r];
+    int sc = (r == start_row) ? start_col : 0;
+    for (int c = sc; c + needle_len <= row->line_size; c++) {
+      if (!strncmp(&row->chars[c], needle, needle_len)) {
+        *out_row = r;
+        *out_col = c;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int editor_search_comment_backward(const char *needle, int needle_len, int start_row, int start_col, int *out_row, int *out_col) {
+  if (needle_len <= 0) return 0;
+  for (int r = start_row; r >= 0; r--) {
+    editor_row *row = &editor.row[r];
+    int sc = (r == start_row) ? start_col : row->line_size - 1;
+    for (int c = sc; c - needle_len + 1 >= 0; c--) {
+      if (!strncmp(&row->chars[c - needle_len + 1], needle, needle_len)) {
+        *out_row = r;
+        *out_col = c - needle_len + 1;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Internal: find match starting at specific position (bracket or comment delimiter). */
+static int editor_match_from(int start_row, int start_col) {
+  editor_reset_bracket_match();
+
+  if (start_row < 0 || start_row >= editor.row_count) return 0;
+  editor_row *row = &editor.row[start_row];
+  if (start_col < 0 || start_col >= row->line_size) return 0;
+
+  char current = row->chars[start_col];
+  char match = get_matching_bracket(current);
+
+  int direction = is_opening_bracket(current) ? 1 : -1;
+  int depth = 1;
+  int search_row = start_row;
+  int search_col = start_col + direction;
+  int in_string = 0;
+  char string_delim = '\0';
+  int in_multiline_comment = 0;
+
+  char *ml_start = editor.syntax ? editor.syntax->multiline_comment_start : NULL;
+  char *ml_end = editor.syntax ? editor.syntax->multiline_comment_end : NULL;
+  int ml_start_len = ml_start ? (int)strlen(ml_start) : 0;
+  int ml_end_len = ml_end ? (int)strlen(ml_end) : 0;
+
+  /* Handle multiline comment delimiters as matchable pairs */
+  if (ml_start_len && ml_end_len &&
+      start_col + ml_start_len <= row->line_size &&
+      !strncmp(&row->chars[start_col], ml_start, ml_start_len)) {
+    int mr, mc;
+    if (editor_search_comment_forward(ml_end, ml_end_len, start_row, start_col + ml_start_len, &mr, &mc)) {
+      editor.bracket_match_row = mr;
+      editor.bracket_match_col = mc;
+      editor.bracket_open_row = start_row;
+      editor.bracket_open_col = start_col;
+      editor.bracket_open_len = ml_start_len;
+      editor.bracket_close_row = mr;
+      editor.bracket_close_col = mc;
+      editor.bracket_close_len = ml_end_len;
+      return 1;
+    }
+    return 0;
+  }
+  if (ml_start_len && ml_end_len &&
+      start_col + ml_end_len <= row->line_size &&
+      !strncmp(&row->chars[start_col], ml_end, ml_end_len)) {
+    int mr, mc;
+    if (editor_search_comment_backward(ml_start, ml_start_len, start_row, start_col - 1, &mr, &mc)) {
+      editor.bracket_match_row = mr;
+      editor.bracket_match_col = mc;
+      editor.bracket_open_row = mr;
+      editor.bracket_open_col = mc;
+      editor.bracket_open_len = ml_start_len;
+      editor.bracket_close_row = start_row;
+      editor.bracket_close_col = start_col;
+      editor.bracket_close_len = ml_end_len;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (match == '\0') return 0;
+
+  while (depth > 0) {
+    if (direction > 0) {
+      while (search_row < editor.row_count) {
+        editor_row *r = &editor.row[search_row];
+        while (search_col < r->line_size) {
+          char c = r->chars[search_col];
+
+          if (!in_multiline_comment) {
+            if (in_string) {
+              if (c == string_delim) {
+                int backslashes = 0;
+                int k = search_col - 1;
+                while (k >= 0 && r->chars[k] == '\\') {
+                  backslashes++;
+                  k--;
+                }
+                if (backslashes % 2 == 0) {
+                  in_string = 0;
+                  string_delim = '\0';
+                }
+              }
+              search_col++;
+              continue;
+            } else if (c == '"' || c == '\'') {
+              in_string = 1;
+              string_delim = c;
+              search_col++;
+              continue;
+            }
+          }
+
+          if (ml_start_len && ml_end_len && !in_string) {
+            if (!in_multiline_comment &&
+                search_col + ml_start_len <= r->line_size &&
+                strncmp(&r->chars[search_col], ml_start, ml_start_len) == 0) {
+              in_multiline_comment = 1;
+              search_col += ml_start_len;
+              continue;
+            } else if (in_multiline_comment &&
+                       search_col + ml_end_len <= r->line_size &&
+                       strncmp(&r->chars[search_col], ml_end, ml_end_len) == 0) {
+              in_multiline_comment = 0;
+              search_col += ml_end_len;
+              continue;
+            }
+            if (in_multiline_comment) {
+              search_col++;
+              continue;
+            }
+          }
+
+          if (c == current) {
+            depth++;
+          } else if (c == match) {
+            depth--;
+            if (depth == 0) {
+              editor.bracket_match_row = search_row;
+              editor.bracket_match_col = search_col;
+              if (direction > 0) {
+                editor.bracket_open_row = start_row;
+                editor.bracket_open_col = start_col;
+                editor.bracket_open_len = 1;
+                editor.bracket_close_row = search_row;
+                editor.bracket_close_col = search_col;
+                editor.bracket_close_len = 1;
+              } else {
+                editor.bracket_open_row = search_row;
+                editor.bracket_open_col = search_col;
+                editor.bracket_open_len = 1;
+                editor.bracket_close_row = start_row;
+                editor.bracket_close_col = start_col;
+                editor.bracket_close_len = 1;
+              }
+              return 1;
+            }
+          }
+          search_col++;
+        }
+        search_row++;
+        search_col = 0;
+      }
+      break;
+    } else {
+      while (search_row >= 0) {
+        editor_row *r = &editor.row[search_row];
+        if (search_col < 0) search_col = r->line_size - 1;
+        while (search_col >= 0) {
+          char c = r->chars[search_col];
+
+          if (!in_multiline_comment) {
+            if (in_string) {
+              if (c == string_delim) {
+                int backslashes = 0;
+                int k = search_col - 1;
+                while (k >= 0 && r->chars[k] == '\\') {
+                  backslashes++;
+                  k--;
+                }
+                if (backslashes % 2 == 0) {
+                  in_string = 0;
+                  string_delim = '\0';
+                }
+              }
+              search_col--;
+              continue;
+            } else if (c == '"' || c == '\'') {
+              in_string = 1;
+              string_delim = c;
+              search_col--;
+              continue;
+            }
+          }
+
+          if (ml_start_len && ml_end_len && !in_string) {
+            if (!in_multiline_comment &&
+                search_col - ml_end_len + 1 >= 0 &&
+                strncmp(&r->chars[search_col - ml_end_len + 1], ml_end, ml_end_len) == 0) {
+              in_multiline_comment = 1;
+              search_col -= ml_end_len;
+              continue;
+            } else if (in_multiline_comment &&
+                       search_col - ml_start_len + 1 >= 0 &&
+                       strncmp(&r->chars[search_col - ml_start_len + 1], ml_start, ml_start_len) == 0) {
+              in_multiline_comment = 0;
+              search_col -= ml_start_len;
+              continue;
+            }
+            if (in_multiline_comment) {
+              search_col--;
+              continue;
+            }
+          }
+
+          if (c == current) {
+            depth++;
+          } else if (c == match) {
+            depth--;
+            if (depth == 0) {
+              editor.bracket_match_row = search_row;
+              editor.bracket_match_col = search_col;
+              if (direction > 0) {
+                editor.bracket_open_row = start_row;
+                editor.bracket_open_col = start_col;
+                editor.bracket_open_len = 1;
+                editor.bracket_close_row = search_row;
+                editor.bracket_close_col = search_col;
+                editor.bracket_close_len = 1;
+              } else {
+                editor.bracket_open_row = search_row;
+                editor.bracket_open_col = search_col;
+                editor.bracket_open_len = 1;
+                editor.bracket_close_row = start_row;
+                editor.bracket_close_col = start_col;
+                editor.bracket_close_len = 1;
+              }
+              return 1;
+            }
+          }
+          search_col--;
+        }
+        search_row--;
+        if (search_row >= 0) {
+          search_col = editor.row[search_row].line_size - 1;
+        }
+      }
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* Check if cursor position is inside a multiline comment.
+ * If so, sets out_start_row/col to the opening delimiter position.
+ * Returns 1 if inside comment, 0 otherwise. */
+static int editor_cursor_in_multiline_comment(int *out_start_row, int *out_start_col) {
+  char *ml_start = editor.syntax ? editor.syntax->multiline_comment_start : NULL;
+  char *ml_end = editor.syntax ? editor.syntax->multiline_comment_end : NULL;
+  if (!ml_start || !ml_end) return 0;
+  int ml_start_len = (int)strlen(ml_start);
+  int ml_end_len = (int)strlen(ml_end);
+  if (ml_start_len == 0 || ml_end_len == 0) return 0;
+
+  /* Scan forward from start of file to cursor, tracking comment state */
+  int in_comment = 0;
+  int comment_start_row = -1, comment_start_col = -1;
+  int in_string = 0;
+  char string_delim = '\0';
+
+  for (int r = 0; r <= editor.cursor_y && r < editor.row_count; r++) {
+    editor_row *row = &editor.row[r];
+    int end_col = (r == editor.cursor_y) ? editor.cursor_x : row->line_size;
+    for (int c = 0; c < end_col && c < row->line_size; c++) {
+      char ch = row->chars[c];
+
+      if (!in_comment) {
+        /* Track string state to avoid matching delimiters inside strings */
+        if (in_string) {
+          if (ch == string_delim) {
+            int backslashes = 0;
+            for (int k = c - 1; k >= 0 && row->chars[k] == '\\'; k--) backslashes++;
+            if (backslashes % 2 == 0) in_string = 0;
+          }
+          continue;
+        }
+        if (ch == '"' || ch == '\'') {
+          in_string = 1;
+          string_delim = ch;
+          continue;
+        }
+
+        /* Check for comment start */
+        if (c + ml_start_len <= row->line_size &&
+            strncmp(&row->chars[c], ml_start, ml_start_len) == 0) {
+          in_comment = 1;
+          comment_start_row = r;
+          comment_start_col = c;
+          c += ml_start_len - 1;  /* -1 because loop will increment */
+        }
+      } else {
+        /* Check for comment end */
+        if (c + ml_end_len <= row->line_size &&
+            strncmp(&row->chars[c], ml_end, ml_end_len) == 0) {
+          in_comment = 0;
+          comment_start_row = -1;
+          comment_start_col = -1;
+          c += ml_end_len - 1;
+        }
+      }
+    }
+  }
+
+  if (in_comment && comment_start_row >= 0) {
+    *out_start_row = comment_start_row;
+    *out_start_col = comment_start_col;
+    return 1;
+  }
+  return 0;
+}
+
+/* Find matching bracket position.
+ * Scans across lines and skips over string literals and multi-line comments
+ * based on current syntax rules. Sets editor.bracket_match_row/col.
+ * Returns 1 if match found, 0 otherwise.
+ * Additionally, when cursor is inside a bracketed region, match the nearest enclosing pair.
+ * When cursor is inside a multiline comment, highlights the comment delimiters. */
+int editor_find_matching_bracket() {
+  TRACE_SCOPE(__func__);
+  editor_reset_bracket_match();
+
+  if (editor.cursor_y >= editor.row_count) return 0;
+
+  editor_row *row = &editor.row[editor.cursor_y];
+
+  /* First check if cursor is inside a multiline comment */
+  int comment_start_row, comment_start_col;
+  if (editor_cursor_in_multiline_comment(&comment_start_row, &comment_start_col)) {
+    /* We're inside a comment - match the comment delimiters */
+    return editor_match_from(comment_start_row, comment_start_col);
+  }
+
+  if (editor.cursor_x >= row->line_size) return 0;
+
+  /* Try matching at the cursor position (bracket or comment delimiter) */
+  if (editor_match_from(editor.cursor_y, editor.cursor_x)) {
+    return 1;
+  }
+
+  /* Otherwise, find the nearest enclosing opening bracket before the cursor.
+   * We scan backwards, tracking string/comment state properly. */
+  char *ml_start = editor.syntax ? editor.syntax->multiline_comment_start : NULL;
+  char *ml_end = editor.syntax ? editor.syntax->multiline_comment_end : NULL;
+  int ml_start_len = ml_start ? (int)strlen(ml_start) : 0;
+  int ml_end_len = ml_end ? (int)strlen(ml_end) : 0;
+
+  /* Track depth of each bracket type to find enclosing bracket */
+  int paren_depth = 0;   /* () */
+  int bracket_depth = 0; /* [] */
+  int brace_depth = 0;   /* {} */
+  int in_string = 0;
+  char string_delim = '\0';
+  int in_multiline_comment = 0;
+
+  for (int sr = editor.cursor_y; sr >= 0; sr--) {
+    editor_row *r = &editor.row[sr];
+    int sc = (sr == editor.cursor_y) ? editor.cursor_x - 1 : r->line_size - 1;
+    for (; sc >= 0; sc--) {
+      char c = r->chars[sc];
+
+      /* Handle multiline comment tracking (backwards: end-delim enters, start-delim exits) */
+      if (ml_start_len && ml_end_len && !in_string) {
+        if (!in_multiline_comment &&
+            sc - ml_end_len + 1 >= 0 &&
+            strncmp(&r->chars[sc - ml_end_len + 1], ml_end, ml_end_len) == 0) {
+          in_multiline_comment = 1;
+          sc -= ml_end_len - 1;
+          continue;
+        } else if (in_multiline_comment &&
+                   sc - ml_start_len + 1 >= 0 &&
+                   strncmp(&r->chars[sc - ml_start_len + 1], ml_start, ml_start_len) == 0) {
+          in_multiline_comment = 0;
+          sc -= ml_start_len - 1;
+          continue;
+        }
+      }
+
+      /* Skip content inside comments */
+      if (in_multiline_comment) {
+        continue;
+      }
+
+      /* Handle string tracking */
+      if (in_string) {
+        if (c == string_delim) {
+          int backslashes = 0;
+          for (int k = sc - 1; k >= 0 && r->chars[k] == '\\'; k--) backslashes++;
+          if (backslashes % 2 == 0) {
+            in_string = 0;
+            string_delim = '\0';
+          }
+        }
+        continue;
+      }
+      if (c == '"' || c == '\'') {
+        in_string = 1;
+        string_delim = c;
+        continue;
+      }
+
+      /* Track bracket depth - closing brackets increase depth (going backwards) */
+      if (c == ')') paren_depth++;
+      else if (c == ']') bracket_depth++;
+      else if (c == '}') brace_depth++;
+      else if (c == '(') {
+        if (paren_depth > 0) paren_depth--;
+        else {
+          /* Found enclosing opening paren */
+          if (editor_match_from(sr, sc)) return 1;
+        }
+      }
+      else if (c == '[') {
+        if (bracket_depth > 0) bracket_depth--;
+        else {
+          /* Found enclosing opening bracket */
+          if (editor_match_from(sr, sc)) return 1;
+        }
+      }
+      else if (c == '{') {
+        if (brace_depth > 0) brace_depth--;
+        else {
+          /* Found enclosing opening brace */
+          if (editor_match_from(sr, sc)) return 1;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Jump cursor to matching bracket */
+void editor_jump_to_matching_bracket() {
+  if (editor_find_matching_bracket()) {
+    editor.cursor_y = editor.bracket_match_row;
+    editor.cursor_x = editor.bracket_match_col;
+  }
+}
+
+/* Adjust scroll speed based on time between consecutive scroll events.
+ * Faster scrolling = higher multiplier (tactile scrolling). */
+void editor_update_scroll_speed(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  /* Calculate time difference in microseconds */
+  long time_diff_us = (now.tv_sec - editor.last_scroll_time.tv_sec) * 1000000 +
+                      (now.tv_nsec - editor.last_scroll_time.tv_nsec) / 1000;
+
+  /* Adjust speed based on timing */
+  if (time_diff_us < 80000) {         /* <80ms: accelerate */
+    if (editor.scroll_speed < 15) editor.scroll_speed++;
+  } else if (time_diff_us > 150000) { /* >150ms: reset */
+    editor.scroll_speed = 1;
+  }
+  /* 80-150ms: maintain current speed */
+
+  editor.last_scroll_time = now;
+}
+
+void editor_handle_mouse_event() {
+  int screen_x = last_mouse_event.column - 1;
+  int screen_y = last_mouse_event.row - 1;
+
+  /* Handle scroll wheel with tactile (velocity-based) speed */
+  if (last_mouse_event.button_base == MOUSE_SCROLL_UP) {
+    editor_update_scroll_speed();
+    for (int i = 0; i < editor.scroll_speed; i++) {
+      editor_move_cursor(ARROW_UP);
+    }
+    /* Extend selection if active (for drag-scroll selection) */
+    if (editor.selection.active) {
+      selection_extend();
+    }
+    return;
+  }
+  if (last_mouse_event.button_base == MOUSE_SCROLL_DOWN) {
+    editor_update_scroll_speed();
+    for (int i = 0; i < editor.scroll_speed; i++) {
+      editor_move_cursor(ARROW_DOWN);
+    }
+    /* Extend selection if active (for drag-scroll selection) */
+    if (editor.selection.active) {
+      selection_extend();
+    }
+    return;
+  }
+
+  /* Only handle left button (button_base 0) */
+  if (last_mouse_event.button_base != MOUSE_BUTTON_LEFT) return;
+
+  /* With split views a click picks the view; positions become its own */
+  if (views.count > 1 && !view_mouse_position(&screen_x, &screen_y)) return;
+
+  /* Calculate message bar position (after status bar) */
+  int message_bar_row = editor.screen_rows + 1;
+
+  /* Check for click on message bar (last row) - copy message to clipboard */
+  if (screen_y == message_bar_row && !last_mouse_event.is_motion) {
+    if (!last_mouse_event.is_release && strlen(editor.status_message) > 0) {
+      clipboard_text *message = clipboard_text_from_string(editor.status_message);
+      clipboard_store(message, 1);
+      clipboard_text_release(message);
+      editor_set_status_message("Message copied to clipboard");
+    }
+    return;
+  }
+
+  /* Ignore clicks in gutter area */
+  if (screen_x < editor.gutter_width) return;
+
+  /* Ignore clicks on status bar or message bar */
+  if (screen_y >= editor.screen_rows) return;
+
+  /* Convert screen row to file row */
+  int visual_row = screen_y + editor.row_offset;
+  int file_row, wrap_row;
+  if (!editor_visual_to_logical(visual_row, &file_row, &wrap_row)) {
+    /* Click past end of file - go to last line */
+    file_row = editor.row_count > 0 ? editor.row_count - 1 : 0;
+    wrap_row = 0;
+  }
+
+  /* Clamp to valid row range */
+  if (file_row >= editor.row_count) {
+    file_row = editor.row_count > 0 ? editor.row_count - 1 : 0;
+  }
+
+  /* Calculate render_x from screen position */
+  int render_x = screen_x - editor.gutter_width;
+
+  /* For soft wrap, adjust based on wrap segment */
+  if (editor.soft_wrap && file_row < editor.row_count) {
+    editor_row *row = &editor.row[file_row];
+    int segment_start = editor_wrap_segment_start(row, wrap_row);
+    render_x += segment_start;
+  } else {
+    render_x += editor.column_offset;
+  }
+
+  /* Convert render_x to cursor_x (accounting for tabs) */
+  int cursor_x = 0;
+  if (file_row < editor.row_count) {
+    cursor_x = editor_row_render_to_cursor(&editor.row[file_row], render_x);
+    /* Clamp to line length */
+    if (cursor_x > editor.row[file_row].line_size) {
+      cursor_x = editor.row[file_row].line_size;
+    }
+  }
+
+  /* Modifier-assisted multi-cursor placement (Ctrl/Alt + click) */
+  if (!last_mouse_event.is_motion &&
+      !last_mouse_event.is_release &&
+      (last_mouse_event.modifiers & (MOUSE_MOD_CTRL | MOUSE_MOD_ALT))) {
+    if (multicursor_add(file_row, cursor_x)) {
+      selection_clear();
+      editor_set_status_message("Added cursor at line %d, col %d (total: %zu)",
+                                file_row + 1, cursor_x + 1, editor.cursor_count + 1);
+    } else {
+      editor_set_status_message("Cursor already exists here");
+    }
+    return;
+  }
+
+  /* Handle mouse motion (dragging) - extend selection */
+  if (last_mouse_event.is_motion) {
+    if (editor.selection.active) {
+      editor.cursor_x = cursor_x;
+      editor.cursor_y = file_row;
+      selection_extend();
+    }
+    return;
+  }
+
+  /* Ignore button releases */
+  if (last_mouse_event.is_release) return;
+
+  /* Check for Shift+Click to extend selection */
+  if (last_mouse_event.modifiers & MOUSE_MOD_SHIFT) {
+    if (!editor.selection.active) {
+      /* Start selection from current cursor position */
+      selection_start();
+    }
+    /* Move cursor and extend selection to click position */
+    editor.cursor_x = cursor_x;
+    editor.cursor_y = file_row;
+    selection_extend();
+    return;
+  }
+
+  /* Handle multi-click detection (double/triple click) */
+  selection_detect_multi_click(file_row, cursor_x);
+
+  if (editor.selection.click_count == 2) {
+    /* Double-click: select word */
+    editor.cursor_x = cursor_x;
+    editor.cursor_y = file_row;
+    selection_select_word(file_row, cursor_x);
+  } else if (editor.selection.click_count >= 3) {
+    /* Triple-click: select line */
+    editor.cursor_x = cursor_x;
+    editor.cursor_y = file_row;
+    selection_select_line(file_row);
+  } else {
+    /* Single click: start drag selection */
+    editor.cursor_x = cursor_x;
+    editor.cursor_y = file_row;
+    selection_start();
+  }
+}
+
+/* Handle a single keypress. Maps keys to editor commands
+ * including editing, navigation, search, and quit. */
+void editor_process_keypress() {
+  static int quit_times = MITER_QUIT_TIMES;
+
+  int key = editor_read_key();
+
+  /* No input available (timeout) - return immediately */
+  if (key == -1) return;
+
+  /* Traced from here, so the event is the key's handling and not the
+   * wait for it */
+  TRACE_SCOPE(__func__);
+
+  /* The huge file viewer moves, searches and copies but never edits */
+  if (viewer.active && !viewer_allows_key(key)) {
+    editor_set_status_message("%s is open read-only (too large to edit)", editor.filename);
+    return;
+  }
+
+  /* Reset Smart Home toggle state for all keys except Home */
+  if (key != HOME_KEY) {
+    editor.last_key_was_home = 0;
+  }
+
+  switch (key) {
+    case '\r':
+      editor_insert_newline();
+      break;
+
+    case CTRL_KEY('q'):
+      /* A server keeps the buffer, unsaved or not, for the next attach */
+      if (server.enabled) {
+        server_detach_and_wait(NULL);
+        return;
+      }
+      if (buffer_dirty_count() > 0 && quit_times > 0) {
+        editor_set_status_message("You have unsaved changes in %d buffer%s. Save with Ctrl-S, "
+          "or press Ctrl-Q %d more times to quit anyway.", buffer_dirty_count(),
+          buffer_dirty_count() == 1 ? "" : "s", quit_times);
+        quit_times--;
+        return;
+      }
+      /* A script that quits still gets its report */
+      if (headless.enabled) headless_finish();
+      terminal_write(ESCAPE_CLEAR_SCREEN, ESCAPE_CLEAR_SCREEN_LEN);
+      terminal_write(ESCAPE_CURSOR_HOME, ESCAPE_CURSOR_HOME_LEN);
+      /* removed */
+      exit(0);
+      break;
+
+    case CTRL_KEY('s'):
+      editor_save();
+      break;
+
+    case CTRL_KEY('o'):
+      editor_open_file_browser();
+      break;
+
+    case CTRL_KEY('p'):
+      editor_open_fuzzy_finder();
+      break;
+
+    case HOME_KEY:
+      selection_clear();
+      {
+        /* Smart Home: toggle between first non-whitespace and column 0 */
+        editor_row *row = (editor.cursor_y < editor.row_count) ?
+                          &editor.row[editor.cursor_y] : NULL;
+        int first_nonws = get_first_nonwhitespace_col(row);
+
+        if (editor.last_key_was_home) {
+          /* Second press: toggle to the other position */
+          if (editor.cursor_x == 0) {
+            editor.cursor_x = first_nonws;
+          } else {
+            editor.cursor_x = 0;
+          }
+        } else {
+          /* First press: go to first non-whitespace, or column 0 if already there */
+          if (editor.cursor_x == first_nonws || first_nonws == 0) {
+            editor.cursor_x = 0;
+          } else {
+            editor.cursor_x = first_nonws;
+          }
+        }
+        editor.last_key_was_home = 1;
+
+        /* Align secondary cursors to same home target */
+        if (editor.cursor_count > 0) {
+          int use_first_nonws = (editor.cursor_x != 0);
+          multicursor_apply_home_position(use_first_nonws);
+        }
+      }
+      break;
+
+    case END_KEY:
+      selection_clear();
+      if (editor.cursor_y < editor.row_count)
+        editor.cursor_x = editor.row[editor.cursor_y].line_size;
+      if (editor.cursor_count > 0) {
+        multicursor_apply_end_position();
+      }
+      break;
+
+    case CTRL_KEY('f'):
+      editor_find();
+      break;
+
+    case CTRL_KEY('a'):
+      selection_select_all();
+      break;
+
+    case CTRL_KEY('g'):
+      editor_jump_to_line();
+      break;
+
+    case ALT_T:
+      theme_cycle();
+      break;
+
+    case ALT_L:
+      editor_toggle_line_numbers();
+      break;
+
+    case ALT_Q:
+      editor_reflow_paragraph();
+      break;
+
+    case ALT_J:
+      editor_join_paragraph();
+      break;
+
+    case ALT_S:
+      /* removed */
+      break;
+
+    case ALT_R:
+      /* SQL replace removed - Miter doesn't have SQLite */
+      break;
+
+    case ALT_N:
+      /* Snippet search removed - Miter doesn't have SQLite */
+      break;
+
+    case ALT_W:
+      editor_toggle_soft_wrap();
+      break;
+
+    case ALT_Z:
+      editor_toggle_center_scroll();
+      break;
+
+    case ALT_H:
+      editor_toggle_perf_hud();
+      break;
+
+    case ALT_B:
+      buffer_pick();
+      break;
+
+    case ALT_K:
+      buffer_close();
+      break;
+
+    case ALT_COMMA:
+      buffer_cycle(-1);
+      break;
+
+    case ALT_PERIOD:
+      buffer_cycle(1);
+      break;
+
+    case ALT_MINUS:
+      view_split(VIEW_NODE_STACKED);
+      break;
+
+    case ALT_BACKSLASH:
+      view_split(VIEW_NODE_SIDE_BY_SIDE);
+      break;
+
+    case ALT_F:
+      view_next();
+      break;
+
+    case ALT_X:
+      view_close();
+      break;
+
+    case ALT_E:
+      editor_toggle_follow();
+      break;
+
+    case ALT_G:
+      editor_jump_to_time();
+      break;
+
+    case ALT_I:
+      editor_show_memory_stats();
+      break;
+
+    case ALT_OPEN_BRACKET:
+      editor_skip_opening_pair();
+      break;
+
+    case ALT_CLOSE_BRACKET:
+      editor_skip_closing_pair();
+      break;
+
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DEL_KEY:
+      if (key == DEL_KEY) editor_move_cursor(ARROW_RIGHT);
+      editor_delete_char();
+      break;
+
+    case PAGE_UP:
+    case PAGE_DOWN:
+      {
+        int original_line = editor.cursor_y;
+        selection_clear();
+        if (key == PAGE_UP) {
+          editor.cursor_y = editor.row_offset;
+        } else if (key == PAGE_DOWN) {
+          editor.cursor_y = editor.row_offset + editor.screen_rows - 1;
+          if (editor.cursor_y > editor.row_count) editor.cursor_y = editor.row_count;
+        }
+
+        int times = editor.screen_rows;
+        while (times--)
+          editor_move_cursor(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+
+        if (editor.cursor_count > 0) {
+          int delta_rows = editor.cursor_y - original_line;
+          multicursor_apply_vertical_delta(delta_rows);
+        }
+      }
+      break;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+      selection_clear();
+      editor_move_cursor(key);
+      if (editor.cursor_count > 0) {
+        multicursor_move_all(key);
+      }
+      break;
+
+    /* Shift+Arrow: extend selection while moving cursor */
+    case SHIFT_ARROW_UP:
+      if (!editor.selection.active) selection_start();
+      editor_move_cursor(ARROW_UP);
+      selection_extend();
+      break;
+    case SHIFT_ARROW_DOWN:
+      if (!editor.selection.active) selection_start();
+      editor_move_cursor(ARROW_DOWN);
+      selection_extend();
+      break;
+    case SHIFT_ARROW_LEFT:
+      if (!editor.selection.active) selection_start();
+      editor_move_cursor(ARROW_LEFT);
+      selection_extend();
+      break;
+    case SHIFT_ARROW_RIGHT:
+      if (!editor.selection.active) selection_start();
+      editor_move_cursor(ARROW_RIGHT);
+      selection_extend();
+      break;
+    case SHIFT_HOME:
+      if (!editor.selection.active) selection_start();
+      editor.cursor_x = 0;
+      selection_extend();
+      break;
+    case SHIFT_END:
+      if (!editor.selection.active) selection_start();
+      if (editor.cursor_y < editor.row_count)
+        editor.cursor_x = editor.row[editor.cursor_y].line_size;
+      selection_extend();
+      break;
+
+    /* Word navigation (Ctrl+Arrow) */
+    case CTRL_ARROW_LEFT:
+      selection_clear();
+      editor_move_word_left();
+      if (editor.cursor_count > 0) {
+        multicursor_move_word_left_all();
+      }
+      break;
+    case CTRL_ARROW_RIGHT:
+      selection_clear();
+      editor_move_word_right();
+      if (editor.cursor_count > 0) {
+        multicursor_move_word_right_all();
+      }
+      break;
+
+    /* Word deletion */
+    case CTRL_KEY('w'):  /* Ctrl+W: delete word backward (Unix standard) */
+      selection_clear();
+      editor_delete_word_backward();
+      break;
+    case CTRL_DELETE:    /* Ctrl+Delete: delete word forward */
+      selection_clear();
+      editor_delete_word_forward();
+      break;
+
+    /* Clipboard operations */
+    case CTRL_KEY('c'):
+      editor_copy();
+      break;
+    case CTRL_KEY('x'):
+      editor_cut();
+      break;
+    case CTRL_KEY('v'):
+      editor_paste();
+      break;
+
+    /* Undo/Redo operations */
+    case CTRL_KEY('z'):
+      editor_undo();
+      break;
+    case CTRL_KEY('y'):
+      editor_redo();
+      break;
+
+    /* Line manipulation operations */
+    case CTRL_KEY('d'):
+      editor_duplicate_line();
+      break;
+    case CTRL_KEY('k'):
+      editor_delete_line();
+      break;
+    case CTRL_KEY('j'):
+      editor_join_lines();
+      break;
+    case ALT_SHIFT_UP:
+      editor_move_line_up();
+      break;
+    case ALT_SHIFT_DOWN:
+      editor_move_line_down();
+      break;
+
+    /* Multi-cursor operations */
+    case ALT_UP:
+      multicursor_add_above();
+      break;
+    case ALT_DOWN:
+      multicursor_add_below();
+      break;
+    case ALT_C:
+      multicursor_add_at_primary();
+      break;
+    case ALT_V:
+      multicursor_add_at_primary_and_advance();
+      break;
+
+    case MOUSE_EVENT:
+      editor_handle_mouse_event();
+      break;
+
+    /* Bracket matching */
+    case CTRL_KEY(']'):
+      editor_jump_to_matching_bracket();
+      break;
+
+    /* Comment toggle operations */
+    case 31:  /* Ctrl+/ sends ASCII 31 (0x1F) */
+      editor_toggle_line_comment();
+      break;
+    case CTRL_KEY('\\'):  /* Ctrl+\ for block comment (alternative) */
+      editor_toggle_block_comment();
+      break;
+
+    case CTRL_KEY('l'):
+      break;
+    case CHAR_ESCAPE:
+      /* Escape: clear secondary cursors and selection */
+      if (editor.cursor_count > 0) {
+        size_t cleared = editor.cursor_count;
+        multicursor_clear();
+        editor_set_status_message("Cleared %zu secondary cursor(s)", cleared);
+      }
+      selection_clear();
+      break;
+
+    /* Tab: indent line, Shift+Tab: unindent line */
+    case '\t':
+      editor_indent_line();
+      break;
+    case SHIFT_TAB:
+      editor_unindent_line();
+      break;
+
+    default:
+      editor_insert_char(key);
+      break;
+  }
+
+  quit_times = MITER_QUIT_TIMES;
+}
+
+/*** fuzzy finder ***/
+
+/* One indexed directory: its path relative to the project root ("" for the
+ * root itself), stored once in the index string pool and shared by every
+ * file inside it */
+typedef struct {
+  /* Offset of the NUL-terminated path in the string pool */
+  uint32_t path;
+  /* Length of the path */
+  uint32_t path_length;
+  /* Characters present in the path (see fuzzy_character_mask) */
+  uint32_t mask;
+} fuzzy_directory;
+
+/* One indexed file */
+typedef struct {
+  /* Index into fuzzy_index.directories */
+  uint32_t directory;
+  /* Offset of the NUL-terminated name in the string pool */
+  uint32_t name;
+  /* Length of the name */
+  uint32_t name_length;
+  /* Characters present in the name (see fuzzy_character_mask) */
+  uint32_t mask;
+} fuzzy_file;
+
+/* Compact project file index. All strings live in one pool and directory
+ * paths are interned, so each file costs sixteen bytes plus its name. */
+typedef struct {
+  char *strings;
+  size_t strings_length;
+  size_t strings_capacity;
+  fuzzy_directory *directories;
+  uint32_t directory_count;
+  uint32_t directory_capacity;
+  fuzzy_file *files;
+  uint32_t file_count;
+  uint32_t file_capacity;
+} fuzzy_index;
+
+/* A directory's identity on disk; the same directory reached through
+ * different symlinks has the same one */
+typedef struct {
+  dev_t device;
+  ino_t inode;
+  int used;
+} fuzzy_directory_identity;
+
+/* Shared state of one parallel tree walk */
+typedef struct {
+  pthread_mutex_t lock;
+  /* Signalled when directories are queued or a worker goes idle */
+  pthread_cond_t wakeup;
+  /* Project root, opened once so workers can use openat() */
+  int root_fd;
+  /* Relative paths of directories waiting to be read */
+  char **queue;
+  int queue_count;
+  int queue_capacity;
+  /* Workers currently reading a directory */
+  int active;
+  /* Index being built; only touched with lock held */
+  fuzzy_index *index;
+  /* Open-addressed set of the directories already read, by device and
+   * inode, so symlinks back up the tree don't loop; lock held */
+  fuzzy_directory_identity *visited;
+  size_t visited_count;
+  size_t visited_capacity;
+  /* fuzzy_finder.walk_generation when the walk started */
+  unsigned long generation;
+} fuzzy_walk;
+
+/* What a background walk is asked to do */
+typedef struct {
+  char root[PATH_MAX];
+  unsigned long generation;
+} fuzzy_walk_request;
+
+/* A scored file */
+typedef struct {
+  uint32_t file;
+  int score;
+} fuzzy_match;
+
+/* Matches for one prefix of the query. Level n holds the files matching the
+ * first n query characters, so typing another character only rescans the
+ * previous level and backspace just drops back a level. */
+typedef struct {
+  /* Matching file indexes in index order (NULL at level 0: every file) */
+  uint32_t *candidates;
+  uint32_t candidate_count;
+  /* Best matches, best first */
+  fuzzy_match results[FUZZY_RESULTS_MAX];
+  int result_count;
+  /* False when the level must be recomputed before use */
+  int valid;
+} fuzzy_level;
+
+/* One slice of a scoring pass, run on its own thread for big passes */
+typedef struct {
+  fuzzy_index *index;
+  /* Files to score: input[begin..end), or file numbers begin..end if NULL */
+  const uint32_t *input;
+  uint32_t begin;
+  uint32_t end;
+  const char *query;
+  int query_length;
+  int case_sensitive;
+  /* fuzzy_character_mask of the query */
+  uint32_t query_mask;
+  /* Matching files are written here, in order */
+  uint32_t *output;
+  uint32_t output_count;
+  /* Min-heap of the best matches seen by this slice */
+  fuzzy_match heap[FUZZY_RESULTS_MAX];
+  int heap_count;
+  /* Request being scored; the slice stops early once a newer one is posted */
+  unsigned long generation;
+  int cancelled;
+} fuzzy_pass;
+
+/* The best matches for one query, as shown by the panel */
+typedef struct {
+  fuzzy_match results[FUZZY_RESULTS_MAX];
+  int result_count;
+  /* Files matching the query */
+  uint32_t match_count;
+  /* Time taken to score the query, shown in the panel header */
+  double pass_ms;
+} fuzzy_answer;
+
+/* Finder state kept for the whole session */
+static struct {
+  pthread_mutex_t lock;
+  /* Project root the index belongs to */
+  char root[PATH_MAX];
+  /* Index the panel searches; owned by the main thread */
+  fuzzy_index *index;
+  /* Freshly walked index waiting for the main thread, or NULL */
+  fuzzy_index *published;
+  /* True while a background walk runs */
+  int walking;
+  /* Number of the current walk. Bumping it abandons a running walk: it
+   * stops early and throws its index away instead of publishing it */
+  unsigned long walk_generation;
+  /* Files found so far by the running walk */
+  uint32_t walk_progress;
+  /* When the last walk was started */
+  time_t last_walk;
+} fuzzy_finder = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Query typed into the open panel; owned by the main thread */
+static char fuzzy_query[FUZZY_QUERY_MAX + 1];
+static int fuzzy_query_length = 0;
+
+/* Per-prefix levels and the query they were computed for; owned by the
+ * scoring thread */
+static fuzzy_level fuzzy_levels[FUZZY_QUERY_MAX + 1];
+static char fuzzy_levels_query[FUZZY_QUERY_MAX];
+static int fuzzy_levels_query_length = 0;
+
+/* Scoring runs on its own thread while the panel is open, so a keystroke
+ * never waits for a pass over a big tree: the main thread posts each query
+ * and draws the latest answer, and posting cancels the pass under way. */
+static struct {
+  pthread_mutex_t lock;
+  /* Signalled when a request is posted and when a request is finished */
+  pthread_cond_t changed;
+  pthread_t thread;
+  int running;
+  int stop;
+  /* Latest request, numbered by generation */
+  char query[FUZZY_QUERY_MAX];
+  int query_length;
+  fuzzy_index *index;
+  /* True until the thread has reset its levels for a newly posted index */
+  int index_changed;
+  unsigned long generation;
+  /* Index the thread is reading right now, or NULL when idle */
+  fuzzy_index *scoring_index;
+  /* Answer to request number answered_generation */
+  unsigned long answered_generation;
+  fuzzy_answer answer;
+} fuzzy_scorer = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .changed = PTHREAD_COND_INITIALIZER
+};
+
+/* Summarize which characters occur in a string as a bit set: one bit per
+ * letter (case folded) and digits folded onto the six remaining bits. A
+ * file whose mask lacks any bit of the query's mask can't match, which
+ * rejects most files with a single AND and no string access. */
+static uint32_t fuzzy_character_mask(const char *string, size_t length) {
+  uint32_t mask = 0;
+  for (size_t i = 0; i < length; i++) {
+    char c = string[i];
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    if (c >= 'a' && c <= 'z') {
+      mask |= 1u << (c - 'a');
+    } else if (c >= '0' && c <= '9') {
+      mask |= 1u << (26 + (c - '0') % 6);
+    }
+  }
+  return mask;
+}
+
+/* Free an index and everything it owns. */
+static void fuzzy_index_free(fuzzy_index *index) {
+  if (!index) return;
+  free(index->strings);
+  free(index->directories);
+  free(index->files);
+  free(index);
+}
+
+/* Copy a string into the index pool. Returns its offset, or UINT32_MAX if
+ * out of memory or the pool is full. */
+static uint32_t fuzzy_index_intern(fuzzy_index *index, const char *string, size_t length) {
+  if (index->strings_length + length + 1 > UINT32_MAX) return UINT32_MAX;
+
+  if (index->strings_length + length + 1 > index->strings_capacity) {
+    size_t capacity = index->strings_capacity ? index->strings_capacity * 2 : 65536;
+    while (capacity < index->strings_length + length + 1) capacity *= 2;
+    char *strings = realloc(index->strings, capacity);
+    if (!strings) return UINT32_MAX;
+    index->strings = strings;
+    index->strings_capacity = capacity;
+  }
+
+  uint32_t offset = index->strings_length;
+  memcpy(index->strings + offset, string, length);
+  index->strings[offset + length] = '\0';
+  index->strings_length += length + 1;
+  return offset;
+}
+
+/* Add a directory to the index. Returns its number, or UINT32_MAX on failure. */
+static uint32_t fuzzy_index_add_directory(fuzzy_index *index, const char *path, size_t length) {
+  if (index->directory_count >= index->directory_capacity) {
+    uint32_t capacity = index->directory_capacity ? index->directory_capacity * 2 : 1024;
+    fuzzy_directory *directories = realloc(index->directories, capacity * sizeof(fuzzy_directory));
+    if (!directories) return UINT32_MAX;
+    index->directories = directories;
+    index->directory_capacity = capacity;
+  }
+
+  uint32_t offset = fuzzy_index_intern(index, path, length);
+  if (offset == UINT32_MAX) return UINT32_MAX;
+
+  index->directories[index->directory_count].path = offset;
+  index->directories[index->directory_count].path_length = length;
+  index->directories[index->directory_count].mask = fuzzy_character_mask(path, length);
+  return index->directory_count++;
+}
+
+/* Add a file in an already indexed directory. Returns 0 on success. */
+static int fuzzy_index_add_file(fuzzy_index *index, uint32_t directory, const char *name, size_t length) {
+  if (index->file_count >= index->file_capacity) {
+    uint32_t capacity = index->file_capacity ? index->file_capacity * 2 : 4096;
+    fuzzy_file *files = realloc(index->files, capacity * sizeof(fuzzy_file));
+    if (!files) return -1;
+    index->files = files;
+    index->file_capacity = capacity;
+  }
+
+  uint32_t offset = fuzzy_index_intern(index, name, length);
+  if (offset == UINT32_MAX) return -1;
+
+  index->files[index->file_count].directory = directory;
+  index->files[index->file_count].name = offset;
+  index->files[index->file_count].name_length = length;
+  index->files[index->file_count].mask = fuzzy_character_mask(name, length);
+  index->file_count++;
+  return 0;
+}
+
+/* Write a file's path relative to the root into buffer.
+ * Returns the path length, or -1 if it does not fit. */
+static int fuzzy_index_file_path(fuzzy_index *index, uint32_t file_number, char *buffer, size_t size) {
+  fuzzy_file *file = &index->files[file_number];
+  fuzzy_directory *directory = &index->directories[file->directory];
+  size_t length = directory->path_length + (directory->path_length ? 1 : 0) + file->name_length;
+  if (length + 1 > size) return -1;
+
+  char *p = buffer;
+  if (directory->path_length) {
+    memcpy(p, index->strings + directory->path, directory->path_length);
+    p += directory->path_length;
+    *p++ = '/';
+  }
+  memcpy(p, index->strings + file->name, file->name_length);
+  buffer[length] = '\0';
+  return length;
+}
+
+/* Build the on-disk cache path for the index of a project root. The file
+ * name is a hash of the root, so every project gets its own index.
+ * Returns 0 on success. */
+static int fuzzy_index_cache_path(const char *root, char *buffer, size_t size) {
+  /* FNV-1a */
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  for (const char *p = root; *p; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= FNV_PRIME;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "files-%016llx.idx", hash);
+  return editor_cache_path(name, buffer, size);
+}
+
+/* Save an index so the next run can search immediately. Written to a
+ * temporary file and renamed into place, so readers never see half of it. */
+static void fuzzy_index_save(fuzzy_index *index, const char *root) {
+  char path[PATH_MAX], temporary[PATH_MAX];
+  if (fuzzy_index_cache_path(root, path, sizeof(path)) != 0) return;
+  if (snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) >= (int)sizeof(temporary)) return;
+
+  FILE *file = fopen(temporary, "wb");
+  if (!file) return;
+
+  uint32_t root_length = strlen(root);
+  uint64_t strings_length = index->strings_length;
+  int ok = fwrite(FUZZY_INDEX_MAGIC, 1, FUZZY_INDEX_MAGIC_LEN, file) == FUZZY_INDEX_MAGIC_LEN &&
+           fwrite(&root_length, sizeof(root_length), 1, file) == 1 &&
+           fwrite(root, 1, root_length, file) == root_length &&
+           fwrite(&strings_length, sizeof(strings_length), 1, file) == 1 &&
+           fwrite(&index->directory_count, sizeof(uint32_t), 1, file) == 1 &&
+           fwrite(&index->file_count, sizeof(uint32_t), 1, file) == 1 &&
+           fwrite(index->strings, 1, strings_length, file) == strings_length &&
+           fwrite(index->directories, sizeof(fuzzy_directory), index->directory_count, file) == index->directory_count &&
+           fwrite(index->files, sizeof(fuzzy_file), index->file_count, file) == index->file_count;
+
+  if (fclose(file) != 0) ok = 0;
+  if (!ok || rename(temporary, path) != 0) unlink(temporary);
+}
+
+/* Load the saved index for a root. Every offset is checked, so a damaged
+ * cache file is rejected rather than trusted. Returns NULL if there is no
+ * usable index. */
+static fuzzy_index *fuzzy_index_load(const char *root) {
+  char path[PATH_MAX];
+  if (fuzzy_index_cache_path(root, path, sizeof(path)) != 0) return NULL;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) return NULL;
+
+  fuzzy_index *index = calloc(1, sizeof(fuzzy_index));
+  char magic[FUZZY_INDEX_MAGIC_LEN];
+  char saved_root[PATH_MAX];
+  uint32_t root_length;
+  uint64_t strings_length;
+  int ok = index &&
+           fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+           memcmp(magic, FUZZY_INDEX_MAGIC, FUZZY_INDEX_MAGIC_LEN) == 0 &&
+           fread(&root_length, sizeof(root_length), 1, file) == 1 &&
+           root_length < sizeof(saved_root) &&
+           fread(saved_root, 1, root_length, file) == root_length &&
+           fread(&strings_length, sizeof(strings_length), 1, file) == 1 &&
+           strings_length < UINT32_MAX &&
+           fread(&index->directory_count, sizeof(uint32_t), 1, file) == 1 &&
+           fread(&index->file_count, sizeof(uint32_t), 1, file) == 1 &&
+           index->file_count <= FUZZY_INDEX_MAX_FILES &&
+           index->directory_count <= FUZZY_INDEX_MAX_FILES;
+
+  if (ok) {
+    saved_root[root_length] = '\0';
+    ok = strcmp(saved_root, root) == 0;
+  }
+  if (ok) {
+    index->strings_length = index->strings_capacity = strings_length;
+    index->directory_capacity = index->directory_count;
+    index->file_capacity = index->file_count;
+    index->strings = malloc(strings_length + 1);
+    index->directories = malloc((index->directory_count + 1) * sizeof(fuzzy_directory));
+    index->files = malloc((index->file_count + 1) * sizeof(fuzzy_file));
+    ok = index->strings && index->directories && index->files &&
+         fread(index->strings, 1, strings_length, file) == strings_length &&
+         fread(index->directories, sizeof(fuzzy_directory), index->directory_count, file) == index->directory_count &&
+         fread(index->files, sizeof(fuzzy_file), index->file_count, file) == index->file_count;
+  }
+  fclose(file);
+
+  for (uint32_t i = 0; ok && i < index->directory_count; i++) {
+    fuzzy_directory *directory = &index->directories[i];
+    ok = (uint64_t)directory->path + directory->path_length < strings_length;
+  }
+  for (uint32_t i = 0; ok && i < index->file_count; i++) {
+    fuzzy_file *file_entry = &index->files[i];
+    ok = file_entry->directory < index->directory_count &&
+         (uint64_t)file_entry->name + file_entry->name_length < strings_length;
+  }
+
+  if (!ok) {
+    fuzzy_index_free(index);
+    return NULL;
+  }
+  return index;
+}
+
+/* Queue a directory for reading. Caller holds the walk lock. */
+static void fuzzy_walk_push(fuzzy_walk *walk, char *relative_path) {
+  if (walk->queue_count >= walk->queue_capacity) {
+    int capacity = walk->queue_capacity ? walk->queue_capacity * 2 : 256;
+    char **queue = realloc(walk->queue, capacity * sizeof(char *));
+    if (!queue) {
+      free(relative_path);
+      return;
+    }
+    walk->queue = queue;
+    walk->queue_capacity = capacity;
+  }
+  walk->queue[walk->queue_count++] = relative_path;
+}
+
+/* Record a directory as read. Returns 1 the first time it is seen, 0 if
+ * it was read already (or the set can't grow). Caller holds the walk lock. */
+static int fuzzy_walk_visit(fuzzy_walk *walk, dev_t device, ino_t inode) {
+  if (walk->visited_count * 2 >= walk->visited_capacity) {
+    size_t capacity = walk->visited_capacity ? walk->visited_capacity * 2 : FUZZY_VISITED_INITIAL_CAPACITY;
+    fuzzy_directory_identity *visited = calloc(capacity, sizeof(fuzzy_directory_identity));
+    if (!visited) return 0;
+    for (size_t i = 0; i < walk->visited_capacity; i++) {
+      if (!walk->visited[i].used) continue;
+      size_t slot = ((size_t)walk->visited[i].inode ^ (size_t)walk->visited[i].device) & (capacity - 1);
+      while (visited[slot].used) slot = (slot + 1) & (capacity - 1);
+      visited[slot] = walk->visited[i];
+    }
+    free(walk->visited);
+    walk->visited = visited;
+    walk->visited_capacity = capacity;
+  }
+
+  size_t slot = ((size_t)inode ^ (size_t)device) & (walk->visited_capacity - 1);
+  while (walk->visited[slot].used) {
+    if (walk->visited[slot].inode == inode && walk->visited[slot].device == device) return 0;
+    slot = (slot + 1) & (walk->visited_capacity - 1);
+  }
+  walk->visited[slot] = (fuzzy_directory_identity){device, inode, 1};
+  walk->visited_count++;
+  return 1;
+}
+
+/* Read one directory. Entries are gathered into a local buffer first so the
+ * shared index is locked once per directory rather than once per file.
+ * Hidden entries are skipped. Symlinks are followed, so a link to a
+ * directory is walked like one; a directory already read (through a link
+ * loop, or a second link to it) is skipped. */
+static void fuzzy_walk_directory(fuzzy_walk *walk, const char *relative_path) {
+  int fd = openat(walk->root_fd, relative_path[0] ? relative_path : ".",
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return;
+
+  struct stat directory_stat;
+  int first_visit = 0;
+  if (fstat(fd, &directory_stat) == 0) {
+    pthread_mutex_lock(&walk->lock);
+    first_visit = fuzzy_walk_visit(walk, directory_stat.st_dev, directory_stat.st_ino);
+    pthread_mutex_unlock(&walk->lock);
+  }
+  if (!first_visit) {
+    close(fd);
+    return;
+  }
+
+  DIR *dp = fdopendir(fd);
+  if (!dp) {
+    close(fd);
+    return;
+  }
+
+  /* Each entry is stored as a type byte ('d' or 'f') and a NUL-terminated name */
+  char *entries = NULL;
+  size_t entries_length = 0, entries_capacity = 0;
+  int file_count = 0;
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dp))) {
+    if (dirent->d_name[0] == '.') continue;
+
+    int is_directory = 0;
+    if (dirent->d_type == DT_DIR) {
+      is_directory = 1;
+    } else if (dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK) {
+      /* stat, not lstat: a symlink counts as what it points at */
+      struct stat st;
+      if (fstatat(fd, dirent->d_name, &st, 0) != 0) continue;
+      is_directory = S_ISDIR(st.st_mode);
+    }
+
+    size_t name_length = strlen(dirent->d_name);
+    if (entries_length + name_length + 2 > entries_capacity) {
+      size_t capacity = entries_capacity ? entries_capacity * 2 : 4096;
+      while (capacity < entries_length + name_length + 2) capacity *= 2;
+      char *grown = realloc(entries, capacity);
+      if (!grown) break;
+      entries = grown;
+      entries_capacity = capacity;
+    }
+    entries[entries_length] = is_directory ? 'd' : 'f';
+    memcpy(entries + entries_length + 1, dirent->d_name, name_length + 1);
+    entries_length += name_length + 2;
+    if (!is_directory) file_count++;
+  }
+  closedir(dp);
+
+  size_t relative_length = strlen(relative_path);
+
+  pthread_mutex_lock(&walk->lock);
+  uint32_t directory = UINT32_MAX;
+  if (file_count > 0 && walk->index->file_count < FUZZY_INDEX_MAX_FILES) {
+    directory = fuzzy_index_add_directory(walk->index, relative_path, relative_length);
+  }
+
+  for (size_t offset = 0; offset < entries_length;) {
+    char type = entries[offset];
+    const char *name = entries + offset + 1;
+    size_t name_length = strlen(name);
+    offset += name_length + 2;
+
+    if (type == 'd') {
+      char *child = malloc(relative_length + name_length + 2);
+      if (!child) continue;
+      if (relative_length) {
+        memcpy(child, relative_path, relative_length);
+        child[relative_length] = '/';
+        memcpy(child + relative_length + 1, name, name_length + 1);
+      } else {
+        memcpy(child, name, name_length + 1);
+      }
+      fuzzy_walk_push(walk, child);
+    } else if (directory != UINT32_MAX && walk->index->file_count < FUZZY_INDEX_MAX_FILES) {
+      fuzzy_index_add_file(walk->index, directory, name, name_length);
+    }
+  }
+  if (walk->generation == __atomic_load_n(&fuzzy_finder.walk_generation, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&fuzzy_finder.walk_progress, walk->index->file_count, __ATOMIC_RELAXED);
+  }
+  pthread_cond_broadcast(&walk->wakeup);
+  pthread_mutex_unlock(&walk->lock);
+
+  free(entries);
+}
+
+/* Walk worker: take directories off the queue until the queue is empty and
+ * no other worker can add more. */
+static void *fuzzy_walk_worker(void *argument) {
+  fuzzy_walk *walk = argument;
+
+  pthread_mutex_lock(&walk->lock);
+  while (1) {
+    while (walk->queue_count == 0 && walk->active > 0) {
+      pthread_cond_wait(&walk->wakeup, &walk->lock);
+    }
+    if (walk->queue_count == 0 ||
+        walk->generation != __atomic_load_n(&fuzzy_finder.walk_generation, __ATOMIC_RELAXED)) {
+      break;
+    }
+
+    char *relative_path = walk->queue[--walk->queue_count];
+    walk->active++;
+    pthread_mutex_unlock(&walk->lock);
+
+    fuzzy_walk_directory(walk, relative_path);
+    free(relative_path);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->active--;
+  }
+  pthread_cond_broadcast(&walk->wakeup);
+  pthread_mutex_unlock(&walk->lock);
+  return NULL;
+}
+
+/* Number of threads to use for walking or scoring. */
+static int fuzzy_thread_count() {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) cpus = 1;
+  if (cpus > FUZZY_THREADS_MAX) cpus = FUZZY_THREADS_MAX;
+  return cpus;
+}
+
+/* Background thread that walks the project tree with a pool of workers,
+ * saves the result to the cache and hands it to the main thread, unless a
+ * newer walk replaced it meanwhile. */
+static void *fuzzy_walk_run(void *argument) {
+  fuzzy_walk_request *request = argument;
+  const char *root = request->root;
+
+  fuzzy_walk walk = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+    .root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+    .index = calloc(1, sizeof(fuzzy_index)),
+    .generation = request->generation
+  };
+
+  if (walk.root_fd >= 0 && walk.index) {
+    fuzzy_walk_push(&walk, strdup(""));
+
+    pthread_t workers[FUZZY_THREADS_MAX];
+    int worker_count = fuzzy_thread_count();
+    int started = 0;
+    while (started < worker_count &&
+           pthread_create(&workers[started], NULL, fuzzy_walk_worker, &walk) == 0) {
+      started++;
+    }
+    /* Fall back to walking on this thread if no worker could start */
+    if (started == 0) fuzzy_walk_worker(&walk);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    if (walk.generation == __atomic_load_n(&fuzzy_finder.walk_generation, __ATOMIC_RELAXED)) {
+      fuzzy_index_save(walk.index, root);
+    }
+  }
+  if (walk.root_fd >= 0) close(walk.root_fd);
+  for (int i = 0; i < walk.queue_count; i++) free(walk.queue[i]);
+  free(walk.queue);
+  free(walk.visited);
+
+  pthread_mutex_lock(&fuzzy_finder.lock);
+  if (walk.generation == fuzzy_finder.walk_generation) {
+    fuzzy_index_free(fuzzy_finder.published);
+    fuzzy_finder.published = walk.index;
+    fuzzy_finder.walking = 0;
+  } else {
+    fuzzy_index_free(walk.index);
+  }
+  pthread_mutex_unlock(&fuzzy_finder.lock);
+
+  free(request);
+  return NULL;
+}
+
+/* Start a background walk of the project root. A walk already running for
+ * it is reused. */
+static void fuzzy_walk_start() {
+  pthread_mutex_lock(&fuzzy_finder.lock);
+  int walking = fuzzy_finder.walking;
+  pthread_mutex_unlock(&fuzzy_finder.lock);
+  if (walking) return;
+
+  fuzzy_walk_request *request = malloc(sizeof(fuzzy_walk_request));
+  if (!request) return;
+  memcpy(request->root, fuzzy_finder.root, sizeof(request->root));
+
+  pthread_mutex_lock(&fuzzy_finder.lock);
+  request->generation = ++fuzzy_finder.walk_generation;
+  fuzzy_finder.walking = 1;
+  pthread_mutex_unlock(&fuzzy_finder.lock);
+  fuzzy_finder.walk_progress = 0;
+  fuzzy_finder.last_walk = time(NULL);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, fuzzy_walk_run, request) != 0) {
+    pthread_mutex_lock(&fuzzy_finder.lock);
+    fuzzy_finder.walking = 0;
+    pthread_mutex_unlock(&fuzzy_finder.lock);
+    free(request);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/* Abandon any walk of the old root, along with an index it published that
+ * the panel hasn't picked up, before switching to another root. */
+static void fuzzy_walk_cancel() {
+  pthread_mutex_lock(&fuzzy_finder.lock);
+  fuzzy_finder.walk_generation++;
+  fuzzy_finder.walking = 0;
+  fuzzy_index_free(fuzzy_finder.published);
+  fuzzy_finder.published = NULL;
+  pthread_mutex_unlock(&fuzzy_finder.lock);
+}
+
+/* Fold ASCII upper case to lower case. */
+static inline char fuzzy_fold(char c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* Whether the character at position starts a word in a path: the first
+ * character, anything after a separator, or an upper-case letter after a
+ * lower-case one. */
+static int fuzzy_is_boundary(const char *path, int position) {
+  if (position == 0) return 1;
+  char previous = path[position - 1];
+  char current = path[position];
+  if (previous == '/' || previous == '_' || previous == '-' || previous == '.' || previous == ' ') return 1;
+  return (previous >= 'a' && previous <= 'z' && current >= 'A' && current <= 'Z');
+}
+
+/* Score one alignment of the query against a path: bonuses for consecutive
+ * runs, word starts and the file name, minus gaps and path length. */
+static int fuzzy_score_alignment(const char *path, int length, int name_start,
+                                 const int *matched, int query_length) {
+  int score = 0;
+  for (int j = 0; j < query_length; j++) {
+    score += FUZZY_SCORE_MATCH;
+    if (j > 0 && matched[j] == matched[j - 1] + 1) score += FUZZY_SCORE_CONSECUTIVE;
+    if (fuzzy_is_boundary(path, matched[j])) score += FUZZY_SCORE_BOUNDARY;
+    if (matched[j] >= name_start) score += FUZZY_SCORE_FILENAME;
+  }
+  score -= (matched[query_length - 1] - matched[0] + 1 - query_length) * FUZZY_PENALTY_GAP;
+  score -= length / FUZZY_PENALTY_LENGTH_DIVISOR;
+  return score < 0 ? 0 : score;
+}
+
+/* Align the query backwards from position end of subject (the path,
+ * already case folded when matching ignores case), which packs the match
+ * as tightly as possible against that end. Returns 0 if it doesn't fit. */
+static int fuzzy_align_backward(const char *subject, int end, const char *query, int query_length,
+                                int *matched) {
+  int q = query_length - 1;
+  for (int i = end; i >= 0 && q >= 0; i--) {
+    if (subject[i] == query[q]) matched[q--] = i;
+  }
+  return q < 0;
+}
+
+/* Find the best-scoring alignment inside path[start..end] by dynamic
+ * programming. Every alignment lies inside that window, so the result is
+ * optimal for fuzzy_score_alignment. The gap penalty is linear, which lets
+ * the best earlier position be carried along as a running maximum, making
+ * this O(query length * window). Returns the score, or -1 if the window is
+ * too wide (callers then fall back to greedy alignments). */
+static int fuzzy_align_optimal(const char *path, const char *subject, int length, int name_start,
+                               int start, int end, const char *query, int query_length, int *matched) {
+  int width = end - start + 1;
+  if (width > FUZZY_OPTIMAL_WINDOW_MAX) return -1;
+
+  /* Best score with query[j] at window position i; previous and current row */
+  int previous[FUZZY_OPTIMAL_WINDOW_MAX], current[FUZZY_OPTIMAL_WINDOW_MAX];
+  /* Window position of query[j - 1] on the best path to (j, i) */
+  short from[FUZZY_QUERY_MAX][FUZZY_OPTIMAL_WINDOW_MAX];
+  const int impossible = INT_MIN / 2;
+
+  for (int j = 0; j < query_length; j++) {
+    int running = impossible, running_at = -1;
+    for (int i = 0; i < width; i++) {
+      /* Fold in position i - 2 as a candidate for a gapped transition */
+      if (j > 0 && i >= 2 && previous[i - 2] > impossible &&
+          previous[i - 2] + (i - 2) * FUZZY_PENALTY_GAP > running) {
+        running = previous[i - 2] + (i - 2) * FUZZY_PENALTY_GAP;
+        running_at = i - 2;
+      }
+
+      int position = start + i;
+      if (subject[position] != query[j]) {
+        current[i] = impossible;
+        continue;
+      }
+
+      int bonus = FUZZY_SCORE_MATCH;
+      if (fuzzy_is_boundary(path, position)) bonus += FUZZY_SCORE_BOUNDARY;
+      if (position >= name_start) bonus += FUZZY_SCORE_FILENAME;
+
+      if (j == 0) {
+        current[i] = bonus;
+        continue;
+      }
+
+      int best = impossible, best_at = -1;
+      if (i >= 1 && previous[i - 1] > impossible) {
+        best = previous[i - 1] + FUZZY_SCORE_CONSECUTIVE;
+        best_at = i - 1;
+      }
+      if (running > impossible && running - (i - 1) * FUZZY_PENALTY_GAP > best) {
+        best = running - (i - 1) * FUZZY_PENALTY_GAP;
+        best_at = running_at;
+      }
+      current[i] = best > impossible ? best + bonus : impossible;
+      from[j][i] = best_at;
+    }
+    memcpy(previous, current, width * sizeof(int));
+  }
+
+  int best = impossible, best_at = -1;
+  for (int i = 0; i < width; i++) {
+    if (previous[i] > best) {
+      best = previous[i];
+      best_at = i;
+    }
+  }
+  if (best_at < 0) return -1;
+
+  for (int j = query_length - 1; j >= 0; j--) {
+    matched[j] = start + best_at;
+    if (j > 0) best_at = from[j][best_at];
+  }
+
+  best -= length / FUZZY_PENALTY_LENGTH_DIVISOR;
+  return best < 0 ? 0 : best;
+}
+
+/* Score one file against the query. Candidates that can't match are
+ * rejected by a subsequence scan over the interned directory and name
+ * without building the path. The earliest and latest greedy alignments
+ * bound the window any match can occupy; the best alignment inside it is
+ * then found exactly, or for very wide windows approximated by the better
+ * of the two greedy ones. Returns -1 for no match. Stores matched path
+ * offsets in positions when it isn't NULL. An empty query matches every
+ * file with score 0. */
+static int fuzzy_score_file(fuzzy_index *index, uint32_t file_number, const char *query,
+                            int query_length, int case_sensitive, int *positions) {
+  if (query_length <= 0) return 0;
+
+  fuzzy_file *file = &index->files[file_number];
+  fuzzy_directory *directory = &index->directories[file->directory];
+  const char *directory_path = index->strings + directory->path;
+  const char *name = index->strings + file->name;
+
+  /* Fast subsequence check across directory, separator and name */
+  int q = 0;
+  for (uint32_t i = 0; i < directory->path_length && q < query_length; i++) {
+    char c = case_sensitive ? directory_path[i] : fuzzy_fold(directory_path[i]);
+    if (c == query[q]) q++;
+  }
+  if (q < query_length && directory->path_length && query[q] == '/') q++;
+  for (uint32_t i = 0; i < file->name_length && q < query_length; i++) {
+    char c = case_sensitive ? name[i] : fuzzy_fold(name[i]);
+    if (c == query[q]) q++;
+  }
+  if (q < query_length) return -1;
+
+  char path[PATH_MAX], folded[PATH_MAX];
+  int length = fuzzy_index_file_path(index, file_number, path, sizeof(path));
+  if (length < 0) return -1;
+  int name_start = length - file->name_length;
+
+  /* Fold once up front so the alignment loops compare bytes directly */
+  const char *subject = path;
+  if (!case_sensitive) {
+    for (int i = 0; i < length; i++) folded[i] = fuzzy_fold(path[i]);
+    subject = folded;
+  }
+
+  int latest[FUZZY_QUERY_MAX] = {0};
+  if (!fuzzy_align_backward(subject, length - 1, query, query_length, latest)) return -1;
+
+  int earliest[FUZZY_QUERY_MAX] = {0};
+  q = 0;
+  for (int i = 0; i < length && q < query_length; i++) {
+    if (subject[i] == query[q]) earliest[q++] = i;
+  }
+
+  int optimal[FUZZY_QUERY_MAX];
+  int score = fuzzy_align_optimal(path, subject, length, name_start, earliest[0],
+                                  latest[query_length - 1], query, query_length, optimal);
+  int *best = optimal;
+
+  if (score < 0) {
+    score = fuzzy_score_alignment(path, length, name_start, latest, query_length);
+    best = latest;
+    int earliest_score = fuzzy_score_alignment(path, length, name_start, earliest, query_length);
+    if (earliest_score > score) {
+      score = earliest_score;
+      best = earliest;
+    }
+  }
+
+  if (positions) memcpy(positions, best, query_length * sizeof(int));
+  return score;
+}
+
+/* Whether match a ranks below match b (lower score, then later file). */
+static int fuzzy_match_worse(const fuzzy_match *a, const fuzzy_match *b) {
+  if (a->score != b->score) return a->score < b->score;
+  return a->file > b->file;
+}
+
+/* Offer a match to a min-heap holding the best FUZZY_RESULTS_MAX matches. */
+static void fuzzy_heap_offer(fuzzy_match *heap, int *count, fuzzy_match match) {
+  int i;
+  if (*count < FUZZY_RESULTS_MAX) {
+    i = (*count)++;
+    while (i > 0 && fuzzy_match_worse(&match, &heap[(i - 1) / 2])) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = match;
+    return;
+  }
+
+  if (!fuzzy_match_worse(&heap[0], &match)) return;
+
+  /* Replace the worst match and sift down */
+  i = 0;
+  while (1) {
+    int child = i * 2 + 1;
+    if (child >= *count) break;
+    if (child + 1 < *count && fuzzy_match_worse(&heap[child + 1], &heap[child])) child++;
+    if (!fuzzy_match_worse(&heap[child], &match)) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = match;
+}
+
+/* Score one slice of a pass. Thread entry point. */
+static void *fuzzy_pass_run(void *argument) {
+  fuzzy_pass *pass = argument;
+
+  for (uint32_t i = pass->begin; i < pass->end; i++) {
+    if ((i - pass->begin) % FUZZY_CANCEL_CHECK_FILES == 0 &&
+        __atomic_load_n(&fuzzy_scorer.generation, __ATOMIC_RELAXED) != pass->generation) {
+      pass->cancelled = 1;
+      break;
+    }
+    uint32_t file = pass->input ? pass->input[i] : i;
+    fuzzy_file *entry = &pass->index->files[file];
+    uint32_t mask = entry->mask | pass->index->directories[entry->directory].mask;
+    if ((pass->query_mask & mask) != pass->query_mask) continue;
+
+    int score = fuzzy_score_file(pass->index, file, pass->query, pass->query_length,
+                                 pass->case_sensitive, NULL);
+    if (score < 0) continue;
+
+    pass->output[pass->output_count++] = file;
+    fuzzy_match match = {file, score};
+    fuzzy_heap_offer(pass->heap, &pass->heap_count, match);
+  }
+  return NULL;
+}
+
+/* Sort matches best first. */
+static int fuzzy_match_compare(const void *a, const void *b) {
+  const fuzzy_match *match_a = a, *match_b = b;
+  if (fuzzy_match_worse(match_a, match_b)) return 1;
+  if (fuzzy_match_worse(match_b, match_a)) return -1;
+  return 0;
+}
+
+/* Free the candidates held by a level and mark it invalid. */
+static void fuzzy_level_clear(fuzzy_level *level) {
+  free(level->candidates);
+  level->candidates = NULL;
+  level->candidate_count = 0;
+  level->result_count = 0;
+  level->valid = 0;
+}
+
+/* Fill level `to` with the files from level `from` that match the first
+ * `to` characters of typed, keeping the best in a bounded heap. Big passes
+ * are split across threads, each with its own output slice and heap; the
+ * slices are then compacted and the heaps merged. Returns 0, leaving the
+ * level invalid, if request generation was superseded during the pass. */
+static int fuzzy_level_compute(fuzzy_index *index, const char *typed, int from, int to,
+                               unsigned long generation) {
+  fuzzy_level *source = &fuzzy_levels[from];
+  fuzzy_level *target = &fuzzy_levels[to];
+
+  fuzzy_level_clear(target);
+  uint32_t total = source->candidates ? source->candidate_count : index->file_count;
+
+  /* Case-sensitive only when the query has upper case (smart case) */
+  char query[FUZZY_QUERY_MAX];
+  int case_sensitive = 0;
+  for (int i = 0; i < to; i++) {
+    if (typed[i] >= 'A' && typed[i] <= 'Z') case_sensitive = 1;
+  }
+  for (int i = 0; i < to; i++) {
+    query[i] = case_sensitive ? typed[i] : fuzzy_fold(typed[i]);
+  }
+
+  uint32_t query_mask = fuzzy_character_mask(query, to);
+
+  uint32_t *output = malloc((total ? total : 1) * sizeof(uint32_t));
+  if (!output) return 1;
+
+  int thread_count = total >= FUZZY_PARALLEL_MIN_FILES ? fuzzy_thread_count() : 1;
+  fuzzy_pass *passes = calloc(thread_count, sizeof(fuzzy_pass));
+  pthread_t threads[FUZZY_THREADS_MAX];
+  int thread_started[FUZZY_THREADS_MAX] = {0};
+  if (!passes) {
+    free(output);
+    return 1;
+  }
+
+  for (int t = 0; t < thread_count; t++) {
+    fuzzy_pass *pass = &passes[t];
+    pass->index = index;
+    pass->input = source->candidates;
+    pass->begin = (uint64_t)total * t / thread_count;
+    pass->end = (uint64_t)total * (t + 1) / thread_count;
+    pass->query = query;
+    pass->query_length = to;
+    pass->case_sensitive = case_sensitive;
+    pass->query_mask = query_mask;
+    pass->output = output + pass->begin;
+    pass->generation = generation;
+    if (t > 0) thread_started[t] = pthread_create(&threads[t], NULL, fuzzy_pass_run, pass) == 0;
+  }
+  /* The calling thread takes the first slice, plus any that failed to start */
+  for (int t = 0; t < thread_count; t++) {
+    if (t == 0 || !thread_started[t]) fuzzy_pass_run(&passes[t]);
+  }
+
+  int cancelled = 0;
+  for (int t = 0; t < thread_count; t++) {
+    if (thread_started[t]) pthread_join(threads[t], NULL);
+    if (passes[t].cancelled) cancelled = 1;
+  }
+  if (cancelled) {
+    free(passes);
+    free(output);
+    return 0;
+  }
+
+  uint32_t count = 0;
+  for (int t = 0; t < thread_count; t++) {
+    memmove(output + count, passes[t].output, passes[t].output_count * sizeof(uint32_t));
+    count += passes[t].output_count;
+    for (int i = 0; i < passes[t].heap_count; i++) {
+      fuzzy_heap_offer(target->results, &target->result_count, passes[t].heap[i]);
+    }
+  }
+  free(passes);
+
+  qsort(target->results, target->result_count, sizeof(fuzzy_match), fuzzy_match_compare);
+
+  uint32_t *shrunk = realloc(output, (count ? count : 1) * sizeof(uint32_t));
+  target->candidates = shrunk ? shrunk : output;
+  target->candidate_count = count;
+  target->valid = 1;
+  return 1;
+}
+
+/* Reset the levels for a new index. Level 0 lists every file in index
+ * order; the others are filled in as queries need them. */
+static void fuzzy_levels_reset(fuzzy_index *index) {
+  for (int i = 0; i <= FUZZY_QUERY_MAX; i++) fuzzy_level_clear(&fuzzy_levels[i]);
+  fuzzy_levels_query_length = 0;
+
+  fuzzy_level *all = &fuzzy_levels[0];
+  uint32_t file_count = index ? index->file_count : 0;
+  all->valid = 1;
+  for (uint32_t i = 0; i < file_count && i < FUZZY_RESULTS_MAX; i++) {
+    all->results[all->result_count].file = i;
+    all->results[all->result_count].score = 0;
+    all->result_count++;
+  }
+}
+
+/* Bring the level for query up to date. Levels of a common prefix with the
+ * previous query are kept, so typing narrows the previous level and
+ * backspace usually finds its level ready; anything else is scored in a
+ * single pass from the longest valid prefix. Returns 0 if request
+ * generation was superseded first. */
+static int fuzzy_levels_update(fuzzy_index *index, const char *query, int query_length,
+                               unsigned long generation) {
+  int common = 0;
+  while (common < query_length && common < fuzzy_levels_query_length &&
+         fuzzy_levels_query[common] == query[common]) {
+    common++;
+  }
+  for (int i = common + 1; i <= FUZZY_QUERY_MAX; i++) fuzzy_level_clear(&fuzzy_levels[i]);
+  memcpy(fuzzy_levels_query, query, query_length);
+  fuzzy_levels_query_length = query_length;
+
+  if (!index || fuzzy_levels[query_length].valid) return 1;
+  int from = query_length;
+  while (!fuzzy_levels[from].valid) from--;
+  return fuzzy_level_compute(index, query, from, query_length, generation);
+}
+
+/* Answer the latest posted request. Called with fuzzy_scorer.lock held,
+ * which is released while scoring. */
+static void fuzzy_scorer_answer_request() {
+  unsigned long generation = fuzzy_scorer.generation;
+  char query[FUZZY_QUERY_MAX];
+  int query_length = fuzzy_scorer.query_length;
+  memcpy(query, fuzzy_scorer.query, query_length);
+  fuzzy_index *index = fuzzy_scorer.index;
+  int index_changed = fuzzy_scorer.index_changed;
+  fuzzy_scorer.index_changed = 0;
+  fuzzy_scorer.scoring_index = index;
+  pthread_mutex_unlock(&fuzzy_scorer.lock);
+
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if (index_changed) fuzzy_levels_reset(index);
+  int complete = fuzzy_levels_update(index, query, query_length, generation);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+
+  pthread_mutex_lock(&fuzzy_scorer.lock);
+  fuzzy_scorer.scoring_index = NULL;
+  if (complete && generation == fuzzy_scorer.generation) {
+    fuzzy_level *level = &fuzzy_levels[query_length];
+    fuzzy_answer *answer = &fuzzy_scorer.answer;
+    memcpy(answer->results, level->results, level->result_count * sizeof(fuzzy_match));
+    answer->result_count = level->result_count;
+    answer->match_count = query_length ? level->candidate_count : (index ? index->file_count : 0);
+    answer->pass_ms = (finished.tv_sec - started.tv_sec) * 1000.0 +
+                      (finished.tv_nsec - started.tv_nsec) / 1000000.0;
+    fuzzy_scorer.answered_generation = generation;
+  }
+  pthread_cond_broadcast(&fuzzy_scorer.changed);
+}
+
+/* Scoring thread: answer requests until told to stop. */
+static void *fuzzy_scorer_run(void *argument) {
+  (void)argument;
+  pthread_mutex_lock(&fuzzy_scorer.lock);
+  while (1) {
+    while (!fuzzy_scorer.stop && fuzzy_scorer.answered_generation == fuzzy_scorer.generation) {
+      pthread_cond_wait(&fuzzy_scorer.changed, &fuzzy_scorer.lock);
+    }
+    if (fuzzy_scorer.stop) break;
+    fuzzy_scorer_answer_request();
+  }
+  pthread_mutex_unlock(&fuzzy_scorer.lock);
+  return NULL;
+}
 
-  return 0;
+/* Post the panel query for scoring, along with fuzzy_finder.index if it
+ * changed. Without a scoring thread the request is answered right here. */
+static void fuzzy_scorer_post(int index_changed) {
+  pthread_mutex_lock(&fuzzy_scorer.lock);
+  memcpy(fuzzy_scorer.query, fuzzy_query, fuzzy_query_length);
+  fuzzy_scorer.query_length = fuzzy_query_length;
+  if (index_changed) {
+    fuzzy_scorer.index = fuzzy_finder.index;
+    fuzzy_scorer.index_changed = 1;
+    /* Results of the old index name files of the old index */
+    fuzzy_scorer.answer.result_count = 0;
+    fuzzy_scorer.answer.match_count = 0;
+  }
+  __atomic_add_fetch(&fuzzy_scorer.generation, 1, __ATOMIC_RELAXED);
+  if (fuzzy_scorer.running) {
+    pthread_cond_broadcast(&fuzzy_scorer.changed);
+  } else {
+    fuzzy_scorer_answer_request();
+  }
+  pthread_mutex_unlock(&fuzzy_scorer.lock);
 }
 
-/* Check if cursor position is inside a multiline comment.
- * If so, sets out_start_row/col to the opening delimiter position.
- * Returns 1 if inside comment, 0 otherwise. */
-static int editor_cursor_in_multiline_comment(int *out_start_row, int *out_start_col) {
-  char *ml_start = editor.syntax ? editor.syntax->multiline_comment_start : NULL;
-  char *ml_end = editor.syntax ? editor.syntax->multiline_comment_end : NULL;
-  if (!ml_start || !ml_end) return 0;
-  int ml_start_len = (int)strlen(ml_start);
-  int ml_end_len = (int)strlen(ml_end);
-  if (ml_start_len == 0 || ml_end_len == 0) return 0;
+/* Start the scoring thread for an opening panel and post its first request. */
+static void fuzzy_scorer_start() {
+  memset(&fuzzy_scorer.answer, 0, sizeof(fuzzy_scorer.answer));
+  fuzzy_scorer.stop = 0;
+  fuzzy_scorer.answered_generation = fuzzy_scorer.generation;
+  fuzzy_scorer.running = pthread_create(&fuzzy_scorer.thread, NULL, fuzzy_scorer_run, NULL) == 0;
+  fuzzy_scorer_post(1);
+}
 
-  /* Scan forward from start of file to cursor, tracking comment state */
-  int in_comment = 0;
-  int comment_start_row = -1, comment_start_col = -1;
-  int in_string = 0;
-  char string_delim = '\0';
+/* Stop the scoring thread, cancelling any pass, and free the levels. */
+static void fuzzy_scorer_finish() {
+  if (fuzzy_scorer.running) {
+    pthread_mutex_lock(&fuzzy_scorer.lock);
+    fuzzy_scorer.stop = 1;
+    __atomic_add_fetch(&fuzzy_scorer.generation, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&fuzzy_scorer.changed);
+    pthread_mutex_unlock(&fuzzy_scorer.lock);
+    pthread_join(fuzzy_scorer.thread, NULL);
+    fuzzy_scorer.running = 0;
+  }
+  for (int i = 0; i <= FUZZY_QUERY_MAX; i++) fuzzy_level_clear(&fuzzy_levels[i]);
+  fuzzy_levels_query_length = 0;
+  fuzzy_scorer.index = NULL;
+}
 
-  for (int r = 0; r <= editor.cursor_y && r < editor.row_count; r++) {
-    editor_row *row = &editor.row[r];
-    int end_col = (r == editor.cursor_y) ? editor.cursor_x : row->line_size;
-    for (int c = 0; c < end_col && c < row->line_size; c++) {
-      char ch = row->chars[c];
+/* Copy the latest answer into answer. Returns 1 if it is for the query as
+ * typed now, 0 while a newer query is still being scored. */
+static int fuzzy_scorer_snapshot(fuzzy_answer *answer) {
+  pthread_mutex_lock(&fuzzy_scorer.lock);
+  *answer = fuzzy_scorer.answer;
+  int current = fuzzy_scorer.answered_generation == fuzzy_scorer.generation;
+  pthread_mutex_unlock(&fuzzy_scorer.lock);
+  return current;
+}
 
-      if (!in_comment) {
-        /* Track string state to avoid matching delimiters inside strings */
-        if (in_string) {
-          if (ch == string_delim) {
-            int backslashes = 0;
-            for (int k = c - 1; k >= 0 && row->chars[k] == '\\'; k--) backslashes++;
-            if (backslashes % 2 == 0) in_string = 0;
-          }
-          continue;
-        }
-        if (ch == '"' || ch == '\'') {
-          in_string = 1;
-          string_delim = ch;
-          continue;
-        }
+/* Pick up an index published by the background walk, if any.
+ * Returns 1 if the index changed. */
+static int fuzzy_adopt_published_index() {
+  pthread_mutex_lock(&fuzzy_finder.lock);
+  fuzzy_index *published = fuzzy_finder.published;
+  fuzzy_finder.published = NULL;
+  pthread_mutex_unlock(&fuzzy_finder.lock);
+
+  if (!published) return 0;
+  fuzzy_index *old = fuzzy_finder.index;
+  fuzzy_finder.index = published;
+  fuzzy_scorer_post(1);
+
+  /* The scoring thread may still be reading the old index */
+  pthread_mutex_lock(&fuzzy_scorer.lock);
+  while (old && fuzzy_scorer.scoring_index == old) {
+    pthread_cond_wait(&fuzzy_scorer.changed, &fuzzy_scorer.lock);
+  }
+  pthread_mutex_unlock(&fuzzy_scorer.lock);
+  fuzzy_index_free(old);
+  return 1;
+}
 
-        /* Check for comment start */
-        if (c + ml_start_len <= row->line_size &&
-            strncmp(&row->chars[c], ml_start, ml_start_len) == 0) {
-          in_comment = 1;
-          comment_start_row = r;
-          comment_start_col = c;
-          c += ml_start_len - 1;  /* -1 because loop will increment */
-        }
+/* Draw the fuzzy finder panel, using the same geometry as the file browser.
+ * Matched characters of each result are highlighted. */
+static void fuzzy_finder_draw(const fuzzy_answer *answer, int current, int selected,
+                              int scroll_offset) {
+  if (!terminal_output_ready()) return;
+
+  struct append_buffer ab = ABUF_INIT;
+  if (editor.sync_output) append_buffer_write(&ab, ESCAPE_SYNC_OUTPUT_BEGIN, ESCAPE_SYNC_OUTPUT_BEGIN_LEN);
+  fuzzy_index *index = fuzzy_finder.index;
+
+  int panel_height = editor.screen_rows / 2;
+  if (panel_height < 10) panel_height = 10;
+  if (panel_height > editor.screen_rows - 2) panel_height = editor.screen_rows - 2;
+
+  int panel_width = (editor.screen_columns * 70) / 100;
+  if (panel_width < 40) panel_width = 40;
+  if (panel_width > editor.screen_columns - 4) panel_width = editor.screen_columns - 4;
+
+  int panel_top = (editor.screen_rows - panel_height) / 2;
+  int panel_left = (editor.screen_columns - panel_width) / 2;
+
+  append_buffer_write(&ab, ESCAPE_HIDE_CURSOR, ESCAPE_HIDE_CURSOR_LEN);
+
+  for (int row = 0; row < panel_height; row++) {
+    char pos_buf[32];
+    snprintf(pos_buf, sizeof(pos_buf), "\x1b[%d;%dH", panel_top + row + 1, panel_left + 1);
+    append_buffer_write(&ab, pos_buf, strlen(pos_buf));
+
+    char line[PATH_MAX + 64];
+    int line_len = 0;
+
+    if (row == 0) {
+      set_background_rgb(&ab, theme_get_color(THEME_UI_STATUS_BG));
+      set_foreground_rgb(&ab, theme_get_color(THEME_UI_STATUS_FG));
+
+      char counts[64];
+      int counts_len;
+      if (current) {
+        counts_len = snprintf(counts, sizeof(counts), "%u/%u %.1fms ", answer->match_count,
+                              index ? index->file_count : 0, answer->pass_ms);
       } else {
-        /* Check for comment end */
-        if (c + ml_end_len <= row->line_size &&
-            strncmp(&row->chars[c], ml_end, ml_end_len) == 0) {
-          in_comment = 0;
-          comment_start_row = -1;
-          comment_start_col = -1;
-          c += ml_end_len - 1;
-        }
+        counts_len = snprintf(counts, sizeof(counts), "%u/%u searching... ", answer->match_count,
+                              index ? index->file_count : 0);
+      }
+      line_len = snprintf(line, sizeof(line), " Find: %s", fuzzy_query);
+      if (line_len > panel_width) line_len = panel_width;
+      append_buffer_write(&ab, line, line_len);
+
+      int padding = panel_width - line_len - counts_len;
+      for (int p = 0; p < padding; p++) append_buffer_write(&ab, " ", 1);
+      if (padding >= 0) {
+        append_buffer_write(&ab, counts, counts_len);
+      } else {
+        for (int p = line_len; p < panel_width; p++) append_buffer_write(&ab, " ", 1);
       }
+      continue;
     }
-  }
 
-  if (in_comment && comment_start_row >= 0) {
-    *out_start_row = comment_start_row;
-    *out_start_col = comment_start_col;
-    return 1;
-  }
-  return 0;
-}
+    if (row == panel_height - 1) {
+      set_background_rgb(&ab, theme_get_color(THEME_UI_MESSAGE_BG));
+      set_foreground_rgb(&ab, theme_get_color(THEME_UI_MESSAGE_FG));
 
-/* Find matching bracket position.
- * Scans across lines and skips over string literals and multi-line comments
- * based on current syntax rules. Sets editor.bracket_match_row/col.
- * Returns 1 if match found, 0 otherwise.
- * Additionally, when cursor is inside a bracketed region, match the nearest enclosing pair.
- * When cursor is inside a multiline comment, highlights the comment delimiters. */
-int editor_find_matching_bracket() {
-  editor_reset_bracket_match();
+      uint32_t progress = __atomic_load_n(&fuzzy_finder.walk_progress, __ATOMIC_RELAXED);
+      if (__atomic_load_n(&fuzzy_finder.walking, __ATOMIC_RELAXED)) {
+        line_len = snprintf(line, sizeof(line), " Type to filter Enter:Open ESC:Cancel  indexing... %u", progress);
+      } else {
+        line_len = snprintf(line, sizeof(line), " Type to filter Up/Down:Nav Enter:Open ESC:Cancel");
+      }
+      if (line_len > panel_width) line_len = panel_width;
+      append_buffer_write(&ab, line, line_len);
+      for (int p = line_len; p < panel_width; p++) append_buffer_write(&ab, " ", 1);
+      continue;
+    }
 
-  if (editor.cursor_y >= editor.row_count) return 0;
+    int result = scroll_offset + (row - 1);
+    int path_len = -1;
+    if (index && result < answer->result_count) {
+      path_len = fuzzy_index_file_path(index, answer->results[result].file, line, sizeof(line));
+    }
+    if (path_len < 0) {
+      set_background_rgb(&ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
+      set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
+      for (int p = 0; p < panel_width; p++) append_buffer_write(&ab, " ", 1);
+      continue;
+    }
 
-  editor_row *row = &editor.row[editor.cursor_y];
+    /* Recover matched offsets for highlighting (visible rows only) */
+    int positions[FUZZY_QUERY_MAX];
+    int highlighted = 0;
+    if (fuzzy_query_length > 0) {
+      int case_sensitive = 0;
+      char query[FUZZY_QUERY_MAX];
+      for (int i = 0; i < fuzzy_query_length; i++) {
+        if (fuzzy_query[i] >= 'A' && fuzzy_query[i] <= 'Z') case_sensitive = 1;
+      }
+      for (int i = 0; i < fuzzy_query_length; i++) {
+        query[i] = case_sensitive ? fuzzy_query[i] : fuzzy_fold(fuzzy_query[i]);
+      }
+      if (fuzzy_score_file(index, answer->results[result].file, query, fuzzy_query_length,
+                           case_sensitive, positions) >= 0) {
+        highlighted = fuzzy_query_length;
+      }
+    }
 
-  /* First check if cursor is inside a multiline comment */
-  int comment_start_row, comment_start_col;
-  if (editor_cursor_in_multiline_comment(&comment_start_row, &comment_start_col)) {
-    /* We're inside a comment - match the comment delimiters */
-    return editor_match_from(comment_start_row, comment_start_col);
+    rgb_color background = theme_get_color(result == selected ? THEME_UI_SELECTION_BG
+                                                                : THEME_UI_LINE_NUMBER_BG);
+    rgb_color foreground = theme_get_color(result == selected ? THEME_UI_SELECTION_FG
+                                                                : THEME_UI_FOREGROUND);
+    rgb_color match_color = theme_get_color(THEME_SYNTAX_KEYWORD2);
+    set_background_rgb(&ab, background);
+    set_foreground_rgb(&ab, foreground);
+    append_buffer_write(&ab, " ", 1);
+
+    /* Long paths keep their tail, where the file name is */
+    int max_name = panel_width - 2;
+    int start = path_len > max_name ? path_len - max_name : 0;
+    int next = 0;
+    while (next < highlighted && positions[next] < start) next++;
+
+    int in_match = 0;
+    for (int i = start; i < path_len; i++) {
+      int is_match = next < highlighted && positions[next] == i;
+      if (is_match) next++;
+      if (is_match != in_match) {
+        set_foreground_rgb(&ab, is_match ? match_color : foreground);
+        in_match = is_match;
+      }
+      append_buffer_write(&ab, &line[i], 1);
+    }
+    if (in_match) set_foreground_rgb(&ab, foreground);
+    for (int p = path_len - start + 1; p < panel_width; p++) append_buffer_write(&ab, " ", 1);
   }
 
-  if (editor.cursor_x >= row->line_size) return 0;
+  set_background_rgb(&ab, theme_get_color(THEME_UI_BACKGROUND));
+  set_foreground_rgb(&ab, theme_get_color(THEME_UI_FOREGROUND));
 
-  /* Try matching at the cursor position (bracket or comment delimiter) */
-  if (editor_match_from(editor.cursor_y, editor.cursor_x)) {
-    return 1;
+  if (editor.sync_output) append_buffer_write(&ab, ESCAPE_SYNC_OUTPUT_END, ESCAPE_SYNC_OUTPUT_END_LEN);
+  terminal_write(ab.buffer, ab.length);
+  append_buffer_destroy(&ab);
+  /* Drawn over any split views */
+  view_invalidate();
+}
+
+/* Interactive fuzzy finder over every file under the working directory.
+ * Searches the saved index right away while a background walk refreshes it.
+ * Returns the selected path (relative to the working directory, malloc'd)
+ * or NULL if cancelled. */
+char *editor_fuzzy_finder() {
+  char root[PATH_MAX];
+  if (editor_working_directory(root, sizeof(root)) == -1) {
+    editor_set_status_message("Cannot determine working directory");
+    return NULL;
   }
 
-  /* Otherwise, find the nearest enclosing opening bracket before the cursor.
-   * We scan backwards, tracking string/comment state properly. */
-  char *ml_start = editor.syntax ? editor.syntax->multiline_comment_start : NULL;
-  char *ml_end = editor.syntax ? editor.syntax->multiline_comment_end : NULL;
-  int ml_start_len = ml_start ? (int)strlen(ml_start) : 0;
-  int ml_end_len = ml_end ? (int)strlen(ml_end) : 0;
+  /* A different root invalidates the session index and any walk of the
+   * old root, which is replaced by a walk of the new one */
+  if (strcmp(root, fuzzy_finder.root) != 0) {
+    fuzzy_walk_cancel();
+    fuzzy_index_free(fuzzy_finder.index);
+    fuzzy_finder.index = NULL;
+    fuzzy_finder.last_walk = 0;
+    snprintf(fuzzy_finder.root, sizeof(fuzzy_finder.root), "%s", root);
+  }
 
-  /* Track depth of each bracket type to find enclosing bracket */
-  int paren_depth = 0;   /* () */
-  int bracket_depth = 0; /* [] */
-  int brace_depth = 0;   /* {} */
-  int in_string = 0;
-  char string_delim = '\0';
-  int in_multiline_comment = 0;
+  if (!fuzzy_finder.index) fuzzy_finder.index = fuzzy_index_load(root);
+  if (time(NULL) - fuzzy_finder.last_walk >= FUZZY_REINDEX_SECONDS) fuzzy_walk_start();
 
-  for (int sr = editor.cursor_y; sr >= 0; sr--) {
-    editor_row *r = &editor.row[sr];
-    int sc = (sr == editor.cursor_y) ? editor.cursor_x - 1 : r->line_size - 1;
-    for (; sc >= 0; sc--) {
-      char c = r->chars[sc];
+  fuzzy_query_length = 0;
+  fuzzy_query[0] = '\0';
+  fuzzy_scorer_start();
 
-      /* Handle multiline comment tracking (backwards: end-delim enters, start-delim exits) */
-      if (ml_start_len && ml_end_len && !in_string) {
-        if (!in_multiline_comment &&
-            sc - ml_end_len + 1 >= 0 &&
-            strncmp(&r->chars[sc - ml_end_len + 1], ml_end, ml_end_len) == 0) {
-          in_multiline_comment = 1;
-          sc -= ml_end_len - 1;
-          continue;
-        } else if (in_multiline_comment &&
-                   sc - ml_start_len + 1 >= 0 &&
-                   strncmp(&r->chars[sc - ml_start_len + 1], ml_start, ml_start_len) == 0) {
-          in_multiline_comment = 0;
-          sc -= ml_start_len - 1;
-          continue;
-        }
-      }
+  int selected = 0;
+  int scroll_offset = 0;
+  char *result = NULL;
+  fuzzy_answer answer;
 
-      /* Skip content inside comments */
-      if (in_multiline_comment) {
-        continue;
-      }
+  while (1) {
+    fuzzy_adopt_published_index();
 
-      /* Handle string tracking */
-      if (in_string) {
-        if (c == string_delim) {
-          int backslashes = 0;
-          for (int k = sc - 1; k >= 0 && r->chars[k] == '\\'; k--) backslashes++;
-          if (backslashes % 2 == 0) {
-            in_string = 0;
-            string_delim = '\0';
-          }
-        }
-        continue;
-      }
-      if (c == '"' || c == '\'') {
-        in_string = 1;
-        string_delim = c;
-        continue;
-      }
+    int current = fuzzy_scorer_snapshot(&answer);
+    if (selected >= answer.result_count) selected = answer.result_count - 1;
+    if (selected < 0) selected = 0;
 
-      /* Track bracket depth - closing brackets increase depth (going backwards) */
-      if (c == ')') paren_depth++;
-      else if (c == ']') bracket_depth++;
-      else if (c == '}') brace_depth++;
-      else if (c == '(') {
-        if (paren_depth > 0) paren_depth--;
-        else {
-          /* Found enclosing opening paren */
-          if (editor_match_from(sr, sc)) return 1;
+    int panel_height = editor.screen_rows / 2;
+    if (panel_height < 10) panel_height = 10;
+    if (panel_height > editor.screen_rows - 2) panel_height = editor.screen_rows - 2;
+    int visible_rows = panel_height - 2;
+
+    if (selected < scroll_offset) {
+      scroll_offset = selected;
+    } else if (selected >= scroll_offset + visible_rows) {
+      scroll_offset = selected - visible_rows + 1;
+    }
+
+    fuzzy_finder_draw(&answer, current, selected, scroll_offset);
+
+    int key = editor_read_key();
+    if (key == CHAR_ESCAPE) {
+      break;
+    } else if (key == '\r') {
+      /* Enter opens the best match for the query as typed */
+      if (!current) {
+        pthread_mutex_lock(&fuzzy_scorer.lock);
+        while (fuzzy_scorer.answered_generation != fuzzy_scorer.generation) {
+          pthread_cond_wait(&fuzzy_scorer.changed, &fuzzy_scorer.lock);
         }
+        pthread_mutex_unlock(&fuzzy_scorer.lock);
+        fuzzy_scorer_snapshot(&answer);
       }
-      else if (c == '[') {
-        if (bracket_depth > 0) bracket_depth--;
-        else {
-          /* Found enclosing opening bracket */
-          if (editor_match_from(sr, sc)) return 1;
+      if (fuzzy_finder.index && selected < answer.result_count) {
+        char path[PATH_MAX];
+        if (fuzzy_index_file_path(fuzzy_finder.index, answer.results[selected].file,
+                                  path, sizeof(path)) >= 0) {
+          result = strdup(path);
         }
       }
-      else if (c == '{') {
-        if (brace_depth > 0) brace_depth--;
-        else {
-          /* Found enclosing opening brace */
-          if (editor_match_from(sr, sc)) return 1;
-        }
+      break;
+    } else if (key == ARROW_UP && selected > 0) {
+      selected--;
+    } else if (key == ARROW_DOWN) {
+      selected++;
+    } else if (key == PAGE_UP) {
+      selected -= visible_rows;
+    } else if (key == PAGE_DOWN) {
+      selected += visible_rows;
+    } else if (key == BACKSPACE || key == CTRL_KEY('h') || key == DEL_KEY) {
+      if (fuzzy_query_length > 0) {
+        fuzzy_query[--fuzzy_query_length] = '\0';
+        fuzzy_scorer_post(0);
+        selected = 0;
       }
+    } else if (key >= 32 && key < 127 && fuzzy_query_length < FUZZY_QUERY_MAX) {
+      fuzzy_query[fuzzy_query_length++] = key;
+      fuzzy_query[fuzzy_query_length] = '\0';
+      fuzzy_scorer_post(0);
+      selected = 0;
     }
   }
 
-  return 0;
+  fuzzy_scorer_finish();
+  fuzzy_query_length = 0;
+  return result;
 }
 
-/* Jump cursor to matching bracket */
-void editor_jump_to_matching_bracket() {
-  if (editor_find_matching_bracket()) {
-    editor.cursor_y = editor.bracket_match_row;
-    editor.cursor_x = editor.bracket_match_col;
+/* Open the fuzzy finder and load the selected file into a buffer (Ctrl+P) */
+void editor_open_fuzzy_finder() {
+  char *filepath = editor_fuzzy_finder();
+  if (filepath) {
+    buffer_open(filepath);
+    free(filepath);
+  } else {
+    editor_set_status_message("Open cancelled");
   }
 }
 
-/* Adjust scroll speed based on time between consecutive scroll events.
- * Faster scrolling = higher multiplier (tactile scrolling). */
-void editor_update_scroll_speed(void) {
-  struct timespec now;
-  clock_gettime(CLOCK_MONOTONIC, &now);
+/*** clipboard functions ***/
 
-  /* Calculate time difference in microseconds */
-  long time_diff_us = (now.tv_sec - editor.last_scroll_time.tv_sec) * 1000000 +
-                      (now.tv_nsec - editor.last_scroll_time.tv_nsec) / 1000;
+/* Simple in-memory clipboard */
+static clipboard_text *clipboard_content = NULL;
+static int clipboard_content_type = 0;
 
-  /* Adjust speed based on timing */
-  if (time_diff_us < 80000) {         /* <80ms: accelerate */
-    if (editor.scroll_speed < 15) editor.scroll_speed++;
-  } else if (time_diff_us > 150000) { /* >150ms: reset */
-    editor.scroll_speed = 1;
-  }
-  /* 80-150ms: maintain current speed */
+/* Create an empty clipboard text holding one reference.
+ * Returns NULL if out of memory. */
+clipboard_text *clipboard_text_create() {
+  clipboard_text *text = memory_calloc(MEMORY_CLIPBOARD, 1, sizeof(clipboard_text));
+  if (text) text->reference_count = 1;
+  return text;
+}
 
-  editor.last_scroll_time = now;
+/* Take another reference to text. Safe to call from any thread.
+ * Returns text so it can be used inline. */
+clipboard_text *clipboard_text_retain(clipboard_text *text) {
+  if (text) __atomic_add_fetch(&text->reference_count, 1, __ATOMIC_RELAXED);
+  return text;
 }
 
-void editor_handle_mouse_event() {
-  int screen_x = last_mouse_event.column - 1;
-  int screen_y = last_mouse_event.row - 1;
+/* Drop a reference to text, freeing all chunks when it was the last one.
+ * Safe to call from any thread. */
+void clipboard_text_release(clipboard_text *text) {
+  if (!text) return;
+  if (__atomic_sub_fetch(&text->reference_count, 1, __ATOMIC_ACQ_REL) != 0) return;
 
-  /* Handle scroll wheel with tactile (velocity-based) speed */
-  if (last_mouse_event.button_base == MOUSE_SCROLL_UP) {
-    editor_update_scroll_speed();
-    for (int i = 0; i < editor.scroll_speed; i++) {
-      editor_move_cursor(ARROW_UP);
-    }
-    /* Extend selection if active (for drag-scroll selection) */
-    if (editor.selection.active) {
-      selection_extend();
-    }
-    return;
+  clipboard_chunk *chunk = text->head;
+  while (chunk) {
+    clipboard_chunk *next = chunk->next;
+    memory_free(MEMORY_CLIPBOARD, chunk);
+    chunk = next;
   }
-  if (last_mouse_event.button_base == MOUSE_SCROLL_DOWN) {
-    editor_update_scroll_speed();
-    for (int i = 0; i < editor.scroll_speed; i++) {
-      editor_move_cursor(ARROW_DOWN);
-    }
-    /* Extend selection if active (for drag-scroll selection) */
-    if (editor.selection.active) {
-      selection_extend();
+  memory_free(MEMORY_CLIPBOARD, text);
+}
+
+/* Append bytes to text, filling the tail chunk before allocating a new one.
+ * Only valid while the caller holds the sole reference.
+ * Returns 0 on success, -1 if out of memory. */
+int clipboard_text_append(clipboard_text *text, const char *data, size_t length) {
+  while (length > 0) {
+    clipboard_chunk *tail = text->tail;
+
+    if (!tail || tail->length == tail->capacity) {
+      size_t capacity = tail ? tail->capacity * 2 : CLIPBOARD_CHUNK_MIN_SIZE;
+      if (capacity > CLIPBOARD_CHUNK_MAX_SIZE) capacity = CLIPBOARD_CHUNK_MAX_SIZE;
+      while (capacity < length && capacity < CLIPBOARD_CHUNK_MAX_SIZE) capacity *= 2;
+
+      clipboard_chunk *chunk = memory_malloc(MEMORY_CLIPBOARD, sizeof(clipboard_chunk) + capacity);
+      if (!chunk) return -1;
+      chunk->next = NULL;
+      chunk->length = 0;
+      chunk->capacity = capacity;
+
+      if (tail) {
+        tail->next = chunk;
+      } else {
+        text->head = chunk;
+      }
+      text->tail = chunk;
+      tail = chunk;
     }
-    return;
+
+    size_t space = tail->capacity - tail->length;
+    size_t amount = length < space ? length : space;
+    memcpy(tail->data + tail->length, data, amount);
+    tail->length += amount;
+    text->total_length += amount;
+    data += amount;
+    length -= amount;
   }
+  return 0;
+}
 
-  /* Only handle left button (button_base 0) */
-  if (last_mouse_event.button_base != MOUSE_BUTTON_LEFT) return;
+/* Build a clipboard text from a NUL-terminated string.
+ * Returns NULL if out of memory. */
+clipboard_text *clipboard_text_from_string(const char *string) {
+  clipboard_text *text = clipboard_text_create();
+  if (text && clipboard_text_append(text, string, strlen(string)) != 0) {
+    clipboard_text_release(text);
+    return NULL;
+  }
+  return text;
+}
 
-  /* Calculate message bar position (after status bar) */
-  int message_bar_row = editor.screen_rows + 1;
+/* Copy text into one NUL-terminated string, for callers (like the undo log)
+ * that need contiguous memory. Returns malloc'd string, caller must free. */
+char *clipboard_text_flatten(clipboard_text *text) {
+  char *result = malloc(text->total_length + 1);
+  if (!result) return NULL;
 
-  /* Check for click on message bar (last row) - copy message to clipboard */
-  if (screen_y == message_bar_row && !last_mouse_event.is_motion) {
-    if (!last_mouse_event.is_release && strlen(editor.status_message) > 0) {
-      clipboard_store(editor.status_message, 1);
-      clipboard_sync_to_system(editor.status_message);
-      editor_set_status_message("Message copied to clipboard");
-    }
-    return;
+  size_t position = 0;
+  for (clipboard_chunk *chunk = text->head; chunk; chunk = chunk->next) {
+    memcpy(result + position, chunk->data, chunk->length);
+    position += chunk->length;
   }
+  result[position] = '\0';
+  return result;
+}
 
-  /* Ignore clicks in gutter area */
-  if (screen_x < editor.gutter_width) return;
+/* Compare two clipboard texts byte for byte without flattening either.
+ * Chunk boundaries don't have to line up. Returns 1 if equal. */
+static int clipboard_text_equal(clipboard_text *a, clipboard_text *b) {
+  if (a == b) return 1;
+  if (!a || !b || a->total_length != b->total_length) return 0;
 
-  /* Ignore clicks on status bar or message bar */
-  if (screen_y >= editor.screen_rows) return;
+  clipboard_chunk *chunk_a = a->head, *chunk_b = b->head;
+  size_t offset_a = 0, offset_b = 0;
+  while (chunk_a && chunk_b) {
+    size_t left_a = chunk_a->length - offset_a;
+    size_t left_b = chunk_b->length - offset_b;
+    size_t amount = left_a < left_b ? left_a : left_b;
 
-  /* Convert screen row to file row */
-  int visual_row = screen_y + editor.row_offset;
-  int file_row, wrap_row;
-  if (!editor_visual_to_logical(visual_row, &file_row, &wrap_row)) {
-    /* Click past end of file - go to last line */
-    file_row = editor.row_count > 0 ? editor.row_count - 1 : 0;
-    wrap_row = 0;
-  }
+    if (memcmp(chunk_a->data + offset_a, chunk_b->data + offset_b, amount) != 0) return 0;
 
-  /* Clamp to valid row range */
-  if (file_row >= editor.row_count) {
-    file_row = editor.row_count > 0 ? editor.row_count - 1 : 0;
+    offset_a += amount;
+    offset_b += amount;
+    if (offset_a == chunk_a->length) { chunk_a = chunk_a->next; offset_a = 0; }
+    if (offset_b == chunk_b->length) { chunk_b = chunk_b->next; offset_b = 0; }
   }
+  return 1;
+}
 
-  /* Calculate render_x from screen position */
-  int render_x = screen_x - editor.gutter_width;
+/* External tool the clipboard worker uses to reach the system clipboard */
+enum clipboard_helper {
+  CLIPBOARD_HELPER_NONE = 0,
+  CLIPBOARD_HELPER_XSEL,
+  CLIPBOARD_HELPER_XCLIP
+};
 
-  /* For soft wrap, adjust based on wrap segment */
-  if (editor.soft_wrap && file_row < editor.row_count) {
-    editor_row *row = &editor.row[file_row];
-    int segment_start = editor_wrap_segment_start(row, wrap_row);
-    render_x += segment_start;
-  } else {
-    render_x += editor.column_offset;
-  }
+/*
+ * Background clipboard worker. All process spawning (xsel/xclip) happens on
+ * this thread so the UI never waits on an external tool. The main thread
+ * hands over content to publish and asks for refreshes; the worker keeps a
+ * cached copy of the system clipboard plus a generation counter that bumps
+ * whenever that cached copy changes.
+ */
+typedef struct {
+  /* Worker thread handle */
+  pthread_t thread;
+  /* Guards every field below */
+  pthread_mutex_t lock;
+  /* Signalled when there is work for the worker or it should exit */
+  pthread_cond_t wakeup;
+  /* True once the worker thread has been started */
+  int started;
+  /* Set by the main thread to ask the worker to finish and exit */
+  int stopping;
+  /* Helper tool detected once at startup */
+  enum clipboard_helper helper;
+  /* Content waiting to be written to the system clipboard, or NULL */
+  clipboard_text *pending_write;
+  /* True when the main thread wants the cache re-read from the system */
+  int refresh_requested;
+  /* Cached system clipboard content as of the last read or write */
+  clipboard_text *system_content;
+  /* Incremented each time system_content changes */
+  unsigned long system_generation;
+} clipboard_worker_state;
+
+static clipboard_worker_state clipboard_worker = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wakeup = PTHREAD_COND_INITIALIZER
+};
 
-  /* Convert render_x to cursor_x (accounting for tabs) */
-  int cursor_x = 0;
-  if (file_row < editor.row_count) {
-    cursor_x = editor_row_render_to_cursor(&editor.row[file_row], render_x);
-    /* Clamp to line length */
-    if (cursor_x > editor.row[file_row].line_size) {
-      cursor_x = editor.row[file_row].line_size;
-    }
-  }
+/* Generation of the worker cache that clipboard_smart_merge last looked at */
+static unsigned long clipboard_seen_generation = 0;
 
-  /* Modifier-assisted multi-cursor placement (Ctrl/Alt + click) */
-  if (!last_mouse_event.is_motion &&
-      !last_mouse_event.is_release &&
-      (last_mouse_event.modifiers & (MOUSE_MOD_CTRL | MOUSE_MOD_ALT))) {
-    if (multicursor_add(file_row, cursor_x)) {
-      selection_clear();
-      editor_set_status_message("Added cursor at line %d, col %d (total: %zu)",
-                                file_row + 1, cursor_x + 1, editor.cursor_count + 1);
-    } else {
-      editor_set_status_message("Cursor already exists here");
-    }
-    return;
-  }
+/* True when copies should also be sent to the terminal via OSC 52 */
+static int clipboard_use_osc52 = 0;
 
-  /* Handle mouse motion (dragging) - extend selection */
-  if (last_mouse_event.is_motion) {
-    if (editor.selection.active) {
-      editor.cursor_x = cursor_x;
-      editor.cursor_y = file_row;
-      selection_extend();
-    }
-    return;
-  }
+/* Check whether an executable with the given name exists somewhere in PATH.
+ * Used once at startup so we never spawn a shell just to find out a tool is
+ * missing. Returns 1 if found, 0 otherwise. */
+static int clipboard_command_exists(const char *command) {
+  const char *path = getenv("PATH");
+  if (!path) return 0;
 
-  /* Ignore button releases */
-  if (last_mouse_event.is_release) return;
+  while (*path) {
+    const char *separator = strchr(path, ':');
+    size_t directory_length = separator ? (size_t)(separator - path) : strlen(path);
 
-  /* Check for Shift+Click to extend selection */
-  if (last_mouse_event.modifiers & MOUSE_MOD_SHIFT) {
-    if (!editor.selection.active) {
-      /* Start selection from current cursor position */
-      selection_start();
+    char candidate[PATH_MAX];
+    if (directory_length > 0 &&
+        snprintf(candidate, sizeof(candidate), "%.*s/%s",
+                 (int)directory_length, path, command) < (int)sizeof(candidate) &&
+        access(candidate, X_OK) == 0) {
+      return 1;
     }
-    /* Move cursor and extend selection to click position */
-    editor.cursor_x = cursor_x;
-    editor.cursor_y = file_row;
-    selection_extend();
-    return;
-  }
-
-  /* Handle multi-click detection (double/triple click) */
-  selection_detect_multi_click(file_row, cursor_x);
 
-  if (editor.selection.click_count == 2) {
-    /* Double-click: select word */
-    editor.cursor_x = cursor_x;
-    editor.cursor_y = file_row;
-    selection_select_word(file_row, cursor_x);
-  } else if (editor.selection.click_count >= 3) {
-    /* Triple-click: select line */
-    editor.cursor_x = cursor_x;
-    editor.cursor_y = file_row;
-    selection_select_line(file_row);
-  } else {
-    /* Single click: start drag selection */
-    editor.cursor_x = cursor_x;
-    editor.cursor_y = file_row;
-    selection_start();
+    if (!separator) break;
+    path = separator + 1;
   }
+  return 0;
 }
 
-/* Handle a single keypress. Maps keys to editor commands
- * including editing, navigation, search, and quit. */
-void editor_process_keypress() {
-  static int quit_times = MITER_QUIT_TIMES;
-
-  int key = editor_read_key();
+/* Pick the system clipboard helper. Without an X display neither xsel nor
+ * xclip can work, so we don't even try (that used to cost a full timeout on
+ * every paste over SSH). */
+static enum clipboard_helper clipboard_detect_helper() {
+  if (!getenv("DISPLAY")) return CLIPBOARD_HELPER_NONE;
+  if (clipboard_command_exists("xsel")) return CLIPBOARD_HELPER_XSEL;
+  if (clipboard_command_exists("xclip")) return CLIPBOARD_HELPER_XCLIP;
+  return CLIPBOARD_HELPER_NONE;
+}
 
-  /* No input available (timeout) - return immediately */
-  if (key == -1) return;
+/* Write content to the system clipboard with the detected helper, streaming
+ * it chunk by chunk straight into the pipe. Runs on the worker thread only. */
+static void clipboard_helper_write(enum clipboard_helper helper, clipboard_text *content) {
+  const char *command = NULL;
+  if (helper == CLIPBOARD_HELPER_XSEL) command = CLIPBOARD_XSEL_WRITE_COMMAND;
+  if (helper == CLIPBOARD_HELPER_XCLIP) command = CLIPBOARD_XCLIP_WRITE_COMMAND;
+  if (!command) return;
 
-  /* Reset Smart Home toggle state for all keys except Home */
-  if (key != HOME_KEY) {
-    editor.last_key_was_home = 0;
+  FILE *pipe = popen(command, "w");
+  if (pipe) {
+    for (clipboard_chunk *chunk = content->head; chunk; chunk = chunk->next) {
+      if (fwrite(chunk->data, 1, chunk->length, pipe) != chunk->length) break;
+    }
+    pclose(pipe);
   }
+}
 
-  switch (key) {
-    case '\r':
-      editor_insert_newline();
-      break;
-
-    case CTRL_KEY('q'):
-      if (editor.dirty && quit_times > 0) {
-        editor_set_status_message("You have unsaved changes. Save with Ctrl-S, "
-          "or press Ctrl-Q %d more times to quit anyway.", quit_times);
-        quit_times--;
-        return;
-      }
-      write(STDOUT_FILENO, ESCAPE_CLEAR_SCREEN, ESCAPE_CLEAR_SCREEN_LEN);
-      write(STDOUT_FILENO, ESCAPE_CURSOR_HOME, ESCAPE_CURSOR_HOME_LEN);
-      /* removed */
-      exit(0);
-      break;
-
-    case CTRL_KEY('s'):
-      editor_save();
-      break;
-
-    case CTRL_KEY('o'):
-      editor_open_file_browser();
-      break;
-
-    case HOME_KEY:
-      selection_clear();
-      {
-        /* Smart Home: toggle between first non-whitespace and column 0 */
-        editor_row *row = (editor.cursor_y < editor.row_count) ?
-                          &editor.row[editor.cursor_y] : NULL;
-        int first_nonws = get_first_nonwhitespace_col(row);
+/* Read the system clipboard with the detected helper. The pipe is drained
+ * into a chunk list, so there is no size limit. Runs on the worker thread
+ * only. Returns a new clipboard text, or NULL if empty/unavailable. */
+static clipboard_text *clipboard_helper_read(enum clipboard_helper helper) {
+  const char *command = NULL;
+  if (helper == CLIPBOARD_HELPER_XSEL) command = CLIPBOARD_XSEL_READ_COMMAND;
+  if (helper == CLIPBOARD_HELPER_XCLIP) command = CLIPBOARD_XCLIP_READ_COMMAND;
+  if (!command) return NULL;
+
+  FILE *pipe = popen(command, "r");
+  if (!pipe) return NULL;
+
+  clipboard_text *content = clipboard_text_create();
+  char buffer[CLIPBOARD_READ_BUFFER_SIZE];
+  size_t length;
+  while (content && (length = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+    if (clipboard_text_append(content, buffer, length) != 0) {
+      clipboard_text_release(content);
+      content = NULL;
+    }
+  }
+  pclose(pipe);
 
-        if (editor.last_key_was_home) {
-          /* Second press: toggle to the other position */
-          if (editor.cursor_x == 0) {
-            editor.cursor_x = first_nonws;
-          } else {
-            editor.cursor_x = 0;
-          }
-        } else {
-          /* First press: go to first non-whitespace, or column 0 if already there */
-          if (editor.cursor_x == first_nonws || first_nonws == 0) {
-            editor.cursor_x = 0;
-          } else {
-            editor.cursor_x = first_nonws;
-          }
-        }
-        editor.last_key_was_home = 1;
+  if (content && content->total_length == 0) {
+    clipboard_text_release(content);
+    return NULL;
+  }
+  return content;
+}
 
-        /* Align secondary cursors to same home target */
-        if (editor.cursor_count > 0) {
-          int use_first_nonws = (editor.cursor_x != 0);
-          multicursor_apply_home_position(use_first_nonws);
-        }
-      }
-      break;
+/* Replace the worker's cached system content, bumping the generation if the
+ * text actually changed. Takes over the caller's reference to content.
+ * Caller holds the lock. */
+static void clipboard_worker_update_cache(clipboard_text *content) {
+  if (!content) return;
 
-    case END_KEY:
-      selection_clear();
-      if (editor.cursor_y < editor.row_count)
-        editor.cursor_x = editor.row[editor.cursor_y].line_size;
-      if (editor.cursor_count > 0) {
-        multicursor_apply_end_position();
-      }
-      break;
+  if (clipboard_text_equal(clipboard_worker.system_content, content)) {
+    clipboard_text_release(content);
+    return;
+  }
+  clipboard_text_release(clipboard_worker.system_content);
+  clipboard_worker.system_content = content;
+  clipboard_worker.system_generation++;
+}
 
-    case CTRL_KEY('f'):
-      editor_find();
-      break;
+/* Worker thread main loop. Sleeps until the main thread queues a write or a
+ * refresh, then talks to the helper tool with the lock released. Pending
+ * writes are always flushed before the thread exits. */
+static void *clipboard_worker_run(void *argument) {
+  (void)argument;
 
-    case CTRL_KEY('a'):
-      selection_select_all();
-      break;
+  pthread_mutex_lock(&clipboard_worker.lock);
+  while (1) {
+    while (!clipboard_worker.pending_write && !clipboard_worker.refresh_requested &&
+           !clipboard_worker.stopping) {
+      pthread_cond_wait(&clipboard_worker.wakeup, &clipboard_worker.lock);
+    }
 
-    case CTRL_KEY('g'):
-      editor_jump_to_line();
-      break;
+    enum clipboard_helper helper = clipboard_worker.helper;
 
-    case ALT_T:
-      theme_cycle();
-      break;
+    if (clipboard_worker.pending_write) {
+      clipboard_text *content = clipboard_worker.pending_write;
+      clipboard_worker.pending_write = NULL;
 
-    case ALT_L:
-      editor_toggle_line_numbers();
-      break;
+      pthread_mutex_unlock(&clipboard_worker.lock);
+      clipboard_helper_write(helper, content);
+      pthread_mutex_lock(&clipboard_worker.lock);
 
-    case ALT_Q:
-      editor_reflow_paragraph();
-      break;
+      /* What we just wrote is now the system content */
+      clipboard_worker_update_cache(content);
+      continue;
+    }
 
-    case ALT_J:
-      editor_join_paragraph();
-      break;
+    if (clipboard_worker.stopping) break;
 
-    case ALT_S:
-      /* removed */
-      break;
+    if (clipboard_worker.refresh_requested) {
+      clipboard_worker.refresh_requested = 0;
 
-    case ALT_R:
-      /* SQL replace removed - Miter doesn't have SQLite */
-      break;
+      pthread_mutex_unlock(&clipboard_worker.lock);
+      clipboard_text *content = clipboard_helper_read(helper);
+      pthread_mutex_lock(&clipboard_worker.lock);
 
-    case ALT_N:
-      /* Snippet search removed - Miter doesn't have SQLite */
-      break;
+      clipboard_worker_update_cache(content);
+    }
+  }
+  pthread_mutex_unlock(&clipboard_worker.lock);
+  return NULL;
+}
 
-    case ALT_W:
-      editor_toggle_soft_wrap();
-      break;
+/* Stop the worker at exit, letting it finish any write still in flight so a
+ * copy made right before quitting is not lost. Registered with atexit(). */
+static void clipboard_worker_stop() {
+  if (!clipboard_worker.started) return;
 
-    case ALT_Z:
-      editor_toggle_center_scroll();
-      break;
+  pthread_mutex_lock(&clipboard_worker.lock);
+  clipboard_worker.stopping = 1;
+  clipboard_worker.refresh_requested = 0;
+  pthread_cond_signal(&clipboard_worker.wakeup);
+  pthread_mutex_unlock(&clipboard_worker.lock);
 
-    case ALT_OPEN_BRACKET:
-      editor_skip_opening_pair();
-      break;
+  pthread_join(clipboard_worker.thread, NULL);
+  clipboard_worker.started = 0;
+}
 
-    case ALT_CLOSE_BRACKET:
-      editor_skip_closing_pair();
-      break;
+/* Start the clipboard worker and decide whether OSC 52 should be used.
+ * OSC 52 lets the terminal itself own the clipboard, which is the only thing
+ * that works over SSH without X forwarding. Also queues an initial read so
+ * the first paste already has a warm cache. */
+void clipboard_worker_start() {
+  if (clipboard_worker.started) return;
 
-    case BACKSPACE:
-    case CTRL_KEY('h'):
-    case DEL_KEY:
-      if (key == DEL_KEY) editor_move_cursor(ARROW_RIGHT);
-      editor_delete_char();
-      break;
+  clipboard_worker.helper = clipboard_detect_helper();
+  clipboard_use_osc52 = (getenv("SSH_TTY") != NULL || getenv("SSH_CONNECTION") != NULL ||
+                         clipboard_worker.helper == CLIPBOARD_HELPER_NONE);
 
-    case PAGE_UP:
-    case PAGE_DOWN:
-      {
-        int original_line = editor.cursor_y;
-        selection_clear();
-        if (key == PAGE_UP) {
-          editor.cursor_y = editor.row_offset;
-        } else if (key == PAGE_DOWN) {
-          editor.cursor_y = editor.row_offset + editor.screen_rows - 1;
-          if (editor.cursor_y > editor.row_count) editor.cursor_y = editor.row_count;
-        }
+  /* Nothing for a thread to do without a helper tool */
+  if (clipboard_worker.helper == CLIPBOARD_HELPER_NONE) return;
 
-        int times = editor.screen_rows;
-        while (times--)
-          editor_move_cursor(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+  clipboard_worker.refresh_requested = 1;
+  if (pthread_create(&clipboard_worker.thread, NULL, clipboard_worker_run, NULL) != 0) {
+    clipboard_worker.helper = CLIPBOARD_HELPER_NONE;
+    return;
+  }
+  clipboard_worker.started = 1;
+  atexit(clipboard_worker_stop);
+}
 
-        if (editor.cursor_count > 0) {
-          int delta_rows = editor.cursor_y - original_line;
-          multicursor_apply_vertical_delta(delta_rows);
-        }
-      }
-      break;
+/* Ask the worker to re-read the system clipboard in the background.
+ * Returns immediately; the result shows up in the cache generation. */
+void clipboard_request_refresh() {
+  if (!clipboard_worker.started) return;
 
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-      selection_clear();
-      editor_move_cursor(key);
-      if (editor.cursor_count > 0) {
-        multicursor_move_all(key);
+  pthread_mutex_lock(&clipboard_worker.lock);
+  clipboard_worker.refresh_requested = 1;
+  pthread_cond_signal(&clipboard_worker.wakeup);
+  pthread_mutex_unlock(&clipboard_worker.lock);
+}
+
+/* Base64-encode content straight into an OSC 52 sequence on the terminal.
+ * Works a chunk at a time through a small fixed buffer, carrying up to two
+ * bytes across chunk boundaries, so no encoded copy of the text is built.
+ * Works over SSH and inside multiplexers that pass OSC 52 through. */
+static void clipboard_write_osc52(clipboard_text *content) {
+  static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  if (content->total_length == 0 || content->total_length > CLIPBOARD_OSC52_MAX_BYTES) return;
+
+  char output[CLIPBOARD_OSC52_OUTPUT_BUFFER_SIZE];
+  size_t out = 0;
+  unsigned char carry[3];
+  int carried = 0;
+
+  terminal_write(ESCAPE_OSC52_PREFIX, ESCAPE_OSC52_PREFIX_LEN);
+
+  for (clipboard_chunk *chunk = content->head; chunk; chunk = chunk->next) {
+    for (size_t i = 0; i < chunk->length; i++) {
+      carry[carried++] = (unsigned char)chunk->data[i];
+      if (carried < 3) continue;
+
+      unsigned long triple = ((unsigned long)carry[0] << 16) | (carry[1] << 8) | carry[2];
+      output[out++] = alphabet[(triple >> 18) & 0x3F];
+      output[out++] = alphabet[(triple >> 12) & 0x3F];
+      output[out++] = alphabet[(triple >> 6) & 0x3F];
+      output[out++] = alphabet[triple & 0x3F];
+      carried = 0;
+
+      if (out + 4 > sizeof(output)) {
+        terminal_write(output, out);
+        out = 0;
       }
-      break;
+    }
+  }
 
-    /* Shift+Arrow: extend selection while moving cursor */
-    case SHIFT_ARROW_UP:
-      if (!editor.selection.active) selection_start();
-      editor_move_cursor(ARROW_UP);
-      selection_extend();
-      break;
-    case SHIFT_ARROW_DOWN:
-      if (!editor.selection.active) selection_start();
-      editor_move_cursor(ARROW_DOWN);
-      selection_extend();
-      break;
-    case SHIFT_ARROW_LEFT:
-      if (!editor.selection.active) selection_start();
-      editor_move_cursor(ARROW_LEFT);
-      selection_extend();
-      break;
-    case SHIFT_ARROW_RIGHT:
-      if (!editor.selection.active) selection_start();
-      editor_move_cursor(ARROW_RIGHT);
-      selection_extend();
-      break;
-    case SHIFT_HOME:
-      if (!editor.selection.active) selection_start();
-      editor.cursor_x = 0;
-      selection_extend();
-      break;
-    case SHIFT_END:
-      if (!editor.selection.active) selection_start();
-      if (editor.cursor_y < editor.row_count)
-        editor.cursor_x = editor.row[editor.cursor_y].line_size;
-      selection_extend();
-      break;
+  /* Pad the final group */
+  if (carried > 0) {
+    unsigned long triple = (unsigned long)carry[0] << 16;
+    if (carried > 1) triple |= carry[1] << 8;
+    output[out++] = alphabet[(triple >> 18) & 0x3F];
+    output[out++] = alphabet[(triple >> 12) & 0x3F];
+    output[out++] = carried > 1 ? alphabet[(triple >> 6) & 0x3F] : '=';
+    output[out++] = '=';
+  }
+  terminal_write(output, out);
+  terminal_write(ESCAPE_OSC52_SUFFIX, ESCAPE_OSC52_SUFFIX_LEN);
+}
 
-    /* Word navigation (Ctrl+Arrow) */
-    case CTRL_ARROW_LEFT:
-      selection_clear();
-      editor_move_word_left();
-      if (editor.cursor_count > 0) {
-        multicursor_move_word_left_all();
-      }
-      break;
-    case CTRL_ARROW_RIGHT:
-      selection_clear();
-      editor_move_word_right();
-      if (editor.cursor_count > 0) {
-        multicursor_move_word_right_all();
-      }
-      break;
+/* Store content in clipboard. The clipboard takes its own reference, so
+ * the caller keeps (and must still release) the one it passed in.
+ * Returns 0 on success, -1 on failure. */
+int clipboard_store(clipboard_text *content, int content_type) {
+  if (!content) return -1;
 
-    /* Word deletion */
-    case CTRL_KEY('w'):  /* Ctrl+W: delete word backward (Unix standard) */
-      selection_clear();
-      editor_delete_word_backward();
-      break;
-    case CTRL_DELETE:    /* Ctrl+Delete: delete word forward */
-      selection_clear();
-      editor_delete_word_forward();
-      break;
+  clipboard_text_release(clipboard_content);
+  clipboard_content = clipboard_text_retain(content);
+  clipboard_content_type = content_type;
 
-    /* Clipboard operations */
-    case CTRL_KEY('c'):
-      editor_copy();
-      break;
-    case CTRL_KEY('x'):
-      editor_cut();
-      break;
-    case CTRL_KEY('v'):
-      editor_paste();
-      break;
+  /* Also sync to system clipboard */
+  clipboard_sync_to_system(content);
 
-    /* Undo/Redo operations */
-    case CTRL_KEY('z'):
-      editor_undo();
-      break;
-    case CTRL_KEY('y'):
-      editor_redo();
-      break;
+  return 0;
+}
 
-    /* Line manipulation operations */
-    case CTRL_KEY('d'):
-      editor_duplicate_line();
-      break;
-    case CTRL_KEY('k'):
-      editor_delete_line();
-      break;
-    case CTRL_KEY('j'):
-      editor_join_lines();
-      break;
-    case ALT_SHIFT_UP:
-      editor_move_line_up();
-      break;
-    case ALT_SHIFT_DOWN:
-      editor_move_line_down();
-      break;
+/* Get most recent clipboard entry. Returns a new reference to the shared
+ * text (no copy), caller must release. Sets content_type if non-NULL. */
+clipboard_text *clipboard_get_latest(int *content_type) {
+  if (!clipboard_content) return NULL;
 
-    /* Multi-cursor operations */
-    case ALT_UP:
-      multicursor_add_above();
-      break;
-    case ALT_DOWN:
-      multicursor_add_below();
-      break;
-    case ALT_C:
-      multicursor_add_at_primary();
-      break;
-    case ALT_V:
-      multicursor_add_at_primary_and_advance();
-      break;
+  if (content_type) *content_type = clipboard_content_type;
+  return clipboard_text_retain(clipboard_content);
+}
 
-    case MOUSE_EVENT:
-      editor_handle_mouse_event();
-      break;
+/* Sync content TO system clipboard. The write itself is handed to the
+ * clipboard worker (replacing any write it hasn't started yet), and OSC 52
+ * is emitted when the terminal is the better clipboard owner. Never blocks
+ * on an external process, and only ever shares content by reference. */
+void clipboard_sync_to_system(clipboard_text *content) {
+  if (!content) return;
 
-    /* Bracket matching */
-    case CTRL_KEY(']'):
-      editor_jump_to_matching_bracket();
-      break;
+  if (clipboard_use_osc52) {
+    clipboard_write_osc52(content);
+  }
 
-    /* Comment toggle operations */
-    case 31:  /* Ctrl+/ sends ASCII 31 (0x1F) */
-      editor_toggle_line_comment();
-      break;
-    case CTRL_KEY('\\'):  /* Ctrl+\ for block comment (alternative) */
-      editor_toggle_block_comment();
-      break;
+  if (clipboard_worker.started) {
+    pthread_mutex_lock(&clipboard_worker.lock);
+    clipboard_text_release(clipboard_worker.pending_write);
+    clipboard_worker.pending_write = clipboard_text_retain(content);
+    pthread_cond_signal(&clipboard_worker.wakeup);
+    pthread_mutex_unlock(&clipboard_worker.lock);
+  }
 
-    case CTRL_KEY('l'):
-      break;
-    case CHAR_ESCAPE:
-      /* Escape: clear secondary cursors and selection */
-      if (editor.cursor_count > 0) {
-        size_t cleared = editor.cursor_count;
-        multicursor_clear();
-        editor_set_status_message("Cleared %zu secondary cursor(s)", cleared);
-      }
-      selection_clear();
-      break;
+  /* Track what we synced for smart merge */
+  clipboard_text_release(editor.last_system_clipboard);
+  editor.last_system_clipboard = clipboard_text_retain(content);
+}
 
-    /* Tab: indent line, Shift+Tab: unindent line */
-    case '\t':
-      editor_indent_line();
-      break;
-    case SHIFT_TAB:
-      editor_unindent_line();
-      break;
+/* Read FROM system clipboard. Returns a reference to the worker's cached
+ * content rather than spawning a helper, so the caller never waits.
+ * Caller must release. Returns NULL if empty/unavailable. */
+clipboard_text *clipboard_read_from_system() {
+  if (!clipboard_worker.started) return NULL;
 
-    default:
-      editor_insert_char(key);
-      break;
+  pthread_mutex_lock(&clipboard_worker.lock);
+  clipboard_text *content = clipboard_text_retain(clipboard_worker.system_content);
+  pthread_mutex_unlock(&clipboard_worker.lock);
+  return content;
+}
+
+/* Smart merge: check if system clipboard changed externally.
+ * Only looks at the cache when its generation moved since the last check,
+ * then imports the new content into the internal clipboard before paste.
+ * Always queues a background refresh so the next paste sees fresh data. */
+void clipboard_smart_merge() {
+  if (!clipboard_worker.started) return;
+
+  pthread_mutex_lock(&clipboard_worker.lock);
+  unsigned long generation = clipboard_worker.system_generation;
+  pthread_mutex_unlock(&clipboard_worker.lock);
+
+  if (generation != clipboard_seen_generation) {
+    clipboard_seen_generation = generation;
+    clipboard_text *system_content = clipboard_read_from_system();
+
+    /* If different from last sync, update internal clipboard */
+    if (system_content && !clipboard_text_equal(system_content, editor.last_system_clipboard)) {
+      clipboard_text_release(clipboard_content);
+      clipboard_content = clipboard_text_retain(system_content);
+      clipboard_content_type = SELECTION_CHAR;
+      clipboard_text_release(editor.last_system_clipboard);
+      editor.last_system_clipboard = clipboard_text_retain(system_content);
+    }
+    clipboard_text_release(system_content);
   }
 
-  quit_times = MITER_QUIT_TIMES;
+  clipboard_request_refresh();
+}
+
+/*** configuration ***/
+
+/* One line of the config file. Every line is kept, comments and blank
+ * lines included, so saving rewrites only the values that changed. */
+typedef struct {
+  /* The line as read (or as regenerated after config_set), no newline */
+  char *text;
+  /* Section the line belongs to ("" before the first [section]) */
+  char *section;
+  /* Key and value for key=value lines; NULL otherwise */
+  char *key;
+  char *value;
+} config_line;
+
+/* In-memory model of miter.conf, loaded once and reloaded only when the
+ * file's modification time or size changes */
+static struct {
+  config_line *lines;
+  int line_count;
+  int line_capacity;
+  /* File the model was read from */
+  char path[PATH_MAX];
+  /* Identity of that file when read; reload when any of these change */
+  int exists;
+  struct timespec modified;
+  off_t size;
+  /* True once config_refresh has run */
+  int loaded;
+} config;
+
+/* Strip leading and trailing blanks in place. Returns the trimmed start. */
+static char *config_trim(char *text) {
+  while (*text == ' ' || *text == '\t') text++;
+  char *end = text + strlen(text);
+  while (end > text && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) end--;
+  *end = '\0';
+  return text;
+}
+
+/* Free every line of the model. */
+static void config_clear() {
+  for (int i = 0; i < config.line_count; i++) {
+    free(config.lines[i].text);
+    free(config.lines[i].section);
+    free(config.lines[i].key);
+    free(config.lines[i].value);
+  }
+  free(config.lines);
+  config.lines = NULL;
+  config.line_count = 0;
+  config.line_capacity = 0;
+}
+
+/* Append a line to the model, splitting key=value lines.
+ * Returns the new line, or NULL if out of memory. */
+static config_line *config_add_line(const char *text, const char *section) {
+  if (config.line_count >= config.line_capacity) {
+    int capacity = config.line_capacity ? config.line_capacity * 2 : 32;
+    config_line *lines = realloc(config.lines, capacity * sizeof(config_line));
+    if (!lines) return NULL;
+    config.lines = lines;
+    config.line_capacity = capacity;
+  }
+
+  config_line *line = &config.lines[config.line_count];
+  memset(line, 0, sizeof(*line));
+  line->text = strdup(text);
+  line->section = strdup(section);
+  if (!line->text || !line->section) {
+    free(line->text);
+    free(line->section);
+    return NULL;
+  }
+  config.line_count++;
+
+  char *copy = strdup(text);
+  if (!copy) return line;
+  char *trimmed = config_trim(copy);
+  char *eq = strchr(trimmed, '=');
+  if (eq && trimmed[0] != '#' && trimmed[0] != ';' && trimmed[0] != '/' && trimmed[0] != '[') {
+    *eq = '\0';
+    char *key = config_trim(trimmed);
+    if (*key) {
+      line->key = strdup(key);
+      line->value = strdup(config_trim(eq + 1));
+    }
+  }
+  free(copy);
+  return line;
 }
 
-/*** clipboard functions ***/
-
-/* Simple in-memory clipboard */
-static char *clipboard_content = NULL;
-static int clipboard_content_type = 0;
-
-/* Store content in clipboard.
- * Returns 0 on success, -1 on failure. */
-int clipboard_store(const char *content, int content_type) {
-  if (!content) return -1;
+/* Pick the config file: miter.conf, or the legacy terra.conf if only that
+ * exists. Fills st and returns 1 if the chosen file exists. */
+static int config_locate(char *path, size_t size, struct stat *st) {
+  if (stat(CONFIG_FILE_NAME, st) == 0) {
+    snprintf(path, size, "%s", CONFIG_FILE_NAME);
+    return 1;
+  }
+  if (stat(CONFIG_LEGACY_FILE_NAME, st) == 0) {
+    snprintf(path, size, "%s", CONFIG_LEGACY_FILE_NAME);
+    return 1;
+  }
+  snprintf(path, size, "%s", CONFIG_FILE_NAME);
+  return 0;
+}
 
-  free(clipboard_content);
-  clipboard_content = strdup(content);
-  clipboard_content_type = content_type;
+/* Make sure the model reflects the config file, parsing it only when it
+ * is new or its mtime or size changed since the last read. Cheap enough
+ * (a single stat) to call whenever settings are about to be used.
+ * Returns 1 if the model was (re)loaded. */
+int config_refresh() {
+  char path[PATH_MAX];
+  struct stat st;
+  int exists = config_locate(path, sizeof(path), &st);
+
+  if (config.loaded && exists == config.exists && strcmp(path, config.path) == 0 &&
+      (!exists || (st.st_mtim.tv_sec == config.modified.tv_sec &&
+                   st.st_mtim.tv_nsec == config.modified.tv_nsec &&
+                   st.st_size == config.size))) {
+    return 0;
+  }
 
-  /* Also sync to system clipboard */
-  clipboard_sync_to_system(content);
+  config_clear();
+  config.loaded = 1;
+  config.exists = exists;
+  snprintf(config.path, sizeof(config.path), "%s", path);
+  if (!exists) return 1;
+  config.modified = st.st_mtim;
+  config.size = st.st_size;
+
+  FILE *f = fopen(path, "r");
+  if (!f) return 1;
+
+  char section[CONFIG_LINE_BUFFER_SIZE] = "";
+  char *text = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&text, &capacity, f)) != -1) {
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) text[--length] = '\0';
+
+    /* A [section] header starts a new section */
+    char *trimmed = text;
+    while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+    if (*trimmed == '[') {
+      char *close = strchr(trimmed, ']');
+      if (close) {
+        int name_length = close - trimmed - 1;
+        if (name_length >= (int)sizeof(section)) name_length = sizeof(section) - 1;
+        memcpy(section, trimmed + 1, name_length);
+        section[name_length] = '\0';
+      }
+    }
+    config_add_line(text, section);
+  }
+  free(text);
+  fclose(f);
+  return 1;
+}
 
-  return clipboard_content ? 0 : -1;
+/* Find the line holding key in section, or NULL. Later lines win, as they
+ * did when the file was scanned top to bottom. */
+static config_line *config_find(const char *section, const char *key) {
+  for (int i = config.line_count - 1; i >= 0; i--) {
+    config_line *line = &config.lines[i];
+    if (line->key && strcmp(line->key, key) == 0 && strcmp(line->section, section) == 0) return line;
+  }
+  return NULL;
 }
 
-/* Get most recent clipboard entry.
- * Returns malloc'd string, caller must free. Sets content_type if non-NULL. */
-char *clipboard_get_latest(int *content_type) {
-  if (!clipboard_content) return NULL;
+/* Look up a string setting ("" is the top-level section).
+ * Returns fallback if the key isn't set. */
+const char *config_get_string(const char *section, const char *key, const char *fallback) {
+  config_line *line = config_find(section, key);
+  return line && line->value ? line->value : fallback;
+}
 
-  if (content_type) *content_type = clipboard_content_type;
-  return strdup(clipboard_content);
+/* Look up an integer setting, clamped to [minimum, maximum].
+ * Returns fallback if the key isn't set or isn't a number. */
+int config_get_int(const char *section, const char *key, int fallback, int minimum, int maximum) {
+  const char *value = config_get_string(section, key, NULL);
+  if (!value) return fallback;
+
+  char *end;
+  long number = strtol(value, &end, 10);
+  if (end == value || *config_trim(end) != '\0') return fallback;
+  if (number < minimum) return minimum;
+  if (number > maximum) return maximum;
+  return number;
 }
 
-/* Sync content TO system clipboard via xsel or xclip.
- * Silently fails if neither tool is available. */
-void clipboard_sync_to_system(const char *content) {
-  if (!content) return;
+/* Look up a boolean setting (1/0, true/false, yes/no, on/off).
+ * Returns fallback if the key isn't set or isn't recognized. */
+int config_get_bool(const char *section, const char *key, int fallback) {
+  const char *value = config_get_string(section, key, NULL);
+  if (!value) return fallback;
+  if (strcmp(value, "1") == 0 || strcasecmp(value, "true") == 0 ||
+      strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0) return 1;
+  if (strcmp(value, "0") == 0 || strcasecmp(value, "false") == 0 ||
+      strcasecmp(value, "no") == 0 || strcasecmp(value, "off") == 0) return 0;
+  return fallback;
+}
 
-  FILE *pipe = popen("xsel --clipboard --input 2>/dev/null", "w");
-  if (!pipe) {
-    pipe = popen("xclip -selection clipboard 2>/dev/null", "w");
+/* Set a string setting in the model. An existing line is rewritten in
+ * place; a new top-level key goes before the first [section] so it is not
+ * swallowed by it. Call config_save to write the file. */
+void config_set_string(const char *section, const char *key, const char *value) {
+  char text[CONFIG_LINE_BUFFER_SIZE];
+  snprintf(text, sizeof(text), "%s=%s", key, value);
+
+  config_line *line = config_find(section, key);
+  if (line) {
+    char *new_text = strdup(text);
+    char *new_value = strdup(value);
+    if (!new_text || !new_value) {
+      free(new_text);
+      free(new_value);
+      return;
+    }
+    free(line->text);
+    free(line->value);
+    line->text = new_text;
+    line->value = new_value;
+    return;
   }
-  if (pipe) {
-    fwrite(content, 1, strlen(content), pipe);
-    pclose(pipe);
+
+  /* Position: after the last line of the section (or of the top level) */
+  int position = config.line_count;
+  if (section[0] == '\0') {
+    for (int i = 0; i < config.line_count; i++) {
+      if (config.lines[i].section[0] != '\0') {
+        position = i;
+        break;
+      }
+    }
+  } else {
+    int found = 0;
+    for (int i = 0; i < config.line_count; i++) {
+      if (strcmp(config.lines[i].section, section) == 0) {
+        position = i + 1;
+        found = 1;
+      }
+    }
+    if (!found) {
+      char header[CONFIG_LINE_BUFFER_SIZE];
+      snprintf(header, sizeof(header), "[%s]", section);
+      config_add_line(header, section);
+      position = config.line_count;
+    }
   }
 
-  /* Track what we synced for smart merge */
-  free(editor.last_system_clipboard);
-  editor.last_system_clipboard = strdup(content);
+  if (!config_add_line(text, section)) return;
+  config_line added = config.lines[config.line_count - 1];
+  memmove(&config.lines[position + 1], &config.lines[position],
+          (config.line_count - 1 - position) * sizeof(config_line));
+  config.lines[position] = added;
 }
 
-/* Read FROM system clipboard via xsel or xclip.
- * Returns malloc'd string, caller must free. Returns NULL if empty/unavailable. */
-char *clipboard_read_from_system() {
-  char buffer[65536];
-  buffer[0] = '\0';
+/* Set an integer setting in the model. */
+void config_set_int(const char *section, const char *key, int value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%d", value);
+  config_set_string(section, key, text);
+}
 
-  FILE *pipe = popen("xsel --clipboard --output 2>/dev/null", "r");
-  if (!pipe) {
-    pipe = popen("xclip -selection clipboard -o 2>/dev/null", "r");
+/* Write the model to miter.conf, keeping comments, sections and settings
+ * the editor doesn't know about. The file's new identity is recorded so
+ * our own write doesn't trigger a reload. */
+void config_save() {
+  FILE *f = fopen(CONFIG_FILE_NAME, "w");
+  if (!f) return;
+  for (int i = 0; i < config.line_count; i++) {
+    fprintf(f, "%s\n", config.lines[i].text);
   }
-  if (pipe) {
-    size_t len = fread(buffer, 1, sizeof(buffer) - 1, pipe);
-    buffer[len] = '\0';
-    pclose(pipe);
-    return len > 0 ? strdup(buffer) : NULL;
+  fclose(f);
+
+  struct stat st;
+  if (stat(CONFIG_FILE_NAME, &st) == 0) {
+    config.exists = 1;
+    snprintf(config.path, sizeof(config.path), "%s", CONFIG_FILE_NAME);
+    config.modified = st.st_mtim;
+    config.size = st.st_size;
   }
-  return NULL;
 }
 
-/* Smart merge: check if system clipboard changed externally.
- * If different from last sync, import to internal clipboard before paste. */
-void clipboard_smart_merge() {
-  char *system_content = clipboard_read_from_system();
-  if (!system_content) return;
-
-  /* If different from last sync, update internal clipboard */
-  if (!editor.last_system_clipboard ||
-      strcmp(system_content, editor.last_system_clipboard) != 0) {
-    free(clipboard_content);
-    clipboard_content = system_content;
-    clipboard_content_type = SELECTION_CHAR;
-    free(editor.last_system_clipboard);
-    editor.last_system_clipboard = strdup(system_content);
+/* Apply editor settings from the config model: tab stop, hard wrap column
+ * and soft wrap. Rows are re-rendered when the tab stop changes, and
+ * rewrapped when soft wrap or the text width changes. */
+void config_apply_settings() {
+  editor.show_line_numbers = config_get_bool("", "show_line_numbers", 1);
+  editor.wrap_column = config_get_int("", "wrap_column", DEFAULT_WRAP_COLUMN, 1, CONFIG_WRAP_COLUMN_MAX);
+  int soft_wrap = config_get_bool("", "soft_wrap", 0);
+  /* Wrapped lines never scroll sideways */
+  if (soft_wrap && !editor.soft_wrap) editor.column_offset = 0;
+  editor.soft_wrap = soft_wrap;
+
+  const char *depth = config_get_string("", "color_depth", "auto");
+  if (strcmp(depth, "truecolor") == 0 || strcmp(depth, "24bit") == 0) {
+    editor.color_depth_setting = COLOR_DEPTH_TRUECOLOR;
+  } else if (strcmp(depth, "256") == 0) {
+    editor.color_depth_setting = COLOR_DEPTH_256;
+  } else if (strcmp(depth, "16") == 0) {
+    editor.color_depth_setting = COLOR_DEPTH_16;
   } else {
-    free(system_content);
+    editor.color_depth_setting = COLOR_DEPTH_AUTO;
+  }
+  color_depth_update();
+
+  editor.buffer_memory_budget = (size_t)config_get_int("", "buffer_memory_mb", DEFAULT_BUFFER_MEMORY_MB, 0,
+                                                       CONFIG_BUFFER_MEMORY_MB_MAX) << 20;
+
+  int tab_stop = config_get_int("", "tab_stop", MITER_TAB_STOP, 1, CONFIG_TAB_STOP_MAX);
+  if (tab_stop != editor.tab_stop) {
+    editor.tab_stop = tab_stop;
+    for (int i = 0; i < editor.row_count; i++) editor_update_row(&editor.row[i]);
   }
+  editor_update_gutter_width();
+  editor_rewrap_all_rows();
+}
+
+/* Pick up edits to the config file made while the editor runs. */
+void config_reload_if_changed() {
+  if (!config_refresh()) return;
+  config_apply_settings();
+  theme_load(editor.current_theme_index);
 }
 
 /*** undo/redo system (in-memory) ***/
 
 /* Free an undo entry's allocated strings */
 static void undo_entry_free(undo_entry *entry) {
-  free(entry->row_content);
-  free(entry->char_data);
-  free(entry->multi_line);
+  memory_free(MEMORY_UNDO, entry->row_content);
+  memory_free(MEMORY_UNDO, entry->char_data);
+  memory_free(MEMORY_UNDO, entry->multi_line);
   entry->row_content = NULL;
   entry->char_data = NULL;
   entry->multi_line = NULL;
@@ -7652,6 +14056,7 @@ void undo_start_new_group() {
 
 /* Check if enough time has passed to start a new undo group */
 void undo_maybe_start_group(int force_new) {
+  if (editor.undo_group_held) return;
   if (force_new) {
     undo_start_new_group();
     return;
@@ -7677,10 +14082,26 @@ void undo_log(enum undo_op_type type, int cursor_row, int cursor_col,
               int row_idx, int char_pos, const char *char_data,
               int end_row, int end_col, const char *multi_line) {
   if (editor.undo_logging) return;
+  undo_log_adopt(type, cursor_row, cursor_col, row_idx, char_pos, char_data, end_row, end_col,
+                 multi_line ? memory_strdup(MEMORY_UNDO, multi_line) : NULL,
+                 multi_line ? strlen(multi_line) : 0);
+}
+
+/* Like undo_log, but the entry takes ownership of multi_line, which must
+ * be allocated under MEMORY_UNDO and holds multi_line_length bytes. Large
+ * pastes are logged without a copy. */
+void undo_log_adopt(enum undo_op_type type, int cursor_row, int cursor_col,
+                    int row_idx, int char_pos, const char *char_data,
+                    int end_row, int end_col, char *multi_line, size_t multi_line_length) {
+  TRACE_SCOPE(__func__);
+  if (editor.undo_logging) {
+    memory_free(MEMORY_UNDO, multi_line);
+    return;
+  }
 
   int force_new_group = (type == UNDO_ROW_INSERT || type == UNDO_ROW_DELETE ||
                          type == UNDO_ROW_SPLIT || type == UNDO_SELECTION_DELETE ||
-                         type == UNDO_PASTE);
+                         type == UNDO_PASTE || type == UNDO_TEXT_INSERT);
 
   undo_clear_redo();
   undo_maybe_start_group(force_new_group);
@@ -7688,7 +14109,7 @@ void undo_log(enum undo_op_type type, int cursor_row, int cursor_col,
   /* Initialize stack if needed */
   if (!editor.undo_stack) {
     editor.undo_stack_capacity = 256;
-    editor.undo_stack = malloc(editor.undo_stack_capacity * sizeof(undo_entry));
+    editor.undo_stack = memory_malloc(MEMORY_UNDO, editor.undo_stack_capacity * sizeof(undo_entry));
     editor.undo_stack_count = 0;
   }
 
@@ -7705,8 +14126,8 @@ void undo_log(enum undo_op_type type, int cursor_row, int cursor_col,
       editor.undo_stack_count -= to_remove;
     } else {
       editor.undo_stack_capacity *= 2;
-      editor.undo_stack = realloc(editor.undo_stack,
-                                  editor.undo_stack_capacity * sizeof(undo_entry));
+      editor.undo_stack = memory_realloc(MEMORY_UNDO, editor.undo_stack,
+                                         editor.undo_stack_capacity * sizeof(undo_entry));
     }
   }
 
@@ -7724,13 +14145,14 @@ void undo_log(enum undo_op_type type, int cursor_row, int cursor_col,
   /* Copy row content for row operations */
   if ((type == UNDO_ROW_DELETE || type == UNDO_ROW_INSERT) &&
       row_idx >= 0 && row_idx < editor.row_count) {
-    entry->row_content = strdup(editor.row[row_idx].chars);
+    entry->row_content = memory_strdup(MEMORY_UNDO, editor.row[row_idx].chars);
   } else {
     entry->row_content = NULL;
   }
 
-  entry->char_data = char_data ? strdup(char_data) : NULL;
-  entry->multi_line = multi_line ? strdup(multi_line) : NULL;
+  entry->char_data = char_data ? memory_strdup(MEMORY_UNDO, char_data) : NULL;
+  entry->multi_line = multi_line;
+  entry->multi_line_length = multi_line_length;
 
   editor.undo_position = editor.undo_group_id;
 }
@@ -7777,30 +14199,14 @@ void editor_undo() {
     switch (e->op_type) {
       case UNDO_CHAR_INSERT:
         if (e->row_idx >= 0 && e->row_idx < editor.row_count && e->char_pos >= 0) {
-          editor_row *row = &editor.row[e->row_idx];
-          if (e->char_pos < row->line_size) {
-            memmove(&row->chars[e->char_pos], &row->chars[e->char_pos + 1],
-                    row->line_size - e->char_pos);
-            row->line_size--;
-            editor_update_row(row);
-            row->dirty = 1;
-            editor.dirty++;
-          }
+          editor_row_delete_char(&editor.row[e->row_idx], e->char_pos);
         }
         break;
 
       case UNDO_CHAR_DELETE:
       case UNDO_CHAR_DELETE_FWD:
         if (e->row_idx >= 0 && e->row_idx < editor.row_count && e->char_data && e->char_pos >= 0) {
-          editor_row *row = &editor.row[e->row_idx];
-          row->chars = realloc(row->chars, row->line_size + 2);
-          memmove(&row->chars[e->char_pos + 1], &row->chars[e->char_pos],
-                  row->line_size - e->char_pos + 1);
-          row->chars[e->char_pos] = e->char_data[0];
-          row->line_size++;
-          editor_update_row(row);
-          row->dirty = 1;
-          editor.dirty++;
+          editor_row_insert_char(&editor.row[e->row_idx], e->char_pos, e->char_data[0]);
         }
         break;
 
@@ -7811,21 +14217,24 @@ void editor_undo() {
         break;
 
       case UNDO_ROW_DELETE:
-        if (e->row_content && e->row_idx >= 0) {
+        if (e->row_content && e->row_idx >= 0 && e->row_idx <= editor.row_count) {
+          /* Take the joined text back off the previous row */
+          editor_row *previous = e->row_idx > 0 ? &editor.row[e->row_idx - 1] : NULL;
+          if (previous && e->char_pos >= 0 && e->char_pos < previous->line_size) {
+            int removed = previous->line_size - e->char_pos;
+            previous->line_size = e->char_pos;
+            previous->chars[previous->line_size] = '\0';
+            editor_update_row_edit(previous, e->char_pos, removed, 0);
+            previous->dirty = 1;
+          }
           editor_insert_row(e->row_idx, e->row_content, strlen(e->row_content));
         }
         break;
 
       case UNDO_ROW_SPLIT:
         if (e->row_idx >= 0 && e->row_idx < editor.row_count - 1) {
-          editor_row *row = &editor.row[e->row_idx];
           editor_row *next = &editor.row[e->row_idx + 1];
-          row->chars = realloc(row->chars, row->line_size + next->line_size + 1);
-          memcpy(&row->chars[row->line_size], next->chars, next->line_size);
-          row->line_size += next->line_size;
-          row->chars[row->line_size] = '\0';
-          editor_update_row(row);
-          row->dirty = 1;
+          editor_row_append_string(&editor.row[e->row_idx], next->chars, next->line_size);
           editor_delete_row(e->row_idx + 1);
         }
         break;
@@ -7834,14 +14243,12 @@ void editor_undo() {
         if (e->multi_line) {
           editor.cursor_y = e->cursor_row;
           editor.cursor_x = e->cursor_col;
-          for (const char *p = e->multi_line; *p; p++) {
-            if (*p == '\n') editor_insert_newline();
-            else editor_insert_char(*p);
-          }
+          editor_insert_text(e->multi_line, e->multi_line_length);
         }
         break;
 
       case UNDO_PASTE:
+      case UNDO_TEXT_INSERT:
         if (e->multi_line) {
           editor.selection.active = 1;
           editor.selection.anchor.row = e->cursor_row;
@@ -7894,15 +14301,7 @@ void editor_redo() {
     switch (e->op_type) {
       case UNDO_CHAR_INSERT:
         if (e->row_idx >= 0 && e->row_idx < editor.row_count && e->char_data && e->char_pos >= 0) {
-          editor_row *row = &editor.row[e->row_idx];
-          row->chars = realloc(row->chars, row->line_size + 2);
-          memmove(&row->chars[e->char_pos + 1], &row->chars[e->char_pos],
-                  row->line_size - e->char_pos + 1);
-          row->chars[e->char_pos] = e->char_data[0];
-          row->line_size++;
-          editor_update_row(row);
-          row->dirty = 1;
-          editor.dirty++;
+          editor_row_insert_char(&editor.row[e->row_idx], e->char_pos, e->char_data[0]);
           last_col = e->char_pos + 1;
         }
         break;
@@ -7910,15 +14309,7 @@ void editor_redo() {
       case UNDO_CHAR_DELETE:
       case UNDO_CHAR_DELETE_FWD:
         if (e->row_idx >= 0 && e->row_idx < editor.row_count && e->char_pos >= 0) {
-          editor_row *row = &editor.row[e->row_idx];
-          if (e->char_pos < row->line_size) {
-            memmove(&row->chars[e->char_pos], &row->chars[e->char_pos + 1],
-                    row->line_size - e->char_pos);
-            row->line_size--;
-            editor_update_row(row);
-            row->dirty = 1;
-            editor.dirty++;
-          }
+          editor_row_delete_char(&editor.row[e->row_idx], e->char_pos);
         }
         break;
 
@@ -7930,6 +14321,9 @@ void editor_redo() {
 
       case UNDO_ROW_DELETE:
         if (e->row_idx >= 0 && e->row_idx < editor.row_count) {
+          editor_row *joined = &editor.row[e->row_idx];
+          if (e->row_idx > 0)
+            editor_row_append_string(&editor.row[e->row_idx - 1], joined->chars, joined->line_size);
           editor_delete_row(e->row_idx);
         }
         break;
@@ -7954,13 +14348,11 @@ void editor_redo() {
         break;
 
       case UNDO_PASTE:
+      case UNDO_TEXT_INSERT:
         if (e->multi_line) {
           editor.cursor_y = e->cursor_row;
           editor.cursor_x = e->cursor_col;
-          for (const char *p = e->multi_line; *p; p++) {
-            if (*p == '\n') editor_insert_newline();
-            else editor_insert_char(*p);
-          }
+          editor_insert_text(e->multi_line, e->multi_line_length);
           last_row = editor.cursor_y;
           last_col = editor.cursor_x;
         }
@@ -7985,9 +14377,10 @@ void editor_redo() {
 
 /* Simple strstr-based search (replaces FTS5) */
 void simple_search(const char *query) {
+  TRACE_SCOPE(__func__);
   /* Clear previous results */
   if (editor.search_results) {
-    free(editor.search_results);
+    memory_free(MEMORY_SEARCH, editor.search_results);
     editor.search_results = NULL;
   }
   editor.search_result_count = 0;
@@ -7996,7 +14389,7 @@ void simple_search(const char *query) {
 
   /* Allocate initial results array */
   editor.search_result_capacity = INITIAL_SEARCH_RESULT_CAPACITY;
-  editor.search_results = malloc(editor.search_result_capacity * sizeof(search_result));
+  editor.search_results = memory_malloc(MEMORY_SEARCH, editor.search_result_capacity * sizeof(search_result));
 
   /* Search each line */
   for (int line_num = 0; line_num < editor.row_count; line_num++) {
@@ -8008,18 +14401,764 @@ void simple_search(const char *query) {
       /* Expand results array if needed */
       if (editor.search_result_count >= editor.search_result_capacity) {
         editor.search_result_capacity *= 2;
-        editor.search_results = realloc(editor.search_results,
-                                    editor.search_result_capacity * sizeof(search_result));
+        editor.search_results = memory_realloc(MEMORY_SEARCH, editor.search_results,
+                                               editor.search_result_capacity * sizeof(search_result));
+      }
+
+      editor.search_results[editor.search_result_count].line_number = line_num;
+      editor.search_results[editor.search_result_count].match_offset = match_pos - line_start;
+      editor.search_results[editor.search_result_count].match_length = strlen(query);
+      editor.search_result_count++;
+
+      search_pos = match_pos + 1;
+    }
+  }
+}
+
+/*** split views ***/
+
+/* True if buffer slot index is on screen in some view. */
+static int view_shows_buffer(int index) {
+  if (views.count < 2) return index == editor.buffer_current;
+  for (int i = 0; i < views.count; i++) {
+    int shown = i == views.active ? editor.buffer_current : views.views[i].buffer;
+    if (shown == index) return 1;
+  }
+  return 0;
+}
+
+/* Send every line again on the next frame, e.g. after something was drawn
+ * over the views. */
+void view_invalidate() {
+  views.repaint = 1;
+}
+
+/* Give a layout node the area at (top, left), dividing it between the
+ * children of a split. A view's text area is its share less its status
+ * line. */
+static void view_layout_node(int node, int top, int left, int height, int width) {
+  view_node *layout = &views.nodes[node];
+  layout->top = top;
+  layout->left = left;
+  layout->height = height;
+  layout->width = width;
+
+  if (layout->type == VIEW_NODE_STACKED) {
+    int first = height / 2;
+    view_layout_node(layout->children[0], top, left, first, width);
+    view_layout_node(layout->children[1], top + first, left, height - first, width);
+  } else if (layout->type == VIEW_NODE_SIDE_BY_SIDE) {
+    /* One column between the halves for the separator */
+    int first = (width - 1) / 2;
+    view_layout_node(layout->children[0], top, left, height, first);
+    view_layout_node(layout->children[1], top, left + first + 1, height, width - first - 1);
+  } else {
+    editor_view *view = &views.views[layout->view];
+    view->top = top;
+    view->left = left;
+    /* A terminal shrunk below what the splits need still gets a line */
+    view->rows = height > 1 ? height - 1 : 1;
+    view->columns = width > 1 ? width : 1;
+    free(view->line_hashes);
+    view->line_hashes = calloc(view->rows + 1, sizeof(unsigned long long));
+  }
+}
+
+/* Lay the views out over the screen and give the editor the active
+ * view's text area. */
+void view_layout() {
+  view_layout_node(views.root, 0, 0, views.screen_rows, views.screen_columns);
+  editor_view *active = &views.views[views.active];
+  editor.screen_rows = active->rows;
+  editor.screen_columns = active->columns;
+  editor_update_gutter_width();
+  views.repaint = 1;
+}
+
+/* Store the editor's position in the active view. */
+static void view_save_active() {
+  editor_view *view = &views.views[views.active];
+  view->buffer = editor.buffer_current;
+  view->cursor_x = editor.cursor_x;
+  view->cursor_y = editor.cursor_y;
+  view->row_offset = editor.row_offset;
+  view->column_offset = editor.column_offset;
+}
+
+/* Make view index the active one, showing its buffer at its position. */
+static void view_activate(int index) {
+  if (index != views.active) {
+    view_save_active();
+    /* Its lines were sent as the active view; hashes from before are stale */
+    editor_view *previous = &views.views[views.active];
+    if (previous->line_hashes) memset(previous->line_hashes, 0, (previous->rows + 1) * sizeof(unsigned long long));
+  }
+  views.active = index;
+
+  editor_view *view = &views.views[index];
+  if (view->buffer != editor.buffer_current) buffer_switch(view->buffer);
+  /* Extra cursors and the selection stay with the view left */
+  selection_clear();
+  editor.cursor_count = 0;
+  editor.cursor_y = view->cursor_y <= editor.row_count ? view->cursor_y : editor.row_count;
+  int line_size = editor.cursor_y < editor.row_count ? editor.row[editor.cursor_y].line_size : 0;
+  editor.cursor_x = view->cursor_x <= line_size ? view->cursor_x : line_size;
+  editor.row_offset = view->row_offset;
+  editor.column_offset = view->column_offset;
+  editor.screen_rows = view->rows;
+  editor.screen_columns = view->columns;
+  editor_update_gutter_width();
+}
+
+/* Claim an unused layout node. There is always one while fewer than
+ * VIEW_MAX views exist. */
+static int view_node_alloc(enum view_node_type type, int parent, int view) {
+  for (int i = 0; i < VIEW_NODE_MAX; i++) {
+    if (views.nodes[i].type != VIEW_NODE_FREE) continue;
+    views.nodes[i].type = type;
+    views.nodes[i].parent = parent;
+    views.nodes[i].view = view;
+    return i;
+  }
+  return -1;
+}
+
+/* Split the active view in two, stacked (Alt+-) or side by side (Alt+\),
+ * both showing its buffer. The new half, below or to the right, becomes
+ * active. */
+void view_split(enum view_node_type type) {
+  if (views.count == 0) {
+    /* First split: the whole screen is one view */
+    memset(&views.nodes, 0, sizeof(views.nodes));
+    views.root = view_node_alloc(VIEW_NODE_LEAF, -1, 0);
+    views.views[0].node = views.root;
+    views.views[0].line_hashes = NULL;
+    views.active = 0;
+    views.count = 1;
+    views.screen_rows = editor.screen_rows + SCREEN_RESERVED_ROWS - 1;
+    views.screen_columns = editor.screen_columns;
+    view_layout_node(views.root, 0, 0, views.screen_rows, views.screen_columns);
+  }
+
+  int leaf = views.views[views.active].node;
+  view_node *layout = &views.nodes[leaf];
+  int room = type == VIEW_NODE_STACKED ? layout->height / 2 - 1 >= VIEW_MIN_ROWS
+                                       : (layout->width - 1) / 2 >= VIEW_MIN_COLUMNS;
+  if (views.count == VIEW_MAX || !room) {
+    if (views.count == VIEW_MAX) {
+      editor_set_status_message("Can't have more than %d views", VIEW_MAX);
+    } else {
+      editor_set_status_message("No room to split this view");
+    }
+    if (views.count == 1) {
+      free(views.views[0].line_hashes);
+      views.count = 0;
+    }
+    return;
+  }
+
+  view_save_active();
+  int added = views.count++;
+  views.views[added] = views.views[views.active];
+  views.views[added].line_hashes = NULL;
+
+  /* The leaf becomes the split, with the old and new view below it */
+  int first = view_node_alloc(VIEW_NODE_LEAF, leaf, views.active);
+  int second = view_node_alloc(VIEW_NODE_LEAF, leaf, added);
+  layout->type = type;
+  layout->children[0] = first;
+  layout->children[1] = second;
+  views.views[views.active].node = first;
+  views.views[added].node = second;
+  views.active = added;
+  view_layout();
+  editor_set_status_message("%d views (Alt+F next, Alt+X close)", views.count);
+}
+
+/* Activate the next view in screen order (Alt+F), wrapping around. */
+void view_next() {
+  if (views.count < 2) {
+    editor_set_status_message("No other views (Alt+- or Alt+\\ splits)");
+    return;
+  }
+  /* Climb out of second children, step to the sibling, take its first leaf */
+  int node = views.views[views.active].node;
+  while (views.nodes[node].parent != -1 && views.nodes[views.nodes[node].parent].children[1] == node) {
+    node = views.nodes[node].parent;
+  }
+  node = views.nodes[node].parent == -1 ? views.root : views.nodes[views.nodes[node].parent].children[1];
+  while (views.nodes[node].type != VIEW_NODE_LEAF) node = views.nodes[node].children[0];
+  view_activate(views.nodes[node].view);
+}
+
+/* Close the active view (Alt+X); its neighbour takes over its area. The
+ * buffer stays open. */
+void view_close() {
+  if (views.count < 2) {
+    editor_set_status_message("Only one view");
+    return;
+  }
+
+  int closing = views.active;
+  int leaf = views.views[closing].node;
+  int parent = views.nodes[leaf].parent;
+  int sibling = views.nodes[parent].children[views.nodes[parent].children[0] == leaf ? 1 : 0];
+  int grandparent = views.nodes[parent].parent;
+  if (grandparent == -1) {
+    views.root = sibling;
+  } else {
+    view_node *above = &views.nodes[grandparent];
+    above->children[above->children[0] == parent ? 0 : 1] = sibling;
+  }
+  views.nodes[sibling].parent = grandparent;
+  views.nodes[leaf].type = VIEW_NODE_FREE;
+  views.nodes[parent].type = VIEW_NODE_FREE;
+
+  /* Keep the views packed */
+  free(views.views[closing].line_hashes);
+  int last = --views.count;
+  if (closing != last) {
+    views.views[closing] = views.views[last];
+    views.nodes[views.views[closing].node].view = closing;
+  }
+
+  int node = sibling;
+  while (views.nodes[node].type != VIEW_NODE_LEAF) node = views.nodes[node].children[0];
+  views.active = views.nodes[node].view;
+  view_activate(views.active);
+
+  if (views.count == 1) {
+    /* Back to a single screen */
+    free(views.views[0].line_hashes);
+    views.views[0].line_hashes = NULL;
+    views.count = 0;
+    editor.screen_rows = views.screen_rows + 1 - SCREEN_RESERVED_ROWS;
+    editor.screen_columns = views.screen_columns;
+    editor_update_gutter_width();
+  } else {
+    view_layout();
+  }
+}
+
+/* Map a mouse cell (0-based) into the active view's coordinates. A press
+ * in another view activates it first; the message bar maps to the row
+ * under the active view's status line. Returns 0 if the event should be
+ * ignored (a separator, or a drag out of the active view). */
+int view_mouse_position(int *x, int *y) {
+  if (*y >= views.screen_rows) {
+    *y = editor.screen_rows + 1;
+    return 1;
+  }
+  for (int i = 0; i < views.count; i++) {
+    editor_view *view = &views.views[i];
+    if (*y < view->top || *y > view->top + view->rows || *x < view->left || *x >= view->left + view->columns) {
+      continue;
+    }
+    if (i != views.active) {
+      if (last_mouse_event.is_motion || last_mouse_event.is_release) return 0;
+      view_activate(i);
+    }
+    *x -= view->left;
+    *y -= view->top;
+    return 1;
+  }
+  return 0;
+}
+
+/* Status line of an inactive view, in the editor fields lent to it. */
+static void view_draw_status(struct append_buffer *ab) {
+  set_background_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER_BG));
+  set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
+
+  char status[STATUS_BAR_BUFFER_SIZE], position[32];
+  int length = snprintf(status, sizeof(status), " %.20s%s", editor.filename ? editor.filename : "[No Name]",
+                        editor.dirty ? " (modified)" : "");
+  int position_length = snprintf(position, sizeof(position), "%d/%d ", editor.cursor_y + 1, editor.row_count);
+  if (length > editor.screen_columns) length = editor.screen_columns;
+  append_buffer_write(ab, status, length);
+  while (length < editor.screen_columns) {
+    if (editor.screen_columns - length == position_length) {
+      append_buffer_write(ab, position, position_length);
+      break;
+    }
+    append_buffer_write(ab, " ", 1);
+    length++;
+  }
+  reset_colors(ab);
+}
+
+/* Move the terminal cursor to a 0-based cell. */
+static void view_move_to(struct append_buffer *ab, int row, int column) {
+  char position[CURSOR_POSITION_BUFFER_SIZE];
+  int length = snprintf(position, sizeof(position), ESCAPE_CURSOR_POSITION_FORMAT, row + 1, column + 1);
+  append_buffer_write(ab, position, length);
+}
+
+/* Draw an inactive view. Drawing reads the editor fields, so they are
+ * lent the view's buffer, position and size, without the selection,
+ * extra cursors or bracket match, and put back afterwards. */
+static void view_draw_inactive(struct append_buffer *ab, editor_view *view) {
+  struct editor_config active = editor;
+  if (view->buffer != editor.buffer_current) {
+    editor_buffer *slot = &editor.buffers[view->buffer];
+    editor.filename = slot->filename;
+    editor.row = slot->row;
+    editor.row_count = slot->row_count;
+    editor.dirty = slot->dirty;
+    editor.syntax = slot->syntax;
+  }
+  editor.screen_rows = view->rows;
+  editor.screen_columns = view->columns;
+  /* Edits in another view may have shortened the buffer */
+  editor.cursor_y = view->cursor_y <= editor.row_count ? view->cursor_y : editor.row_count;
+  editor.row_offset = view->row_offset <= editor.row_count ? view->row_offset : editor.row_count;
+  editor.column_offset = view->column_offset;
+  editor.selection.active = 0;
+  editor.cursor_count = 0;
+  editor_reset_bracket_match();
+  editor_update_gutter_width();
+
+  views.drawing = view;
+  views.drawing_hashes = view->line_hashes;
+  editor_draw_rows(ab);
+  int start = ab->length;
+  view_move_to(ab, view->top + view->rows, view->left);
+  view_draw_status(ab);
+  view_drop_unchanged_line(ab, start, &view->line_hashes[view->rows]);
+  views.drawing = NULL;
+  views.drawing_hashes = NULL;
+  editor = active;
+}
+
+/* Draw the separators of side-by-side splits. */
+static void view_draw_separators(struct append_buffer *ab) {
+  set_background_rgb(ab, theme_get_color(THEME_UI_BACKGROUND));
+  set_foreground_rgb(ab, theme_get_color(THEME_UI_LINE_NUMBER));
+  for (int i = 0; i < VIEW_NODE_MAX; i++) {
+    view_node *layout = &views.nodes[i];
+    if (layout->type != VIEW_NODE_SIDE_BY_SIDE) continue;
+    int column = views.nodes[layout->children[0]].left + views.nodes[layout->children[0]].width;
+    for (int row = layout->top; row < layout->top + layout->height; row++) {
+      view_move_to(ab, row, column);
+      append_buffer_write(ab, VIEW_SEPARATOR, VIEW_SEPARATOR_LEN);
+    }
+  }
+}
+
+/* Draw the split screen: the other views (only their changed lines), the
+ * active view and its status line, then the message bar across the
+ * bottom. */
+void view_draw_screen(struct append_buffer *ab) {
+  if (views.repaint) {
+    for (int i = 0; i < views.count; i++) {
+      memset(views.views[i].line_hashes, 0, (views.views[i].rows + 1) * sizeof(unsigned long long));
+    }
+    view_draw_separators(ab);
+    views.repaint = 0;
+  }
+  for (int i = 0; i < views.count; i++) {
+    if (i != views.active) view_draw_inactive(ab, &views.views[i]);
+  }
+
+  editor_view *active = &views.views[views.active];
+  views.drawing = active;
+  editor_draw_rows(ab);
+  view_move_to(ab, active->top + active->rows, active->left);
+  editor_draw_status_bar(ab);
+  views.drawing = NULL;
+
+  view_move_to(ab, views.screen_rows, 0);
+  int columns = editor.screen_columns;
+  editor.screen_columns = views.screen_columns;
+  editor_draw_message_bar(ab);
+  editor.screen_columns = columns;
+}
+
+/*** buffer list ***/
+
+/* Approximate heap bytes held by the active buffer's rows. */
+static size_t buffer_rows_memory() {
+  size_t bytes = editor.row_count * sizeof(editor_row);
+  for (int i = 0; i < editor.row_count; i++) {
+    editor_row *row = &editor.row[i];
+    /* Text, render and one highlight byte per render byte */
+    bytes += row->line_size + 2 * ((size_t)row->render_size + 1) + 1;
+    bytes += row->wrap_break_count * sizeof(int);
+    bytes += row->chunk_count * sizeof(row_chunk);
+  }
+  return bytes;
+}
+
+/* Free an undo history. */
+static void buffer_free_undo(undo_entry *stack, int count) {
+  for (int i = 0; i < count; i++) undo_entry_free(&stack[i]);
+  memory_free(MEMORY_UNDO, stack);
+}
+
+/* Move the active buffer into slot, leaving the editor with no buffer. */
+static void buffer_park(editor_buffer *slot) {
+  slot->memory = buffer_rows_memory();
+  slot->filename = editor.filename;
+  slot->row = editor.row;
+  slot->row_count = editor.row_count;
+  slot->dirty = editor.dirty;
+  slot->cursor_x = editor.cursor_x;
+  slot->cursor_y = editor.cursor_y;
+  slot->row_offset = editor.row_offset;
+  slot->column_offset = editor.column_offset;
+  slot->syntax = editor.syntax;
+  slot->tab_stop = editor.tab_stop;
+  slot->undo_stack = editor.undo_stack;
+  slot->undo_stack_count = editor.undo_stack_count;
+  slot->undo_stack_capacity = editor.undo_stack_capacity;
+  slot->undo_group_id = editor.undo_group_id;
+  slot->undo_position = editor.undo_position;
+  slot->undo_memory_groups = editor.undo_memory_groups;
+  slot->file_size = editor.file_size;
+  slot->file_mtime = editor.file_mtime;
+  slot->file_inode = editor.file_inode;
+  slot->follow = editor.follow;
+  slot->log_format = editor.log_format;
+  slot->crlf = editor.crlf;
+  slot->no_final_newline = editor.no_final_newline;
+  slot->evicted = 0;
+  slot->last_used = ++editor.buffer_clock;
+
+  editor.filename = NULL;
+  editor.row = NULL;
+  editor.row_count = 0;
+  editor.dirty = 0;
+  editor.syntax = NULL;
+  editor.undo_stack = NULL;
+  editor.undo_stack_count = 0;
+  editor.undo_stack_capacity = 0;
+  editor.undo_group_id = 0;
+  editor.undo_position = 0;
+  editor.undo_memory_groups = 0;
+  editor.file_size = 0;
+  editor.file_mtime = (struct timespec){0, 0};
+  editor.file_inode = 0;
+  editor.follow = 0;
+  editor.log_format = LOG_FORMAT_NONE;
+  editor.crlf = 0;
+  editor.no_final_newline = 0;
+
+  /* Selections, extra cursors and matches belong to the buffer left */
+  selection_clear();
+  editor.cursor_count = 0;
+  editor.search_result_count = 0;
+  editor_reset_bracket_match();
+}
+
+/* Make slot the active buffer, reading its file again if it was evicted. */
+static void buffer_restore(editor_buffer *slot) {
+  if (slot->evicted) {
+    /* The history only applies to the text it was recorded against */
+    struct stat file_stat;
+    if (stat(slot->filename, &file_stat) == -1 || file_stat.st_size != slot->file_size ||
+        file_stat.st_ino != slot->file_inode || file_stat.st_mtim.tv_sec != slot->file_mtime.tv_sec ||
+        file_stat.st_mtim.tv_nsec != slot->file_mtime.tv_nsec) {
+      buffer_free_undo(slot->undo_stack, slot->undo_stack_count);
+      slot->undo_stack = NULL;
+      slot->undo_stack_count = slot->undo_stack_capacity = 0;
+      slot->undo_group_id = slot->undo_position = slot->undo_memory_groups = 0;
+    }
+    if (editor_load_file(slot->filename) == -1) {
+      editor_set_status_message("Can't reload %s: %s", slot->filename, strerror(errno));
+      editor.filename = slot->filename;
+      editor_select_syntax_highlight();
+    } else {
+      free(slot->filename);
+    }
+  } else {
+    editor.filename = slot->filename;
+    editor.row = slot->row;
+    editor.row_count = slot->row_count;
+    editor.dirty = slot->dirty;
+    editor.syntax = slot->syntax;
+    editor.file_size = slot->file_size;
+    editor.file_mtime = slot->file_mtime;
+    editor.file_inode = slot->file_inode;
+    editor.crlf = slot->crlf;
+    editor.no_final_newline = slot->no_final_newline;
+    /* tab_stop= changed while the buffer was parked */
+    if (slot->tab_stop != editor.tab_stop) {
+      for (int i = 0; i < editor.row_count; i++) editor_update_row(&editor.row[i]);
+    }
+  }
+  editor.follow = slot->follow;
+  if (!slot->evicted) editor.log_format = slot->log_format;
+  slot->filename = NULL;
+  slot->row = NULL;
+  slot->row_count = 0;
+
+  editor.undo_stack = slot->undo_stack;
+  editor.undo_stack_count = slot->undo_stack_count;
+  editor.undo_stack_capacity = slot->undo_stack_capacity;
+  editor.undo_group_id = slot->undo_group_id;
+  editor.undo_position = slot->undo_position;
+  editor.undo_memory_groups = slot->undo_memory_groups;
+  slot->undo_stack = NULL;
+  slot->undo_stack_count = slot->undo_stack_capacity = 0;
+
+  /* The file may have shrunk since the position was saved */
+  editor.cursor_y = slot->cursor_y <= editor.row_count ? slot->cursor_y : editor.row_count;
+  int line_size = editor.cursor_y < editor.row_count ? editor.row[editor.cursor_y].line_size : 0;
+  editor.cursor_x = slot->cursor_x <= line_size ? slot->cursor_x : line_size;
+  editor.row_offset = slot->row_offset <= editor.cursor_y ? slot->row_offset : editor.cursor_y;
+  editor.column_offset = slot->column_offset;
+  slot->last_used = ++editor.buffer_clock;
+  editor_update_gutter_width();
+}
+
+/* Drop a parked buffer's rows, keeping what is needed to read them back.
+ * The history survives if the file is still as the rows were read. */
+static void buffer_evict(editor_buffer *slot) {
+  /* Only drop rows that can be read back */
+  if (access(slot->filename, R_OK) == -1) return;
+
+  for (int i = 0; i < slot->row_count; i++) editor_free_row(&slot->row[i]);
+  free(slot->row);
+  slot->row = NULL;
+  slot->row_count = 0;
+  slot->memory = 0;
+  slot->evicted = 1;
+}
+
+/* Evict the least recently used clean buffers until the parked ones fit
+ * the memory budget. */
+static void buffer_enforce_budget() {
+  size_t total = 0;
+  for (int i = 0; i < editor.buffer_count; i++) {
+    if (i != editor.buffer_current && !editor.buffers[i].evicted) total += editor.buffers[i].memory;
+  }
+  while (total > editor.buffer_memory_budget) {
+    editor_buffer *oldest = NULL;
+    for (int i = 0; i < editor.buffer_count; i++) {
+      editor_buffer *slot = &editor.buffers[i];
+      if (view_shows_buffer(i) || slot->evicted || slot->dirty || !slot->filename) continue;
+      if (!oldest || slot->last_used < oldest->last_used) oldest = slot;
+    }
+    if (!oldest) break;
+    size_t memory = oldest->memory;
+    buffer_evict(oldest);
+    /* Unreadable files stay resident; stop rather than retry them */
+    if (!oldest->evicted) break;
+    total -= memory;
+  }
+}
+
+/* Append an empty slot to the buffer list, which starts out holding the
+ * active buffer. Returns its index, or -1 if out of memory. */
+static int buffer_add_slot() {
+  int count = editor.buffer_count ? editor.buffer_count : 1;
+  editor_buffer *buffers = realloc(editor.buffers, (count + 1) * sizeof(editor_buffer));
+  if (!buffers) return -1;
+  if (editor.buffer_count == 0) {
+    memset(&buffers[0], 0, sizeof(editor_buffer));
+    editor.buffer_current = 0;
+  }
+  memset(&buffers[count], 0, sizeof(editor_buffer));
+  editor.buffers = buffers;
+  editor.buffer_count = count + 1;
+  return count;
+}
+
+/* Name of a buffer for messages. */
+static const char *buffer_name(int index) {
+  const char *filename = index == editor.buffer_current ? editor.filename : editor.buffers[index].filename;
+  return filename ? filename : "[No Name]";
+}
+
+/* True if a buffer is showing filename (compared as real paths). */
+static int buffer_has_file(int index, const char *resolved) {
+  const char *filename = index == editor.buffer_current ? editor.filename : editor.buffers[index].filename;
+  if (!filename) return 0;
+  char path[PATH_MAX];
+  return strcmp(realpath(filename, path) ? path : filename, resolved) == 0;
+}
+
+/* Make buffer index the active one. */
+void buffer_switch(int index) {
+  if (index < 0 || index >= editor.buffer_count || index == editor.buffer_current) return;
+  buffer_park(&editor.buffers[editor.buffer_current]);
+  editor.buffer_current = index;
+  buffer_restore(&editor.buffers[index]);
+  buffer_enforce_budget();
+  editor_set_status_message("[%d/%d] %s", index + 1, editor.buffer_count, buffer_name(index));
+}
+
+/* Show a file: switch to its buffer if it is open, otherwise read it into
+ * a new buffer (or into the active one, if that is empty and unnamed). A
+ * file that doesn't exist yet gets an empty buffer and is created on
+ * save. A file of VIEWER_MIN_BYTES or more goes to the viewer, which
+ * shows it alone: only in place of a session that is nothing but an
+ * empty, unnamed buffer. Returns 0, or -1 with a status message. */
+int buffer_open(const char *path) {
+  char absolute[PATH_MAX], resolved[PATH_MAX];
+  if (editor_absolute_path(path, absolute, sizeof(absolute)) == -1) {
+    editor_set_status_message("Can't open %s: %s", path, strerror(ENAMETOOLONG));
+    return -1;
+  }
+  if (!realpath(absolute, resolved)) memcpy(resolved, absolute, sizeof(resolved));
+  /* A server's filenames are all absolute: its clients' directories differ */
+  if (server.enabled) path = resolved;
+  int count = editor.buffer_count ? editor.buffer_count : 1;
+  for (int i = 0; i < count; i++) {
+    if (!buffer_has_file(i, resolved)) continue;
+    buffer_switch(i);
+    return 0;
+  }
+
+  int reuse = !editor.filename && !editor.dirty && editor.row_count == 0;
+  struct stat file_stat;
+  if (stat(absolute, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size >= VIEWER_MIN_BYTES) {
+    if (viewer.active || !reuse || editor.buffer_count > 1) {
+      editor_set_status_message("%s is too large to edit; open it on its own to view it read-only", path);
+      return -1;
+    }
+    if (viewer_open(path, 1) == -1) {
+      editor_set_status_message("Can't view %s: %s", path, strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+  int previous = editor.buffer_current;
+  if (!reuse) {
+    int slot = buffer_add_slot();
+    if (slot == -1) {
+      editor_set_status_message("Out of memory opening %s", path);
+      return -1;
+    }
+    buffer_park(&editor.buffers[editor.buffer_current]);
+    editor.buffer_current = slot;
+  }
+
+  editor.cursor_x = editor.cursor_y = 0;
+  editor.row_offset = editor.column_offset = 0;
+  if (editor_load_file(path) == -1) {
+    if (errno != ENOENT) {
+      editor_set_status_message("Can't open %s: %s", path, strerror(errno));
+      if (!reuse) {
+        editor.buffer_count--;
+        editor.buffer_current = previous;
+        buffer_restore(&editor.buffers[previous]);
       }
+      return -1;
+    }
+    editor.filename = strdup(path);
+    editor_select_syntax_highlight();
+    editor_set_status_message("New file: %s", path);
+  }
+  editor_update_gutter_width();
+  if (!reuse) buffer_enforce_budget();
+  return 0;
+}
+
+/* Show the next (direction 1) or previous (-1) buffer (Alt+. and Alt+,). */
+void buffer_cycle(int direction) {
+  if (editor.buffer_count < 2) {
+    editor_set_status_message("No other buffers");
+    return;
+  }
+  buffer_switch((editor.buffer_current + direction + editor.buffer_count) % editor.buffer_count);
+}
+
+/* Close the active buffer (Alt+K), offering to save it first, and show
+ * the most recently used of the others. */
+void buffer_close() {
+  if (!editor_prompt_save_changes()) {
+    editor_set_status_message("Close cancelled");
+    return;
+  }
+  editor_clear_buffer();
+  buffer_free_undo(editor.undo_stack, editor.undo_stack_count);
+  editor.undo_stack = NULL;
+  editor.undo_stack_count = editor.undo_stack_capacity = 0;
+  if (editor.buffer_count < 2) {
+    editor_set_status_message("Buffer closed");
+    return;
+  }
+
+  int closed = editor.buffer_current;
+  memmove(&editor.buffers[closed], &editor.buffers[closed + 1],
+          (editor.buffer_count - closed - 1) * sizeof(editor_buffer));
+  editor.buffer_count--;
+  int next = 0;
+  for (int i = 1; i < editor.buffer_count; i++) {
+    if (editor.buffers[i].last_used > editor.buffers[next].last_used) next = i;
+  }
+  /* Views on the closed buffer show the new active one */
+  for (int i = 0; i < views.count; i++) {
+    if (views.views[i].buffer == closed) {
+      views.views[i].buffer = next;
+    } else if (views.views[i].buffer > closed) {
+      views.views[i].buffer--;
+    }
+  }
+  editor.buffer_current = next;
+  buffer_restore(&editor.buffers[next]);
+  editor_set_status_message("Closed; [%d/%d] %s", next + 1, editor.buffer_count, buffer_name(next));
+}
+
+/* Number of buffers with unsaved changes, the active one included. */
+int buffer_dirty_count() {
+  int count = editor.dirty ? 1 : 0;
+  for (int i = 0; i < editor.buffer_count; i++) {
+    if (i != editor.buffer_current && editor.buffers[i].dirty) count++;
+  }
+  return count;
+}
+
+/* Pick a buffer by number or by part of its name (Alt+B). The prompt
+ * lists every buffer, marking those with unsaved changes. */
+void buffer_pick() {
+  if (editor.buffer_count < 2) {
+    editor_set_status_message("No other buffers");
+    return;
+  }
 
-      editor.search_results[editor.search_result_count].line_number = line_num;
-      editor.search_results[editor.search_result_count].match_offset = match_pos - line_start;
-      editor.search_results[editor.search_result_count].match_length = strlen(query);
-      editor.search_result_count++;
+  /* The list is the prompt's format string, so escape any '%' */
+  char prompt[STATUS_MESSAGE_BUFFER_SIZE];
+  size_t length = snprintf(prompt, sizeof(prompt), "Buffer:");
+  for (int i = 0; i < editor.buffer_count && length < sizeof(prompt) - 16; i++) {
+    const char *name = buffer_name(i);
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    int dirty = i == editor.buffer_current ? editor.dirty : editor.buffers[i].dirty;
+    length += snprintf(prompt + length, sizeof(prompt) - length, " %d:", i + 1);
+    for (const char *c = base; *c && length < sizeof(prompt) - 16; c++) {
+      if (*c == '%') prompt[length++] = '%';
+      prompt[length++] = *c;
+    }
+    if (dirty) prompt[length++] = '*';
+    prompt[length] = '\0';
+  }
+  snprintf(prompt + length, sizeof(prompt) - length, " > %%s");
 
-      search_pos = match_pos + 1;
+  char *answer = editor_prompt(prompt, NULL);
+  if (!answer) {
+    editor_set_status_message("");
+    return;
+  }
+  char *end;
+  long number = strtol(answer, &end, 10);
+  int index = -1;
+  if (*end == '\0' && number >= 1 && number <= editor.buffer_count) {
+    index = number - 1;
+  } else {
+    for (int i = 0; i < editor.buffer_count && index == -1; i++) {
+      if (strstr(buffer_name(i), answer)) index = i;
     }
   }
+  if (index == -1) {
+    editor_set_status_message("No buffer matches '%s'", answer);
+  } else if (index == editor.buffer_current) {
+    editor_set_status_message("[%d/%d] %s", index + 1, editor.buffer_count, buffer_name(index));
+  } else {
+    buffer_switch(index);
+  }
+  free(answer);
 }
 
 /*** theming ***/
@@ -8040,19 +15179,187 @@ rgb_color theme_get_color(enum theme_color color_id) {
   return fallback;
 }
 
+/* Pick the colour depth to emit: the color_depth= setting if given,
+ * otherwise truecolor when the terminal has it (probe or COLORTERM), else
+ * what terminfo's max_colors allows. An unknown terminal keeps truecolor,
+ * which is what miter always emitted. Quantized colours are dropped when
+ * the depth changes. */
+void color_depth_update() {
+  int depth = editor.color_depth_setting;
+  if (depth == COLOR_DEPTH_AUTO) {
+    static int terminfo_colors = 0;
+    if (terminfo_colors == 0) terminfo_colors = terminfo_max_colors();
+
+    if (editor.truecolor || terminfo_colors < 0 || terminfo_colors >= (1 << 24)) {
+      depth = COLOR_DEPTH_TRUECOLOR;
+    } else if (terminfo_colors >= 256) {
+      depth = COLOR_DEPTH_256;
+    } else {
+      depth = COLOR_DEPTH_16;
+    }
+  }
+
+  if (depth != editor.color_depth) {
+    editor.color_depth = depth;
+    color_quantize_prepare();
+  }
+}
+
+/* RGB value of a palette entry: the 16 xterm defaults, the 6x6x6 cube
+ * and the 24-step grey ramp. */
+static rgb_color color_palette_entry(int index) {
+  static const rgb_color basic[COLOR_PALETTE_BASIC_COUNT] = {
+    {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+    {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+    {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+  };
+  static const unsigned char cube[COLOR_CUBE_LEVELS] = {0, 95, 135, 175, 215, 255};
+
+  if (index < COLOR_PALETTE_BASIC_COUNT) return basic[index];
+  if (index < COLOR_GREY_BASE) {
+    index -= COLOR_PALETTE_BASIC_COUNT;
+    rgb_color color = {cube[index / 36], cube[(index / 6) % 6], cube[index % 6]};
+    return color;
+  }
+  unsigned char level = 8 + (index - COLOR_GREY_BASE) * 10;
+  rgb_color color = {level, level, level};
+  return color;
+}
+
+/* Weighted squared distance between two colours (green counts most, as
+ * the eye is most sensitive to it). */
+static int color_distance(rgb_color a, rgb_color b) {
+  int red = a.r - b.r, green = a.g - b.g, blue = a.b - b.b;
+  return 3 * red * red + 4 * green * green + 2 * blue * blue;
+}
+
+/* Nearest cube level index (0-5) for one channel. */
+static int color_cube_level(int value) {
+  if (value < 48) return 0;
+  if (value < 115) return 1;
+  return (value - 35) / 40;
+}
+
+/* Quantize a colour for the current depth. For 16 colours the runner-up
+ * is kept too, so text never lands on the same palette entry as its
+ * background. */
+static void color_quantize(rgb_color color, unsigned char *nearest, unsigned char *second) {
+  if (editor.color_depth == COLOR_DEPTH_256) {
+    /* Best cube entry vs. best grey; the basic 16 vary between terminals */
+    int cube = COLOR_PALETTE_BASIC_COUNT + 36 * color_cube_level(color.r) +
+               6 * color_cube_level(color.g) + color_cube_level(color.b);
+    int average = (color.r + color.g + color.b) / 3;
+    int grey = average < 8 ? 0 : (average - 8 + 5) / 10;
+    if (grey > COLOR_GREY_STEPS - 1) grey = COLOR_GREY_STEPS - 1;
+    grey += COLOR_GREY_BASE;
+
+    *nearest = color_distance(color, color_palette_entry(grey)) <
+               color_distance(color, color_palette_entry(cube)) ? grey : cube;
+    *second = *nearest;
+    return;
+  }
+
+  int best = INT_MAX, runner_up = INT_MAX;
+  *nearest = *second = 0;
+  for (int i = 0; i < COLOR_PALETTE_BASIC_COUNT; i++) {
+    int distance = color_distance(color, color_palette_entry(i));
+    if (distance < best) {
+      runner_up = best;
+      *second = *nearest;
+      best = distance;
+      *nearest = i;
+    } else if (distance < runner_up) {
+      runner_up = distance;
+      *second = i;
+    }
+  }
+}
+
+/* Cache of quantized colours, so the palette search runs once per colour
+ * rather than once per escape. */
+static struct {
+  rgb_color color;
+  unsigned char valid;
+  unsigned char nearest;
+  unsigned char second;
+} color_quantize_cache[COLOR_QUANTIZE_CACHE_SIZE];
+
+/* Palette entry of the last background emitted in 16-colour mode */
+static int color_background_index = -1;
+
+/* Look up (quantizing on a miss) the palette entries for a colour. */
+static void color_lookup(rgb_color color, unsigned char *nearest, unsigned char *second) {
+  unsigned int slot = ((color.r * 31u + color.g) * 31u + color.b) & (COLOR_QUANTIZE_CACHE_SIZE - 1);
+  if (!color_quantize_cache[slot].valid || !rgb_equal(color_quantize_cache[slot].color, color)) {
+    color_quantize_cache[slot].color = color;
+    color_quantize_cache[slot].valid = 1;
+    color_quantize(color, &color_quantize_cache[slot].nearest, &color_quantize_cache[slot].second);
+  }
+  *nearest = color_quantize_cache[slot].nearest;
+  *second = color_quantize_cache[slot].second;
+}
+
+/* Quantize the active theme's colours for the current depth, once, so
+ * drawing only does cache lookups. Called when a theme is loaded and
+ * when the depth changes. */
+void color_quantize_prepare() {
+  memset(color_quantize_cache, 0, sizeof(color_quantize_cache));
+  color_background_index = -1;
+  if (editor.color_depth == COLOR_DEPTH_TRUECOLOR) return;
+
+  unsigned char nearest, second;
+  for (int i = 0; i < THEME_COLOR_COUNT; i++) color_lookup(active_theme[i], &nearest, &second);
+}
+
 /* Write ANSI escape sequence to set foreground text color. */
 void set_foreground_rgb(struct append_buffer *ab, rgb_color color) {
   char color_buffer[COLOR_ESCAPE_BUFFER_SIZE];
-  int length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_FOREGROUND_RGB_FORMAT,
-                     color.r, color.g, color.b);
+  int length;
+  unsigned char nearest, second;
+
+  switch (editor.color_depth) {
+    case COLOR_DEPTH_256:
+      color_lookup(color, &nearest, &second);
+      length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_FOREGROUND_256_FORMAT, nearest);
+      break;
+    case COLOR_DEPTH_16:
+      color_lookup(color, &nearest, &second);
+      /* Keep text readable when it collapses onto its background */
+      if (nearest == color_background_index) nearest = second;
+      length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_COLOR_16_FORMAT,
+                        nearest < 8 ? SGR_FOREGROUND_BASE + nearest : SGR_FOREGROUND_BRIGHT_BASE + nearest - 8);
+      break;
+    default:
+      length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_FOREGROUND_RGB_FORMAT,
+                        color.r, color.g, color.b);
+      break;
+  }
   append_buffer_write(ab, color_buffer, length);
 }
 
 /* Write ANSI escape sequence to set background color. */
 void set_background_rgb(struct append_buffer *ab, rgb_color color) {
   char color_buffer[COLOR_ESCAPE_BUFFER_SIZE];
-  int length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_BACKGROUND_RGB_FORMAT,
-                     color.r, color.g, color.b);
+  int length;
+  unsigned char nearest, second;
+
+  switch (editor.color_depth) {
+    case COLOR_DEPTH_256:
+      color_lookup(color, &nearest, &second);
+      length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_BACKGROUND_256_FORMAT, nearest);
+      break;
+    case COLOR_DEPTH_16:
+      color_lookup(color, &nearest, &second);
+      color_background_index = nearest;
+      length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_COLOR_16_FORMAT,
+                        nearest < 8 ? SGR_BACKGROUND_BASE + nearest : SGR_BACKGROUND_BRIGHT_BASE + nearest - 8);
+      break;
+    default:
+      length = snprintf(color_buffer, sizeof(color_buffer), ESCAPE_BACKGROUND_RGB_FORMAT,
+                        color.r, color.g, color.b);
+      break;
+  }
   append_buffer_write(ab, color_buffer, length);
 }
 
@@ -8117,7 +15424,7 @@ void theme_registry_add(const char *name, rgb_color *colors) {
   /* Grow capacity if needed */
   if (loaded_theme_count >= loaded_theme_capacity) {
     int new_capacity = loaded_theme_capacity == 0 ? 8 : loaded_theme_capacity * 2;
-    runtime_theme *new_themes = realloc(loaded_themes, new_capacity * sizeof(runtime_theme));
+    runtime_theme *new_themes = memory_realloc(MEMORY_THEMES, loaded_themes, new_capacity * sizeof(runtime_theme));
     if (!new_themes) return;  /* Out of memory, skip this theme */
     loaded_themes = new_themes;
     loaded_theme_capacity = new_capacity;
@@ -8125,7 +15432,7 @@ void theme_registry_add(const char *name, rgb_color *colors) {
 
   /* Add the theme */
   runtime_theme *theme = &loaded_themes[loaded_theme_count];
-  theme->name = strdup(name);
+  theme->name = memory_strdup(MEMORY_THEMES, name);
   if (!theme->name) return;  /* Out of memory */
   memcpy(theme->colors, colors, sizeof(theme->colors));
   loaded_theme_count++;
@@ -8134,9 +15441,9 @@ void theme_registry_add(const char *name, rgb_color *colors) {
 /* Free all loaded themes. */
 void theme_registry_free() {
   for (int i = 0; i < loaded_theme_count; i++) {
-    free(loaded_themes[i].name);
+    memory_free(MEMORY_THEMES, loaded_themes[i].name);
   }
-  free(loaded_themes);
+  memory_free(MEMORY_THEMES, loaded_themes);
   loaded_themes = NULL;
   loaded_theme_count = 0;
   loaded_theme_capacity = 0;
@@ -8258,6 +15565,7 @@ int theme_load_from_file(const char *filepath) {
   /* Apply base theme inheritance if specified */
   if (base_theme[0] != '\0') {
     int base_idx = theme_find_by_name(base_theme);
+    if (base_idx < 0) theme_base_missing = 1;
     if (base_idx >= 0) {
       /* Start with base theme, then apply our overrides */
       rgb_color base_colors[THEME_COLOR_COUNT];
@@ -8353,92 +15661,242 @@ void theme_discover_all() {
   }
 }
 
-/* Find theme index by name. Returns -1 if not found. */
-int theme_find_by_name(const char *name) {
-  for (int i = 0; i < loaded_theme_count; i++) {
-    if (strcmp(loaded_themes[i].name, name) == 0) {
-      return i;
+/* Directories themes are loaded from, in load order. Returns the count. */
+static int theme_source_directories(char directories[][PATH_MAX]) {
+  int count = 0;
+  snprintf(directories[count++], PATH_MAX, "./themes");
+
+  char *home = getenv("HOME");
+  if (home) {
+    snprintf(directories[count++], PATH_MAX, "%s/.config/terra/themes", home);
+  }
+  return count;
+}
+
+/* Fingerprint the theme sources without parsing them: every directory's
+ * resolved path and mtime, plus the name, mtime and size of each .def file.
+ * Any added, removed or edited theme changes the result. */
+static unsigned long long theme_sources_fingerprint() {
+  char directories[2][PATH_MAX];
+  int directory_count = theme_source_directories(directories);
+
+  /* FNV-1a over the raw bytes of everything that identifies a source */
+  unsigned long long hash = FNV_OFFSET_BASIS;
+#define THEME_FINGERPRINT_MIX(data, length) do { \
+    const unsigned char *bytes_ = (const unsigned char *)(data); \
+    for (size_t i_ = 0; i_ < (size_t)(length); i_++) { \
+      hash ^= bytes_[i_]; \
+      hash *= FNV_PRIME; \
+    } \
+  } while (0)
+
+  for (int d = 0; d < directory_count; d++) {
+    char resolved[PATH_MAX];
+    DIR *dp = opendir(directories[d]);
+    if (!dp) continue;
+
+    if (realpath(directories[d], resolved)) THEME_FINGERPRINT_MIX(resolved, strlen(resolved));
+    struct stat st;
+    if (fstat(dirfd(dp), &st) == 0) {
+      THEME_FINGERPRINT_MIX(&st.st_mtim, sizeof(st.st_mtim));
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dp))) {
+      size_t name_len = strlen(entry->d_name);
+      if (name_len < 4 || strcmp(entry->d_name + name_len - 4, ".def") != 0) continue;
+      if (fstatat(dirfd(dp), entry->d_name, &st, 0) != 0) continue;
+
+      THEME_FINGERPRINT_MIX(entry->d_name, name_len);
+      THEME_FINGERPRINT_MIX(&st.st_mtim, sizeof(st.st_mtim));
+      THEME_FINGERPRINT_MIX(&st.st_size, sizeof(st.st_size));
     }
+    closedir(dp);
   }
-  return -1;
+#undef THEME_FINGERPRINT_MIX
+
+  return hash;
 }
 
-/* Initialize theming system: discover themes and load saved preference. */
-void theme_init() {
-  /* Discover and load all themes from disk */
-  theme_discover_all();
+/* Load the whole registry from the binary theme cache. The cache is only
+ * used when it was built from sources with the same fingerprint and the
+ * same color slot layout. Returns 1 on success. */
+static int theme_cache_load(unsigned long long fingerprint) {
+  char path[PATH_MAX];
+  if (editor_cache_path(THEME_CACHE_FILE_NAME, path, sizeof(path)) != 0) return 0;
 
-  /* Try to load saved theme by name */
-  char saved_name[64];
-  if (theme_load_name_from_config(saved_name, sizeof(saved_name))) {
-    int idx = theme_find_by_name(saved_name);
-    if (idx >= 0) {
-      editor.current_theme_index = idx;
-      theme_load(idx);
-      return;
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+
+  char magic[THEME_CACHE_MAGIC_LEN];
+  uint32_t color_count, theme_count;
+  unsigned long long saved_fingerprint;
+  int ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+           memcmp(magic, THEME_CACHE_MAGIC, THEME_CACHE_MAGIC_LEN) == 0 &&
+           fread(&color_count, sizeof(color_count), 1, f) == 1 &&
+           color_count == THEME_COLOR_COUNT &&
+           fread(&saved_fingerprint, sizeof(saved_fingerprint), 1, f) == 1 &&
+           saved_fingerprint == fingerprint &&
+           fread(&theme_count, sizeof(theme_count), 1, f) == 1;
+
+  for (uint32_t i = 0; ok && i < theme_count; i++) {
+    unsigned char name_length;
+    char name[256];
+    rgb_color colors[THEME_COLOR_COUNT];
+    ok = fread(&name_length, 1, 1, f) == 1 &&
+         fread(name, 1, name_length, f) == name_length &&
+         fread(colors, sizeof(rgb_color), THEME_COLOR_COUNT, f) == THEME_COLOR_COUNT;
+    if (ok) {
+      name[name_length] = '\0';
+      theme_registry_add(name, colors);
     }
   }
+  fclose(f);
 
-  /* Fallback to first theme */
-  editor.current_theme_index = 0;
-  theme_load(0);
+  if (!ok || loaded_theme_count == 0) {
+    theme_registry_free();
+    return 0;
+  }
+  return 1;
 }
 
-/* Apply color overrides from config file [colors] section.
- * Call after theme_load() to override specific colors. */
-static void config_apply_color_overrides() {
-  FILE *f = fopen("miter.conf", "r");
-  if (!f) {
-    /* Try legacy config name */
-    f = fopen("terra.conf", "r");
-    if (!f) return;
+/* Write the registry to the binary theme cache. Written to a temporary file
+ * and renamed into place so a concurrent reader never sees half of it. */
+static void theme_cache_save(unsigned long long fingerprint) {
+  char path[PATH_MAX], temporary[PATH_MAX];
+  if (editor_cache_path(THEME_CACHE_FILE_NAME, path, sizeof(path)) != 0) return;
+  if (snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) >= (int)sizeof(temporary)) return;
+
+  FILE *f = fopen(temporary, "wb");
+  if (!f) return;
+
+  uint32_t color_count = THEME_COLOR_COUNT;
+  uint32_t theme_count = loaded_theme_count;
+  int ok = fwrite(THEME_CACHE_MAGIC, 1, THEME_CACHE_MAGIC_LEN, f) == THEME_CACHE_MAGIC_LEN &&
+           fwrite(&color_count, sizeof(color_count), 1, f) == 1 &&
+           fwrite(&fingerprint, sizeof(fingerprint), 1, f) == 1 &&
+           fwrite(&theme_count, sizeof(theme_count), 1, f) == 1;
+
+  for (int i = 0; ok && i < loaded_theme_count; i++) {
+    size_t length = strlen(loaded_themes[i].name);
+    unsigned char name_length = length > 255 ? 255 : length;
+    ok = fwrite(&name_length, 1, 1, f) == 1 &&
+         fwrite(loaded_themes[i].name, 1, name_length, f) == name_length &&
+         fwrite(loaded_themes[i].colors, sizeof(rgb_color), THEME_COLOR_COUNT, f) == THEME_COLOR_COUNT;
+  }
+
+  if (fclose(f) != 0) ok = 0;
+  if (!ok || rename(temporary, path) != 0) unlink(temporary);
+}
+
+/* Make sure every theme on disk is in the registry, from the binary cache
+ * when it is still valid, otherwise by parsing the .def files and then
+ * refreshing the cache. Keeps the current theme selected. */
+void theme_registry_ensure_complete() {
+  if (theme_registry_complete) return;
+  theme_registry_complete = 1;
+
+  char current[64] = "";
+  if (loaded_theme_count > 0) {
+    snprintf(current, sizeof(current), "%s", theme_get_name());
   }
+  theme_registry_free();
 
-  char line[256];
-  int in_colors_section = 0;
+  unsigned long long fingerprint = theme_sources_fingerprint();
+  if (!theme_cache_load(fingerprint)) {
+    theme_discover_all();
+    theme_cache_save(fingerprint);
+  }
 
-  while (fgets(line, sizeof(line), f)) {
-    /* Check for [colors] section header */
-    if (strncmp(line, "[colors]", 8) == 0) {
-      in_colors_section = 1;
-      continue;
-    }
+  int index = current[0] ? theme_find_by_name(current) : -1;
+  editor.current_theme_index = index >= 0 ? index : 0;
+}
 
-    /* Check for other section headers (exit [colors] section) */
-    if (line[0] == '[') {
-      in_colors_section = 0;
-      continue;
+/* Load just the named theme, from the .def file its name maps to (lower
+ * case, with anything but letters and digits turned into '_'). Themes whose
+ * file is named differently, or that inherit from a @base, are left to the
+ * full registry. Returns 1 if the theme is now in the registry. */
+static int theme_load_single(const char *name) {
+  char file_name[NAME_MAX];
+  size_t length = 0;
+  for (const char *p = name; *p && length + sizeof(".def") < sizeof(file_name); p++) {
+    char c = *p;
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    file_name[length++] = ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) ? c : '_';
+  }
+  memcpy(file_name + length, ".def", sizeof(".def"));
+
+  char directories[2][PATH_MAX];
+  int directory_count = theme_source_directories(directories);
+  for (int d = 0; d < directory_count; d++) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", directories[d], file_name) >= (int)sizeof(path)) continue;
+
+    theme_base_missing = 0;
+    if (!theme_load_from_file(path)) continue;
+
+    runtime_theme *loaded = &loaded_themes[loaded_theme_count - 1];
+    if (!theme_base_missing && strcmp(loaded->name, name) == 0) return 1;
+
+    /* Wrong theme (or incomplete without its base): drop it again */
+    memory_free(MEMORY_THEMES, loaded->name);
+    loaded_theme_count--;
+  }
+  return 0;
+}
+
+/* Find theme index by name. Returns -1 if not found. */
+int theme_find_by_name(const char *name) {
+  for (int i = 0; i < loaded_theme_count; i++) {
+    if (strcmp(loaded_themes[i].name, name) == 0) {
+      return i;
     }
+  }
+  return -1;
+}
 
-    /* Only parse color overrides in [colors] section */
-    if (!in_colors_section) continue;
+/* Initialize theming system and load the saved theme. Only the configured
+ * theme's file is parsed; the full registry is built on first cycle. */
+void theme_init() {
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
 
-    /* Parse color_name = value */
-    char *eq = strchr(line, '=');
-    if (eq) {
-      *eq = '\0';
-      char *key = line;
-      char *value = eq + 1;
+  char saved_name[64];
+  int have_name = theme_load_name_from_config(saved_name, sizeof(saved_name));
 
-      /* Trim whitespace from key */
-      while (*key == ' ' || *key == '\t') key++;
-      char *key_end = key + strlen(key) - 1;
-      while (key_end > key && (*key_end == ' ' || *key_end == '\t')) key_end--;
-      *(key_end + 1) = '\0';
+  if (have_name && theme_load_single(saved_name)) {
+    editor.current_theme_index = 0;
+    theme_load(0);
+  } else {
+    /* No saved theme or it can't be found by file name: load everything */
+    theme_registry_ensure_complete();
 
-      /* Skip empty keys or comment lines */
-      if (*key == '\0' || *key == '#' || *key == ';') continue;
+    int idx = have_name ? theme_find_by_name(saved_name) : -1;
+    editor.current_theme_index = idx >= 0 ? idx : 0;
+    theme_load(editor.current_theme_index);
+  }
 
-      int idx = theme_color_name_to_index(key);
-      if (idx >= 0 && idx < (int)THEME_COLOR_SLOT_COUNT) {
-        rgb_color parsed;
-        if (parse_color_value(value, &parsed)) {
-          active_theme[idx] = parsed;
-        }
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  theme_init_milliseconds = (finished.tv_sec - started.tv_sec) * 1000.0 +
+                            (finished.tv_nsec - started.tv_nsec) / 1000000.0;
+}
+
+/* Apply color overrides from config file [colors] section.
+ * Call after theme_load() to override specific colors. */
+static void config_apply_color_overrides() {
+  config_refresh();
+  for (int i = 0; i < config.line_count; i++) {
+    config_line *line = &config.lines[i];
+    if (!line->key || strcmp(line->section, "colors") != 0) continue;
+
+    int idx = theme_color_name_to_index(line->key);
+    if (idx >= 0 && idx < (int)THEME_COLOR_SLOT_COUNT) {
+      rgb_color parsed;
+      if (parse_color_value(line->value, &parsed)) {
+        active_theme[idx] = parsed;
       }
     }
   }
-  fclose(f);
 }
 
 /* Load a theme by index into the active color palette. */
@@ -8456,10 +15914,14 @@ void theme_load(int index) {
 
   /* Apply any color overrides from config file */
   config_apply_color_overrides();
+
+  /* Map the palette to the terminal's colour depth once, up front */
+  color_quantize_prepare();
 }
 
 /* Cycle to next theme and save preference. */
 void theme_cycle() {
+  theme_registry_ensure_complete();
   if (loaded_theme_count == 0) return;
   int next_index = (editor.current_theme_index + 1) % loaded_theme_count;
   theme_load(next_index);
@@ -8476,95 +15938,628 @@ const char* theme_get_name() {
   return loaded_themes[editor.current_theme_index].name;
 }
 
-/* Save current theme (by name) and preferences to config file. */
+/* Save current theme (by name) and preferences to config file. Other
+ * settings, sections and comments in the file are kept. */
 void theme_save() {
-  FILE *file_pointer = fopen("miter.conf", "w");
-  if (file_pointer == NULL) return;
-
+  config_refresh();
   /* Save theme by name instead of index for stability */
-  const char *theme_name = theme_get_name();
-  fprintf(file_pointer, "theme=%s\n", theme_name);
-  fprintf(file_pointer, "show_line_numbers=%d\n", editor.show_line_numbers);
-  fclose(file_pointer);
+  config_set_string("", "theme", theme_get_name());
+  config_set_int("", "show_line_numbers", editor.show_line_numbers);
+  config_save();
 }
 
 /* Load theme name from config file into name_buf.
  * Returns 1 if found, 0 if not found or error. */
 int theme_load_name_from_config(char *name_buf, int buf_size) {
-  FILE *file_pointer = fopen("miter.conf", "r");
-  if (file_pointer == NULL) {
-    /* Try legacy config name */
-    file_pointer = fopen("terra.conf", "r");
-    if (file_pointer == NULL) {
-      editor.show_line_numbers = 1;
-      return 0;
+  config_refresh();
+  /* Old numeric format will fail lookup, using fallback */
+  const char *name = config_get_string("", "theme", NULL);
+  if (!name) return 0;
+  snprintf(name_buf, buf_size, "%s", name);
+  return 1;
+}
+
+/* Recalculate gutter width based on line count and settings. */
+void editor_update_gutter_width() {
+  if (!editor.show_line_numbers) {
+    editor.gutter_width = 0;
+    return;
+  }
+
+  /* Calculate number of digits needed for line numbers */
+  long long last_line = editor.row_count + editor.line_number_base;
+  if (viewer.active) {
+    /* Wide enough for the whole file, so it doesn't shift while scrolling */
+    long long lines;
+    int percent;
+    viewer_progress(&lines, &percent);
+    if (lines > last_line) last_line = lines;
+  }
+  int digits = snprintf(NULL, 0, "%lld", last_line);
+  if (digits < 1) digits = 1;
+
+  /* Gutter width = digits + 1 trailing space */
+  editor.gutter_width = digits + 1;
+}
+
+/* Toggle line number display and save preference. */
+void editor_toggle_line_numbers() {
+  editor.show_line_numbers = !editor.show_line_numbers;
+  editor_update_gutter_width();
+  /* Save preference to config */
+  theme_save();
+  editor_set_status_message("Line numbers %s", editor.show_line_numbers ? "ON" : "OFF");
+}
+
+/* Toggle soft wrap mode for visual line wrapping. */
+void editor_toggle_soft_wrap() {
+  editor.soft_wrap = !editor.soft_wrap;
+  editor_set_status_message("Soft wrap %s", editor.soft_wrap ? "ON" : "OFF");
+}
+
+/* Toggle center/typewriter scrolling mode. */
+void editor_toggle_center_scroll() {
+  editor.center_scroll = !editor.center_scroll;
+  editor_set_status_message("Center scroll %s", editor.center_scroll ? "ON" : "OFF");
+}
+
+/* Toggle the performance HUD in the message bar. */
+void editor_toggle_perf_hud() {
+  editor.perf_hud = !editor.perf_hud;
+  /* The HUD itself is the feedback; a message would crowd it out */
+  editor_set_status_message(editor.perf_hud ? "" : "Performance HUD OFF");
+}
+
+/*** headless mode ***/
+
+/* Keep one key-to-frame latency sample (nanoseconds). */
+void headless_latency_sample(long long elapsed) {
+  if (headless.latency_count >= headless.latency_capacity) {
+    int capacity = headless.latency_capacity ? headless.latency_capacity * 2
+                                             : HEADLESS_LATENCY_INITIAL_CAPACITY;
+    long long *latencies = realloc(headless.latencies, capacity * sizeof(long long));
+    if (!latencies) return;
+    headless.latencies = latencies;
+    headless.latency_capacity = capacity;
+  }
+  headless.latencies[headless.latency_count++] = elapsed;
+}
+
+/* qsort comparator for latency samples. */
+static int headless_compare_latency(const void *a, const void *b) {
+  long long latency_a = *(const long long *)a, latency_b = *(const long long *)b;
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/* Latency at a percentile of the sorted samples, in microseconds. */
+static double headless_percentile(int percent) {
+  if (headless.latency_count == 0) return 0;
+  int index = (int)((long long)(headless.latency_count - 1) * percent / HEADLESS_PERCENTILE_MAX);
+  return headless.latencies[index] / HEADLESS_NANOSECONDS_PER_MICROSECOND;
+}
+
+/* Print the run's report to stdout and exit. */
+void headless_finish() {
+  qsort(headless.latencies, headless.latency_count, sizeof(long long), headless_compare_latency);
+
+  printf("keys %lu, frames %lu, screen %dx%d\n", headless.keys, perf.frames,
+         headless.columns, headless.rows);
+  printf("latency us: p%d %.1f  p%d %.1f  p%d %.1f  max %.1f  (%d samples)\n",
+         HEADLESS_PERCENTILE_MEDIAN, headless_percentile(HEADLESS_PERCENTILE_MEDIAN),
+         HEADLESS_PERCENTILE_HIGH, headless_percentile(HEADLESS_PERCENTILE_HIGH),
+         HEADLESS_PERCENTILE_TAIL, headless_percentile(HEADLESS_PERCENTILE_TAIL),
+         headless_percentile(HEADLESS_PERCENTILE_MAX), headless.latency_count);
+  printf("bytes: %llu total, %.0f per frame\n", terminal_output.bytes_written,
+         perf.frames ? (double)terminal_output.bytes_written / perf.frames : 0.0);
+  if (ALLOCATION_COUNTING) {
+    unsigned long long allocations = __atomic_load_n(&allocation_count, __ATOMIC_RELAXED) - headless.allocations_at_start;
+    printf("allocations: %llu total, %.1f per key\n", allocations,
+           headless.keys ? (double)allocations / headless.keys : 0.0);
+  } else {
+    printf("allocations: not counted (build with -DMITER_COUNT_ALLOCATIONS on glibc)\n");
+  }
+  fflush(stdout);
+  exit(0);
+}
+
+/* Decode a keystroke script: bytes are taken literally except for the
+ * escapes \e (ESC), \r, \n, \t, \xHH and \\, and line breaks, which are
+ * skipped so a script can be laid out one key per line. Kitty (CSI ... u)
+ * and SGR mouse (CSI < ... M) sequences are written with \e. Returns the
+ * decoded length, or -1 on error. */
+static ssize_t headless_decode_script(FILE *source, FILE *decoded) {
+  ssize_t length = 0;
+  int character;
+  while ((character = fgetc(source)) != EOF) {
+    if (character == '\n') continue;
+    if (character == '\\') {
+      character = fgetc(source);
+      switch (character) {
+        case 'e': character = CHAR_ESCAPE; break;
+        case 'r': character = '\r'; break;
+        case 'n': character = '\n'; break;
+        case 't': character = '\t'; break;
+        case 'x': {
+          char digits[HEADLESS_ESCAPE_HEX_DIGITS + 1] = {0};
+          for (int i = 0; i < HEADLESS_ESCAPE_HEX_DIGITS; i++) digits[i] = fgetc(source);
+          character = (int)strtol(digits, NULL, HEADLESS_ESCAPE_HEX_BASE);
+          break;
+        }
+        case '\\': break;
+        default: return -1;
+      }
     }
+    fputc(character, decoded);
+    length++;
   }
+  return length;
+}
 
-  char line[CONFIG_LINE_BUFFER_SIZE];
-  int found_theme = 0;
-  int line_numbers = 1;
+/* True if the decoded script contains a kitty keyboard event (CSI ... u),
+ * in which case it is parsed the way a kitty terminal's input would be. */
+static int headless_script_uses_kitty(FILE *script) {
+  /* 0: plain text, 1: after ESC, 2: inside a CSI sequence */
+  int character, state = 0;
+  rewind(script);
+  while ((character = fgetc(script)) != EOF) {
+    if (character == CHAR_ESCAPE) state = 1;
+    else if (state == 1) state = character == CHAR_CSI ? 2 : 0;
+    else if (state == 2 && character == 'u') return 1;
+    else if (state == 2 && !isdigit(character) && character != ';' && character != ':') state = 0;
+  }
+  return 0;
+}
+
+/* Set up headless mode: the script becomes stdin, output goes nowhere, and
+ * the screen has the given size. Exits with a message on a bad script. */
+void headless_start(const char *script_path, int columns, int rows) {
+  FILE *source = fopen(script_path, "r");
+  if (!source) {
+    perror(script_path);
+    exit(1);
+  }
+  FILE *script = tmpfile();
+  if (!script) die("tmpfile");
+  ssize_t length = headless_decode_script(source, script);
+  fclose(source);
+  if (length < 0) {
+    fprintf(stderr, "%s: bad escape in script\n", script_path);
+    exit(1);
+  }
+  fflush(script);
+
+  editor.kitty_keyboard_mode = headless_script_uses_kitty(script);
+  if (dup2(fileno(script), STDIN_FILENO) == -1) die("dup2");
+  lseek(STDIN_FILENO, 0, SEEK_SET);
+
+  int sink = open("/dev/null", O_WRONLY);
+  if (sink >= 0) terminal_output.fd = sink;
+
+  headless.enabled = 1;
+  headless.input_size = length;
+  headless.columns = columns;
+  headless.rows = rows;
+}
+
+/*** server mode ***/
+
+/* Path of the server socket: $XDG_RUNTIME_DIR/miter.sock, or a socket in
+ * /tmp/miter-UID, a directory only this user may use. Returns 0, or -1 if
+ * neither is usable. */
+static int server_socket_path(char *path, size_t size) {
+  char directory[PATH_MAX];
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime && runtime[0]) {
+    snprintf(directory, sizeof(directory), "%s", runtime);
+  } else {
+    snprintf(directory, sizeof(directory), "/tmp/miter-%d", (int)getuid());
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) return -1;
+    struct stat directory_stat;
+    if (lstat(directory, &directory_stat) == -1 || !S_ISDIR(directory_stat.st_mode) ||
+        directory_stat.st_uid != getuid() || (directory_stat.st_mode & 077)) {
+      errno = EACCES;
+      return -1;
+    }
+  }
+  struct sockaddr_un address;
+  int length = snprintf(path, size, "%s/" SERVER_SOCKET_NAME, directory);
+  if (length >= (int)size || length >= (int)sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+/* A Unix socket address for path (checked by server_socket_path). */
+static struct sockaddr_un server_address(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  size_t length = strlen(path);
+  if (length >= sizeof(address.sun_path)) length = sizeof(address.sun_path) - 1;
+  memcpy(address.sun_path, path, length);
+  return address;
+}
+
+/* Connect to the server at path. Returns the socket, or -1. */
+static int server_connect(const char *path) {
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connection == -1) return -1;
+  struct sockaddr_un address = server_address(path);
+  if (connect(connection, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    close(connection);
+    return -1;
+  }
+  return connection;
+}
+
+/* Remove the socket when the server exits. */
+static void server_cleanup() {
+  if (server.path[0]) unlink(server.path);
+}
+
+/* Become a server: claim the socket, then continue in the background
+ * with no terminal. The foreground process reports the socket and exits.
+ * Exits with a message if another server is running. */
+void server_start() {
+  if (server_socket_path(server.path, sizeof(server.path)) != 0) {
+    perror("miter: server socket");
+    exit(1);
+  }
+  int existing = server_connect(server.path);
+  if (existing != -1) {
+    close(existing);
+    fprintf(stderr, "miter: a server is already listening on %s\n", server.path);
+    exit(1);
+  }
+  /* Nobody answered, so any socket file left there is stale */
+  unlink(server.path);
+
+  server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = server_address(server.path);
+  if (server.listen_fd == -1 ||
+      bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+      chmod(server.path, 0600) == -1 || listen(server.listen_fd, SOMAXCONN) == -1) {
+    perror(server.path);
+    exit(1);
+  }
+  fcntl(server.listen_fd, F_SETFD, FD_CLOEXEC);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    unlink(server.path);
+    exit(1);
+  }
+  if (pid > 0) {
+    printf("miter: server %d listening on %s\n", (int)pid, server.path);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  setsid();
+  int null = open("/dev/null", O_RDWR);
+  if (null != -1) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if (null > STDERR_FILENO) close(null);
+  }
+  /* A client that vanishes must not take the server with it */
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  atexit(server_cleanup);
+  server.enabled = 1;
+}
+
+/* Read a request from a new connection: the request byte, then
+ * SERVER_REQUEST_FIELDS NUL-terminated fields, returned in fields. A
+ * terminal descriptor passed with it is returned in terminal (-1 if
+ * none). Returns 0, or -1 if the request is malformed or times out. */
+static int server_read_request(int connection, char *request, size_t size,
+                               char **fields, int *terminal) {
+  *terminal = -1;
+  size_t length = 0;
+  int field_count = 0;
+  while (field_count < SERVER_REQUEST_FIELDS) {
+    if (length >= size) return -1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec vector = {request + length, size - length};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(connection, &message, 0);
+    if (received <= 0) return -1;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header;
+         header = CMSG_NXTHDR(&message, header)) {
+      if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+      int descriptor;
+      memcpy(&descriptor, CMSG_DATA(header), sizeof(descriptor));
+      if (*terminal == -1) {
+        *terminal = descriptor;
+      } else {
+        close(descriptor);
+      }
+    }
+    for (size_t i = length; i < length + received; i++) {
+      if (i > 0 && request[i] == '\0') field_count++;
+    }
+    length += received;
+  }
+
+  char *field = request + 1;
+  for (int i = 0; i < SERVER_REQUEST_FIELDS; i++) {
+    fields[i] = field;
+    field += strlen(field) + 1;
+  }
+  return 0;
+}
+
+/* Send a line of text for the client to print. */
+static void server_reply(int connection, const char *message) {
+  if (write(connection, message, strlen(message)) == -1) {
+    /* The client is gone; nothing to report to */
+  }
+}
+
+/* Set an environment variable from a client, unsetting it if empty. */
+static void server_set_environment(const char *name, const char *value) {
+  if (value[0]) {
+    setenv(name, value, 1);
+  } else {
+    unsetenv(name);
+  }
+}
+
+/* Let go of the attached client's terminal: restore its modes, point
+ * stdin and stdout at /dev/null and close the connection, sending message
+ * for the client to print if given. Does nothing while detached. */
+static void server_detach(const char *message) {
+  if (server.client_fd == -1) return;
+
+  terminal_write(ESCAPE_CLEAR_SCREEN, ESCAPE_CLEAR_SCREEN_LEN);
+  terminal_write(ESCAPE_CURSOR_HOME, ESCAPE_CURSOR_HOME_LEN);
+  disable_raw_mode();
+  editor.kitty_keyboard_mode = 0;
+  if (terminal_output.fd != STDOUT_FILENO) close(terminal_output.fd);
+  terminal_output.fd = STDOUT_FILENO;
+  terminal_output.offset = terminal_output.length = 0;
+
+  int null = open("/dev/null", O_RDWR);
+  if (null != -1) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    if (null > STDERR_FILENO) close(null);
+  }
+  if (message) server_reply(server.client_fd, message);
+  close(server.client_fd);
+  server.client_fd = -1;
+}
+
+/* Take over a client's terminal, replacing any attached client, and show
+ * the file it asked for. fields are those of server_read_request. */
+static void server_attach(int connection, int terminal, char **fields) {
+  server_detach("miter: detached (another terminal attached)\n");
+
+  /* Relative paths typed at prompts resolve against the client's shell */
+  snprintf(server.directory, sizeof(server.directory), "%s", fields[0]);
+  server_set_environment("TERM", fields[2]);
+  server_set_environment("COLORTERM", fields[3]);
+  server_set_environment("TERM_PROGRAM", fields[4]);
+
+  dup2(terminal, STDIN_FILENO);
+  dup2(terminal, STDOUT_FILENO);
+  close(terminal);
+  server.client_fd = connection;
+
+  enable_raw_mode();
+  editor_handle_resize();
+  editor_set_status_message("Miter server | Ctrl-Q = detach | Ctrl-S = save");
+  /* A file already open is shown as it is, with no reload */
+  if (fields[1][0]) buffer_open(fields[1]);
+}
+
+/* Stop the server for a client, unless that would lose unsaved changes. */
+static void server_stop(int connection) {
+  int dirty = buffer_dirty_count();
+  if (dirty > 0) {
+    char message[CONFIG_LINE_BUFFER_SIZE];
+    snprintf(message, sizeof(message), "miter: not stopping, %d buffer%s unsaved changes\n",
+             dirty, dirty == 1 ? " has" : "s have");
+    server_reply(connection, message);
+    close(connection);
+    return;
+  }
+  server_detach("miter: server stopped\n");
+  server_reply(connection, "miter: server stopped\n");
+  close(connection);
+  exit(0);
+}
+
+/* Serve one connection on the listening socket. */
+static void server_accept() {
+  int connection = accept(server.listen_fd, NULL, NULL);
+  if (connection == -1) return;
+  fcntl(connection, F_SETFD, FD_CLOEXEC);
+  /* A client that connects and says nothing can't hold up the editor */
+  struct timeval timeout = {SERVER_REQUEST_TIMEOUT_SECONDS, 0};
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char request[SERVER_REQUEST_MAX];
+  char *fields[SERVER_REQUEST_FIELDS];
+  int terminal;
+  if (server_read_request(connection, request, sizeof(request), fields, &terminal) == -1) {
+    if (terminal != -1) close(terminal);
+    close(connection);
+    return;
+  }
+
+  if (request[0] == SERVER_REQUEST_STOP) {
+    if (terminal != -1) close(terminal);
+    server_stop(connection);
+  } else if (request[0] == SERVER_REQUEST_ATTACH && terminal != -1 && isatty(terminal)) {
+    server_attach(connection, terminal, fields);
+  } else {
+    if (terminal != -1) close(terminal);
+    server_reply(connection, "miter: bad request\n");
+    close(connection);
+  }
+}
+
+/* Block until a client attaches, serving stop requests meanwhile. */
+static void server_wait_for_client() {
+  while (server.client_fd == -1) server_accept();
+}
+
+/* Detach the current client and wait for the next one. */
+void server_detach_and_wait(const char *message) {
+  server_detach(message);
+  server_wait_for_client();
+}
 
-  while (fgets(line, sizeof(line), file_pointer)) {
-    /* Try to parse theme=Name */
-    if (strncmp(line, "theme=", 6) == 0) {
-      char *value = line + 6;
-      /* Remove trailing newline */
-      char *nl = strchr(value, '\n');
-      if (nl) *nl = '\0';
-      /* Copy as theme name (old numeric format will fail lookup, using fallback) */
-      strncpy(name_buf, value, buf_size - 1);
-      name_buf[buf_size - 1] = '\0';
-      found_theme = 1;
-    } else if (sscanf(line, "show_line_numbers=%d", &line_numbers) == 1) {
-      editor.show_line_numbers = line_numbers;
+/* Wait up to the usual read timeout for terminal input, while also
+ * watching the client connection (resizes, disconnects), the listening
+ * socket and room for queued output. Returns 1 if input is ready to read,
+ * 0 if the caller should return without a key. */
+int server_wait_for_input() {
+  int output_queued = terminal_output.offset < terminal_output.length;
+  struct pollfd descriptors[] = {
+    {.fd = STDIN_FILENO, .events = POLLIN},
+    {.fd = server.client_fd, .events = POLLIN},
+    {.fd = server.listen_fd, .events = POLLIN},
+    {.fd = terminal_output.fd, .events = output_queued ? POLLOUT : 0},
+  };
+  if (poll(descriptors, 4, VTIME_DECISECONDS * 100) <= 0) return 0;
+
+  if (descriptors[3].revents & POLLOUT) terminal_output_drain();
+  if (descriptors[1].revents) {
+    char message;
+    if (read(server.client_fd, &message, 1) != 1) {
+      server_detach_and_wait(NULL);
+      return 0;
     }
+    if (message == SERVER_MESSAGE_RESIZE) window_resize_pending = 1;
   }
-
-  fclose(file_pointer);
-  return found_theme;
+  if (descriptors[2].revents & POLLIN) {
+    server_accept();
+    return 0;
+  }
+  if (descriptors[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+    server_detach_and_wait(NULL);
+    return 0;
+  }
+  return (descriptors[0].revents & POLLIN) != 0;
 }
 
-/* Recalculate gutter width based on line count and settings. */
-void editor_update_gutter_width() {
-  if (!editor.show_line_numbers) {
-    editor.gutter_width = 0;
-    return;
+/* Client side of --attach and --stop-server: send the request (with this
+ * terminal for an attach), forward window resizes, and print whatever
+ * the server replies until it closes the connection. Returns the exit
+ * status. */
+int server_client_run(char request_type, const char *filename) {
+  char path[PATH_MAX];
+  int connection = -1;
+  if (server_socket_path(path, sizeof(path)) == 0) connection = server_connect(path);
+  if (connection == -1) {
+    fprintf(stderr, "miter: no server running (start one with miter --server)\n");
+    return 1;
   }
 
-  /* Calculate number of digits needed for line numbers */
-  int digits = snprintf(NULL, 0, "%d", editor.row_count);
-  if (digits < 1) digits = 1;
+  /* Request: type byte, then the NUL-terminated fields */
+  char request[SERVER_REQUEST_MAX];
+  char directory[PATH_MAX] = "", file[PATH_MAX] = "";
+  if (!getcwd(directory, sizeof(directory))) directory[0] = '\0';
+  if (filename) {
+    if (!realpath(filename, file)) {
+      /* Not there yet: the server creates it on save */
+      if (filename[0] == '/') {
+        snprintf(file, sizeof(file), "%s", filename);
+      } else if (snprintf(file, sizeof(file), "%s/%s", directory, filename) >= (int)sizeof(file)) {
+        fprintf(stderr, "miter: %s: path too long\n", filename);
+        return 1;
+      }
+    }
+  }
+  const char *values[SERVER_REQUEST_FIELDS] = {
+    directory, file, getenv("TERM"), getenv("COLORTERM"), getenv("TERM_PROGRAM")};
+  size_t length = 0;
+  request[length++] = request_type;
+  for (int i = 0; i < SERVER_REQUEST_FIELDS; i++) {
+    const char *value = values[i] ? values[i] : "";
+    size_t value_length = strlen(value) + 1;
+    if (length + value_length > sizeof(request)) {
+      fprintf(stderr, "miter: request too long\n");
+      return 1;
+    }
+    memcpy(request + length, value, value_length);
+    length += value_length;
+  }
 
-  /* Gutter width = digits + 1 trailing space */
-  editor.gutter_width = digits + 1;
-}
+  int terminal = -1;
+  if (request_type == SERVER_REQUEST_ATTACH) {
+    terminal = open("/dev/tty", O_RDWR | O_NOCTTY);
+    if (terminal == -1) {
+      perror("miter: /dev/tty");
+      return 1;
+    }
+  }
 
-/* Toggle line number display and save preference. */
-void editor_toggle_line_numbers() {
-  editor.show_line_numbers = !editor.show_line_numbers;
-  editor_update_gutter_width();
-  /* Save preference to config */
-  theme_save();
-  editor_set_status_message("Line numbers %s", editor.show_line_numbers ? "ON" : "OFF");
-}
+  struct iovec vector = {request, length};
+  struct msghdr message;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(&message, 0, sizeof(message));
+  memset(control, 0, sizeof(control));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  if (terminal != -1) {
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &terminal, sizeof(int));
+  }
+  if (sendmsg(connection, &message, 0) != (ssize_t)length) {
+    perror("miter: send");
+    return 1;
+  }
+  if (terminal != -1) close(terminal);
 
-/* Toggle soft wrap mode for visual line wrapping. */
-void editor_toggle_soft_wrap() {
-  editor.soft_wrap = !editor.soft_wrap;
-  editor_set_status_message("Soft wrap %s", editor.soft_wrap ? "ON" : "OFF");
-}
+  /* No SA_RESTART, so a resize interrupts the read below */
+  struct sigaction resize_action;
+  memset(&resize_action, 0, sizeof(resize_action));
+  resize_action.sa_handler = handle_sigwinch;
+  sigemptyset(&resize_action.sa_mask);
+  sigaction(SIGWINCH, &resize_action, NULL);
 
-/* Toggle center/typewriter scrolling mode. */
-void editor_toggle_center_scroll() {
-  editor.center_scroll = !editor.center_scroll;
-  editor_set_status_message("Center scroll %s", editor.center_scroll ? "ON" : "OFF");
+  char reply[CONFIG_LINE_BUFFER_SIZE];
+  while (1) {
+    ssize_t received = read(connection, reply, sizeof(reply));
+    if (received > 0) {
+      fwrite(reply, 1, received, stderr);
+    } else if (received == -1 && errno == EINTR) {
+      if (window_resize_pending) {
+        window_resize_pending = 0;
+        char resize = SERVER_MESSAGE_RESIZE;
+        if (write(connection, &resize, 1) == -1) break;
+      }
+    } else {
+      break;
+    }
+  }
+  close(connection);
+  return 0;
 }
 
 /*** init ***/
 
-/* Initialize all editor state to defaults. Must be called before use. */
-void editor_init() {
+/* Reset the bound editor state to defaults without touching the
+ * terminal, config or themes. */
+void editor_init_state() {
   editor.cursor_x = 0;
   editor.cursor_y = 0;
   editor.render_x = 0;
@@ -8581,6 +16576,7 @@ void editor_init() {
   editor.search_result_count = 0;
   editor.search_result_capacity = 0;
   editor.wrap_column = DEFAULT_WRAP_COLUMN;
+  editor.tab_stop = MITER_TAB_STOP;
   /* Soft wrap disabled by default */
   editor.soft_wrap = 0;
   /* Center/typewriter scrolling enabled by default */
@@ -8595,6 +16591,11 @@ void editor_init() {
   editor.undo_stack_count = 0;
   editor.undo_stack_capacity = 0;
   clock_gettime(CLOCK_MONOTONIC, &editor.last_edit_time);
+}
+
+/* Initialize all editor state to defaults. Must be called before use. */
+void editor_init() {
+  editor_init_state();
 
   if (window_get_size(&editor.screen_rows, &editor.screen_columns) == -1) die("window_get_size");
 
@@ -8609,22 +16610,830 @@ void editor_init() {
   /* Register signal handler for terminal resize */
   signal(SIGWINCH, handle_sigwinch);
 
+  /* Read miter.conf once; the theme code below reuses the parsed model */
+  config_refresh();
+  config_apply_settings();
   theme_init();
   editor_update_gutter_width();
+
+  /* Start the background clipboard bridge (no-op without a helper tool) */
+  clipboard_worker_start();
+}
+
+
+/*** library interface ***/
+
+/* A buffer handle for library clients (miter.h). Each call binds the
+ * context to the calling thread for its duration, so any number of
+ * contexts can be used concurrently from different threads; a single
+ * context must not be shared between threads without locking. */
+struct miter_context {
+  struct editor_config state;
+};
+
+/* Bind context to this thread, returning the previous binding. */
+static struct editor_config *miter_bind(miter_context *context) {
+  struct editor_config *previous = editor_current;
+  editor_current = &context->state;
+  return previous;
+}
+
+/* Restore the binding miter_bind replaced. */
+static void miter_unbind(struct editor_config *previous) {
+  editor_current = previous;
+}
+
+/* Drop the last search's results. Called by every interface function that
+ * edits the buffer or changes its render text, since results are render
+ * offsets into the rows as they were. */
+static void miter_forget_search() {
+  editor.search_result_count = 0;
+}
+
+miter_context *miter_context_create(void) {
+  miter_context *context = calloc(1, sizeof(*context));
+  if (!context) return NULL;
+
+  struct editor_config *previous = miter_bind(context);
+  editor_init_state();
+  editor.screen_columns = MITER_CONTEXT_COLUMNS;
+  editor.screen_rows = MITER_CONTEXT_ROWS;
+  editor.center_scroll = 0;
+  editor.bracket_match_row = -1;
+  editor.bracket_open_row = -1;
+  editor.bracket_close_row = -1;
+  miter_unbind(previous);
+  return context;
+}
+
+void miter_context_destroy(miter_context *context) {
+  if (!context) return;
+
+  struct editor_config *previous = miter_bind(context);
+  editor_clear_buffer();
+  for (int i = 0; i < editor.undo_stack_count; i++) undo_entry_free(&editor.undo_stack[i]);
+  memory_free(MEMORY_UNDO, editor.undo_stack);
+  memory_free(MEMORY_SEARCH, editor.search_results);
+  free(editor.cursors);
+#ifndef PCRE2_DISABLED
+  syntax_free_patterns();
+#endif
+  miter_unbind(previous);
+  free(context);
+}
+
+int miter_open(miter_context *context, const char *path) {
+  /* Load into a fresh buffer and swap it in only once the whole file has
+   * been read, so a failed open leaves the current document intact */
+  miter_context *fresh = miter_context_create();
+  if (!fresh) {
+    errno = ENOMEM;
+    return -1;
+  }
+  fresh->state.tab_stop = context->state.tab_stop;
+
+  struct editor_config *previous = miter_bind(fresh);
+  int result = editor_load_file(path);
+  miter_unbind(previous);
+
+  if (result == 0) {
+    struct editor_config swap = context->state;
+    context->state = fresh->state;
+    fresh->state = swap;
+  }
+  int saved_errno = errno;
+  miter_context_destroy(fresh);
+  errno = saved_errno;
+  return result;
+}
+
+int miter_save(miter_context *context, const char *path) {
+  struct editor_config *previous = miter_bind(context);
+  int result = -1;
+  if (!path) path = editor.filename;
+  if (!path) {
+    errno = EINVAL;
+  } else {
+    result = editor_write_file(path);
+    if (result != -1 && path == editor.filename) editor.dirty = 0;
+  }
+  miter_unbind(previous);
+  return result;
+}
+
+const char *miter_filename(miter_context *context) {
+  return context->state.filename;
+}
+
+int miter_dirty(miter_context *context) {
+  return context->state.dirty != 0;
+}
+
+void miter_set_tab_stop(miter_context *context, int tab_stop) {
+  if (tab_stop < 1 || tab_stop > CONFIG_TAB_STOP_MAX) return;
+  struct editor_config *previous = miter_bind(context);
+  editor.tab_stop = tab_stop;
+  for (int i = 0; i < editor.row_count; i++) editor_update_row(&editor.row[i]);
+  miter_forget_search();
+  miter_unbind(previous);
+}
+
+int miter_row_count(miter_context *context) {
+  return context->state.row_count;
+}
+
+const char *miter_row_text(miter_context *context, int row, int *length) {
+  if (row < 0 || row >= context->state.row_count) return NULL;
+  if (length) *length = context->state.row[row].line_size;
+  return context->state.row[row].chars;
+}
+
+const char *miter_row_render(miter_context *context, int row, int *length) {
+  if (row < 0 || row >= context->state.row_count) return NULL;
+  if (length) *length = context->state.row[row].render_size;
+  return context->state.row[row].render;
+}
+
+const unsigned char *miter_row_highlight(miter_context *context, int row) {
+  if (row < 0 || row >= context->state.row_count) return NULL;
+  return context->state.row[row].highlight;
+}
+
+void miter_set_cursor(miter_context *context, int row, int column) {
+  struct editor_config *previous = miter_bind(context);
+  if (row < 0) row = 0;
+  if (row > editor.row_count) row = editor.row_count;
+  int line_size = row < editor.row_count ? editor.row[row].line_size : 0;
+  if (column < 0) column = 0;
+  if (column > line_size) column = line_size;
+  editor.cursor_y = row;
+  editor.cursor_x = column;
+  selection_clear();
+  miter_unbind(previous);
+}
+
+void miter_get_cursor(miter_context *context, int *row, int *column) {
+  if (row) *row = context->state.cursor_y;
+  if (column) *column = context->state.cursor_x;
+}
+
+void miter_insert_text(miter_context *context, const char *text, size_t length) {
+  struct editor_config *previous = miter_bind(context);
+  editor_insert_text(text, length);
+  miter_forget_search();
+  miter_unbind(previous);
+}
+
+void miter_delete_range(miter_context *context, int start_row, int start_column,
+                        int end_row, int end_column) {
+  struct editor_config *previous = miter_bind(context);
+  if (start_row >= 0 && end_row < editor.row_count && start_row <= end_row &&
+      start_column >= 0 && start_column <= editor.row[start_row].line_size &&
+      end_column >= 0 && end_column <= editor.row[end_row].line_size &&
+      (start_row < end_row || start_column < end_column)) {
+    editor.selection.active = 1;
+    editor.selection.mode = SELECTION_CHAR;
+    editor.selection.anchor.row = start_row;
+    editor.selection.anchor.col = start_column;
+    editor.selection.cursor.row = end_row;
+    editor.selection.cursor.col = end_column;
+    selection_delete();
+    miter_forget_search();
+  }
+  miter_unbind(previous);
+}
+
+int miter_reload(miter_context *context) {
+  struct editor_config *previous = miter_bind(context);
+  int result = -1;
+  struct stat file_stat;
+  if (!editor.filename) {
+    errno = EINVAL;
+  } else if (stat(editor.filename, &file_stat) == 0) {
+    result = editor_reload_file(&file_stat);
+    miter_forget_search();
+  }
+  miter_unbind(previous);
+  return result;
+}
+
+void miter_begin_undo_group(miter_context *context) {
+  struct editor_config *previous = miter_bind(context);
+  undo_start_new_group();
+  miter_unbind(previous);
 }
 
+int miter_undo(miter_context *context) {
+  struct editor_config *previous = miter_bind(context);
+  int position = editor.undo_position;
+  editor_undo();
+  int undone = editor.undo_position != position;
+  if (undone) miter_forget_search();
+  miter_unbind(previous);
+  return undone;
+}
+
+int miter_redo(miter_context *context) {
+  struct editor_config *previous = miter_bind(context);
+  int position = editor.undo_position;
+  editor_redo();
+  int redone = editor.undo_position != position;
+  if (redone) miter_forget_search();
+  miter_unbind(previous);
+  return redone;
+}
+
+int miter_search(miter_context *context, const char *query) {
+  struct editor_config *previous = miter_bind(context);
+  simple_search(query);
+  int count = editor.search_result_count;
+  miter_unbind(previous);
+  return count;
+}
+
+int miter_search_result(miter_context *context, int index, int *row, int *column, int *length) {
+  struct editor_config *previous = miter_bind(context);
+  int found = index >= 0 && index < editor.search_result_count;
+  search_result *result = found ? &editor.search_results[index] : NULL;
+  /* Results are forgotten on every edit; this guards against any that
+   * outlived their rows anyway */
+  if (found && (result->line_number < 0 || result->line_number >= editor.row_count ||
+                result->match_offset < 0 ||
+                result->match_offset + result->match_length > editor.row[result->line_number].render_size)) {
+    found = 0;
+  }
+  if (found) {
+    editor_row *line = &editor.row[result->line_number];
+    int start = editor_row_render_to_cursor(line, result->match_offset);
+    if (row) *row = result->line_number;
+    if (column) *column = start;
+    if (length) *length = editor_row_render_to_cursor(line, result->match_offset + result->match_length) - start;
+  }
+  miter_unbind(previous);
+  return found ? 0 : -1;
+}
+
+const char *miter_status_message(miter_context *context) {
+  return context->state.status_message;
+}
+
+/*** batch mode ***/
+
+/* Batch script operations */
+enum batch_operation {
+  BATCH_REPLACE,
+  BATCH_COMMENT,
+  BATCH_INDENT,
+  BATCH_UNINDENT,
+  BATCH_REFLOW,
+  BATCH_DELETE
+};
+
+/* One script command and the lines it applies to */
+typedef struct {
+  enum batch_operation operation;
+  /* 1-based line range; last_line 0 means the end of the file */
+  int first_line, last_line;
+  /* replace: literal text and its replacement */
+  char *from, *to;
+  size_t from_length, to_length;
+  /* reflow: wrap column */
+  int column;
+} batch_command;
+
+/* What happened to one file */
+typedef struct batch_result {
+  const char *path;
+  /* The file path names once symlinks and dots are resolved, or NULL if
+   * it can't be (the load then reports why) */
+  char *real_path;
+  /* Earlier result for the same file, which this one skips */
+  const struct batch_result *same_as;
+  /* errno of the failure, 0 on success */
+  int error;
+  /* Failure that isn't an errno, NULL if none */
+  const char *message;
+  int changed;
+  int rows;
+  double load_milliseconds, edit_milliseconds, save_milliseconds;
+} batch_result;
+
+/* The script and file list shared by the worker threads. Workers claim
+ * queued files by bumping next, and each writes only its own result. */
+static struct {
+  batch_command *commands;
+  int command_count;
+  char **paths;
+  int path_count;
+  batch_result *results;
+  /* One result per distinct file, so no two threads save the same one */
+  batch_result **queue;
+  int queue_count;
+  int next;
+} batch;
+
+/* Milliseconds between two monotonic times. */
+static double batch_elapsed_milliseconds(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * BATCH_MILLISECONDS_PER_SECOND +
+         (end->tv_nsec - start->tv_nsec) / BATCH_NANOSECONDS_PER_MILLISECOND;
+}
+
+/* Split a script line into words in place. Double quotes group words
+ * and allow \", \\, \n and \t. Returns the word count, or -1 for an
+ * unterminated quote. */
+static int batch_split(char *line, char **words, size_t *lengths, int max_words) {
+  int count = 0;
+  char *read = line;
+  while (*read) {
+    while (*read == ' ' || *read == '\t') read++;
+    if (!*read || *read == '#') break;
+    if (count == max_words) return max_words + 1;
+
+    char *write = read;
+    words[count] = write;
+    if (*read == '"') {
+      read++;
+      while (*read && *read != '"') {
+        if (*read == '\\' && read[1]) {
+          read++;
+          *write++ = *read == 'n' ? '\n' : *read == 't' ? '\t' : *read;
+          read++;
+        } else {
+          *write++ = *read++;
+        }
+      }
+      if (*read != '"') return -1;
+      read++;
+    } else {
+      while (*read && *read != ' ' && *read != '\t') *write++ = *read++;
+    }
+    lengths[count] = write - words[count];
+    count++;
+    if (*read) read++;
+    *write = '\0';
+  }
+  return count;
+}
+
+/* Parse a line number argument; "$" is the last line (0). */
+static int batch_parse_line(const char *word, int *line) {
+  if (strcmp(word, "$") == 0) {
+    *line = 0;
+    return 0;
+  }
+  char *end;
+  long value = strtol(word, &end, BATCH_LINE_NUMBER_BASE);
+  if (*end || value < 1 || value > INT_MAX) return -1;
+  *line = (int)value;
+  return 0;
+}
+
+/* Read and parse a script into batch.commands. Prints the first error
+ * and returns -1. */
+static int batch_load_script(const char *script_path) {
+  FILE *file_pointer = fopen(script_path, "r");
+  if (!file_pointer) {
+    perror(script_path);
+    return -1;
+  }
+
+  int first_line = 1, last_line = 0, capacity = 0, line_number = 0, result = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t line_length;
+  while (result == 0 && (line_length = getline(&line, &line_capacity, file_pointer)) != -1) {
+    line_number++;
+    while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r'))
+      line[--line_length] = '\0';
+
+    char *words[BATCH_WORDS_MAX];
+    size_t lengths[BATCH_WORDS_MAX];
+    int count = batch_split(line, words, lengths, BATCH_WORDS_MAX);
+    if (count == 0) continue;
+
+    batch_command command = {0};
+    command.first_line = first_line;
+    command.last_line = last_line;
+    const char *error = NULL;
+    if (count < 0) {
+      error = "unterminated quote";
+    } else if (strcmp(words[0], "lines") == 0) {
+      if (count == 2 && strcmp(words[1], "all") == 0) {
+        first_line = 1;
+        last_line = 0;
+      } else if (count != 3 || batch_parse_line(words[1], &first_line) == -1 ||
+                 batch_parse_line(words[2], &last_line) == -1 || first_line == 0 ||
+                 (last_line && last_line < first_line)) {
+        error = "usage: lines FIRST LAST | lines all";
+      }
+      if (!error) continue;
+    } else if (strcmp(words[0], "replace") == 0) {
+      if (count != 3 || lengths[1] == 0) {
+        error = "usage: replace FROM TO";
+      } else if (memchr(words[1], '\n', lengths[1]) || memchr(words[2], '\n', lengths[2])) {
+        error = "replace text can't contain newlines";
+      } else {
+        command.operation = BATCH_REPLACE;
+        command.from = malloc(lengths[1] + 1);
+        command.to = malloc(lengths[2] + 1);
+        memcpy(command.from, words[1], lengths[1] + 1);
+        memcpy(command.to, words[2], lengths[2] + 1);
+        command.from_length = lengths[1];
+        command.to_length = lengths[2];
+      }
+    } else if (strcmp(words[0], "reflow") == 0) {
+      command.operation = BATCH_REFLOW;
+      command.column = DEFAULT_WRAP_COLUMN;
+      if (count > 2 || (count == 2 && batch_parse_line(words[1], &command.column) == -1) ||
+          command.column < 1 || command.column > CONFIG_WRAP_COLUMN_MAX) {
+        error = "usage: reflow [COLUMN]";
+      }
+    } else if (count == 1 && strcmp(words[0], "comment") == 0) {
+      command.operation = BATCH_COMMENT;
+    } else if (count == 1 && strcmp(words[0], "indent") == 0) {
+      command.operation = BATCH_INDENT;
+    } else if (count == 1 && strcmp(words[0], "unindent") == 0) {
+      command.operation = BATCH_UNINDENT;
+    } else if (count == 1 && strcmp(words[0], "delete") == 0) {
+      command.operation = BATCH_DELETE;
+    } else {
+      error = "unknown command";
+    }
+
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", script_path, line_number, error);
+      result = -1;
+      break;
+    }
+
+    if (batch.command_count == capacity) {
+      capacity = capacity ? capacity * 2 : BATCH_COMMANDS_INITIAL_CAPACITY;
+      batch.commands = realloc(batch.commands, capacity * sizeof(batch_command));
+    }
+    batch.commands[batch.command_count++] = command;
+  }
+  free(line);
+  fclose(file_pointer);
+  return result;
+}
+/* Replace every occurrence of command->from in a row. */
+static void batch_replace_row(editor_row *row, const batch_command *command) {
+  int count = 0;
+  const char *end = row->chars + row->line_size;
+  for (const char *match = row->chars;
+       (match = memmem(match, end - match, command->from, command->from_length)) != NULL;
+       match += command->from_length) {
+    count++;
+  }
+  if (count == 0) return;
+
+  size_t new_size = row->line_size + count * (command->to_length - command->from_length);
+  char *chars = memory_malloc(MEMORY_ROW_CHARS, new_size + 1);
+  char *write = chars;
+  const char *read = row->chars;
+  const char *match;
+  while ((match = memmem(read, end - read, command->from, command->from_length)) != NULL) {
+    memcpy(write, read, match - read);
+    write += match - read;
+    memcpy(write, command->to, command->to_length);
+    write += command->to_length;
+    read = match + command->from_length;
+  }
+  memcpy(write, read, end - read);
+  chars[new_size] = '\0';
+
+  memory_free(MEMORY_ROW_CHARS, row->chars);
+  row->chars = chars;
+  row->line_size = new_size;
+  editor_update_row(row);
+  row->dirty = 1;
+  editor.dirty++;
+}
+
+/* Run one command on the bound buffer. Returns why it can't apply to
+ * this file, or NULL. */
+static const char *batch_apply(const batch_command *command) {
+  int first = command->first_line - 1;
+  int last = command->last_line ? command->last_line - 1 : editor.row_count - 1;
+  if (last >= editor.row_count) last = editor.row_count - 1;
+
+  switch (command->operation) {
+    case BATCH_REPLACE:
+      for (int line = first; line <= last; line++) batch_replace_row(&editor.row[line], command);
+      break;
+
+    case BATCH_COMMENT:
+      if (!editor.syntax || !editor.syntax->singleline_comment_start)
+        return "no line comment syntax for this file type";
+      /* Blank lines are left alone, as they are when commenting by hand */
+      for (int line = first; line <= last; line++) {
+        if (editor.row[line].line_size == 0) continue;
+        editor.cursor_y = line;
+        editor.cursor_x = 0;
+        editor_toggle_line_comment();
+      }
+      break;
+
+    case BATCH_INDENT:
+      for (int line = first; line <= last; line++) {
+        if (editor.row[line].line_size > 0) indent_line_apply(line);
+      }
+      break;
+
+    case BATCH_UNINDENT:
+      for (int line = first; line <= last; line++) unindent_line_apply(line);
+      break;
+
+    case BATCH_REFLOW:
+      /* Reflow each paragraph that starts in the range; the range
+       * grows or shrinks with the rows each reflow adds or removes */
+      editor.wrap_column = command->column;
+      for (int line = first; line <= last && line < editor.row_count; line++) {
+        if (editor.row[line].line_size == 0) continue;
+        paragraph_range paragraph = detect_paragraph(line);
+        int rows_before = editor.row_count;
+        editor.cursor_y = line;
+        editor_reflow_paragraph();
+        int delta = editor.row_count - rows_before;
+        last += delta;
+        line = paragraph.end_line + delta;
+      }
+      break;
+
+    case BATCH_DELETE:
+      for (int line = last; line >= first; line--) editor_delete_row(line);
+      break;
+  }
+  return NULL;
+}
+
+/* Load, edit and (if it changed) atomically save one file in the
+ * bound buffer. */
+static void batch_process(batch_result *result) {
+  struct timespec started, loaded, edited, saved;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if (editor_load_file(result->path) == -1) {
+    result->error = errno;
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &loaded);
+
+  /* A command that can't apply fails the file, which is left untouched */
+  for (int i = 0; i < batch.command_count && !result->message; i++)
+    result->message = batch_apply(&batch.commands[i]);
+  clock_gettime(CLOCK_MONOTONIC, &edited);
+
+  result->changed = !result->message && editor.dirty != 0;
+  if (result->changed && editor_write_file_atomic(result->path) == -1) result->error = errno;
+  clock_gettime(CLOCK_MONOTONIC, &saved);
+
+  result->rows = editor.row_count;
+  result->load_milliseconds = batch_elapsed_milliseconds(&started, &loaded);
+  result->edit_milliseconds = batch_elapsed_milliseconds(&loaded, &edited);
+  result->save_milliseconds = batch_elapsed_milliseconds(&edited, &saved);
+}
+
+/* Thread pool worker: claim files until none are left, each in a fresh
+ * context bound to this thread. */
+static void *batch_worker(void *unused) {
+  (void)unused;
+  int index;
+  while ((index = __atomic_fetch_add(&batch.next, 1, __ATOMIC_RELAXED)) < batch.queue_count) {
+    batch_result *result = batch.queue[index];
+    miter_context *context = miter_context_create();
+    if (!context) {
+      result->error = ENOMEM;
+      continue;
+    }
+    struct editor_config *previous = miter_bind(context);
+    /* Batch edits are never drawn or undone */
+    editor.highlight_disabled = 1;
+    editor.undo_logging = 1;
+    batch_process(result);
+    miter_unbind(previous);
+    miter_context_destroy(context);
+  }
+  return NULL;
+}
+
+/* qsort comparator: results by real path, then in command-line order */
+static int batch_compare_real_paths(const void *left, const void *right) {
+  const batch_result *left_result = *(batch_result *const *)left;
+  const batch_result *right_result = *(batch_result *const *)right;
+  int order = strcmp(left_result->real_path, right_result->real_path);
+  if (order) return order;
+  return (left_result > right_result) - (left_result < right_result);
+}
+
+/* Queue each file once. Paths naming the same file (repeated, through a
+ * symlink or spelled differently) would otherwise be edited by two
+ * threads at once, each saving over the other; later ones are skipped. */
+static void batch_queue_files() {
+  size_t size = (batch.path_count > 0 ? (size_t)batch.path_count : 1) * sizeof(batch_result *);
+  batch.queue = malloc(size);
+  batch_result **resolved = malloc(size);
+  int resolved_count = 0;
+  for (int i = 0; i < batch.path_count; i++) {
+    batch_result *result = &batch.results[i];
+    result->real_path = realpath(result->path, NULL);
+    if (result->real_path) resolved[resolved_count++] = result;
+  }
+  qsort(resolved, resolved_count, sizeof(batch_result *), batch_compare_real_paths);
+  for (int i = 1; i < resolved_count; i++) {
+    if (strcmp(resolved[i]->real_path, resolved[i - 1]->real_path) == 0)
+      resolved[i]->same_as = resolved[i - 1]->same_as ? resolved[i - 1]->same_as : resolved[i - 1];
+  }
+  free(resolved);
+
+  for (int i = 0; i < batch.path_count; i++) {
+    if (!batch.results[i].same_as) batch.queue[batch.queue_count++] = &batch.results[i];
+  }
+}
 
+/* Run a script over files on a thread pool (--batch), then print each
+ * file's timings and a summary. Returns the process exit status. */
+int batch_run(const char *script_path, char **paths, int path_count, int jobs) {
+  if (batch_load_script(script_path) == -1) return 1;
+
+  batch.paths = paths;
+  batch.path_count = path_count;
+  batch.results = calloc(path_count ? path_count : 1, sizeof(batch_result));
+  for (int i = 0; i < path_count; i++) batch.results[i].path = paths[i];
+  batch_queue_files();
+
+  if (jobs < 1) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > BATCH_THREADS_MAX) jobs = BATCH_THREADS_MAX;
+  if (jobs > batch.queue_count) jobs = batch.queue_count;
+  if (jobs < 1) jobs = 1;
+
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  pthread_t threads[BATCH_THREADS_MAX];
+  int started_threads = 0;
+  for (int i = 1; i < jobs; i++) {
+    if (pthread_create(&threads[started_threads], NULL, batch_worker, NULL) != 0) break;
+    started_threads++;
+  }
+  batch_worker(NULL);
+  for (int i = 0; i < started_threads; i++) pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+
+  int changed = 0, failed = 0, skipped = 0;
+  for (int i = 0; i < path_count; i++) {
+    batch_result *result = &batch.results[i];
+    if (result->same_as) {
+      skipped++;
+      printf(BATCH_SKIPPED_FORMAT, result->path, result->same_as->path);
+      continue;
+    }
+    if (result->error || result->message) {
+      failed++;
+      printf(BATCH_FAILED_FORMAT, result->path,
+             result->message ? result->message : strerror(result->error));
+      continue;
+    }
+    changed += result->changed;
+    printf(BATCH_RESULT_FORMAT, result->changed ? "changed" : "unchanged", result->rows,
+           result->load_milliseconds, result->edit_milliseconds, result->save_milliseconds,
+           result->path);
+  }
+  printf(BATCH_SUMMARY_FORMAT, path_count, changed, skipped, failed,
+         batch_elapsed_milliseconds(&started, &finished), started_threads + 1,
+         started_threads ? "s" : "");
+  for (int i = 0; i < path_count; i++) free(batch.results[i].real_path);
+  return failed ? 1 : 0;
+}
+
+#ifndef MITER_LIBRARY
 /* Entry point: Miter text editor */
 int main(int argc, char *argv[]) {
-  enable_raw_mode();
+  struct timespec startup_begin;
+  clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+
+  char *filename = NULL;
+  int report_startup_time = 0;
+  const char *headless_script = NULL;
+  const char *trace_path = getenv(TRACE_FILE_ENVIRONMENT);
+  int trace_requested = 0;
+  int headless_columns = HEADLESS_DEFAULT_COLUMNS, headless_rows = HEADLESS_DEFAULT_ROWS;
+  int size_given = 0;
+  int batch_jobs = 0;
+  int server_mode = 0;
+  int follow = 0;
+  int view = 0;
+  /* Files after the first, opened in background buffers */
+  char **more_files = malloc(argc * sizeof(char *));
+  int more_file_count = 0;
+  /* The first file that couldn't be opened, reported in place of the greeting */
+  char open_problem[STATUS_MESSAGE_BUFFER_SIZE] = "";
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--attach") == 0) {
+      return server_client_run(SERVER_REQUEST_ATTACH, i + 1 < argc ? argv[i + 1] : NULL);
+    } else if (strcmp(argv[i], "--stop-server") == 0) {
+      return server_client_run(SERVER_REQUEST_STOP, NULL);
+    } else if (strcmp(argv[i], "--server") == 0) {
+      server_mode = 1;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      /* Everything after the script is a file to edit */
+      return batch_run(argv[i + 1], argv + i + 2, argc - i - 2, batch_jobs);
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      batch_jobs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--follow") == 0) {
+      follow = 1;
+    } else if (strcmp(argv[i], "--view") == 0) {
+      view = 1;
+    } else if (strcmp(argv[i], "--startup-time") == 0) {
+      report_startup_time = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      /* Registered before raw mode so it runs after the terminal is restored */
+      atexit(memory_stats_report);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+      trace_requested = 1;
+    } else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+      headless_script = argv[++i];
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &headless_columns, &headless_rows) != 2 ||
+          headless_columns < 1 || headless_rows < 1) {
+        fprintf(stderr, "--size takes COLUMNSxROWS, e.g. 80x24\n");
+        return 1;
+      }
+      size_given = 1;
+    } else if (!filename) {
+      filename = argv[i];
+    } else {
+      more_files[more_file_count++] = argv[i];
+    }
+  }
+
+  /* Only an explicit --trace is fatal; the environment variable is a
+   * standing preference that builds without tracing simply ignore */
+  if (trace_path && trace_path[0] && trace_open(trace_path) != 0) {
+#ifdef MITER_TRACE
+    perror(trace_path);
+    if (trace_requested) return 1;
+#else
+    if (trace_requested) {
+      fprintf(stderr, "miter: built without tracing; rebuild with 'make trace'\n");
+      return 1;
+    }
+#endif
+  }
+
+  /* A real terminal has its own size */
+  if (size_given && !headless_script) {
+    fprintf(stderr, "--size only applies with --headless\n");
+    return 1;
+  }
+
+  if (server_mode) {
+    server_start();
+  } else if (headless_script) {
+    headless_start(headless_script, headless_columns, headless_rows);
+  } else {
+    enable_raw_mode();
+  }
   editor_init();
 
-  if (argc >= 2) {
-    editor_open(argv[1]);
+  if (filename) {
+    if (server_mode) {
+      if (buffer_open(filename) == -1) snprintf(open_problem, sizeof(open_problem), "%s", editor.status_message);
+    } else if (viewer_open(filename, view) == 0) {
+      /* The viewer shows one file */
+      if (more_file_count > 0) {
+        snprintf(open_problem, sizeof(open_problem), "%s is shown on its own, read-only; %d other file%s not opened",
+                 filename, more_file_count, more_file_count == 1 ? "" : "s");
+      }
+      more_file_count = 0;
+    } else {
+      editor_open(filename);
+    }
+    for (int i = 0; i < more_file_count; i++) {
+      if (buffer_open(more_files[i]) == -1 && !open_problem[0])
+        snprintf(open_problem, sizeof(open_problem), "%s", editor.status_message);
+    }
+    buffer_switch(0);
+    if (follow) editor_toggle_follow();
   }
+  free(more_files);
+  headless.allocations_at_start = __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
 
   editor_set_status_message(
     "Miter | Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  if (open_problem[0]) editor_set_status_message("%s", open_problem);
+
+  /* Time to the first complete frame, shown in place of the greeting */
+  if (report_startup_time) {
+    editor_refresh_screen();
+    struct timespec first_frame;
+    clock_gettime(CLOCK_MONOTONIC, &first_frame);
+    editor_set_status_message("Startup %.2f ms to first frame (themes %.2f ms)",
+                              (first_frame.tv_sec - startup_begin.tv_sec) * 1000.0 +
+                              (first_frame.tv_nsec - startup_begin.tv_nsec) / 1000000.0,
+                              theme_init_milliseconds);
+  }
+
+  if (server.enabled) server_wait_for_client();
 
   while (1) {
     /* Handle pending terminal resize */
@@ -8632,9 +17441,12 @@ int main(int argc, char *argv[]) {
       window_resize_pending = 0;
       editor_handle_resize();
     }
+    file_watch_poll();
+    viewer_poll();
     editor_refresh_screen();
     editor_process_keypress();
   }
 
   return 0;
 }
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Miter - A lightweight terminal text editor.
+ * Copyright (C) 2025 Edward J Edmonds (deths74r) <edwardedmonds@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Editor core as a library (libmiter.a, built with `make lib`).
+ *
+ * A miter_context is one buffer with its own rows, cursor, undo history,
+ * search results and syntax state; there is no shared editor state, so
+ * different contexts can be used from different threads at once. A
+ * single context is not thread-safe.
+ *
+ * Rows and columns are 0-based. Columns count bytes of the row text;
+ * render text has tabs expanded and is what highlight classes index.
+ */
+
+#ifndef MITER_H
+#define MITER_H
+
+#include <stddef.h>
+
+/* Syntax highlighting class of each render byte */
+enum editor_highlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH,
+  HL_BRACKET_MATCH
+};
+
+typedef struct miter_context miter_context;
+
+/* Create an empty buffer, or return NULL if out of memory. */
+miter_context *miter_context_create(void);
+/* Free a buffer and everything it owns. NULL is ignored. */
+void miter_context_destroy(miter_context *context);
+
+/* Replace the buffer with the file at path, picking syntax rules from
+ * its name. Returns 0, or -1 with errno set and the buffer unchanged. */
+int miter_open(miter_context *context, const char *path);
+/* Write the buffer to path, or to the opened file if path is NULL.
+ * Returns the bytes written, or -1 with errno set. */
+int miter_save(miter_context *context, const char *path);
+/* Bring the buffer in line with its file as changed on disk, replacing
+ * only the lines that differ, as one undo group. Returns 0, or -1 with
+ * errno set. */
+int miter_reload(miter_context *context);
+/* Name of the opened file, or NULL. */
+const char *miter_filename(miter_context *context);
+/* True if the buffer changed since it was opened or saved. */
+int miter_dirty(miter_context *context);
+/* Columns per tab in render text (1-16, default 8). */
+void miter_set_tab_stop(miter_context *context, int tab_stop);
+
+/* Number of rows in the buffer. */
+int miter_row_count(miter_context *context);
+/* Text of a row (NUL-terminated, no newline) and its length, or NULL
+ * if row is out of range. Valid until the next edit. */
+const char *miter_row_text(miter_context *context, int row, int *length);
+/* Render text of a row (tabs expanded) and its length. */
+const char *miter_row_render(miter_context *context, int row, int *length);
+/* One enum editor_highlight value per render byte of a row. */
+const unsigned char *miter_row_highlight(miter_context *context, int row);
+
+/* Move the cursor, clamped to the buffer. Row may be one past the end. */
+void miter_set_cursor(miter_context *context, int row, int column);
+void miter_get_cursor(miter_context *context, int *row, int *column);
+/* Insert text verbatim at the cursor (newlines split rows) as one undo
+ * step, leaving the cursor after it. */
+void miter_insert_text(miter_context *context, const char *text, size_t length);
+/* Delete from (start_row, start_column) up to (end_row, end_column) as
+ * one undo step. Invalid or empty ranges are ignored. */
+void miter_delete_range(miter_context *context, int start_row, int start_column,
+                        int end_row, int end_column);
+
+/* Make the next edit start a new undo group. Edits made close together
+ * are otherwise grouped the way typing is. */
+void miter_begin_undo_group(miter_context *context);
+/* Undo or redo one group. Return 1 if anything changed. */
+int miter_undo(miter_context *context);
+int miter_redo(miter_context *context);
+
+/* Find every occurrence of query (in render text). Returns the count.
+ * The results describe the buffer as it is now: any call that changes it
+ * (insert, delete, undo, redo, open, tab stop) discards them, so search
+ * again after editing. */
+int miter_search(miter_context *context, const char *query);
+/* Position of match index from the last search, in row text columns.
+ * Returns 0, or -1 if index is out of range or the results have been
+ * discarded by an edit. */
+int miter_search_result(miter_context *context, int index, int *row, int *column, int *length);
+
+/* Last status message the core set (e.g. "Nothing to undo"). */
+const char *miter_status_message(miter_context *context);
+
+#endif
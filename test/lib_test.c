@@ -0,0 +1,232 @@
+/*
+ * libmiter smoke test.
+ *
+ * Drives two contexts through miter.h side by side: open a file in each,
+ * edit, undo, redo and save, checking that neither buffer sees the
+ * other's changes. Prints one line per failed check and exits non-zero
+ * if any failed.
+ *
+ * Run with `make test`.
+ */
+
+/*** includes ***/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../miter.h"
+
+/*** defines ***/
+
+/* Scratch directory template, under TMPDIR or /tmp */
+#define TEST_DIRECTORY_TEMPLATE "miter-lib-test-XXXXXX"
+
+/*** state ***/
+
+static int test_failures = 0;
+static char test_directory[1024];
+
+/*** helpers ***/
+
+/* Report a failed check. */
+#define TEST_CHECK(condition)                                               \
+  do {                                                                      \
+    if (!(condition)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      test_failures++;                                                      \
+    }                                                                       \
+  } while (0)
+
+/* Write contents to name in the scratch directory, storing its path. */
+static void test_write_file(const char *name, const char *contents, char *path, size_t size) {
+  snprintf(path, size, "%s/%s", test_directory, name);
+  FILE *file_pointer = fopen(path, "w");
+  if (!file_pointer) {
+    perror(path);
+    exit(1);
+  }
+  fputs(contents, file_pointer);
+  fclose(file_pointer);
+}
+
+/* Whether the file at path holds exactly contents. */
+static int test_file_equals(const char *path, const char *contents) {
+  FILE *file_pointer = fopen(path, "r");
+  if (!file_pointer) return 0;
+  char buffer[4096];
+  size_t length = fread(buffer, 1, sizeof(buffer) - 1, file_pointer);
+  fclose(file_pointer);
+  buffer[length] = '\0';
+  return strcmp(buffer, contents) == 0;
+}
+
+/* Whether row of context holds exactly text. */
+static int test_row_equals(miter_context *context, int row, const char *text) {
+  int length;
+  const char *chars = miter_row_text(context, row, &length);
+  return chars && (size_t)length == strlen(text) && memcmp(chars, text, length) == 0;
+}
+
+/*** tests ***/
+
+/* Open, edit, undo, redo and save two contexts in turn. */
+static void test_two_contexts() {
+  char first_path[4096], second_path[4096];
+  test_write_file("first.txt", "alpha\nbeta\n", first_path, sizeof(first_path));
+  test_write_file("second.txt", "one\ntwo\nthree\n", second_path, sizeof(second_path));
+
+  miter_context *first = miter_context_create();
+  miter_context *second = miter_context_create();
+  TEST_CHECK(first && second);
+  if (!first || !second) return;
+
+  TEST_CHECK(miter_open(first, first_path) == 0);
+  TEST_CHECK(miter_open(second, second_path) == 0);
+  TEST_CHECK(miter_row_count(first) == 2);
+  TEST_CHECK(miter_row_count(second) == 3);
+
+  /* Edits in one context leave the other untouched */
+  miter_set_cursor(first, 1, 0);
+  miter_insert_text(first, "new\n", 4);
+  miter_set_cursor(second, 0, 3);
+  miter_insert_text(second, "!", 1);
+  TEST_CHECK(miter_row_count(first) == 3);
+  TEST_CHECK(test_row_equals(first, 1, "new"));
+  TEST_CHECK(test_row_equals(second, 0, "one!"));
+  TEST_CHECK(miter_row_count(second) == 3);
+  TEST_CHECK(miter_dirty(first) && miter_dirty(second));
+
+  /* Undo in one context, redo it, and undo the other */
+  TEST_CHECK(miter_undo(first) == 1);
+  TEST_CHECK(miter_row_count(first) == 2);
+  TEST_CHECK(test_row_equals(first, 1, "beta"));
+  TEST_CHECK(test_row_equals(second, 0, "one!"));
+  TEST_CHECK(miter_redo(first) == 1);
+  TEST_CHECK(test_row_equals(first, 1, "new"));
+  TEST_CHECK(miter_undo(second) == 1);
+  TEST_CHECK(test_row_equals(second, 0, "one"));
+  TEST_CHECK(miter_undo(second) == 0);
+
+  /* A failed open keeps the edited document */
+  char missing_path[4096];
+  snprintf(missing_path, sizeof(missing_path), "%s/missing.txt", test_directory);
+  TEST_CHECK(miter_open(first, missing_path) == -1);
+  TEST_CHECK(miter_row_count(first) == 3);
+  TEST_CHECK(test_row_equals(first, 1, "new"));
+  TEST_CHECK(miter_dirty(first));
+  TEST_CHECK(strcmp(miter_filename(first), first_path) == 0);
+
+  TEST_CHECK(miter_save(first, NULL) > 0);
+  TEST_CHECK(miter_save(second, NULL) > 0);
+  TEST_CHECK(!miter_dirty(first) && !miter_dirty(second));
+  TEST_CHECK(test_file_equals(first_path, "alpha\nnew\nbeta\n"));
+  TEST_CHECK(test_file_equals(second_path, "one\ntwo\nthree\n"));
+
+  miter_context_destroy(first);
+  miter_context_destroy(second);
+  unlink(first_path);
+  unlink(second_path);
+}
+
+/* Search results are positions in the buffer as searched; an edit
+ * discards them instead of leaving them pointing past the rows. */
+static void test_search_after_edit() {
+  char path[4096];
+  test_write_file("search.txt", "find me\nand find me\n", path, sizeof(path));
+
+  miter_context *context = miter_context_create();
+  TEST_CHECK(context != NULL);
+  if (!context) return;
+  TEST_CHECK(miter_open(context, path) == 0);
+
+  int row = -1, column = -1, length = -1;
+  TEST_CHECK(miter_search(context, "find") == 2);
+  TEST_CHECK(miter_search_result(context, 1, &row, &column, &length) == 0);
+  TEST_CHECK(row == 1 && column == 4 && length == 4);
+
+  /* Deleting the second row would leave result 1 past the end */
+  miter_delete_range(context, 0, 7, 1, 10);
+  TEST_CHECK(miter_row_count(context) == 1);
+  TEST_CHECK(miter_search_result(context, 0, &row, &column, &length) == -1);
+  TEST_CHECK(miter_search_result(context, 1, &row, &column, &length) == -1);
+
+  /* Undo changes the buffer too; a new search sees it as it is */
+  TEST_CHECK(miter_search(context, "find") == 1);
+  TEST_CHECK(miter_undo(context) == 1);
+  TEST_CHECK(miter_search_result(context, 0, &row, &column, &length) == -1);
+  TEST_CHECK(miter_search(context, "find") == 2);
+
+  miter_context_destroy(context);
+  unlink(path);
+}
+
+/* Reloading an empty file that gained lines, and undoing and redoing
+ * that, goes between exactly no rows and the file's rows. */
+static void test_reload_empty_round_trip() {
+  char path[4096];
+  test_write_file("reload.txt", "", path, sizeof(path));
+
+  miter_context *context = miter_context_create();
+  TEST_CHECK(context != NULL);
+  if (!context) return;
+  TEST_CHECK(miter_open(context, path) == 0);
+  TEST_CHECK(miter_row_count(context) == 0);
+
+  test_write_file("reload.txt", "first\nsecond\n", path, sizeof(path));
+  TEST_CHECK(miter_reload(context) == 0);
+  TEST_CHECK(miter_row_count(context) == 2);
+  TEST_CHECK(miter_undo(context) == 1);
+  TEST_CHECK(miter_row_count(context) == 0);
+  TEST_CHECK(miter_redo(context) == 1);
+  TEST_CHECK(miter_row_count(context) == 2);
+  int length = 0;
+  const char *text = miter_row_text(context, 1, &length);
+  TEST_CHECK(text && length == 6 && memcmp(text, "second", 6) == 0);
+
+  /* And back to empty */
+  test_write_file("reload.txt", "", path, sizeof(path));
+  TEST_CHECK(miter_reload(context) == 0);
+  TEST_CHECK(miter_row_count(context) == 0);
+  TEST_CHECK(miter_undo(context) == 1);
+  TEST_CHECK(miter_row_count(context) == 2);
+  TEST_CHECK(miter_redo(context) == 1);
+  TEST_CHECK(miter_row_count(context) == 0);
+
+  /* A lone empty line is one row */
+  test_write_file("reload.txt", "\n", path, sizeof(path));
+  TEST_CHECK(miter_reload(context) == 0);
+  TEST_CHECK(miter_row_count(context) == 1);
+  TEST_CHECK(miter_undo(context) == 1);
+  TEST_CHECK(miter_row_count(context) == 0);
+
+  miter_context_destroy(context);
+  unlink(path);
+}
+
+/*** init ***/
+
+int main() {
+  const char *temporary = getenv("TMPDIR");
+  snprintf(test_directory, sizeof(test_directory), "%s/" TEST_DIRECTORY_TEMPLATE,
+           temporary ? temporary : "/tmp");
+  if (!mkdtemp(test_directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  test_two_contexts();
+  test_search_after_edit();
+  test_reload_empty_round_trip();
+
+  rmdir(test_directory);
+  if (test_failures) {
+    fprintf(stderr, "%d check%s failed\n", test_failures, test_failures == 1 ? "" : "s");
+    return 1;
+  }
+  printf("libmiter: all checks passed\n");
+  return 0;
+}